@@ -3,11 +3,127 @@
  */
 #pragma once
 
+// The JIT and guard pages use POSIX and its extensions, such as sigaction() and MAP_ANONYMOUS, which a strict C11 build (-std=c11)
+// hides unless they're asked for, as they are here. That only works before the first system header is included, so the translation
+// unit that defines ARVISS_IMPLEMENTATION should include arviss.h first, or define _DEFAULT_SOURCE itself.
+#if defined(ARVISS_IMPLEMENTATION) && defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#if defined(ARVISS_JIT) || defined(ARVISS_GUARD_PAGES)
+#define _DEFAULT_SOURCE
+#endif
+#endif
+
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// The geometry of the decoded instruction cache, which holds CACHE_LINES lines of CACHE_LINE_LENGTH instructions. The lines are
+// grouped into sets of CACHE_WAYS, and code can be cached in any line of the set that its address maps to, so code at addresses
+// that map to the same set only evicts each other when there are more of them than there are ways. Define these before including
+// arviss.h to change them. Powers of 2 are fastest.
+#if !defined(CACHE_LINES)
 #define CACHE_LINES 64
+#endif
+#if !defined(CACHE_LINE_LENGTH)
 #define CACHE_LINE_LENGTH 32
+#endif
+#if !defined(CACHE_WAYS)
+#define CACHE_WAYS 1 // Direct-mapped.
+#endif
+#define CACHE_SETS (CACHE_LINES / CACHE_WAYS)
+#if CACHE_LINES % CACHE_WAYS != 0
+#error "CACHE_LINES must be a multiple of CACHE_WAYS"
+#endif
+#if CACHE_LINES > 65536 || CACHE_LINE_LENGTH > 65536
+#error "The decoded instruction cache is too big"
+#endif
+#define PREDECODE_WORDS 32 // How many instructions are read and decoded in one go when a cache line is filled.
+
+// Define ARVISS_THREADED_DISPATCH to use threaded dispatch. This relies on the "labels as values" extension that is supported by GCC
+// and Clang. Other compilers fall back to dispatching via a switch statement.
+#if defined(ARVISS_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define ARVISS_USE_THREADED_DISPATCH
+#endif
+
+// Define ARVISS_JIT to translate hot blocks into native code on x86-64 Linux and macOS hosts. This builds on the block cache, so it
+// implies ARVISS_BLOCK_CACHE. Once built in, the JIT is enabled for a given CPU with ArvissEnableJit().
+#if defined(ARVISS_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define ARVISS_USE_JIT
+#if !defined(ARVISS_BLOCK_CACHE)
+#define ARVISS_BLOCK_CACHE
+#endif
+#endif
+#define JIT_CODE_SIZE (256 * 1024) // The number of bytes of executable memory used for translated blocks, per CPU.
+#define JIT_THRESHOLD 16           // How many times a block is run before it is translated into native code.
+
+// Define ARVISS_FUSION to fuse common pairs of instructions, such as lui followed by addi, into superinstructions that run both
+// halves in one dispatch. Fusion is only done for threaded dispatch.
+#if defined(ARVISS_FUSION) && defined(ARVISS_USE_THREADED_DISPATCH)
+#define ARVISS_USE_FUSION
+#endif
+
+// Define ARVISS_CACHE_STATS to count how the decoded instruction cache and the TLB are used, as reported by ArvissGetCacheStats()
+// and ArvissGetTlbStats(). Otherwise the counting compiles out completely.
+//
+// Define ARVISS_ADAPTIVE_CACHE to start with a direct-mapped cache, whose lookups are cheapest, and double the number of ways that
+// it uses, up to CACHE_WAYS, whenever too many lookups evict a line. This implies ARVISS_CACHE_STATS. It needs CACHE_LINES and
+// CACHE_WAYS to be powers of 2, and has no effect on the block cache.
+#if defined(ARVISS_ADAPTIVE_CACHE) && !defined(ARVISS_CACHE_STATS)
+#define ARVISS_CACHE_STATS
+#endif
+#if defined(ARVISS_ADAPTIVE_CACHE) && CACHE_WAYS > 1 && !defined(ARVISS_BLOCK_CACHE)
+#define ARVISS_USE_ADAPTIVE_CACHE
+#if (CACHE_LINES & (CACHE_LINES - 1)) != 0 || (CACHE_WAYS & (CACHE_WAYS - 1)) != 0
+#error "ARVISS_ADAPTIVE_CACHE needs CACHE_LINES and CACHE_WAYS to be powers of 2"
+#endif
+#endif
+#define ADAPTIVE_CACHE_INTERVAL 4096 // How many lookups there are between checks of how many of them evicted a line.
+#define ADAPTIVE_CACHE_EVICTIONS 256 // How many of those lookups can evict a line before the cache uses more ways.
+
+// Define ARVISS_BLOCK_CACHE to decode and cache whole basic blocks, looked up by their start address, rather than cache lines.
+#define BLOCK_CACHE_BLOCKS 512                                   // The number of slots in the block hash table (a power of 2).
+#define BLOCK_CACHE_INSTRUCTIONS (CACHE_LINES * CACHE_LINE_LENGTH) // The number of decoded instructions that can be cached.
+#define BLOCK_MAX_LENGTH 64                                      // The maximum number of instructions in a block.
+#define RETURN_STACK_DEPTH 16                                    // The number of return addresses predicted (a power of 2).
+#define JUMP_TARGET_CACHE_SIZE 64                                // The number of indirect jump targets predicted (a power of 2).
+
+// Stores are checked against a map of the pages of guest memory that hold decoded code, so that most of them needn't look for
+// decoded instructions to discard.
+#define CODE_PAGE_SIZE 256  // The size of a page, in bytes (a power of 2).
+#define CODE_PAGE_BITS 1024 // The number of bits in the map (a multiple of 32). Pages this many pages apart share a bit.
+
+#define MEMORY_MAP_REGIONS 8 // The maximum number of regions in a CPU's memory map.
+
+// Define ARVISS_TLB to keep a software TLB that maps pages of guest memory to the host memory that holds them, so that loads and
+// stores to the memory map's regions don't have to search for the region. Pages that aren't wholly in one region are never in it.
+#define TLB_ENTRIES 64     // The number of entries in the TLB (a power of 2).
+#define TLB_PAGE_SIZE 4096 // The size of a page, in bytes (a power of 2).
+
+// Define ARVISS_GUARD_PAGES to let a CPU move its memory map into a 4GB window of host address space on 64-bit Linux hosts, so that
+// loads and stores are a single access at an offset from the window, with no range checks. Everything in the window that isn't in
+// a region is a guard page, and accesses to those are caught by a SIGSEGV handler. Once built in, guard pages are enabled for a
+// given CPU with ArvissEnableGuardPages().
+#if defined(ARVISS_GUARD_PAGES) && defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define ARVISS_USE_GUARD_PAGES
+#endif
+#define GUARD_PAGE_SIZE 4096 // The size of a page, in bytes, which must be the host's page size.
+#define GUARD_MAX_PATCHES 2  // The most pages that one access can fault on, as it may straddle two.
+
+// ArvissRunBatch() runs CPUs that share code in lock-step, in batches of up to this many, executing each instruction for all of the
+// CPUs in a batch that are at it in one go.
+#if !defined(BATCH_LANES)
+#define BATCH_LANES 16
+#endif
+
+// Each CPU starts on a cache line of the host, so that its hot state isn't split across more of them than it needs to be, and CPUs
+// in an array don't share cache lines.
+#define HOST_CACHE_LINE_SIZE 64
+#if defined(__cplusplus)
+#define ARVISS_ALIGNED(n) alignas(n)
+#elif defined(_MSC_VER)
+#define ARVISS_ALIGNED(n) __declspec(align(n))
+#else
+#define ARVISS_ALIGNED(n) _Alignas(n)
+#endif
 
 // Opcodes.
 typedef enum
@@ -176,6 +292,11 @@ typedef enum
  */
 typedef struct ArvissCpu ArvissCpu;
 
+/**
+ * A handle to decoded code that CPUs running the same image can share.
+ */
+typedef struct ArvissCode ArvissCode;
+
 /**
  * An arbitrary, caller supplied token that an Arviss CPU passes to the bus callbacks.
  */
@@ -192,6 +313,14 @@ typedef enum
     bcSTORE_ACCESS_FAULT
 } BusCode;
 
+// The kinds of access that a host wants to make to guest memory via ArvissTranslate().
+typedef enum
+{
+    acREAD = 1,
+    acWRITE = 2,
+    acREAD_WRITE = acREAD | acWRITE
+} ArvissAccess;
+
 /**
  * Signatures of bus callbacks.
  */
@@ -201,10 +330,14 @@ typedef uint32_t (*BusRead32Fn)(BusToken token, uint32_t addr, BusCode* busCode)
 typedef void (*BusWrite8Fn)(BusToken token, uint32_t addr, uint8_t byte, BusCode* busCode);
 typedef void (*BusWrite16Fn)(BusToken token, uint32_t addr, uint16_t halfword, BusCode* busCode);
 typedef void (*BusWrite32Fn)(BusToken token, uint32_t addr, uint32_t word, BusCode* busCode);
+typedef void (*BusReadBlockFn)(BusToken token, uint32_t addr, uint8_t* bytes, uint32_t len, BusCode* busCode);
+typedef void (*BusWriteBlockFn)(BusToken token, uint32_t addr, const uint8_t* bytes, uint32_t len, BusCode* busCode);
+typedef void (*BusZeroBlockFn)(BusToken token, uint32_t addr, uint32_t len, BusCode* busCode);
 
 /**
  * The bus is how an Arviss CPU interacts with the rest of the system. It has a number of callbacks, and a caller-supplied token
- * that is passed to them on invocation.
+ * that is passed to them on invocation. The block callbacks, which read, write or zero len bytes at once, are optional. Without
+ * them, blocks are accessed a word at a time.
  */
 typedef struct
 {
@@ -215,12 +348,102 @@ typedef struct
     BusWrite8Fn Write8;
     BusWrite16Fn Write16;
     BusWrite32Fn Write32;
+    BusReadBlockFn ReadBlock;
+    BusWriteBlockFn WriteBlock;
+    BusZeroBlockFn ZeroBlock;
 } Bus;
 
+/**
+ * The result of a read in the second version of the bus ABI. The value that was read and the bus code are packed into one 64-bit
+ * integer, so that callbacks return both in a register rather than writing the bus code to memory.
+ */
+typedef uint64_t BusResult;
+
+/**
+ * Signatures of bus callbacks in the second version of the bus ABI. Reads return a BusResult, and writes return a bus code.
+ */
+typedef BusResult (*BusV2Read8Fn)(BusToken token, uint32_t addr);
+typedef BusResult (*BusV2Read16Fn)(BusToken token, uint32_t addr);
+typedef BusResult (*BusV2Read32Fn)(BusToken token, uint32_t addr);
+typedef BusCode (*BusV2Write8Fn)(BusToken token, uint32_t addr, uint8_t byte);
+typedef BusCode (*BusV2Write16Fn)(BusToken token, uint32_t addr, uint16_t halfword);
+typedef BusCode (*BusV2Write32Fn)(BusToken token, uint32_t addr, uint32_t word);
+typedef BusCode (*BusV2ReadBlockFn)(BusToken token, uint32_t addr, uint8_t* bytes, uint32_t len);
+typedef BusCode (*BusV2WriteBlockFn)(BusToken token, uint32_t addr, const uint8_t* bytes, uint32_t len);
+typedef BusCode (*BusV2ZeroBlockFn)(BusToken token, uint32_t addr, uint32_t len);
+
+/**
+ * A bus whose callbacks use the second version of the bus ABI. A CPU that is given a Bus adapts it to this.
+ */
+typedef struct
+{
+    BusToken token;
+    BusV2Read8Fn Read8;
+    BusV2Read16Fn Read16;
+    BusV2Read32Fn Read32;
+    BusV2Write8Fn Write8;
+    BusV2Write16Fn Write16;
+    BusV2Write32Fn Write32;
+    BusV2ReadBlockFn ReadBlock;
+    BusV2WriteBlockFn WriteBlock;
+    BusV2ZeroBlockFn ZeroBlock;
+} BusV2;
+
+static inline BusResult ArvissMakeBusValue(uint32_t value)
+{
+    return value;
+}
+
+static inline BusResult ArvissMakeBusFault(BusCode busCode)
+{
+    return (BusResult)busCode << 32;
+}
+
+static inline bool ArvissBusResultIsFault(BusResult result)
+{
+    return (result >> 32) != bcOK;
+}
+
+static inline BusCode ArvissBusResultAsCode(BusResult result)
+{
+    return (BusCode)(result >> 32);
+}
+
+static inline uint32_t ArvissBusResultAsValue(BusResult result)
+{
+    return (uint32_t)result;
+}
+
+/**
+ * A region of guest memory, such as ROM or RAM, that is held in host memory. The CPU loads from and stores to it directly rather
+ * than via the bus callbacks.
+ */
+typedef struct
+{
+    uint32_t start;  // The guest address of the start of the region.
+    uint32_t size;   // The size of the region, in bytes. This must be at least 4.
+    uint8_t* mem;    // The host memory that holds the region's contents, in little-endian order.
+    bool isWritable; // True if the guest can store to the region, i.e., it's RAM rather than ROM.
+} ArvissMemoryRegion;
+
+/**
+ * A declarative description of the guest's address space. Loads and stores that fall within one of its regions go directly to
+ * host memory, and everything else, e.g., memory-mapped I/O, goes to its bus. Regions are searched in order, so the most frequently
+ * accessed should come first.
+ */
+typedef struct
+{
+    const ArvissMemoryRegion* regions; // The regions of guest memory that are held in host memory.
+    int count;                         // The number of regions, up to MEMORY_MAP_REGIONS.
+    Bus bus; // The bus for everything outside the regions. Accesses for which it has no callback raise an access fault.
+    BusV2 busV2; // The same, using the second version of the bus ABI. If it has any callbacks then it's used instead of bus.
+} ArvissMemoryMap;
+
 typedef enum
 {
     execIllegalInstruction,
     execFetchDecodeReplace,
+    execNextBlock, // Not a real instruction. Marks the end of a block in the block cache.
     execLui,
     execAuipc,
     execJal,
@@ -298,110 +521,232 @@ typedef enum
     execFleS,
     execFcvtSW,
     execFcvtSWu,
-    execFmvWX
+    execFmvWX,
+    // Canonical forms, which ArvissDecode() never produces. Instructions that would write to x0 become one of these, or execNop.
+    execNop,
+    execLi,
+    execMv,
+    execJ,
+    execJr,
+    execLbDiscard,
+    execLhDiscard,
+    execLwDiscard,
+    // Superinstructions, which run the instruction in their own entry followed by the instruction in the entry after it.
+    execLuiAddi,
+    execAuipcAddi,
+    execAuipcJalr,
+    execSltBne,
+    execSltuBne,
+    execLwAdd,
+    execLwAddi
 } ExecFn;
 
 typedef struct DecodedInstruction DecodedInstruction;
 
+// Decoded instructions are packed into 8 bytes so that a cache line or a block of them stays small enough to sit in the host's L1
+// cache. Every field is a whole number of bytes, so reading one doesn't need any shifting or masking.
 struct DecodedInstruction
 {
-    ExecFn opcode; // The instruction that this function executes. TODO: need to call it something other than opcode?
+    uint8_t opcode; // The ExecFn that executes this instruction.
+    uint8_t rd;     // Destination register.
+    uint8_t rs1;    // First source register.
+    uint8_t rs2;    // Second source register.
     union
     {
-        struct
-        {
-            uint32_t cacheLine; // The instruction's cache line.
-            uint32_t index;     // The instruction's index in the cache line.
-        } fdr;
+        int32_t imm; // Immediate operand.
 
         struct
         {
-            uint8_t rd;  // Destination register.
-            int32_t imm; // Immediate operand.
-        } rd_imm;
+            uint8_t rs3; // Third source register.
+            uint8_t rm;  // Rounding mode.
+        };
 
         struct
         {
-            uint8_t rd;  // Destination register.
-            uint8_t rs1; // Source register.
-        } rd_rs1;
+            uint16_t cacheLine; // The instruction's cache line.
+            uint16_t index;     // The instruction's index in the cache line.
+        } fdr;
 
-        struct
-        {
-            uint8_t rd;  // Destination register.
-            uint8_t rs1; // Source register.
-            int32_t imm; // Immediate operand.
-        } rd_rs1_imm;
+        uint32_t ins; // Instruction.
+    };
+};
 
-        struct
-        {
-            uint8_t rd;  // Destination register.
-            uint8_t rs1; // First source register.
-            uint8_t rs2; // Second source register.
-        } rd_rs1_rs2;
+// Counts of how often the blocks at the targets of indirect jumps were predicted, rather than looked up.
+typedef struct
+{
+    uint64_t returnHits;   // Returns whose target was predicted by the return address stack.
+    uint64_t returnMisses; // Returns whose target had to be looked up.
+    uint64_t targetHits;   // Other indirect jumps whose target was found in the jump target cache.
+    uint64_t targetMisses; // Other indirect jumps whose target had to be looked up.
+} ArvissJumpStats;
 
-        struct
-        {
-            uint8_t rs1; // First source register.
-            uint8_t rs2; // Second source register.
-            int32_t imm; // Immediate operand.
-        } rs1_rs2_imm;
+// Counts of how often loads and stores found their page in the TLB.
+typedef struct
+{
+    uint64_t hits;    // Accesses whose page was in the TLB.
+    uint64_t misses;  // Accesses whose page wasn't, including those to addresses outside the memory map's regions.
+    uint64_t flushes; // Times that the TLB was emptied.
+} ArvissTlbStats;
 
-        struct
-        {
-            uint8_t rd;  // Destination register.
-            uint8_t rs1; // First source register.
-            uint8_t rs2; // Second source register.
-            uint8_t rs3; // Third source register.
-            uint8_t rm;  // Rounding mode.
-        } rd_rs1_rs2_rs3_rm;
+#if defined(ARVISS_TLB)
+// A direct-mapped software TLB. Each entry holds a page of guest memory that is wholly in one of the memory map's regions.
+typedef struct
+{
+    struct TlbEntry
+    {
+        uint32_t readTag;  // The guest address of the page if it can be read from, otherwise TLB_INVALID.
+        uint32_t writeTag; // The guest address of the page if it can be written to, otherwise TLB_INVALID.
+        uint8_t* mem;      // The host memory that holds the page.
+    } entry[TLB_ENTRIES];
+#if defined(ARVISS_CACHE_STATS)
+    ArvissTlbStats stats; // How the TLB has been used.
+#endif
+} Tlb;
+#endif
 
-        struct
-        {
-            uint8_t rd;  // Destination register.
-            uint8_t rs1; // Source register.
-            uint8_t rm;  // Rounding mode.
-        } rd_rs1_rm;
+#if defined(ARVISS_USE_GUARD_PAGES)
+// A guest address space held in a 4GB window of host address space. Each of the memory map's regions is moved into the window at
+// its guest address, and the rest of the window is guard pages, which fault when they're accessed.
+typedef struct
+{
+    uint8_t* window;                      // The window, or NULL if guard pages aren't enabled.
+    uint8_t* hostMem[MEMORY_MAP_REGIONS]; // The host memory that held each region before it was moved into the window.
+    int patches;                          // The number of pages that were opened up to let a faulting access complete.
+    struct GuardPatch
+    {
+        uint32_t page;   // The guest address of the page.
+        bool isInRegion; // True if it's a page of a read-only region, false if it's a guard page.
+    } patch[GUARD_MAX_PATCHES];
+    uint8_t* saved; // The contents of those pages of read-only regions, to be put back, in a page each just below the window.
+} GuardPages;
+#endif
 
-        struct
-        {
-            uint8_t rd;  // Destination register.
-            uint8_t rs1; // First source register.
-            uint8_t rs2; // Second source register.
-            uint8_t rm;  // Rounding mode.
-        } rd_rs1_rs2_rm;
+// Counts of how the decoded instruction cache was used. With the block cache, these count blocks rather than cache lines.
+typedef struct
+{
+    uint64_t lookups;     // Lookups of the cache line or block at an address. Running on within a line or along a link isn't one.
+    uint64_t misses;      // Lookups that had to fill a cache line or decode a block.
+    uint64_t evictions;   // Valid cache lines or blocks that were discarded to make room for others.
+    uint64_t decodes;     // Instructions decoded.
+    uint64_t adaptations; // Times that the adaptive cache started using more ways.
+} ArvissCacheStats;
 
-        uint32_t ins; // Instruction.
-    };
+#if defined(ARVISS_BLOCK_CACHE)
+// Blocks and the links between them are declared outside of DecodedInstructionCache so that C and C++ agree on their names.
+struct Block;
+
+// A link to the block that starts at a given address.
+struct BlockLink
+{
+    uint32_t pc;         // The address that this link leads to.
+    struct Block* block; // The block that starts at that address, or NULL if this link is unused.
+};
+
+// A basic block in the block cache.
+struct Block
+{
+    uint32_t pc;                 // The address of the first instruction in the block.
+    uint32_t start;              // The index of the block's first instruction in the instructions array.
+    uint32_t generation;         // The cache's generation when the block was decoded. The slot is empty if it isn't current.
+    struct BlockLink links[2];   // The blocks that this block most recently led to, e.g., a branch target and its fall through.
+    struct BlockLink returnLink; // The block that calls made from the end of this block return to.
+#if defined(ARVISS_USE_JIT)
+    uint32_t length;             // The number of instructions in the block.
+    uint32_t hits;               // How many times the block has been run.
+    int (*code)(ArvissCpu* cpu); // The block translated into native code, or NULL if it hasn't been translated.
+#endif
 };
+#endif
 
-// Decoded instructions are written to cache lines in the decoded instruction cache. Arviss then executes these decoded
-// instructions.
+// Decoded instructions are written to cache lines in the decoded instruction cache, or to blocks if ARVISS_BLOCK_CACHE is defined.
+// Arviss then executes these decoded instructions.
 typedef struct
 {
+#if defined(ARVISS_BLOCK_CACHE)
+    struct Block blocks[BLOCK_CACHE_BLOCKS];                   // A hash table of blocks, keyed by the address they start at.
+    int blockCount;                                            // The number of blocks in the hash table.
+    int used;                                                  // The number of entries in the instructions array in use.
+    DecodedInstruction instructions[BLOCK_CACHE_INSTRUCTIONS]; // The decoded instructions that make up the blocks.
+    struct JumpPredictor
+    {
+        struct ReturnAddress
+        {
+            uint32_t pc;          // The address that the call returns to.
+            struct Block* caller; // The block that made the call, or NULL if this entry is unused.
+        } returnStack[RETURN_STACK_DEPTH];                    // A circular stack, pushed by calls and popped by returns.
+        uint32_t returnTop;                                   // The index of the top of the return address stack, modulo depth.
+        struct BlockLink jumpTargets[JUMP_TARGET_CACHE_SIZE]; // The blocks at the targets of other indirect jumps, by address.
+#if defined(ARVISS_CACHE_STATS)
+        ArvissJumpStats stats; // How well the targets of indirect jumps were predicted.
+#endif
+    } jumps; // Predicts the blocks at the targets of indirect jumps.
+#if defined(ARVISS_USE_JIT)
+    uint8_t* code;     // Executable memory for translated blocks, or NULL if the JIT is not enabled.
+    uint32_t codeUsed; // The number of bytes of executable memory in use.
+#endif
+#else
     struct CacheLine
     {
-        uint32_t owner;                                     // The address that owns this cache line.
-        DecodedInstruction instructions[CACHE_LINE_LENGTH]; // The cache line itself.
-        bool isValid;                                       // True if the cache line is valid.
-    } line[CACHE_LINES];
+        uint32_t owner;      // The address that owns this cache line.
+        uint32_t generation; // The cache's generation when the line was filled. The line is invalid if it isn't current.
+#if CACHE_WAYS > 1
+        uint32_t lastUsed; // When the line was last looked up, so that the least recently used line in its set can be replaced.
+#endif
+        DecodedInstruction instructions[CACHE_LINE_LENGTH]; // The cache line itself. It comes last, so that looking up a line
+                                                            // doesn't touch its instructions.
+    } line[CACHE_LINES]; // The cache lines, with each set's lines next to each other.
+#if CACHE_WAYS > 1
+    uint32_t clock; // Counts lookups, to say when each cache line was last used.
+#endif
+#if defined(ARVISS_USE_ADAPTIVE_CACHE)
+    uint32_t ways;           // The number of ways in use, which only ever grows.
+    uint32_t setMask;        // The number of sets that the lines are grouped into for that many ways, minus one.
+    uint64_t nextCheck;      // The number of lookups at which to next check how many of them evicted a line.
+    uint64_t evictionsSoFar; // The number of evictions when it was last checked.
+#endif
+#endif
+    uint32_t generation;                      // Incremented to discard everything in the cache at once.
+    uint32_t codePages[CODE_PAGE_BITS / 32]; // A bit for each page of guest memory, set if it may hold decoded code.
+    struct CodeRange
+    {
+        uint32_t first; // The lowest address of the decoded code in the page.
+        uint32_t last;  // The highest address of the decoded code in the page.
+    } codeRanges[CODE_PAGE_BITS]; // Where the decoded code is in each page whose bit is set. The others are left as they were.
+#if defined(ARVISS_CACHE_STATS)
+    ArvissCacheStats stats; // How the cache has been used.
+#endif
+#if defined(ARVISS_USE_FUSION)
+    bool fuse; // True if decoded instructions may be fused into superinstructions. Blocks decoded for the JIT aren't fused.
+#endif
 } DecodedInstructionCache;
 
-// An Arviss CPU.
+// An Arviss CPU. The state that running instructions touches all the time comes first, starting on a host cache line, so that it
+// takes up as few of them as it can. The rest of the state, and the decoded instruction cache, which is allocated separately, are
+// kept out of its way. A CPU is then small enough that many of them can be kept in an array.
 struct ArvissCpu
 {
-    ArvissResult result;           // The result of the last operation.
-    BusCode busCode;               // The result of the last bus operation.
-    uint32_t pc;                   // The program counter.
-    uint32_t xreg[32];             // Regular registers, x0-x31.
-    uint32_t mepc;                 // The machine exception program counter.
-    uint32_t mcause;               // The machine cause register.
-    uint32_t mtval;                // The machine trap value register.
-    float freg[32];                // Floating point registers, f0-f31.
-    uint32_t fcsr;                 // Floating point control and status register.
-    Bus bus;                       // The address bus.
-    DecodedInstructionCache cache; // The decoded instruction cache.
-    int retired;                   // Instructions retired in the most recent call to ArvissRun().
+    ARVISS_ALIGNED(HOST_CACHE_LINE_SIZE) uint32_t pc; // The program counter.
+    int retired;                                      // Instructions retired in the most recent call to ArvissRun().
+    ArvissResult result;                              // The result of the last operation.
+    BusCode busCode;                 // Set when a load or store faults in a guard page, until the access sees it.
+    DecodedInstructionCache* cache;  // The decoded instruction cache, or NULL if it hasn't been needed yet.
+    ArvissCode* code;                // Decoded code shared with other CPUs, or NULL if there isn't any.
+    int memoryRegions;               // How many regions of guest memory there are in memory.
+    uint32_t xreg[32];               // Regular registers, x0-x31.
+    uint32_t fcsr;                   // Floating point control and status register.
+    float freg[32];                  // Floating point registers, f0-f31.
+    BusV2 bus;                       // The address bus.
+    ArvissMemoryRegion memory[MEMORY_MAP_REGIONS]; // Regions of guest memory that are accessed directly.
+    uint32_t mepc;                                 // The machine exception program counter.
+    uint32_t mcause;                               // The machine cause register.
+    uint32_t mtval;                                // The machine trap value register.
+    Bus busV1; // A bus using the original ABI, which bus adapts, or all NULL if there isn't one.
+#if defined(ARVISS_TLB)
+    Tlb tlb; // Pages of those regions that were accessed recently.
+#endif
+#if defined(ARVISS_USE_GUARD_PAGES)
+    GuardPages guard; // The window that holds those regions, if guard pages are enabled.
+#endif
 };
 
 #ifdef __cplusplus
@@ -445,16 +790,84 @@ static inline ArvissTrap ArvissResultAsTrap(ArvissResult result)
 void ArvissReset(ArvissCpu* cpu);
 
 /**
- * Initialises the given Arviss CPU and provides it with its bus.
+ * Replaces the given CPU's bus. The bus is adapted to the second version of the bus ABI, which costs an extra call per access.
+ * Guard pages are disabled if the bus has any callbacks.
+ * @param cpu the CPU.
+ * @param bus the bus that the CPU should use to interact with the rest of the system.
+ */
+void ArvissSetBus(ArvissCpu* cpu, const Bus* bus);
+
+/**
+ * Replaces the given CPU's bus with one that uses the second version of the bus ABI. Guard pages are disabled if the bus has any
+ * callbacks.
+ * @param cpu the CPU.
+ * @param bus the bus that the CPU should use to interact with the rest of the system.
+ */
+void ArvissSetBusV2(ArvissCpu* cpu, const BusV2* bus);
+
+/**
+ * Initialises the given Arviss CPU and provides it with its bus. The CPU starts with nothing allocated, and anything that it held
+ * before is forgotten rather than freed, so call ArvissRelease() before initialising a CPU again.
  * @param cpu the CPU.
  * @param bus the bus that the CPU should use to interact with the rest of the system.
  */
-static inline void ArvissInit(ArvissCpu* cpu, Bus* bus)
+static inline void ArvissInit(ArvissCpu* cpu, const Bus* bus)
 {
+#if defined(ARVISS_USE_GUARD_PAGES)
+    cpu->guard.window = NULL;
+#endif
+    cpu->cache = NULL;
+    cpu->code = NULL;
     ArvissReset(cpu);
-    cpu->bus = *bus;
+    ArvissSetBus(cpu, bus);
+    cpu->memoryRegions = 0;
+}
+
+/**
+ * Initialises the given Arviss CPU and provides it with a bus that uses the second version of the bus ABI. As with ArvissInit(),
+ * call ArvissRelease() before initialising a CPU again.
+ * @param cpu the CPU.
+ * @param bus the bus that the CPU should use to interact with the rest of the system.
+ */
+static inline void ArvissInitWithBusV2(ArvissCpu* cpu, const BusV2* bus)
+{
+    const Bus none = {{NULL}, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    ArvissInit(cpu, &none);
+    ArvissSetBusV2(cpu, bus);
+}
+
+/**
+ * Replaces the regions of the given CPU's memory map, e.g., to switch banks of memory, and its bus. This flushes the TLB,
+ * discards all decoded instructions and detaches any shared code, as the code that they came from may no longer be there.
+ * @param cpu the CPU.
+ * @param map the memory map. Its regions are copied, but the host memory that holds them must outlive the CPU.
+ * @return true if the memory map was replaced, or false if the map has more than MEMORY_MAP_REGIONS regions or a region that is
+ * smaller than 4 bytes, in which case the CPU's memory map is left as it was.
+ */
+bool ArvissSetMemoryMap(ArvissCpu* cpu, const ArvissMemoryMap* map);
+
+/**
+ * Initialises the given Arviss CPU and provides it with a memory map. As with ArvissInit(), call ArvissRelease() before
+ * initialising a CPU again.
+ * @param cpu the CPU.
+ * @param map the memory map. Its regions are copied, but the host memory that holds them must outlive the CPU.
+ * @return true if the CPU was initialised, or false if the map has more than MEMORY_MAP_REGIONS regions or a region that is
+ * smaller than 4 bytes.
+ */
+static inline bool ArvissInitWithMemoryMap(ArvissCpu* cpu, const ArvissMemoryMap* map)
+{
+    ArvissInit(cpu, &map->bus);
+    return ArvissSetMemoryMap(cpu, map);
 }
 
+/**
+ * Releases everything that the given CPU has allocated, i.e., its decoded instruction cache, which it allocates when it first
+ * needs it, the JIT's memory, its guard pages and its reference to any shared code. Call this before the CPU is freed or
+ * initialised again. The CPU can still be run afterwards, but it will allocate its cache again.
+ * @param cpu the CPU.
+ */
+void ArvissRelease(ArvissCpu* cpu);
+
 /**
  * Decodes and executes a single Arviss instruction.
  * @param cpu the CPU.
@@ -471,6 +884,181 @@ ArvissResult ArvissExecute(ArvissCpu* cpu, uint32_t instruction);
  */
 ArvissResult ArvissRun(ArvissCpu* cpu, int count);
 
+/**
+ * Runs each of the given CPUs for up to count instructions, as ArvissRun() would, leaving each CPU's result in its result field and
+ * the number of instructions that it retired in its retired field. CPUs that are next to each other in the array and have the same
+ * shared code attached to them are run in lock-step, in batches, so that each instruction is looked up once and executed for every
+ * CPU in the batch that is at it. CPUs whose paths diverge wait for each other, and carry on together once their paths meet again.
+ * As the CPUs' instructions are interleaved, CPUs that are run together shouldn't share writable memory.
+ * @param cpus the CPUs.
+ * @param n the number of CPUs.
+ * @param count the most instructions to run on each CPU.
+ */
+void ArvissRunBatch(ArvissCpu* const* cpus, int n, int count);
+
+/**
+ * Enables or disables translation of hot code into native code on the given CPU. Disabling it releases the memory that it uses.
+ * @param cpu the CPU.
+ * @param enable true to enable the JIT, false to disable it.
+ * @return true if the JIT is now enabled. It can't be enabled if Arviss was built without ARVISS_JIT, or on an unsupported host.
+ */
+bool ArvissEnableJit(ArvissCpu* cpu, bool enable);
+
+/**
+ * Gets counts of how often the targets of returns and other indirect jumps were predicted since the CPU was reset. Predicting a
+ * jump's target means that the block there doesn't have to be looked up. Only the block cache makes predictions, so the counts are
+ * always zero if Arviss was built without ARVISS_BLOCK_CACHE, and like the other counts they're always zero if it was built without
+ * ARVISS_CACHE_STATS.
+ * @param cpu the CPU.
+ * @return the counts.
+ */
+ArvissJumpStats ArvissGetJumpStats(ArvissCpu* cpu);
+
+/**
+ * Gets counts of how the decoded instruction cache has been used since the CPU was reset. The counts are always zero if Arviss was
+ * built without ARVISS_CACHE_STATS.
+ * @param cpu the CPU.
+ * @return the counts.
+ */
+ArvissCacheStats ArvissGetCacheStats(ArvissCpu* cpu);
+
+/**
+ * Discards any decoded instructions in the given range of guest memory, so that they are fetched and decoded again before they are
+ * next run. Call this after changing code in memory behind Arviss's back, e.g., after loading a new program. Stores made by the
+ * guest don't need this, as they are checked for self-modifying code, and neither does code that runs FENCE.I.
+ * @param cpu the CPU.
+ * @param addr the address of the start of the range.
+ * @param len the length of the range, in bytes.
+ */
+void ArvissInvalidateRange(ArvissCpu* cpu, uint32_t addr, uint32_t len);
+
+/**
+ * Decodes all of the code in a read-only region of guest memory, such as a program's ROM, so that every CPU that runs the same
+ * image can share it rather than decoding it for itself. CPUs that it's attached to run code in the region from it, and only
+ * decode code elsewhere, e.g., in RAM, for themselves. The code is reference counted. The caller holds the first reference.
+ * @param region the region. Its contents are decoded straight away, so its host memory needn't outlive the code.
+ * @return the shared code, or NULL if the region is writable, its start or size isn't a multiple of the size of a cache line,
+ * i.e., CACHE_LINE_LENGTH * 4 bytes, or there's no memory for it.
+ */
+ArvissCode* ArvissCreateCode(const ArvissMemoryRegion* region);
+
+/**
+ * Releases a reference to shared code, freeing it once the last CPU that it was attached to has let it go.
+ * @param code the shared code, or NULL.
+ */
+void ArvissReleaseCode(ArvissCode* code);
+
+/**
+ * Attaches shared code to the given CPU, which takes a reference to it, and releases any code that was attached to it already.
+ * The CPU must have a read-only region in its memory map at the same address and of the same size as the one that the code was
+ * decoded from, and that region should hold the same image. As the region is read-only the guest can't change the code, but if
+ * the host does so then it should attach newly created code rather than call ArvissInvalidateRange(). Shared code can't be
+ * attached or released by more than one thread at a time.
+ * @param cpu the CPU.
+ * @param code the shared code, or NULL to detach the CPU's code.
+ * @return true if the code was attached, or false if the CPU's memory map has no such region, in which case the CPU is left as
+ * it was.
+ */
+bool ArvissAttachCode(ArvissCpu* cpu, ArvissCode* code);
+
+/**
+ * Reads a word from guest memory, as the CPU would, e.g., to fetch a syscall's arguments.
+ * @param cpu the CPU.
+ * @param addr the guest address of the word.
+ * @param busCode set to bcLOAD_ACCESS_FAULT if the word could not be read, otherwise left unchanged.
+ * @return the word, or zero if it could not be read.
+ */
+uint32_t ArvissRead32(ArvissCpu* cpu, uint32_t addr, BusCode* busCode);
+
+/**
+ * Writes a word to guest memory, as the CPU would, e.g., to return a syscall's results. Any decoded instructions that it
+ * overwrites are discarded.
+ * @param cpu the CPU.
+ * @param addr the guest address of the word.
+ * @param word the word to write.
+ * @param busCode set to bcSTORE_ACCESS_FAULT if the word could not be written, otherwise left unchanged.
+ */
+void ArvissWrite32(ArvissCpu* cpu, uint32_t addr, uint32_t word, BusCode* busCode);
+
+/**
+ * Reads a block of bytes from guest memory, as the CPU would, e.g., to fetch a structure that a syscall was given. It is read in
+ * one go if it is wholly in one of the memory map's regions, or if the bus has a ReadBlock callback, otherwise a word at a time.
+ * @param cpu the CPU.
+ * @param addr the guest address of the block.
+ * @param bytes where to put the block's contents.
+ * @param len the length of the block, in bytes.
+ * @param busCode set to bcLOAD_ACCESS_FAULT if the block could not be read, otherwise left unchanged.
+ */
+void ArvissReadBlock(ArvissCpu* cpu, uint32_t addr, void* bytes, uint32_t len, BusCode* busCode);
+
+/**
+ * Writes a block of bytes to guest memory, as the CPU would, e.g., to return a structure from a syscall. It is written in one go if
+ * it is wholly in one of the memory map's regions, or if the bus has a WriteBlock callback, otherwise a word at a time. Any decoded
+ * instructions that it overwrites are discarded.
+ * @param cpu the CPU.
+ * @param addr the guest address of the block.
+ * @param bytes the block's contents.
+ * @param len the length of the block, in bytes.
+ * @param busCode set to bcSTORE_ACCESS_FAULT if the block could not be written, otherwise left unchanged. Some of it may have been
+ * written even so.
+ */
+void ArvissWriteBlock(ArvissCpu* cpu, uint32_t addr, const void* bytes, uint32_t len, BusCode* busCode);
+
+/**
+ * Fills a block of guest memory with zeros, in the same way as ArvissWriteBlock(), but using the bus's ZeroBlock callback.
+ * @param cpu the CPU.
+ * @param addr the guest address of the block.
+ * @param len the length of the block, in bytes.
+ * @param busCode set to bcSTORE_ACCESS_FAULT if the block could not be zeroed, otherwise left unchanged. Some of it may have been
+ * zeroed even so.
+ */
+void ArvissZeroBlock(ArvissCpu* cpu, uint32_t addr, uint32_t len, BusCode* busCode);
+
+/**
+ * Translates a range of guest memory into a pointer to the host memory that holds it, so that a syscall can read or write a guest
+ * structure or buffer in place. The pointer is only valid until the CPU is next run, or its memory map is changed, and it is not
+ * necessarily aligned. Translating a range for writing discards any decoded instructions in it.
+ * @param cpu the CPU.
+ * @param addr the guest address of the start of the range.
+ * @param len the length of the range, in bytes.
+ * @param access how the host will access the range.
+ * @return a pointer to the host memory that holds the range, or NULL if it isn't wholly in one of the memory map's regions or, for
+ * acWRITE, if that region isn't writable.
+ */
+void* ArvissTranslate(ArvissCpu* cpu, uint32_t addr, uint32_t len, ArvissAccess access);
+
+/**
+ * Empties the given CPU's TLB. Call this after changing the regions in its memory map other than via ArvissSetMemoryMap(). It does
+ * nothing if Arviss was built without ARVISS_TLB.
+ * @param cpu the CPU.
+ */
+void ArvissFlushTlb(ArvissCpu* cpu);
+
+/**
+ * Gets counts of how often loads and stores found their page in the TLB since the CPU was reset. The counts are always zero if
+ * Arviss was built without ARVISS_TLB or without ARVISS_CACHE_STATS.
+ * @param cpu the CPU.
+ * @return the counts.
+ */
+ArvissTlbStats ArvissGetTlbStats(ArvissCpu* cpu);
+
+/**
+ * Enables or disables guard pages on the given CPU. Enabling them moves the regions of its memory map into a 4GB window of host
+ * address space, so that loads and stores are made without range checks. Any access outside the regions, or store to a read-only
+ * region, faults as it would otherwise, but the bus is no longer used, so they can only be enabled for a CPU whose bus has no
+ * callbacks, i.e., for guests that don't need memory mapped I/O. Faults are caught by a SIGSEGV handler that is installed when the
+ * first CPU enables guard pages, and replaced by whatever it replaced when the last CPU disables them.
+ * While they are enabled, the host memory that held the regions is no longer used, so access guest memory with ArvissRead32() and
+ * ArvissWrite32(). Disabling them copies the regions back to that memory and releases the window. Replacing the memory map while
+ * they are enabled moves the new map's regions into the window instead, or disables them if it can't.
+ * @param cpu the CPU.
+ * @param enable true to enable guard pages, false to disable them.
+ * @return true if guard pages are now enabled. They can't be enabled if Arviss was built without ARVISS_GUARD_PAGES, on an
+ * unsupported host, if the CPU's bus has any callbacks, or if the start or size of any of the memory map's regions isn't a multiple
+ * of GUARD_PAGE_SIZE.
+ */
+bool ArvissEnableGuardPages(ArvissCpu* cpu, bool enable);
+
 /**
  * Reads the given X register.
  * @param cpu the CPU.
@@ -483,14 +1071,17 @@ static inline uint32_t ArvissReadXReg(ArvissCpu* cpu, int reg)
 }
 
 /**
- * Writes to the given X register.
+ * Writes to the given X register. Writes to x0 are ignored, as it is always zero.
  * @param cpu the CPU.
  * @param reg which X register to write to (0 - 31).
  * @param value the value to write.
  */
 static inline void ArvissWriteXReg(ArvissCpu* cpu, int reg, uint32_t value)
 {
-    cpu->xreg[reg] = value;
+    if (reg != 0)
+    {
+        cpu->xreg[reg] = value;
+    }
 }
 
 /**
@@ -530,6 +1121,21 @@ void ArvissMret(ArvissCpu* cpu);
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ARVISS_USE_JIT) || defined(ARVISS_USE_GUARD_PAGES)
+#include <sys/mman.h>
+#endif
+
+#if defined(ARVISS_USE_JIT) || defined(ARVISS_USE_GUARD_PAGES)
+#include <unistd.h>
+#endif
+
+#if defined(ARVISS_USE_GUARD_PAGES)
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -549,6 +1155,20 @@ extern "C" {
     } while (0)
 #endif
 
+// Adds n to one of the counters of the decoded instruction cache or the TLB, if they are being counted.
+#if defined(ARVISS_CACHE_STATS)
+#define COUNT(cache, counter, n)                                                                                                   \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        (cache)->stats.counter += (n);                                                                                             \
+    } while (0)
+#else
+#define COUNT(cache, counter, n)                                                                                                   \
+    do                                                                                                                             \
+    {                                                                                                                              \
+    } while (0)
+#endif
+
 #if defined(ARVISS_TRACE_ENABLED)
 // The ABI names of the integer registers x0-x31.
 static char* abiNames[] = {"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0",  "a1",  "a2", "a3", "a4", "a5",
@@ -564,6 +1184,7 @@ static char* roundingModes[] = {"rne", "rtz", "rdn", "rup", "rmm", "reserved5",
 
 static void RunOne(ArvissCpu* cpu, DecodedInstruction* ins);
 static DecodedInstruction ArvissDecode(uint32_t instruction);
+static DecodedInstruction Canonicalise(DecodedInstruction decoded);
 
 static inline float U32AsFloat(const uint32_t a)
 {
@@ -593,1315 +1214,2331 @@ static inline uint32_t BoolAsU32(const bool b)
 }
 
 // --- Bus access ------------------------------------------------------------------------------------------------------------------
+//
+// Loads and stores that fall within one of the regions in the CPU's memory map access host memory directly, with a range check and
+// a pointer add, and stores to regions that aren't writable fault. Everything else goes to the bus callbacks. With ARVISS_TLB,
+// recently accessed pages of the regions are kept in the TLB, which saves searching for their region. The bus callbacks use the
+// second version of the bus ABI, so loads return their value and bus code together, and a bus that uses the original ABI is
+// adapted to it.
+//
+// With guard pages, every load and store goes straight to the CPU's window instead. When one faults, the SIGSEGV handler opens up
+// the page that it faulted on, sets the CPU's bus code, and returns so that the access can complete harmlessly. The access then
+// takes the bus code as its result, so the instruction traps just as if the bus had faulted, and the page is closed again before
+// ArvissRun() returns. A store that straddles a page boundary may change the bytes on the side that didn't fault before it traps.
 
-static inline uint8_t Read8(Bus* bus, uint32_t addr, BusCode* busCode)
+// Returns the region of the memory map that holds all len bytes at the given address, or NULL if there isn't one.
+static inline const ArvissMemoryRegion* FindRegion(const ArvissCpu* cpu, uint32_t addr, uint32_t len)
 {
-    return bus->Read8(bus->token, addr, busCode);
+    for (int i = 0; i < cpu->memoryRegions; i++)
+    {
+        // Regions are at least 4 bytes long, so this can't underflow.
+        const ArvissMemoryRegion* region = &cpu->memory[i];
+        if (addr - region->start <= region->size - len)
+        {
+            return region;
+        }
+    }
+    return NULL;
 }
 
-static inline uint16_t Read16(Bus* bus, uint32_t addr, BusCode* busCode)
-{
-    return bus->Read16(bus->token, addr, busCode);
-}
+#if defined(ARVISS_TLB)
+
+#define TLB_INVALID 0xffffffff // A tag that never matches, as it isn't the address of a page.
 
-static inline uint32_t Read32(Bus* bus, uint32_t addr, BusCode* busCode)
+// Returns the TLB entry for the page that holds the given address.
+static inline struct TlbEntry* TlbEntryFor(ArvissCpu* cpu, uint32_t addr)
 {
-    return bus->Read32(bus->token, addr, busCode);
+    return &cpu->tlb.entry[(addr / TLB_PAGE_SIZE) % TLB_ENTRIES];
 }
 
-static inline void Write8(Bus* bus, uint32_t addr, uint8_t byte, BusCode* busCode)
+// Returns the tag that matches an access of len bytes, where len is a power of 2, at the given address. The tag of an access that
+// isn't aligned never matches, so accesses that are found in the TLB never run off the end of the page.
+static inline uint32_t TlbTag(uint32_t addr, uint32_t len)
 {
-    bus->Write8(bus->token, addr, byte, busCode);
+    return addr & (~(uint32_t)(TLB_PAGE_SIZE - 1) | (len - 1));
 }
 
-static inline void Write16(Bus* bus, uint32_t addr, uint16_t halfword, BusCode* busCode)
+// Adds the page that holds the given address to the TLB, provided that it is wholly in the given region.
+static inline void FillTlb(ArvissCpu* cpu, uint32_t addr, const ArvissMemoryRegion* region)
 {
-    bus->Write16(bus->token, addr, halfword, busCode);
+    const uint32_t page = addr & ~(uint32_t)(TLB_PAGE_SIZE - 1);
+    if (page >= region->start && region->size >= TLB_PAGE_SIZE && page - region->start <= region->size - TLB_PAGE_SIZE)
+    {
+        struct TlbEntry* entry = TlbEntryFor(cpu, addr);
+        entry->readTag = page;
+        entry->writeTag = region->isWritable ? page : TLB_INVALID;
+        entry->mem = region->mem + (page - region->start);
+    }
 }
 
-static inline void Write32(Bus* bus, uint32_t addr, uint32_t word, BusCode* busCode)
+// Empties the TLB.
+static inline void FlushTlb(Tlb* tlb)
 {
-    bus->Write32(bus->token, addr, word, busCode);
+    for (int i = 0; i < TLB_ENTRIES; i++)
+    {
+        tlb->entry[i].readTag = TLB_INVALID;
+        tlb->entry[i].writeTag = TLB_INVALID;
+    }
+    COUNT(tlb, flushes, 1);
 }
 
-// --- Execution -------------------------------------------------------------------------------------------------------------------
-//
-// Functions in this section execute decoded instructions. Instruction execution is separate from decoding, as this allows an
-// instruction to be fetched and decoded once, then placed in the decoded instruction cache where it can be executed several times.
-// This mitigates the cost of decoding, as decoded instructions are already in a form that is easy to execute.
-
-static inline ArvissResult TakeTrap(ArvissCpu* cpu, ArvissResult result)
-{
-    ArvissTrap trap = ArvissResultAsTrap(result);
-
-    cpu->mepc = cpu->pc;       // Save the program counter in the machine exception program counter.
-    cpu->mcause = trap.mcause; // mcause <- reason for trap.
-    cpu->mtval = trap.mtval;   // mtval <- exception specific information.
+#endif
 
-    return result;
-}
+#if defined(ARVISS_USE_GUARD_PAGES)
 
-static inline ArvissResult CreateTrap(ArvissCpu* cpu, ArvissTrapType trap, uint32_t value)
-{
-    ArvissResult result = ArvissMakeTrap(trap, value);
-    return TakeTrap(cpu, result);
-}
+// The size of a CPU's window, which covers the whole guest address space, and of the pages below it that hold saved pages.
+#define GUARD_WINDOW_SIZE ((size_t)1 << 32)
+#define GUARD_SAVED_SIZE ((size_t)GUARD_MAX_PATCHES * GUARD_PAGE_SIZE)
 
-inline static void Exec_IllegalInstruction(ArvissCpu* cpu, const DecodedInstruction* ins)
+// The SIGSEGV handler is shared by every CPU with guard pages enabled. It's installed when the first of them is enabled, and what
+// it replaced is put back when the last of them is disabled. It and the CPU that each thread is running have external linkage, like
+// the rest of the implementation, so that they have a single owner, even if more than one copy of it ends up in the process.
+struct ArvissGuardHandler
 {
-    cpu->result = CreateTrap(cpu, trILLEGAL_INSTRUCTION, ins->ins);
-}
+    pthread_mutex_t lock;                    // Held while the handler is installed or put back.
+    int users;                               // The number of CPUs that have guard pages enabled.
+    void (*handler)(int, siginfo_t*, void*); // The handler that was installed.
+    struct sigaction previous;               // What SIGSEGV did before it was installed.
+} arvissGuardHandler = {.lock = PTHREAD_MUTEX_INITIALIZER};
+_Thread_local ArvissCpu* arvissGuardedCpu; // The CPU that faults in a window on this thread are for, or NULL if there isn't one.
 
-inline static void Exec_FetchDecodeReplace(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Passes a SIGSEGV that wasn't caused by a guard page on to whatever handled it before.
+static void ChainSegv(int sig, siginfo_t* info, void* context)
 {
-    // Reconstitute the address given the cache line and index.
-    const uint32_t cacheLine = ins->fdr.cacheLine;
-    const uint32_t index = ins->fdr.index;
-    struct CacheLine* line = &cpu->cache.line[cacheLine];
-    const uint32_t owner = line->owner;
-    const uint32_t addr = owner * 4 * CACHE_LINE_LENGTH + index * 4;
-
-    // Fetch a word from memory at the address.
-    uint32_t instruction = Read32(&cpu->bus, addr, &cpu->busCode);
-
-    // Decode it, save the result in the cache, then execute it.
-    if (cpu->busCode == bcOK)
+    const struct sigaction* previous = &arvissGuardHandler.previous;
+    if (previous->sa_flags & SA_SIGINFO)
     {
-        // Decode the instruction and save it in the cache. All instructions are decodable into something executable, because
-        // all illegal instructions become Exec_IllegalInstruction, which is itself executable.
-        DecodedInstruction decoded = ArvissDecode(instruction);
-        line->instructions[index] = decoded;
-
-        // Execute the decoded instruction.
-        RunOne(cpu, &decoded);
+        previous->sa_sigaction(sig, info, context);
+    }
+    else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+    {
+        previous->sa_handler(sig);
     }
     else
     {
-        cpu->result = ArvissMakeTrap(trINSTRUCTION_ACCESS_FAULT, addr);
+        // Nothing handled it before, so put back what SIGSEGV did then and raise it again. It's delivered once this returns, and
+        // ends the process just as it would have without guard pages.
+        sigaction(sig, previous, NULL);
+        raise(sig);
     }
 }
 
-inline static void Exec_Lui(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Handles a SIGSEGV. If it's for the window of the CPU that's running on this thread then it opens up the page, so that the access
+// can complete, and tells the CPU that it faulted. As the instruction that made the access decides whether to raise a load or a
+// store fault, the bus code only needs to say that there was one.
+static void HandleGuardFault(int sig, siginfo_t* info, void* context)
 {
-    // rd <- imm_u, pc += 4
-    TRACE("LUI %s, %d\n", abiNames[ins->rd_imm.rd], ins->rd_imm.imm >> 12);
-    cpu->xreg[ins->rd_imm.rd] = ins->rd_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-}
+    ArvissCpu* cpu = arvissGuardedCpu;
+    GuardPages* guard = cpu != NULL ? &cpu->guard : NULL;
+    const uint8_t* addr = (const uint8_t*)info->si_addr;
+    if (guard == NULL || guard->window == NULL || addr < guard->window || (size_t)(addr - guard->window) >= GUARD_WINDOW_SIZE
+        || guard->patches == GUARD_MAX_PATCHES)
+    {
+        ChainSegv(sig, info, context);
+        return;
+    }
 
-inline static void Exec_Auipc(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- pc + imm_u, pc += 4
-    TRACE("AUIPC %s, %d\n", abiNames[ins->rd_imm.rd], ins->rd_imm.imm >> 12);
-    cpu->xreg[ins->rd_imm.rd] = cpu->pc + ins->rd_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const uint32_t page = (uint32_t)(addr - guard->window) & ~(uint32_t)(GUARD_PAGE_SIZE - 1);
+    struct GuardPatch* patch = &guard->patch[guard->patches];
+    patch->page = page;
+    patch->isInRegion = FindRegion(cpu, page, 1) != NULL;
+    if (patch->isInRegion)
+    {
+        // It's a store to a read-only region, so save what it overwrites.
+        memcpy(guard->saved + guard->patches * GUARD_PAGE_SIZE, guard->window + page, GUARD_PAGE_SIZE);
+    }
+    mprotect(guard->window + page, GUARD_PAGE_SIZE, PROT_READ | PROT_WRITE);
+    guard->patches++;
+    cpu->busCode = bcLOAD_ACCESS_FAULT;
 }
 
-inline static void Exec_Jal(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Installs the SIGSEGV handler if no other CPU has guard pages enabled. Returns false if it can't be installed.
+static bool AcquireGuardHandler(void)
 {
-    // rd <- pc + 4, pc <- pc + imm_j
-    TRACE("JAL %s, %d\n", abiNames[ins->rd_imm.rd], ins->rd_imm.imm);
-    cpu->xreg[ins->rd_imm.rd] = cpu->pc + 4;
-    cpu->pc += ins->rd_imm.imm;
-    cpu->xreg[0] = 0;
+    struct ArvissGuardHandler* owner = &arvissGuardHandler;
+    pthread_mutex_lock(&owner->lock);
+    bool installed = owner->users > 0;
+    if (!installed)
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = HandleGuardFault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+        installed = sigaction(SIGSEGV, &action, &owner->previous) == 0;
+        owner->handler = HandleGuardFault;
+    }
+    if (installed)
+    {
+        owner->users++;
+    }
+    pthread_mutex_unlock(&owner->lock);
+    return installed;
 }
 
-inline static void Exec_Jalr(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Puts back what SIGSEGV did before the handler was installed, once no CPU has guard pages enabled. If something else has replaced
+// the handler since then, it's left alone, as putting it back is now up to whatever replaced it.
+static void ReleaseGuardHandler(void)
 {
-    // rd <- pc + 4, pc <- (rs1 + imm_i) & ~1
-    TRACE("JALR %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    uint32_t rs1Before = cpu->xreg[ins->rd_rs1_imm.rs1]; // Because rd and rs1 might be the same register.
-    cpu->xreg[ins->rd_rs1_imm.rd] = cpu->pc + 4;
-    cpu->pc = (rs1Before + ins->rd_rs1_imm.imm) & ~1;
-    cpu->xreg[0] = 0;
+    struct ArvissGuardHandler* owner = &arvissGuardHandler;
+    pthread_mutex_lock(&owner->lock);
+    if (--owner->users == 0)
+    {
+        struct sigaction current;
+        if (sigaction(SIGSEGV, NULL, &current) == 0 && (current.sa_flags & SA_SIGINFO) && current.sa_sigaction == owner->handler)
+        {
+            sigaction(SIGSEGV, &owner->previous, NULL);
+        }
+    }
+    pthread_mutex_unlock(&owner->lock);
 }
 
-inline static void Exec_Beq(ArvissCpu* cpu, const DecodedInstruction* ins)
+#endif
+
+// Closes any pages that faulting accesses opened up, putting back the contents of pages of read-only regions and discarding
+// whatever was written to guard pages.
+static inline void ReleaseGuardPages(ArvissCpu* cpu)
 {
-    // pc <- pc + ((rs1 == rs2) ? imm_b : 4)
-    TRACE("BEQ %s, %s, %d\n", abiNames[ins->rs1_rs2_imm.rs1], abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm);
-    cpu->pc += ((cpu->xreg[ins->rs1_rs2_imm.rs1] == cpu->xreg[ins->rs1_rs2_imm.rs2]) ? ins->rs1_rs2_imm.imm : 4);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    GuardPages* guard = &cpu->guard;
+    while (guard->patches > 0)
+    {
+        guard->patches--;
+        const struct GuardPatch* patch = &guard->patch[guard->patches];
+        uint8_t* page = guard->window + patch->page;
+        if (patch->isInRegion)
+        {
+            memcpy(page, guard->saved + guard->patches * GUARD_PAGE_SIZE, GUARD_PAGE_SIZE);
+            mprotect(page, GUARD_PAGE_SIZE, PROT_READ);
+        }
+        else
+        {
+            madvise(page, GUARD_PAGE_SIZE, MADV_DONTNEED);
+            mprotect(page, GUARD_PAGE_SIZE, PROT_NONE);
+        }
+    }
+#else
+    (void)cpu;
+#endif
 }
 
-inline static void Exec_Bne(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Makes faults in the given CPU's window on this thread be reported to it, and returns the CPU that they were reported to before.
+static inline ArvissCpu* EnterGuard(ArvissCpu* cpu)
 {
-    // pc <- pc + ((rs1 != rs2) ? imm_b : 4)
-    TRACE("BNE %s, %s, %d\n", abiNames[ins->rs1_rs2_imm.rs1], abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm);
-    cpu->pc += ((cpu->xreg[ins->rs1_rs2_imm.rs1] != cpu->xreg[ins->rs1_rs2_imm.rs2]) ? ins->rs1_rs2_imm.imm : 4);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    ArvissCpu* outer = arvissGuardedCpu;
+    arvissGuardedCpu = cpu;
+    return outer;
+#else
+    (void)cpu;
+    return NULL;
+#endif
 }
 
-inline static void Exec_Blt(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Undoes EnterGuard(), closing any pages that were opened up in the meantime.
+static inline void LeaveGuard(ArvissCpu* cpu, ArvissCpu* outer)
 {
-    // pc <- pc + ((rs1 < rs2) ? imm_b : 4)
-    TRACE("BLT %s, %s, %d\n", abiNames[ins->rs1_rs2_imm.rs1], abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm);
-    cpu->pc += (((int32_t)cpu->xreg[ins->rs1_rs2_imm.rs1] < (int32_t)cpu->xreg[ins->rs1_rs2_imm.rs2]) ? ins->rs1_rs2_imm.imm : 4);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    arvissGuardedCpu = outer;
+    ReleaseGuardPages(cpu);
+#else
+    (void)cpu;
+    (void)outer;
+#endif
 }
 
-inline static void Exec_Bge(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the bus code of an access to host memory that has just been made. It can only have faulted if it was to a guard page, in
+// which case the handler has set the CPU's bus code, and this takes it.
+static inline BusCode TakeGuardFault(ArvissCpu* cpu)
 {
-    // pc <- pc + ((rs1 >= rs2) ? imm_b : 4)
-    TRACE("BGE %s, %s, %d\n", abiNames[ins->rs1_rs2_imm.rs1], abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm);
-    cpu->pc += (((int32_t)cpu->xreg[ins->rs1_rs2_imm.rs1] >= (int32_t)cpu->xreg[ins->rs1_rs2_imm.rs2]) ? ins->rs1_rs2_imm.imm : 4);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    // Stop the compiler from moving memory accesses across the access, as the handler sets the bus code behind its back.
+    __asm__ __volatile__("" ::: "memory");
+    if (cpu->busCode != bcOK)
+    {
+        const BusCode busCode = cpu->busCode;
+        cpu->busCode = bcOK;
+        return busCode;
+    }
+#else
+    (void)cpu;
+#endif
+    return bcOK;
 }
 
-inline static void Exec_Bltu(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the result of a load of the given value from host memory that has just been made.
+static inline BusResult Loaded(ArvissCpu* cpu, uint32_t value)
 {
-    // pc <- pc + ((rs1 < rs2) ? imm_b : 4)
-    TRACE("BLTU %s, %s, %d\n", abiNames[ins->rs1_rs2_imm.rs1], abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm);
-    cpu->pc += ((cpu->xreg[ins->rs1_rs2_imm.rs1] < cpu->xreg[ins->rs1_rs2_imm.rs2]) ? ins->rs1_rs2_imm.imm : 4);
+    const BusCode busCode = TakeGuardFault(cpu);
+    return busCode == bcOK ? ArvissMakeBusValue(value) : ArvissMakeBusFault(busCode);
 }
 
-inline static void Exec_Bgeu(ArvissCpu* cpu, const DecodedInstruction* ins)
+#if defined(ARVISS_USE_GUARD_PAGES)
+typedef uint16_t __attribute__((aligned(1), may_alias)) UnalignedU16; // A halfword in host memory that may not be aligned.
+typedef uint32_t __attribute__((aligned(1), may_alias)) UnalignedU32; // A word in host memory that may not be aligned.
+#endif
+
+// Loads a byte, halfword or word from host memory. With guard pages, the load itself is what faults if nothing is mapped at its
+// address, so it's made through a volatile pointer, which stops the compiler from leaving it out when its value isn't used, e.g.,
+// for a load to x0.
+static inline uint8_t LoadHost8(const uint8_t* mem)
 {
-    // pc <- pc + ((rs1 >= rs2) ? imm_b : 4)
-    TRACE("BGEU %s, %s, %d\n", abiNames[ins->rs1_rs2_imm.rs1], abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm);
-    cpu->pc += ((cpu->xreg[ins->rs1_rs2_imm.rs1] >= cpu->xreg[ins->rs1_rs2_imm.rs2]) ? ins->rs1_rs2_imm.imm : 4);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    return *(const volatile uint8_t*)mem;
+#else
+    return *mem;
+#endif
 }
 
-inline static void Exec_Lb(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline uint16_t LoadHost16(const uint8_t* mem)
 {
-    // rd <- sx(m8(rs1 + imm_i)), pc += 4
-    TRACE("LB %s, %d(%s)\n", abiNames[ins->rd_rs1_imm.rd], ins->rd_rs1_imm.imm, abiNames[ins->rd_rs1_imm.rs1]);
-    uint8_t byte = Read8(&cpu->bus, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm, &cpu->busCode);
-    if (cpu->busCode != bcOK)
-    {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm));
-        return;
-    }
-    cpu->xreg[ins->rd_rs1_imm.rd] = (int32_t)(int16_t)(int8_t)byte;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+#if defined(ARVISS_USE_GUARD_PAGES)
+    return *(const volatile UnalignedU16*)mem;
+#else
+    uint16_t halfword;
+    memcpy(&halfword, mem, sizeof(halfword));
+    return halfword;
+#endif
 }
 
-inline static void Exec_Lh(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline uint32_t LoadHost32(const uint8_t* mem)
 {
-    // rd <- sx(m16(rs1 + imm_i)), pc += 4
-    TRACE("LH %s, %d(%s)\n", abiNames[ins->rd_rs1_imm.rd], ins->rd_rs1_imm.imm, abiNames[ins->rd_rs1_imm.rs1]);
-    uint16_t halfword = Read16(&cpu->bus, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm, &cpu->busCode);
-    if (cpu->busCode != bcOK)
-    {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm));
-        return;
-    }
-    cpu->xreg[ins->rd_rs1_imm.rd] = (int32_t)(int16_t)halfword;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+#if defined(ARVISS_USE_GUARD_PAGES)
+    return *(const volatile UnalignedU32*)mem;
+#else
+    uint32_t word;
+    memcpy(&word, mem, sizeof(word));
+    return word;
+#endif
 }
 
-inline static void Exec_Lw(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the host address of the len bytes at the given address if they can be loaded from host memory, otherwise NULL.
+static inline const uint8_t* FindLoad(ArvissCpu* cpu, uint32_t addr, uint32_t len)
 {
-    // rd <- sx(m32(rs1 + imm_i)), pc += 4
-    TRACE("LW %s, %d(%s)\n", abiNames[ins->rd_rs1_imm.rd], ins->rd_rs1_imm.imm, abiNames[ins->rd_rs1_imm.rs1]);
-    uint32_t word = Read32(&cpu->bus, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm, &cpu->busCode);
-    if (cpu->busCode != bcOK)
+#if defined(ARVISS_USE_GUARD_PAGES)
+    if (cpu->guard.window != NULL)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm));
-        return;
+        return cpu->guard.window + addr;
     }
-    cpu->xreg[ins->rd_rs1_imm.rd] = (int32_t)word;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-}
-
-inline static void Exec_Lbu(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- zx(m8(rs1 + imm_i)), pc += 4
-    TRACE("LBU x%d, %d(x%d)\n", ins->rd_rs1_imm.rd, ins->rd_rs1_imm.imm, ins->rd_rs1_imm.rs1);
-    uint8_t byte = Read8(&cpu->bus, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm, &cpu->busCode);
-    if (cpu->busCode != bcOK)
+#endif
+#if defined(ARVISS_TLB)
+    const struct TlbEntry* entry = TlbEntryFor(cpu, addr);
+    if (TlbTag(addr, len) == entry->readTag)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm));
-        return;
+        COUNT(&cpu->tlb, hits, 1);
+        return entry->mem + addr % TLB_PAGE_SIZE;
     }
-    cpu->xreg[ins->rd_rs1_imm.rd] = byte;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-}
-
-inline static void Exec_Lhu(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- zx(m16(rs1 + imm_i)), pc += 4
-    TRACE("LHU %s, %d(%s)\n", abiNames[ins->rd_rs1_imm.rd], ins->rd_rs1_imm.imm, abiNames[ins->rd_rs1_imm.rs1]);
-    uint16_t halfword = Read16(&cpu->bus, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm, &cpu->busCode);
-    if (cpu->busCode != bcOK)
+    COUNT(&cpu->tlb, misses, 1);
+#endif
+    const ArvissMemoryRegion* region = FindRegion(cpu, addr, len);
+    if (region == NULL)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm));
-        return;
+        return NULL;
     }
-    cpu->xreg[ins->rd_rs1_imm.rd] = halfword;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+#if defined(ARVISS_TLB)
+    FillTlb(cpu, addr, region);
+#endif
+    return region->mem + (addr - region->start);
 }
 
-inline static void Exec_Sb(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the host address of the len bytes at the given address if they can be stored to host memory, otherwise NULL. Sets
+// *isMapped if they are in one of the memory map's regions, regardless of whether it's writable.
+static inline uint8_t* FindStore(ArvissCpu* cpu, uint32_t addr, uint32_t len, bool* isMapped)
 {
-    // m8(rs1 + imm_s) <- rs2[7:0], pc += 4
-    TRACE("SB %s, %d(%s)\n", abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm, abiNames[ins->rs1_rs2_imm.rs1]);
-    Write8(&cpu->bus, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm, cpu->xreg[ins->rs1_rs2_imm.rs2] & 0xff,
-           &cpu->busCode);
-    if (cpu->busCode != bcOK)
+#if defined(ARVISS_USE_GUARD_PAGES)
+    if (cpu->guard.window != NULL)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm));
-        return;
+        *isMapped = true;
+        return cpu->guard.window + addr;
     }
-    cpu->pc += 4;
-}
-
-inline static void Exec_Sh(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // m16(rs1 + imm_s) <- rs2[15:0], pc += 4
-    TRACE("SH %s, %d(%s)\n", abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm, abiNames[ins->rs1_rs2_imm.rs1]);
-    Write16(&cpu->bus, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm, cpu->xreg[ins->rs1_rs2_imm.rs2] & 0xffff,
-            &cpu->busCode);
-    if (cpu->busCode != bcOK)
+#endif
+#if defined(ARVISS_TLB)
+    const struct TlbEntry* entry = TlbEntryFor(cpu, addr);
+    if (TlbTag(addr, len) == entry->writeTag)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm));
-        return;
+        COUNT(&cpu->tlb, hits, 1);
+        *isMapped = true;
+        return entry->mem + addr % TLB_PAGE_SIZE;
     }
-    cpu->pc += 4;
-}
-
-inline static void Exec_Sw(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // m32(rs1 + imm_s) <- rs2[31:0], pc += 4
-    TRACE("SW %s, %d(%s)\n", abiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm, abiNames[ins->rs1_rs2_imm.rs1]);
-    Write32(&cpu->bus, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm, cpu->xreg[ins->rs1_rs2_imm.rs2], &cpu->busCode);
-    if (cpu->busCode != bcOK)
+    COUNT(&cpu->tlb, misses, 1);
+#endif
+    const ArvissMemoryRegion* region = FindRegion(cpu, addr, len);
+    *isMapped = region != NULL;
+    if (region == NULL || !region->isWritable)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm));
-        return;
+        return NULL;
     }
-    cpu->pc += 4;
+#if defined(ARVISS_TLB)
+    FillTlb(cpu, addr, region);
+#endif
+    return region->mem + (addr - region->start);
 }
 
-inline static void Exec_Addi(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- rs1 + imm_i, pc += 4
-    TRACE("ADDI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-}
+// Adapters from the original bus ABI, whose callbacks report faults through a pointer, to the second. Their token is the CPU, which
+// holds the original bus.
 
-inline static void Exec_Slti(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusResult AdaptRead8(BusToken token, uint32_t addr)
 {
-    // rd <- (rs1 < imm_i) ? 1 : 0, pc += 4
-    TRACE("SLTI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = ((int32_t)cpu->xreg[ins->rd_rs1_imm.rs1] < ins->rd_rs1_imm.imm) ? 1 : 0;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    const uint8_t byte = bus->Read8(bus->token, addr, &busCode);
+    return busCode == bcOK ? ArvissMakeBusValue(byte) : ArvissMakeBusFault(busCode);
 }
 
-inline static void Exec_Sltiu(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusResult AdaptRead16(BusToken token, uint32_t addr)
 {
-    // rd <- (rs1 < imm_i) ? 1 : 0, pc += 4
-    TRACE("SLTIU %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = (cpu->xreg[ins->rd_rs1_imm.rs1] < (uint32_t)ins->rd_rs1_imm.imm) ? 1 : 0;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    const uint16_t halfword = bus->Read16(bus->token, addr, &busCode);
+    return busCode == bcOK ? ArvissMakeBusValue(halfword) : ArvissMakeBusFault(busCode);
 }
 
-inline static void Exec_Xori(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusResult AdaptRead32(BusToken token, uint32_t addr)
 {
-    // rd <- rs1 ^ imm_i, pc += 4
-    TRACE("XORI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = cpu->xreg[ins->rd_rs1_imm.rs1] ^ ins->rd_rs1_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    const uint32_t word = bus->Read32(bus->token, addr, &busCode);
+    return busCode == bcOK ? ArvissMakeBusValue(word) : ArvissMakeBusFault(busCode);
 }
 
-inline static void Exec_Ori(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusCode AdaptWrite8(BusToken token, uint32_t addr, uint8_t byte)
 {
-    // rd <- rs1 | imm_i, pc += 4
-    TRACE("ORI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = cpu->xreg[ins->rd_rs1_imm.rs1] | ins->rd_rs1_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    bus->Write8(bus->token, addr, byte, &busCode);
+    return busCode;
 }
 
-inline static void Exec_Andi(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusCode AdaptWrite16(BusToken token, uint32_t addr, uint16_t halfword)
 {
-    // rd <- rs1 & imm_i, pc += 4
-    TRACE("ANDI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = cpu->xreg[ins->rd_rs1_imm.rs1] & ins->rd_rs1_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    bus->Write16(bus->token, addr, halfword, &busCode);
+    return busCode;
 }
 
-inline static void Exec_Slli(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusCode AdaptWrite32(BusToken token, uint32_t addr, uint32_t word)
 {
-    TRACE("SLLI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = cpu->xreg[ins->rd_rs1_imm.rs1] << ins->rd_rs1_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    bus->Write32(bus->token, addr, word, &busCode);
+    return busCode;
 }
 
-inline static void Exec_Srli(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusCode AdaptReadBlock(BusToken token, uint32_t addr, uint8_t* bytes, uint32_t len)
 {
-    // rd <- rs1 >> shamt_i, pc += 4
-    TRACE("SRLI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = cpu->xreg[ins->rd_rs1_imm.rs1] >> ins->rd_rs1_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    bus->ReadBlock(bus->token, addr, bytes, len, &busCode);
+    return busCode;
 }
 
-inline static void Exec_Srai(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusCode AdaptWriteBlock(BusToken token, uint32_t addr, const uint8_t* bytes, uint32_t len)
 {
-    // rd <- sx(rs1) >> shamt_i, pc += 4
-    TRACE("SRAI %s, %s, %d\n", abiNames[ins->rd_rs1_imm.rd], abiNames[ins->rd_rs1_imm.rs1], ins->rd_rs1_imm.imm);
-    cpu->xreg[ins->rd_rs1_imm.rd] = (int32_t)cpu->xreg[ins->rd_rs1_imm.rs1] >> ins->rd_rs1_imm.imm;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    bus->WriteBlock(bus->token, addr, bytes, len, &busCode);
+    return busCode;
 }
 
-inline static void Exec_Add(ArvissCpu* cpu, const DecodedInstruction* ins)
+static BusCode AdaptZeroBlock(BusToken token, uint32_t addr, uint32_t len)
 {
-    // rd <- rs1 + rs2, pc += 4
-    TRACE("ADD %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] + cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const Bus* bus = &((ArvissCpu*)token.t)->busV1;
+    BusCode busCode = bcOK;
+    bus->ZeroBlock(bus->token, addr, len, &busCode);
+    return busCode;
 }
 
-inline static void Exec_Sub(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- rs1 - rs2, pc += 4
-    TRACE("SUB %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] - cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-}
+// TODO: implement for big-endian hosts.
 
-inline static void Exec_Mul(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline BusResult Read8(ArvissCpu* cpu, uint32_t addr)
 {
-    TRACE("MUL %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] * cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const uint8_t* mem = FindLoad(cpu, addr, 1);
+    if (mem != NULL)
+    {
+        return Loaded(cpu, LoadHost8(mem));
+    }
+    if (cpu->bus.Read8 == NULL)
+    {
+        return ArvissMakeBusFault(bcLOAD_ACCESS_FAULT);
+    }
+    return cpu->bus.Read8(cpu->bus.token, addr);
 }
 
-inline static void Exec_Sll(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline BusResult Read16(ArvissCpu* cpu, uint32_t addr)
 {
-    // rd <- rs1 << (rs2 % XLEN), pc += 4
-    TRACE("SLL %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] << (cpu->xreg[ins->rd_rs1_rs2.rs2] % 32);
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const uint8_t* mem = FindLoad(cpu, addr, 2);
+    if (mem != NULL)
+    {
+        return Loaded(cpu, LoadHost16(mem));
+    }
+    if (cpu->bus.Read16 == NULL)
+    {
+        return ArvissMakeBusFault(bcLOAD_ACCESS_FAULT);
+    }
+    return cpu->bus.Read16(cpu->bus.token, addr);
 }
 
-inline static void Exec_Mulh(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline BusResult Read32(ArvissCpu* cpu, uint32_t addr)
 {
-    TRACE("MULH %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    int64_t t = (int64_t)(int32_t)cpu->xreg[ins->rd_rs1_rs2.rs1] * (int64_t)(int32_t)cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->xreg[ins->rd_rs1_rs2.rd] = t >> 32;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const uint8_t* mem = FindLoad(cpu, addr, 4);
+    if (mem != NULL)
+    {
+        return Loaded(cpu, LoadHost32(mem));
+    }
+    if (cpu->bus.Read32 == NULL)
+    {
+        return ArvissMakeBusFault(bcLOAD_ACCESS_FAULT);
+    }
+    return cpu->bus.Read32(cpu->bus.token, addr);
 }
 
-inline static void Exec_Slt(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline BusCode Write8(ArvissCpu* cpu, uint32_t addr, uint8_t byte)
 {
-    // rd <- (rs1 < rs2) ? 1 : 0, pc += 4
-    TRACE("SLT %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = ((int32_t)cpu->xreg[ins->rd_rs1_rs2.rs1] < (int32_t)cpu->xreg[ins->rd_rs1_rs2.rs2]) ? 1 : 0;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    bool isMapped = false;
+    uint8_t* mem = FindStore(cpu, addr, 1, &isMapped);
+    if (mem != NULL)
+    {
+        *mem = byte;
+        return TakeGuardFault(cpu);
+    }
+    if (isMapped || cpu->bus.Write8 == NULL)
+    {
+        return bcSTORE_ACCESS_FAULT;
+    }
+    return cpu->bus.Write8(cpu->bus.token, addr, byte);
 }
 
-inline static void Exec_Mulhsu(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline BusCode Write16(ArvissCpu* cpu, uint32_t addr, uint16_t halfword)
 {
-    TRACE("MULHSU %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    int64_t t = (int64_t)(int32_t)cpu->xreg[ins->rd_rs1_rs2.rs1] * (uint64_t)cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->xreg[ins->rd_rs1_rs2.rd] = t >> 32;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    bool isMapped = false;
+    uint8_t* mem = FindStore(cpu, addr, 2, &isMapped);
+    if (mem != NULL)
+    {
+        memcpy(mem, &halfword, sizeof(halfword));
+        return TakeGuardFault(cpu);
+    }
+    if (isMapped || cpu->bus.Write16 == NULL)
+    {
+        return bcSTORE_ACCESS_FAULT;
+    }
+    return cpu->bus.Write16(cpu->bus.token, addr, halfword);
 }
 
-inline static void Exec_Sltu(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline BusCode Write32(ArvissCpu* cpu, uint32_t addr, uint32_t word)
 {
-    // rd <- (rs1 < rs2) ? 1 : 0, pc += 4
-    TRACE("SLTU %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = (cpu->xreg[ins->rd_rs1_rs2.rs1] < cpu->xreg[ins->rd_rs1_rs2.rs2]) ? 1 : 0;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-    cpu->xreg[0] = 0;
+    bool isMapped = false;
+    uint8_t* mem = FindStore(cpu, addr, 4, &isMapped);
+    if (mem != NULL)
+    {
+        memcpy(mem, &word, sizeof(word));
+        return TakeGuardFault(cpu);
+    }
+    if (isMapped || cpu->bus.Write32 == NULL)
+    {
+        return bcSTORE_ACCESS_FAULT;
+    }
+    return cpu->bus.Write32(cpu->bus.token, addr, word);
 }
 
-inline static void Exec_Mulhu(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    TRACE("MULHU %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    uint64_t t = (uint64_t)cpu->xreg[ins->rd_rs1_rs2.rs1] * (uint64_t)cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->xreg[ins->rd_rs1_rs2.rd] = t >> 32;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-}
+// Blocks of any length are accessed in one go if they're wholly in one of the memory map's regions, or if they're wholly outside
+// of them and the bus has a block callback. Otherwise they're accessed a word at a time, which stops at the first word that faults.
+// Guard pages don't use the bus, and the regions are still in the window, so blocks never fault on a guard page in one go.
 
-inline static void Exec_Xor(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the region of the memory map that holds all len bytes at the given address, or NULL if there isn't one. Unlike
+// FindRegion(), len may be larger than a region.
+static inline const ArvissMemoryRegion* FindBlockRegion(const ArvissCpu* cpu, uint32_t addr, uint32_t len)
 {
-    // rd <- rs1 ^ rs2, pc += 4
-    TRACE("XOR %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] ^ cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    for (int i = 0; i < cpu->memoryRegions; i++)
+    {
+        const ArvissMemoryRegion* region = &cpu->memory[i];
+        if (len <= region->size && addr - region->start <= region->size - len)
+        {
+            return region;
+        }
+    }
+    return NULL;
 }
 
-inline static void Exec_Div(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns true if the bus can be given the len bytes at the given address as a block, i.e., none of them are in the memory map's
+// regions and guard pages aren't enabled.
+static inline bool IsBusBlock(const ArvissCpu* cpu, uint32_t addr, uint32_t len)
 {
-    TRACE("DIV %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    const int32_t dividend = (int32_t)cpu->xreg[ins->rd_rs1_rs2.rs1];
-    const int32_t divisor = (int32_t)cpu->xreg[ins->rd_rs1_rs2.rs2];
-    // Check for signed division overflow.
-    if (dividend != 0x80000000 || divisor != -1)
+#if defined(ARVISS_USE_GUARD_PAGES)
+    if (cpu->guard.window != NULL)
     {
-        cpu->xreg[ins->rd_rs1_rs2.rd] = divisor != 0 // Check for division by zero.
-                ? dividend / divisor
-                : -1;
+        return false;
     }
-    else
+#endif
+    for (int i = 0; i < cpu->memoryRegions; i++)
     {
-        // Signed division overflow occurred.
-        cpu->xreg[ins->rd_rs1_rs2.rd] = dividend;
+        const ArvissMemoryRegion* region = &cpu->memory[i];
+        if ((uint64_t)addr + len > region->start && (uint64_t)region->start + region->size > addr)
+        {
+            return false;
+        }
     }
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    return true;
 }
 
-inline static void Exec_Srl(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Reads len bytes at the given address. If they can't be read in one go then they're read a word at a time if wordAtATime is true,
+// otherwise this faults without reading anything.
+static BusCode ReadBlock(ArvissCpu* cpu, uint32_t addr, uint8_t* bytes, uint32_t len, bool wordAtATime)
 {
-    // rd <- rs1 >> (rs2 % XLEN), pc += 4
-    TRACE("SRL %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] >> (cpu->xreg[ins->rd_rs1_rs2.rs2] % 32);
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const ArvissMemoryRegion* region = FindBlockRegion(cpu, addr, len);
+    if (region != NULL)
+    {
+        memcpy(bytes, region->mem + (addr - region->start), len);
+        return bcOK;
+    }
+    if (cpu->bus.ReadBlock != NULL && IsBusBlock(cpu, addr, len))
+    {
+        return cpu->bus.ReadBlock(cpu->bus.token, addr, bytes, len);
+    }
+    if (!wordAtATime)
+    {
+        return bcLOAD_ACCESS_FAULT;
+    }
+    for (; len >= 4; addr += 4, bytes += 4, len -= 4)
+    {
+        const BusResult loaded = Read32(cpu, addr);
+        if (ArvissBusResultIsFault(loaded))
+        {
+            return bcLOAD_ACCESS_FAULT;
+        }
+        const uint32_t word = ArvissBusResultAsValue(loaded);
+        memcpy(bytes, &word, sizeof(word));
+    }
+    for (; len > 0; addr++, bytes++, len--)
+    {
+        const BusResult loaded = Read8(cpu, addr);
+        if (ArvissBusResultIsFault(loaded))
+        {
+            return bcLOAD_ACCESS_FAULT;
+        }
+        *bytes = (uint8_t)ArvissBusResultAsValue(loaded);
+    }
+    return bcOK;
 }
 
-inline static void Exec_Sra(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Writes len bytes to the given address, or zeros if bytes is NULL, in one go if possible, otherwise a word at a time.
+static BusCode WriteBlock(ArvissCpu* cpu, uint32_t addr, const uint8_t* bytes, uint32_t len)
 {
-    // rd <- rs1 >> (rs2 % XLEN), pc += 4
-    TRACE("SRA %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = (int32_t)cpu->xreg[ins->rd_rs1_rs2.rs1] >> (cpu->xreg[ins->rd_rs1_rs2.rs2] % 32);
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const ArvissMemoryRegion* region = FindBlockRegion(cpu, addr, len);
+    if (region != NULL)
+    {
+        if (!region->isWritable)
+        {
+            return bcSTORE_ACCESS_FAULT;
+        }
+        uint8_t* mem = region->mem + (addr - region->start);
+        if (bytes != NULL)
+        {
+            memcpy(mem, bytes, len);
+        }
+        else
+        {
+            memset(mem, 0, len);
+        }
+        return bcOK;
+    }
+    if (IsBusBlock(cpu, addr, len))
+    {
+        if (bytes != NULL && cpu->bus.WriteBlock != NULL)
+        {
+            return cpu->bus.WriteBlock(cpu->bus.token, addr, bytes, len);
+        }
+        if (bytes == NULL && cpu->bus.ZeroBlock != NULL)
+        {
+            return cpu->bus.ZeroBlock(cpu->bus.token, addr, len);
+        }
+    }
+    for (; len >= 4; addr += 4, len -= 4)
+    {
+        uint32_t word = 0;
+        if (bytes != NULL)
+        {
+            memcpy(&word, bytes, sizeof(word));
+            bytes += 4;
+        }
+        if (Write32(cpu, addr, word) != bcOK)
+        {
+            return bcSTORE_ACCESS_FAULT;
+        }
+    }
+    for (; len > 0; addr++, len--)
+    {
+        const uint8_t byte = bytes != NULL ? *bytes++ : 0;
+        if (Write8(cpu, addr, byte) != bcOK)
+        {
+            return bcSTORE_ACCESS_FAULT;
+        }
+    }
+    return bcOK;
 }
 
-inline static void Exec_Divu(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    TRACE("DIVU %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    uint32_t divisor = cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->xreg[ins->rd_rs1_rs2.rd] = divisor != 0 ? cpu->xreg[ins->rd_rs1_rs2.rs1] / divisor : 0xffffffff;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
-}
+// --- Invalidation ----------------------------------------------------------------------------------------------------------------
+//
+// Functions in this section discard decoded instructions when the code that they were decoded from changes. Flushing the whole
+// cache takes constant time, as it just moves the cache on to its next generation, and anything left over from an earlier
+// generation is treated as absent. Stores are checked against a map of the pages that hold decoded code, which also records the
+// range of addresses that the code covers in each page, so only stores that overlap that range look for decoded instructions to
+// discard. Data that shares a page with code can then be written without discarding the code.
 
-inline static void Exec_Or(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the bit in the code page map for the page that holds the given address.
+static inline uint32_t CodePage(uint32_t addr)
 {
-    // rd <- rs1 | rs2, pc += 4
-    TRACE("OR %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] | cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    return (addr / CODE_PAGE_SIZE) % CODE_PAGE_BITS;
 }
 
-inline static void Exec_Rem(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Records that the given range of addresses holds decoded code.
+static inline void MarkCode(DecodedInstructionCache* cache, uint32_t addr, uint32_t len)
 {
-    TRACE("REM %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    const int32_t dividend = (int32_t)cpu->xreg[ins->rd_rs1_rs2.rs1];
-    const int32_t divisor = (int32_t)cpu->xreg[ins->rd_rs1_rs2.rs2];
-    // Check for signed division overflow.
-    if (dividend != 0x80000000 || divisor != -1)
-    {
-        cpu->xreg[ins->rd_rs1_rs2.rd] = divisor != 0 // Check for division by zero.
-                ? dividend % divisor
-                : dividend;
-    }
-    else
+    const uint32_t last = addr + len - 1;
+    const uint32_t pages = (addr % CODE_PAGE_SIZE + len + CODE_PAGE_SIZE - 1) / CODE_PAGE_SIZE;
+    for (uint32_t i = 0; i < pages && i < CODE_PAGE_BITS; i++)
     {
-        // Signed division overflow occurred.
-        cpu->xreg[ins->rd_rs1_rs2.rd] = 0;
+        const uint32_t bit = CodePage(addr + i * CODE_PAGE_SIZE);
+        struct CodeRange* range = &cache->codeRanges[bit];
+        if ((cache->codePages[bit / 32] & (1u << (bit % 32))) == 0)
+        {
+            cache->codePages[bit / 32] |= 1u << (bit % 32);
+            *range = (struct CodeRange){.first = addr, .last = last};
+        }
+        else
+        {
+            // Pages that share a bit share a range, which grows to cover the code in all of them.
+            range->first = addr < range->first ? addr : range->first;
+            range->last = last > range->last ? last : range->last;
+        }
     }
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
 }
 
-inline static void Exec_And(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns true if the range of addresses from first to last may overlap decoded code in the page that holds addr. Nothing does if
+// there's no cache yet.
+static inline bool MayBeCode(const DecodedInstructionCache* cache, uint32_t addr, uint32_t first, uint32_t last)
 {
-    // rd <- rs1 & rs2, pc += 4
-    TRACE("AND %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->xreg[ins->rd_rs1_rs2.rs1] & cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    const uint32_t bit = CodePage(addr);
+    return cache != NULL && (cache->codePages[bit / 32] & (1u << (bit % 32))) != 0 && first <= cache->codeRanges[bit].last
+           && last >= cache->codeRanges[bit].first;
 }
 
-inline static void Exec_Remu(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Forgets which pages hold decoded code. The map is a fixed size, so this takes constant time. The ranges don't need clearing, as
+// each one is set afresh when its page's bit is.
+static inline void ClearCodePages(DecodedInstructionCache* cache)
 {
-    TRACE("REMU %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], abiNames[ins->rd_rs1_rs2.rs1], abiNames[ins->rd_rs1_rs2.rs2]);
-    const uint32_t dividend = cpu->xreg[ins->rd_rs1_rs2.rs1];
-    const uint32_t divisor = cpu->xreg[ins->rd_rs1_rs2.rs2];
-    cpu->xreg[ins->rd_rs1_rs2.rd] = divisor != 0 ? cpu->xreg[ins->rd_rs1_rs2.rs1] % divisor : dividend;
-    cpu->pc += 4;
-    cpu->xreg[0] = 0;
+    for (int i = 0; i < CODE_PAGE_BITS / 32; i++)
+    {
+        cache->codePages[i] = 0;
+    }
 }
 
-inline static void Exec_Fence(ArvissCpu* cpu, const DecodedInstruction* ins)
+#if defined(ARVISS_BLOCK_CACHE)
+
+// Empties every slot in the block hash table, so that no block can be mistaken for one from the current generation.
+static inline void ClearBlocks(DecodedInstructionCache* cache)
 {
-    TRACE("FENCE\n");
-    cpu->result = CreateTrap(cpu, trNOT_IMPLEMENTED_YET, 0);
+    for (int i = 0; i < BLOCK_CACHE_BLOCKS; i++)
+    {
+        cache->blocks[i].generation = 0;
+    }
+    cache->generation = 1;
 }
 
-inline static void Exec_Ecall(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Discards every block in the block cache without visiting them. Blocks from earlier generations, and any links that lead to them,
+// are ignored. The predictions are few enough to clear, which keeps them from having to be checked whenever they are used.
+static inline void FlushBlocks(DecodedInstructionCache* cache)
 {
-    TRACE("ECALL\n");
-    cpu->result = CreateTrap(cpu, trENVIRONMENT_CALL_FROM_M_MODE, 0);
+    if (++cache->generation == 0)
+    {
+        // The generation has wrapped around, so blocks from long ago would look current.
+        ClearBlocks(cache);
+    }
+    for (int i = 0; i < RETURN_STACK_DEPTH; i++)
+    {
+        cache->jumps.returnStack[i].caller = NULL;
+    }
+    for (int i = 0; i < JUMP_TARGET_CACHE_SIZE; i++)
+    {
+        cache->jumps.jumpTargets[i].block = NULL;
+    }
+    cache->blockCount = 0;
+    cache->used = 0;
+#if defined(ARVISS_USE_JIT)
+    cache->codeUsed = 0;
+#endif
+    ClearCodePages(cache);
 }
 
-inline static void Exec_Ebreak(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Discards any decoded instructions in the given range of addresses. Blocks can't be taken out of the block cache one at a time, as
+// other blocks and predictions link to them, so this flushes the whole cache. Stores only get here if they overlap the range of
+// decoded code in their page, so stores to data that shares a page with code don't flush it.
+static void InvalidateDecoded(ArvissCpu* cpu, uint32_t addr, uint32_t len)
 {
-    TRACE("EBREAK\n");
-    cpu->result = CreateTrap(cpu, trBREAKPOINT, 0); // TODO: what should value be here?
+    (void)addr;
+    (void)len;
+    FlushBlocks(cpu->cache);
 }
 
-inline static void Exec_Uret(ArvissCpu* cpu, const DecodedInstruction* ins)
+#else
+
+static inline DecodedInstruction GenFetchDecodeReplace(ExecFn opcode, uint32_t cacheLine, uint32_t index);
+
+// Invalidates every line in the decoded instruction cache, so that no line can be mistaken for one from the current generation.
+static inline void ClearLines(DecodedInstructionCache* cache)
 {
-    TRACE("URET\n");
-    // TODO: Only provide this if user mode traps are supported, otherwise raise an illegal instruction exception.
-    cpu->result = CreateTrap(cpu, trNOT_IMPLEMENTED_YET, 0);
+    for (int i = 0; i < CACHE_LINES; i++)
+    {
+        cache->line[i].generation = 0;
+    }
+    cache->generation = 1;
 }
 
-inline static void Exec_Sret(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Discards every line in the decoded instruction cache, in constant time.
+static inline void FlushLines(DecodedInstructionCache* cache)
 {
-    TRACE("SRET\n");
-    // TODO: Only provide this if supervisor mode is supported, otherwise raise an illegal instruction exception.
-    cpu->result = CreateTrap(cpu, trNOT_IMPLEMENTED_YET, 0);
+    if (++cache->generation == 0)
+    {
+        // The generation has wrapped around, so lines from long ago would look current.
+        ClearLines(cache);
+    }
+    ClearCodePages(cache);
 }
 
-inline static void Exec_Mret(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the index of the first line in the set that the given owner maps to, and sets *ways to the number of lines in the set.
+static inline uint32_t FirstLineOfSet(const DecodedInstructionCache* cache, uint32_t owner, uint32_t* ways)
 {
-    // pc <- mepc, pc += 4
-    TRACE("MRET\n");
-    cpu->pc = cpu->mepc; // Restore the program counter from the machine exception program counter.
-    cpu->pc += 4;        // ...and increment it as normal.
+#if defined(ARVISS_USE_ADAPTIVE_CACHE)
+    *ways = cache->ways;
+    return (owner & cache->setMask) * cache->ways;
+#else
+    (void)cache;
+    *ways = CACHE_WAYS;
+    return (owner % CACHE_SETS) * CACHE_WAYS;
+#endif
 }
 
-inline static void Exec_Flw(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Discards any decoded instructions in the given range of addresses by turning them back into fetch/decode/replace stubs, so that
+// they are decoded again if they are ever run. This is safe even if one of them is running, e.g., if it overwrote itself.
+static void InvalidateDecoded(ArvissCpu* cpu, uint32_t addr, uint32_t len)
 {
-    // rd <- f32(rs1 + imm_i)
-    TRACE("FLW %s, %d(%s)\n", fabiNames[ins->rd_rs1_imm.rd], ins->rd_rs1_imm.imm, abiNames[ins->rd_rs1_imm.rs1]);
-    if (cpu->busCode != bcOK)
+    DecodedInstructionCache* cache = cpu->cache;
+    if (len == 0)
     {
         return;
     }
-    uint32_t word = Read32(&cpu->bus, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm, &cpu->busCode);
-    if (cpu->busCode != bcOK)
+    if (len > CACHE_LINES * CACHE_LINE_LENGTH * 4)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rd_rs1_imm.rs1] + ins->rd_rs1_imm.imm));
+        FlushLines(cache);
         return;
     }
-    const float resultAsFloat = U32AsFloat(word);
-    cpu->freg[ins->rd_rs1_imm.rd] = resultAsFloat;
-    cpu->pc += 4;
+
+    // Start with the instruction before the range, as it may have been fused with the first instruction in it.
+    const uint32_t firstWord = addr / 4 > 0 ? addr / 4 - 1 : 0;
+    const uint32_t lastWord = (uint32_t)(((uint64_t)addr + len - 1) / 4);
+    for (uint32_t word = firstWord; word <= lastWord; word++)
+    {
+        const uint32_t owner = word / CACHE_LINE_LENGTH;
+        const uint32_t index = word % CACHE_LINE_LENGTH;
+        uint32_t ways;
+        const uint32_t first = FirstLineOfSet(cache, owner, &ways);
+        for (uint32_t i = first; i < first + ways; i++)
+        {
+            struct CacheLine* line = &cache->line[i];
+            if (line->generation == cache->generation && line->owner == owner)
+            {
+                line->instructions[index] = GenFetchDecodeReplace(execFetchDecodeReplace, i, index);
+            }
+        }
+    }
 }
 
-inline static void Exec_Fsw(ArvissCpu* cpu, const DecodedInstruction* ins)
+#endif
+
+// Discards every decoded instruction.
+static inline void FlushDecoded(DecodedInstructionCache* cache)
 {
-    // f32(rs1 + imm_s) = rs2
-    TRACE("FSW %s, %d(%s)\n", fabiNames[ins->rs1_rs2_imm.rs2], ins->rs1_rs2_imm.imm, abiNames[ins->rs1_rs2_imm.rs1]);
-    uint32_t t = FloatAsU32(cpu->freg[ins->rs1_rs2_imm.rs2]);
-    Write32(&cpu->bus, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm, t, &cpu->busCode);
-    if (cpu->busCode != bcOK)
+    if (cache == NULL)
     {
-        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1_rs2_imm.rs1] + ins->rs1_rs2_imm.imm));
         return;
     }
-    cpu->pc += 4;
+#if defined(ARVISS_BLOCK_CACHE)
+    FlushBlocks(cache);
+#else
+    FlushLines(cache);
+#endif
 }
 
-inline static void Exec_Fmadd_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Discards any decoded instructions that a store of size bytes to the given address overwrote.
+static inline void InvalidateStore(ArvissCpu* cpu, uint32_t addr, uint32_t size)
 {
-    // rd <- (rs1 * rs2) + rs3
-    TRACE("FMADD.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rs3_rm.rd], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rs3_rm.rs2], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs3], roundingModes[ins->rd_rs1_rs2_rs3_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rs3_rm.rd] =
-            (cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs1] * cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs2]) + cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs3];
-    cpu->pc += 4;
-    // TODO: rounding.
+    const uint32_t last = addr + size - 1;
+    if (MayBeCode(cpu->cache, addr, addr, last) || (CodePage(last) != CodePage(addr) && MayBeCode(cpu->cache, last, addr, last)))
+    {
+        InvalidateDecoded(cpu, addr, size);
+    }
 }
 
-inline static void Exec_Fmsub_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Like InvalidateStore(), but for a block of bytes that may span any number of pages.
+static inline void InvalidateBlock(ArvissCpu* cpu, uint32_t addr, uint32_t len)
 {
-    // rd <- (rs1 x rs2) - rs3
-    TRACE("FMSUB.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rs3_rm.rd], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rs3_rm.rs2], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs3], roundingModes[ins->rd_rs1_rs2_rs3_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rs3_rm.rd] =
-            (cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs1] * cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs2]) - cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs3];
-    cpu->pc += 4;
-    // TODO: rounding.
+    const uint64_t end = (uint64_t)addr + len;
+    const uint32_t last = end > UINT32_MAX ? UINT32_MAX : (uint32_t)(end - 1);
+    for (uint64_t page = addr & ~(CODE_PAGE_SIZE - 1u); page < end; page += CODE_PAGE_SIZE)
+    {
+        if (MayBeCode(cpu->cache, (uint32_t)page, addr, last))
+        {
+            InvalidateDecoded(cpu, addr, len);
+            return;
+        }
+    }
 }
 
-inline static void Exec_Fnmsub_s(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- -(rs1 x rs2) + rs3
-    TRACE("FNMSUB.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rs3_rm.rd], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rs3_rm.rs2], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs3], roundingModes[ins->rd_rs1_rs2_rs3_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rs3_rm.rd] = -(cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs1] * cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs2])
-            + cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs3];
-    cpu->pc += 4;
-    // TODO: rounding.
-}
+// --- Shared code -----------------------------------------------------------------------------------------------------------------
+//
+// CPUs that run the same image can share the decoded code from its read-only regions. That code is decoded in full when it's
+// created, and as the guest can't store to it, it never has to be invalidated. It starts and ends on cache line boundaries, so
+// running on from one instruction to the next never leaves it without looking up the next line.
 
-inline static void Exec_Fnmadd_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+struct ArvissCode
 {
-    // rd <- -(rs1 x rs2) - rs3
-    TRACE("FNMADD.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rs3_rm.rd], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rs3_rm.rs2], fabiNames[ins->rd_rs1_rs2_rs3_rm.rs3], roundingModes[ins->rd_rs1_rs2_rs3_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rs3_rm.rd] = -(cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs1] * cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs2])
-            - cpu->freg[ins->rd_rs1_rs2_rs3_rm.rs3];
-    cpu->pc += 4;
-    // TODO: rounding.
-}
+    int refs;                         // The number of references to the code, from CPUs and from the host.
+    uint32_t start;                   // The guest address of the region that the code was decoded from.
+    uint32_t size;                    // The size of that region, in bytes.
+    DecodedInstruction* instructions; // A decoded instruction for each word of the region.
+    uint32_t registers;               // A bit for each register that those instructions name, other than x0.
+};
 
-inline static void Exec_Fadd_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+// Returns the shared decoded instruction at the given address, or NULL if the address isn't in the CPU's shared code.
+static inline DecodedInstruction* FindSharedCode(const ArvissCpu* cpu, uint32_t addr)
 {
-    // rd <- rs1 + rs2
-    TRACE("FADD.S %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rm.rd], fabiNames[ins->rd_rs1_rs2_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rm.rs2], roundingModes[ins->rd_rs1_rs2_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rm.rd] = cpu->freg[ins->rd_rs1_rs2_rm.rs1] + cpu->freg[ins->rd_rs1_rs2_rm.rs2];
-    cpu->pc += 4;
-    // TODO: rounding.
+    const ArvissCode* code = cpu->code;
+    if (code != NULL && addr - code->start < code->size)
+    {
+        return &code->instructions[(addr - code->start) / 4];
+    }
+    return NULL;
 }
 
-inline static void Exec_Fsub_s(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- rs1 - rs2
-    TRACE("FSUB.S %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rm.rd], fabiNames[ins->rd_rs1_rs2_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rm.rs2], roundingModes[ins->rd_rs1_rs2_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rm.rd] = cpu->freg[ins->rd_rs1_rs2_rm.rs1] - cpu->freg[ins->rd_rs1_rs2_rm.rs2];
-    cpu->pc += 4;
-    // TODO: rounding.
-}
+// --- Execution -------------------------------------------------------------------------------------------------------------------
+//
+// Functions in this section execute decoded instructions. Instruction execution is separate from decoding, as this allows an
+// instruction to be fetched and decoded once, then placed in the decoded instruction cache where it can be executed several times.
+// This mitigates the cost of decoding, as decoded instructions are already in a form that is easy to execute.
 
-inline static void Exec_Fmul_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline ArvissResult TakeTrap(ArvissCpu* cpu, ArvissResult result)
 {
-    // rd <- rs1 * rs2
-    TRACE("FMUL.S %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rm.rd], fabiNames[ins->rd_rs1_rs2_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rm.rs2], roundingModes[ins->rd_rs1_rs2_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rm.rd] = cpu->freg[ins->rd_rs1_rs2_rm.rs1] * cpu->freg[ins->rd_rs1_rs2_rm.rs2];
-    cpu->pc += 4;
-    // TODO: rounding.
-}
+    ArvissTrap trap = ArvissResultAsTrap(result);
 
-inline static void Exec_Fdiv_s(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- rs1 / rs2
-    TRACE("FDIV.S %s, %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2_rm.rd], fabiNames[ins->rd_rs1_rs2_rm.rs1],
-          fabiNames[ins->rd_rs1_rs2_rm.rs2], roundingModes[ins->rd_rs1_rs2_rm.rm]);
-    cpu->freg[ins->rd_rs1_rs2_rm.rd] = cpu->freg[ins->rd_rs1_rs2_rm.rs1] / cpu->freg[ins->rd_rs1_rs2_rm.rs2];
-    cpu->pc += 4;
-    // TODO: rounding.
-}
+    cpu->mepc = cpu->pc;       // Save the program counter in the machine exception program counter.
+    cpu->mcause = trap.mcause; // mcause <- reason for trap.
+    cpu->mtval = trap.mtval;   // mtval <- exception specific information.
 
-inline static void Exec_Fsqrt_s(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- sqrt(rs1)
-    TRACE("FSQRT.S %s, %s, %s\n", fabiNames[ins->rd_rs1_rm.rd], fabiNames[ins->rd_rs1_rm.rs1], roundingModes[ins->rd_rs1_rm.rm]);
-    cpu->freg[ins->rd_rs1_rm.rd] = sqrtf(cpu->freg[ins->rd_rs1_rm.rs1]);
-    cpu->pc += 4;
-    // TODO: rounding.
+    return result;
 }
 
-inline static void Exec_Fsgnj_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+static inline ArvissResult CreateTrap(ArvissCpu* cpu, ArvissTrapType trap, uint32_t value)
 {
-    // rd <- abs(rs1) * sgn(rs2)
-    TRACE("FSGNJ.S %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->freg[ins->rd_rs1_rs2.rd] = fabsf(cpu->freg[ins->rd_rs1_rs2.rs1]) * (cpu->freg[ins->rd_rs1_rs2.rs2] < 0.0f ? -1.0f : 1.0f);
-    cpu->pc += 4;
+    ArvissResult result = ArvissMakeTrap(trap, value);
+    return TakeTrap(cpu, result);
 }
 
-inline static void Exec_Fsgnjn_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_IllegalInstruction(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // rd <- abs(rs1) * -sgn(rs2)
-    TRACE("FSGNJN.S %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->freg[ins->rd_rs1_rs2.rd] = fabsf(cpu->freg[ins->rd_rs1_rs2.rs1]) * (cpu->freg[ins->rd_rs1_rs2.rs2] < 0.0f ? 1.0f : -1.0f);
-    cpu->pc += 4;
+    cpu->result = CreateTrap(cpu, trILLEGAL_INSTRUCTION, ins->ins);
 }
 
-inline static void Exec_Fsgnjx_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+#if defined(ARVISS_USE_FUSION)
+
+// Turns the first of two adjacent decoded instructions into a superinstruction if they are a pair that compilers commonly emit
+// together, such as lui followed by addi to load a constant, and returns true if it did. A superinstruction keeps the operands of
+// the first instruction and reads those of the second from the entry after it, so both entries can still be run on their own. As
+// each half keeps its own semantics, it doesn't matter whether the second instruction actually uses the result of the first.
+static inline bool Fuse(DecodedInstruction* first, const DecodedInstruction* second)
 {
-    float m; // The sign bit is the XOR of the sign bits of rs1 and rs2.
-    if ((cpu->freg[ins->rd_rs1_rs2.rs1] < 0.0f && cpu->freg[ins->rd_rs1_rs2.rs2] >= 0.0f)
-        || (cpu->freg[ins->rd_rs1_rs2.rs1] >= 0.0f && cpu->freg[ins->rd_rs1_rs2.rs2] < 0.0f))
+    ExecFn fused = first->opcode;
+    switch (first->opcode)
     {
-        m = -1.0f;
+    case execLui:
+        fused = second->opcode == execAddi ? execLuiAddi : fused; // li
+        break;
+    case execAuipc:
+        fused = second->opcode == execAddi ? execAuipcAddi : second->opcode == execJalr ? execAuipcJalr : fused; // la, call
+        break;
+    case execSlt:
+        fused = second->opcode == execBne ? execSltBne : fused;
+        break;
+    case execSltu:
+        fused = second->opcode == execBne ? execSltuBne : fused;
+        break;
+    case execLw:
+        fused = second->opcode == execAdd ? execLwAdd : second->opcode == execAddi ? execLwAddi : fused;
+        break;
+    default:
+        break;
     }
-    else
+    if (fused == first->opcode)
     {
-        m = 1.0f;
+        return false;
     }
-    // rd <- abs(rs1) * (sgn(rs1) == sgn(rs2)) ? 1 : -1
-    TRACE("FSGNJX.S %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->freg[ins->rd_rs1_rs2.rd] = fabsf(cpu->freg[ins->rd_rs1_rs2.rs1]) * m;
-    cpu->pc += 4;
-}
 
-inline static void Exec_Fmin_s(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- min(rs1, rs2)
-    TRACE("FMIN.S %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->freg[ins->rd_rs1_rs2.rd] = fminf(cpu->freg[ins->rd_rs1_rs2.rs1], cpu->freg[ins->rd_rs1_rs2.rs2]);
-    cpu->pc += 4;
+    first->opcode = fused;
+    return true;
 }
 
-inline static void Exec_Fmax_s(ArvissCpu* cpu, const DecodedInstruction* ins)
-{
-    // rd <- max(rs1, rs2)
-    TRACE("FMAX.S %s, %s, %s\n", fabiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->freg[ins->rd_rs1_rs2.rd] = fmaxf(cpu->freg[ins->rd_rs1_rs2.rs1], cpu->freg[ins->rd_rs1_rs2.rs2]);
-    cpu->pc += 4;
-}
+#endif
 
-inline static void Exec_Fcvt_w_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+#if !defined(ARVISS_BLOCK_CACHE)
+
+// Fetches and decodes the instruction corresponding to a fetch/decode/replace stub, and replaces the stub with the result. Returns
+// the decoded instruction, or NULL if it could not be fetched.
+static inline DecodedInstruction* FetchDecodeReplace(ArvissCpu* cpu, DecodedInstruction* ins)
 {
-    // rd <- int32_t(rs1)
-    TRACE("FCVT.W.S %s, %s, %s\n", abiNames[ins->rd_rs1_rm.rd], fabiNames[ins->rd_rs1_rm.rs1], roundingModes[ins->rd_rs1_rm.rm]);
-    cpu->xreg[ins->rd_rs1_rm.rd] = (int32_t)cpu->freg[ins->rd_rs1_rm.rs1];
-    cpu->pc += 4;
-    // TODO: rounding.
+    // Reconstitute the address given the cache line and index.
+    const uint32_t cacheLine = ins->fdr.cacheLine;
+    const uint32_t index = ins->fdr.index;
+    struct CacheLine* line = &cpu->cache->line[cacheLine];
+    const uint32_t owner = line->owner;
+    const uint32_t addr = owner * 4 * CACHE_LINE_LENGTH + index * 4;
+
+    // Fetch a word from memory at the address.
+    const BusResult fetched = Read32(cpu, addr);
+    if (ArvissBusResultIsFault(fetched))
+    {
+        cpu->result = ArvissMakeTrap(trINSTRUCTION_ACCESS_FAULT, addr);
+        return NULL;
+    }
+
+    // Decode the instruction and save it in the cache. All instructions are decodable into something executable, because all
+    // illegal instructions become Exec_IllegalInstruction, which is itself executable.
+    DecodedInstruction* decoded = &line->instructions[index];
+    *decoded = Canonicalise(ArvissDecode(ArvissBusResultAsValue(fetched)));
+    COUNT(cpu->cache, decodes, 1);
+#if defined(ARVISS_USE_FUSION)
+    // Decode the next instruction too, if it's in the same cache line, so that the two can be fused.
+    if (index + 1 < CACHE_LINE_LENGTH)
+    {
+        DecodedInstruction* next = decoded + 1;
+        if (next->opcode == execFetchDecodeReplace)
+        {
+            const BusResult following = Read32(cpu, addr + 4);
+            if (ArvissBusResultIsFault(following))
+            {
+                // Leave it to fault if it is ever run.
+                ReleaseGuardPages(cpu);
+                return decoded;
+            }
+            *next = Canonicalise(ArvissDecode(ArvissBusResultAsValue(following)));
+            COUNT(cpu->cache, decodes, 1);
+        }
+        Fuse(decoded, next);
+    }
+#endif
+    return decoded;
 }
 
-inline static void Exec_Fcvt_wu_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_FetchDecodeReplace(ArvissCpu* cpu, DecodedInstruction* ins)
 {
-    // rd <- uint32_t(rs1)
-    TRACE("FCVT.WU.S %s, %s, %s\n", abiNames[ins->rd_rs1_rm.rd], fabiNames[ins->rd_rs1_rm.rs1], roundingModes[ins->rd_rs1_rm.rm]);
-    cpu->xreg[ins->rd_rs1_rm.rd] = (uint32_t)(int32_t)cpu->freg[ins->rd_rs1_rm.rs1];
+    // Decode the instruction, save the result in the cache, then execute it.
+    DecodedInstruction* decoded = FetchDecodeReplace(cpu, ins);
+    if (decoded != NULL)
+    {
+        RunOne(cpu, decoded);
+    }
+}
+
+#endif
+
+inline static void Exec_Lui(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- imm_u, pc += 4
+    TRACE("LUI %s, %d\n", abiNames[ins->rd], ins->imm >> 12);
+    cpu->xreg[ins->rd] = ins->imm;
     cpu->pc += 4;
-    // TODO: rounding.
 }
 
-inline static void Exec_Fmv_x_w(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Auipc(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // bits(rd) <- bits(rs1)
-    TRACE("FMV.X.W %s, %s\n", abiNames[ins->rd_rs1.rd], fabiNames[ins->rd_rs1.rs1]);
-    cpu->xreg[ins->rd_rs1.rd] = FloatAsU32(cpu->freg[ins->rd_rs1.rs1]);
+    // rd <- pc + imm_u, pc += 4
+    TRACE("AUIPC %s, %d\n", abiNames[ins->rd], ins->imm >> 12);
+    cpu->xreg[ins->rd] = cpu->pc + ins->imm;
     cpu->pc += 4;
 }
 
-inline static void Exec_Fclass_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Jal(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    TRACE("FCLASS.S %s, %s\n", abiNames[ins->rd_rs1.rd], fabiNames[ins->rd_rs1.rs1]);
-    const float v = cpu->freg[ins->rd_rs1.rs1];
-    const uint32_t bits = FloatAsU32(v);
-    uint32_t result = 0;
-    if (v == -INFINITY)
+    // rd <- pc + 4, pc <- pc + imm_j
+    TRACE("JAL %s, %d\n", abiNames[ins->rd], ins->imm);
+    cpu->xreg[ins->rd] = cpu->pc + 4;
+    cpu->pc += ins->imm;
+}
+
+inline static void Exec_Jalr(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- pc + 4, pc <- (rs1 + imm_i) & ~1
+    TRACE("JALR %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    uint32_t rs1Before = cpu->xreg[ins->rs1]; // Because rd and rs1 might be the same register.
+    cpu->xreg[ins->rd] = cpu->pc + 4;
+    cpu->pc = (rs1Before + ins->imm) & ~1;
+}
+
+inline static void Exec_Beq(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- pc + ((rs1 == rs2) ? imm_b : 4)
+    TRACE("BEQ %s, %s, %d\n", abiNames[ins->rs1], abiNames[ins->rs2], ins->imm);
+    cpu->pc += ((cpu->xreg[ins->rs1] == cpu->xreg[ins->rs2]) ? ins->imm : 4);
+}
+
+inline static void Exec_Bne(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- pc + ((rs1 != rs2) ? imm_b : 4)
+    TRACE("BNE %s, %s, %d\n", abiNames[ins->rs1], abiNames[ins->rs2], ins->imm);
+    cpu->pc += ((cpu->xreg[ins->rs1] != cpu->xreg[ins->rs2]) ? ins->imm : 4);
+}
+
+inline static void Exec_Blt(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- pc + ((rs1 < rs2) ? imm_b : 4)
+    TRACE("BLT %s, %s, %d\n", abiNames[ins->rs1], abiNames[ins->rs2], ins->imm);
+    cpu->pc += (((int32_t)cpu->xreg[ins->rs1] < (int32_t)cpu->xreg[ins->rs2]) ? ins->imm : 4);
+}
+
+inline static void Exec_Bge(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- pc + ((rs1 >= rs2) ? imm_b : 4)
+    TRACE("BGE %s, %s, %d\n", abiNames[ins->rs1], abiNames[ins->rs2], ins->imm);
+    cpu->pc += (((int32_t)cpu->xreg[ins->rs1] >= (int32_t)cpu->xreg[ins->rs2]) ? ins->imm : 4);
+}
+
+inline static void Exec_Bltu(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- pc + ((rs1 < rs2) ? imm_b : 4)
+    TRACE("BLTU %s, %s, %d\n", abiNames[ins->rs1], abiNames[ins->rs2], ins->imm);
+    cpu->pc += ((cpu->xreg[ins->rs1] < cpu->xreg[ins->rs2]) ? ins->imm : 4);
+}
+
+inline static void Exec_Bgeu(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- pc + ((rs1 >= rs2) ? imm_b : 4)
+    TRACE("BGEU %s, %s, %d\n", abiNames[ins->rs1], abiNames[ins->rs2], ins->imm);
+    cpu->pc += ((cpu->xreg[ins->rs1] >= cpu->xreg[ins->rs2]) ? ins->imm : 4);
+}
+
+inline static void Exec_Lb(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- sx(m8(rs1 + imm_i)), pc += 4
+    TRACE("LB %s, %d(%s)\n", abiNames[ins->rd], ins->imm, abiNames[ins->rs1]);
+    const BusResult loaded = Read8(cpu, cpu->xreg[ins->rs1] + ins->imm);
+    if (ArvissBusResultIsFault(loaded))
     {
-        result = (1 << 0);
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    else if (v == INFINITY)
+    const uint8_t byte = (uint8_t)ArvissBusResultAsValue(loaded);
+    cpu->xreg[ins->rd] = (int32_t)(int16_t)(int8_t)byte;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Lh(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- sx(m16(rs1 + imm_i)), pc += 4
+    TRACE("LH %s, %d(%s)\n", abiNames[ins->rd], ins->imm, abiNames[ins->rs1]);
+    const BusResult loaded = Read16(cpu, cpu->xreg[ins->rs1] + ins->imm);
+    if (ArvissBusResultIsFault(loaded))
     {
-        result = (1 << 7);
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    else if (bits == 0x80000000) // Negative zero.
+    const uint16_t halfword = (uint16_t)ArvissBusResultAsValue(loaded);
+    cpu->xreg[ins->rd] = (int32_t)(int16_t)halfword;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Lw(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- sx(m32(rs1 + imm_i)), pc += 4
+    TRACE("LW %s, %d(%s)\n", abiNames[ins->rd], ins->imm, abiNames[ins->rs1]);
+    const BusResult loaded = Read32(cpu, cpu->xreg[ins->rs1] + ins->imm);
+    if (ArvissBusResultIsFault(loaded))
     {
-        result = (1 << 3);
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    else if (v == 0.0f)
+    const uint32_t word = ArvissBusResultAsValue(loaded);
+    cpu->xreg[ins->rd] = (int32_t)word;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Lbu(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- zx(m8(rs1 + imm_i)), pc += 4
+    TRACE("LBU x%d, %d(x%d)\n", ins->rd, ins->imm, ins->rs1);
+    const BusResult loaded = Read8(cpu, cpu->xreg[ins->rs1] + ins->imm);
+    if (ArvissBusResultIsFault(loaded))
     {
-        result = (1 << 4);
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    else if ((bits & 0x7f800000) == 0) // Is the exponent zero?
+    const uint8_t byte = (uint8_t)ArvissBusResultAsValue(loaded);
+    cpu->xreg[ins->rd] = byte;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Lhu(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- zx(m16(rs1 + imm_i)), pc += 4
+    TRACE("LHU %s, %d(%s)\n", abiNames[ins->rd], ins->imm, abiNames[ins->rs1]);
+    const BusResult loaded = Read16(cpu, cpu->xreg[ins->rs1] + ins->imm);
+    if (ArvissBusResultIsFault(loaded))
     {
-        if (bits & 0x80000000)
-        {
-            result = (1 << 2); // Negative subnormal number
-        }
-        else
-        {
-            result = (1 << 5); // Positive subnormal number.
-        }
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    else if ((bits & 0x7f800000) == 0x7f800000) // Is the exponent as large as possible?
+    const uint16_t halfword = (uint16_t)ArvissBusResultAsValue(loaded);
+    cpu->xreg[ins->rd] = halfword;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Sb(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // m8(rs1 + imm_s) <- rs2[7:0], pc += 4
+    TRACE("SB %s, %d(%s)\n", abiNames[ins->rs2], ins->imm, abiNames[ins->rs1]);
+    if (Write8(cpu, cpu->xreg[ins->rs1] + ins->imm, cpu->xreg[ins->rs2] & 0xff) != bcOK)
     {
-        if (bits & 0x00400000)
-        {
-            result = (1 << 9); // Quiet NaN.
-        }
-        else if (bits & 0x003fffff)
-        {
-            result = (1 << 8); // Signaling NaN.
-        }
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    else if (v < 0.0f)
+    InvalidateStore(cpu, cpu->xreg[ins->rs1] + ins->imm, 1);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Sh(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // m16(rs1 + imm_s) <- rs2[15:0], pc += 4
+    TRACE("SH %s, %d(%s)\n", abiNames[ins->rs2], ins->imm, abiNames[ins->rs1]);
+    if (Write16(cpu, cpu->xreg[ins->rs1] + ins->imm, cpu->xreg[ins->rs2] & 0xffff) != bcOK)
     {
-        result = (1 << 1);
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    else if (v > 0.0f)
+    InvalidateStore(cpu, cpu->xreg[ins->rs1] + ins->imm, 2);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Sw(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // m32(rs1 + imm_s) <- rs2[31:0], pc += 4
+    TRACE("SW %s, %d(%s)\n", abiNames[ins->rs2], ins->imm, abiNames[ins->rs1]);
+    if (Write32(cpu, cpu->xreg[ins->rs1] + ins->imm, cpu->xreg[ins->rs2]) != bcOK)
     {
-        result = (1 << 6);
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
     }
-    cpu->xreg[ins->rd_rs1.rd] = result;
+    InvalidateStore(cpu, cpu->xreg[ins->rs1] + ins->imm, 4);
     cpu->pc += 4;
 }
 
-inline static void Exec_Feq_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Addi(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // rd <- (rs1 == rs2) ? 1 : 0;
-    TRACE("FEQ.S %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->freg[ins->rd_rs1_rs2.rs1] == cpu->freg[ins->rd_rs1_rs2.rs2] ? 1 : 0;
+    // rd <- rs1 + imm_i, pc += 4
+    TRACE("ADDI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] + ins->imm;
     cpu->pc += 4;
 }
 
-inline static void Exec_Flt_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Slti(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // rd <- (rs1 < rs2) ? 1 : 0;
-    TRACE("FLT.S %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->freg[ins->rd_rs1_rs2.rs1] < cpu->freg[ins->rd_rs1_rs2.rs2] ? 1 : 0;
+    // rd <- (rs1 < imm_i) ? 1 : 0, pc += 4
+    TRACE("SLTI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = ((int32_t)cpu->xreg[ins->rs1] < ins->imm) ? 1 : 0;
     cpu->pc += 4;
 }
 
-inline static void Exec_Fle_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Sltiu(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // rd <- (rs1 <= rs2) ? 1 : 0;
-    TRACE("FLE.S %s, %s, %s\n", abiNames[ins->rd_rs1_rs2.rd], fabiNames[ins->rd_rs1_rs2.rs1], fabiNames[ins->rd_rs1_rs2.rs2]);
-    cpu->xreg[ins->rd_rs1_rs2.rd] = cpu->freg[ins->rd_rs1_rs2.rs1] <= cpu->freg[ins->rd_rs1_rs2.rs2] ? 1 : 0;
+    // rd <- (rs1 < imm_i) ? 1 : 0, pc += 4
+    TRACE("SLTIU %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = (cpu->xreg[ins->rs1] < (uint32_t)ins->imm) ? 1 : 0;
     cpu->pc += 4;
 }
 
-inline static void Exec_Fcvt_s_w(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Xori(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // rd <- float(int32_t((rs1))
-    TRACE("FCVT.S.W %s, %s, %s\n", fabiNames[ins->rd_rs1_rm.rd], abiNames[ins->rd_rs1_rm.rs1], roundingModes[ins->rd_rs1_rm.rm]);
-    cpu->freg[ins->rd_rs1_rm.rd] = (float)(int32_t)cpu->xreg[ins->rd_rs1_rm.rs1];
+    // rd <- rs1 ^ imm_i, pc += 4
+    TRACE("XORI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] ^ ins->imm;
     cpu->pc += 4;
-    // TODO: rounding.
 }
 
-inline static void Exec_Fcvt_s_wu(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Ori(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // rd <- float(rs1)
-    TRACE("FVCT.S.WU %s, %s, %s\n", fabiNames[ins->rd_rs1_rm.rd], abiNames[ins->rd_rs1_rm.rs1], roundingModes[ins->rd_rs1_rm.rm]);
-    cpu->freg[ins->rd_rs1_rm.rd] = (float)cpu->xreg[ins->rd_rs1_rm.rs1];
+    // rd <- rs1 | imm_i, pc += 4
+    TRACE("ORI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] | ins->imm;
     cpu->pc += 4;
-    // TODO: rounding.
 }
 
-inline static void Exec_Fmv_w_x(ArvissCpu* cpu, const DecodedInstruction* ins)
+inline static void Exec_Andi(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // bits(rd) <- bits(rs1)
-    TRACE("FMV.W.X %s, %s\n", fabiNames[ins->rd_rs1.rd], abiNames[ins->rd_rs1.rs1]);
-    cpu->freg[ins->rd_rs1.rd] = U32AsFloat(cpu->xreg[ins->rd_rs1.rs1]);
+    // rd <- rs1 & imm_i, pc += 4
+    TRACE("ANDI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] & ins->imm;
     cpu->pc += 4;
 }
 
-static void RunOne(ArvissCpu* cpu, DecodedInstruction* ins)
+inline static void Exec_Slli(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    switch (ins->opcode)
-    {
-    case execFetchDecodeReplace:
-        Exec_FetchDecodeReplace(cpu, ins);
-        break;
-    case execLui:
-        Exec_Lui(cpu, ins);
-        break;
-    case execAuipc:
-        Exec_Auipc(cpu, ins);
-        break;
-    case execJal:
-        Exec_Jal(cpu, ins);
-        break;
-    case execJalr:
-        Exec_Jalr(cpu, ins);
-        break;
-    case execBeq:
-        Exec_Beq(cpu, ins);
-        break;
-    case execBne:
-        Exec_Bne(cpu, ins);
-        break;
-    case execBlt:
-        Exec_Blt(cpu, ins);
-        break;
-    case execBge:
-        Exec_Bge(cpu, ins);
-        break;
-    case execBltu:
-        Exec_Bltu(cpu, ins);
-        break;
-    case execBgeu:
-        Exec_Bgeu(cpu, ins);
-        break;
-    case execLb:
-        Exec_Lb(cpu, ins);
-        break;
-    case execLh:
-        Exec_Lh(cpu, ins);
-        break;
-    case execLw:
-        Exec_Lw(cpu, ins);
-        break;
-    case execLbu:
-        Exec_Lbu(cpu, ins);
-        break;
-    case execLhu:
-        Exec_Lhu(cpu, ins);
-        break;
-    case execSb:
-        Exec_Sb(cpu, ins);
-        break;
-    case execSh:
-        Exec_Sh(cpu, ins);
-        break;
-    case execSw:
-        Exec_Sw(cpu, ins);
-        break;
-    case execAddi:
-        Exec_Addi(cpu, ins);
-        break;
-    case execSlti:
-        Exec_Slti(cpu, ins);
-        break;
-    case execSltiu:
-        Exec_Sltiu(cpu, ins);
-        break;
-    case execXori:
-        Exec_Xori(cpu, ins);
-        break;
-    case execOri:
-        Exec_Ori(cpu, ins);
-        break;
-    case execAndi:
-        Exec_Andi(cpu, ins);
-        break;
-    case execSlli:
-        Exec_Slli(cpu, ins);
-        break;
-    case execSrli:
-        Exec_Srli(cpu, ins);
-        break;
-    case execSrai:
-        Exec_Srai(cpu, ins);
-        break;
-    case execAdd:
-        Exec_Add(cpu, ins);
-        break;
-    case execSub:
-        Exec_Sub(cpu, ins);
-        break;
-    case execMul:
-        Exec_Mul(cpu, ins);
-        break;
-    case execSll:
-        Exec_Sll(cpu, ins);
-        break;
-    case execMulh:
-        Exec_Mulh(cpu, ins);
-        break;
-    case execSlt:
-        Exec_Slt(cpu, ins);
-        break;
-    case execMulhsu:
-        Exec_Mulhsu(cpu, ins);
-        break;
-    case execSltu:
-        Exec_Sltu(cpu, ins);
-        break;
-    case execMulhu:
-        Exec_Mulhu(cpu, ins);
-        break;
-    case execXor:
-        Exec_Xor(cpu, ins);
-        break;
-    case execDiv:
-        Exec_Div(cpu, ins);
-        break;
-    case execSrl:
-        Exec_Srl(cpu, ins);
-        break;
-    case execSra:
-        Exec_Sra(cpu, ins);
-        break;
-    case execDivu:
-        Exec_Divu(cpu, ins);
-        break;
-    case execOr:
-        Exec_Or(cpu, ins);
-        break;
-    case execRem:
-        Exec_Rem(cpu, ins);
-        break;
-    case execAnd:
-        Exec_And(cpu, ins);
-        break;
-    case execRemu:
-        Exec_Remu(cpu, ins);
-        break;
-    case execFence:
-        Exec_Fence(cpu, ins);
-        break;
-    case execEcall:
-        Exec_Ecall(cpu, ins);
-        break;
-    case execEbreak:
-        Exec_Ebreak(cpu, ins);
-        break;
-    case execUret:
-        Exec_Uret(cpu, ins);
-        break;
-    case execSret:
-        Exec_Sret(cpu, ins);
-        break;
-    case execMret:
-        Exec_Mret(cpu, ins);
-        break;
-    case execFlw:
-        Exec_Flw(cpu, ins);
-        break;
-    case execFsw:
-        Exec_Fsw(cpu, ins);
-        break;
-    case execFmaddS:
-        Exec_Fmadd_s(cpu, ins);
-        break;
-    case execFmsubS:
-        Exec_Fmsub_s(cpu, ins);
-        break;
-    case execFnmsubS:
-        Exec_Fnmsub_s(cpu, ins);
-        break;
-    case execFnmaddS:
-        Exec_Fnmadd_s(cpu, ins);
-        break;
-    case execFaddS:
-        Exec_Fadd_s(cpu, ins);
-        break;
-    case execFsubS:
-        Exec_Fsub_s(cpu, ins);
-        break;
-    case execFmulS:
-        Exec_Fmul_s(cpu, ins);
-        break;
-    case execFdivS:
-        Exec_Fdiv_s(cpu, ins);
-        break;
-    case execFsqrtS:
-        Exec_Fsqrt_s(cpu, ins);
-        break;
-    case execFsgnjS:
-        Exec_Fsgnj_s(cpu, ins);
-        break;
-    case execFsgnjnS:
-        Exec_Fsgnjn_s(cpu, ins);
-        break;
-    case execFsgnjxS:
-        Exec_Fsgnjx_s(cpu, ins);
-        break;
-    case execFminS:
-        Exec_Fmin_s(cpu, ins);
-        break;
-    case execFmaxS:
-        Exec_Fmax_s(cpu, ins);
-        break;
-    case execFcvtWS:
-        Exec_Fcvt_w_s(cpu, ins);
-        break;
-    case execFcvtWuS:
-        Exec_Fcvt_wu_s(cpu, ins);
-        break;
-    case execFmvXW:
-        Exec_Fmv_x_w(cpu, ins);
-        break;
-    case execFclassS:
-        Exec_Fclass_s(cpu, ins);
-        break;
-    case execFeqS:
-        Exec_Feq_s(cpu, ins);
-        break;
-    case execFltS:
-        Exec_Flt_s(cpu, ins);
-        break;
-    case execFleS:
-        Exec_Fle_s(cpu, ins);
-        break;
-    case execFcvtSW:
-        Exec_Fcvt_s_w(cpu, ins);
-        break;
-    case execFcvtSWu:
-        Exec_Fcvt_s_wu(cpu, ins);
-        break;
-    case execFmvWX:
-        Exec_Fmv_w_x(cpu, ins);
-        break;
-    case execIllegalInstruction:
-    default:
-        Exec_IllegalInstruction(cpu, ins);
-        break;
-    }
+    TRACE("SLLI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] << ins->imm;
+    cpu->pc += 4;
 }
 
-// --- Decoding --------------------------------------------------------------------------------------------------------------------
-//
-// Functions in this section decode instructions into their executable form.
-
-static inline int32_t IImmediate(uint32_t instruction)
+inline static void Exec_Srli(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (int32_t)instruction >> 20; // inst[31:20] -> sext(imm[11:0])
+    // rd <- rs1 >> shamt_i, pc += 4
+    TRACE("SRLI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] >> ins->imm;
+    cpu->pc += 4;
 }
 
-static inline int32_t SImmediate(uint32_t instruction)
+inline static void Exec_Srai(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return ((int32_t)(instruction & 0xfe000000) >> 20) // inst[31:25] -> sext(imm[11:5])
-            | (instruction & 0x00000f80) >> 7          // inst[11:7]  -> imm[4:0]
-            ;
+    // rd <- sx(rs1) >> shamt_i, pc += 4
+    TRACE("SRAI %s, %s, %d\n", abiNames[ins->rd], abiNames[ins->rs1], ins->imm);
+    cpu->xreg[ins->rd] = (int32_t)cpu->xreg[ins->rs1] >> ins->imm;
+    cpu->pc += 4;
 }
 
-static inline int32_t BImmediate(uint32_t instruction)
+inline static void Exec_Add(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return ((int32_t)(instruction & 0x80000000) >> 19) // inst[31]    -> sext(imm[12])
-            | (instruction & 0x00000080) << 4          // inst[7]     -> imm[11]
-            | (instruction & 0x7e000000) >> 20         // inst[30:25] -> imm[10:5]
-            | (instruction & 0x00000f00) >> 7          // inst[11:8]  -> imm[4:1]
-            ;
+    // rd <- rs1 + rs2, pc += 4
+    TRACE("ADD %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] + cpu->xreg[ins->rs2];
+    cpu->pc += 4;
 }
 
-static inline int32_t UImmediate(uint32_t instruction)
+inline static void Exec_Sub(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return instruction & 0xfffff000; // inst[31:12] -> imm[31:12]
+    // rd <- rs1 - rs2, pc += 4
+    TRACE("SUB %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] - cpu->xreg[ins->rs2];
+    cpu->pc += 4;
 }
 
-static inline int32_t JImmediate(uint32_t instruction)
+inline static void Exec_Mul(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return ((int32_t)(instruction & 0x80000000) >> 11) // inst[31]    -> sext(imm[20])
-            | (instruction & 0x000ff000)               // inst[19:12] -> imm[19:12]
-            | (instruction & 0x00100000) >> 9          // inst[20]    -> imm[11]
-            | (instruction & 0x7fe00000) >> 20         // inst[30:21] -> imm[10:1]
-            ;
+    TRACE("MUL %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] * cpu->xreg[ins->rs2];
+    cpu->pc += 4;
 }
 
-static inline uint32_t Rd(uint32_t instruction)
+inline static void Exec_Sll(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (instruction >> 7) & 0x1f;
+    // rd <- rs1 << (rs2 % XLEN), pc += 4
+    TRACE("SLL %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] << (cpu->xreg[ins->rs2] % 32);
+    cpu->pc += 4;
 }
 
-static inline uint32_t Rs1(uint32_t instruction)
+inline static void Exec_Mulh(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (instruction >> 15) & 0x1f;
+    TRACE("MULH %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    int64_t t = (int64_t)(int32_t)cpu->xreg[ins->rs1] * (int64_t)(int32_t)cpu->xreg[ins->rs2];
+    cpu->xreg[ins->rd] = t >> 32;
+    cpu->pc += 4;
 }
 
-static inline uint32_t Rs2(uint32_t instruction)
+inline static void Exec_Slt(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (instruction >> 20) & 0x1f;
+    // rd <- (rs1 < rs2) ? 1 : 0, pc += 4
+    TRACE("SLT %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = ((int32_t)cpu->xreg[ins->rs1] < (int32_t)cpu->xreg[ins->rs2]) ? 1 : 0;
+    cpu->pc += 4;
 }
 
-static inline uint32_t Rs3(uint32_t instruction)
+inline static void Exec_Mulhsu(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (instruction >> 27) & 0x1f;
+    TRACE("MULHSU %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    int64_t t = (int64_t)(int32_t)cpu->xreg[ins->rs1] * (uint64_t)cpu->xreg[ins->rs2];
+    cpu->xreg[ins->rd] = t >> 32;
+    cpu->pc += 4;
 }
 
-static inline uint32_t Rm(uint32_t instruction)
+inline static void Exec_Sltu(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (instruction >> 12) & 7;
+    // rd <- (rs1 < rs2) ? 1 : 0, pc += 4
+    TRACE("SLTU %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = (cpu->xreg[ins->rs1] < cpu->xreg[ins->rs2]) ? 1 : 0;
+    cpu->pc += 4;
 }
 
-static inline uint32_t Bits(uint32_t n, uint32_t hi, uint32_t lo)
+inline static void Exec_Mulhu(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    const uint32_t run = (hi - lo) + 1;
-    const uint32_t mask = ((1 << run) - 1) << lo;
-    const uint32_t result = (n & mask) >> lo;
-    return result;
+    TRACE("MULHU %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    uint64_t t = (uint64_t)cpu->xreg[ins->rs1] * (uint64_t)cpu->xreg[ins->rs2];
+    cpu->xreg[ins->rd] = t >> 32;
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenFetchDecodeReplace(ExecFn opcode, uint32_t cacheLine, uint32_t index)
+inline static void Exec_Xor(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .fdr = {.cacheLine = cacheLine, .index = index}};
+    // rd <- rs1 ^ rs2, pc += 4
+    TRACE("XOR %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] ^ cpu->xreg[ins->rs2];
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenImm12RdRs1(ExecFn opcode, uint32_t ins)
+inline static void Exec_Div(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rd_rs1_imm = {.rd = Rd(ins), .rs1 = Rs1(ins), .imm = IImmediate(ins)}};
-}
-
-static inline DecodedInstruction GenTrap(ExecFn opcode, uint32_t ins)
+    TRACE("DIV %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    const int32_t dividend = (int32_t)cpu->xreg[ins->rs1];
+    const int32_t divisor = (int32_t)cpu->xreg[ins->rs2];
+    // Check for signed division overflow.
+    if (dividend != 0x80000000 || divisor != -1)
+    {
+        cpu->xreg[ins->rd] = divisor != 0 // Check for division by zero.
+                ? dividend / divisor
+                : -1;
+    }
+    else
+    {
+        // Signed division overflow occurred.
+        cpu->xreg[ins->rd] = dividend;
+    }
+    cpu->pc += 4;
+}
+
+inline static void Exec_Srl(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .ins = ins};
+    // rd <- rs1 >> (rs2 % XLEN), pc += 4
+    TRACE("SRL %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] >> (cpu->xreg[ins->rs2] % 32);
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenFmPredRdRs1Succ(ExecFn opcode, uint32_t ins)
+inline static void Exec_Sra(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // TODO: implement this.
-    return (DecodedInstruction){.opcode = opcode};
+    // rd <- rs1 >> (rs2 % XLEN), pc += 4
+    TRACE("SRA %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = (int32_t)cpu->xreg[ins->rs1] >> (cpu->xreg[ins->rs2] % 32);
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenRdRs1Shamtw(ExecFn opcode, uint32_t ins)
+inline static void Exec_Divu(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rd_rs1_imm = {.rd = Rd(ins), .rs1 = Rs1(ins), .imm = IImmediate(ins) & 0x1f}};
+    TRACE("DIVU %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    uint32_t divisor = cpu->xreg[ins->rs2];
+    cpu->xreg[ins->rd] = divisor != 0 ? cpu->xreg[ins->rs1] / divisor : 0xffffffff;
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenImm20Rd(ExecFn opcode, uint32_t ins)
+inline static void Exec_Or(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rd_imm = {.rd = Rd(ins), .imm = UImmediate(ins)}};
+    // rd <- rs1 | rs2, pc += 4
+    TRACE("OR %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] | cpu->xreg[ins->rs2];
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenImm12hiImm12loRs1Rs2(ExecFn opcode, uint32_t ins)
+inline static void Exec_Rem(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rs1_rs2_imm = {.rs1 = Rs1(ins), .rs2 = Rs2(ins), .imm = SImmediate(ins)}};
+    TRACE("REM %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    const int32_t dividend = (int32_t)cpu->xreg[ins->rs1];
+    const int32_t divisor = (int32_t)cpu->xreg[ins->rs2];
+    // Check for signed division overflow.
+    if (dividend != 0x80000000 || divisor != -1)
+    {
+        cpu->xreg[ins->rd] = divisor != 0 // Check for division by zero.
+                ? dividend % divisor
+                : dividend;
+    }
+    else
+    {
+        // Signed division overflow occurred.
+        cpu->xreg[ins->rd] = 0;
+    }
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenRdRs1Rs2(ExecFn opcode, uint32_t ins)
+inline static void Exec_And(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rd_rs1_rs2 = {.rd = Rd(ins), .rs1 = Rs1(ins), .rs2 = Rs2(ins)}};
+    // rd <- rs1 & rs2, pc += 4
+    TRACE("AND %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1] & cpu->xreg[ins->rs2];
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenRdRmRs1Rs2Rs3(ExecFn opcode, uint32_t ins)
+inline static void Exec_Remu(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){
-            .opcode = opcode,
-            .rd_rs1_rs2_rs3_rm = {.rd = Rd(ins), .rs1 = Rs1(ins), .rs2 = Rs2(ins), .rs3 = Rs3(ins), .rm = Rm(ins)}};
+    TRACE("REMU %s, %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1], abiNames[ins->rs2]);
+    const uint32_t dividend = cpu->xreg[ins->rs1];
+    const uint32_t divisor = cpu->xreg[ins->rs2];
+    cpu->xreg[ins->rd] = divisor != 0 ? cpu->xreg[ins->rs1] % divisor : dividend;
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenRdRs1(ExecFn opcode, uint32_t ins)
+inline static void Exec_Fence(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rd_rs1 = {.rd = Rd(ins), .rs1 = Rs1(ins)}};
+    TRACE("FENCE\n");
+    cpu->result = CreateTrap(cpu, trNOT_IMPLEMENTED_YET, 0);
 }
 
-static inline DecodedInstruction GenRdRmRs1(ExecFn opcode, uint32_t ins)
+inline static void Exec_FenceI(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rd_rs1_rm = {.rd = Rd(ins), .rs1 = Rs1(ins), .rm = Rm(ins)}};
+    // Discard every decoded instruction, so that the instructions that follow are fetched again, pc += 4
+    TRACE("FENCE.I\n");
+    FlushDecoded(cpu->cache);
+    cpu->pc += 4;
 }
 
-static inline DecodedInstruction GenRdRmRs1Rs2(ExecFn opcode, uint32_t ins)
+inline static void Exec_Ecall(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode,
-                                .rd_rs1_rs2_rm = {.rd = Rd(ins), .rs1 = Rs1(ins), .rs2 = Rs2(ins), .rm = Rm(ins)}};
+    TRACE("ECALL\n");
+    cpu->result = CreateTrap(cpu, trENVIRONMENT_CALL_FROM_M_MODE, 0);
 }
 
-static inline DecodedInstruction GenBimm12hiBimm12loRs1Rs2(ExecFn opcode, uint32_t ins)
+inline static void Exec_Ebreak(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    TRACE("EBREAK\n");
+    cpu->result = CreateTrap(cpu, trBREAKPOINT, 0); // TODO: what should value be here?
+}
+
+inline static void Exec_Uret(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rs1_rs2_imm = {.rs1 = Rs1(ins), .rs2 = Rs2(ins), .imm = BImmediate(ins)}};
+    TRACE("URET\n");
+    // TODO: Only provide this if user mode traps are supported, otherwise raise an illegal instruction exception.
+    cpu->result = CreateTrap(cpu, trNOT_IMPLEMENTED_YET, 0);
 }
 
-static inline DecodedInstruction GenJimm20Rd(ExecFn opcode, uint32_t ins)
+inline static void Exec_Sret(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode, .rd_imm = {.rd = Rd(ins), .imm = JImmediate(ins)}};
+    TRACE("SRET\n");
+    // TODO: Only provide this if supervisor mode is supported, otherwise raise an illegal instruction exception.
+    cpu->result = CreateTrap(cpu, trNOT_IMPLEMENTED_YET, 0);
 }
 
-static inline DecodedInstruction GenNoArgs(ExecFn opcode, uint32_t ins)
+inline static void Exec_Mret(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    return (DecodedInstruction){.opcode = opcode};
+    // pc <- mepc, pc += 4
+    TRACE("MRET\n");
+    cpu->pc = cpu->mepc; // Restore the program counter from the machine exception program counter.
+    cpu->pc += 4;        // ...and increment it as normal.
 }
 
-static DecodedInstruction ArvissDecode(uint32_t ins)
+inline static void Exec_Flw(ArvissCpu* cpu, const DecodedInstruction* ins)
 {
-    // This function is generated by make_decoder.py. Do not edit.
-    switch (Bits(ins, 1, 0))
+    // rd <- f32(rs1 + imm_i)
+    TRACE("FLW %s, %d(%s)\n", fabiNames[ins->rd], ins->imm, abiNames[ins->rs1]);
+    const BusResult loaded = Read32(cpu, cpu->xreg[ins->rs1] + ins->imm);
+    if (ArvissBusResultIsFault(loaded))
     {
-    case 0x3:
-        switch (Bits(ins, 6, 2))
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
+    }
+    const uint32_t word = ArvissBusResultAsValue(loaded);
+    const float resultAsFloat = U32AsFloat(word);
+    cpu->freg[ins->rd] = resultAsFloat;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fsw(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // f32(rs1 + imm_s) = rs2
+    TRACE("FSW %s, %d(%s)\n", fabiNames[ins->rs2], ins->imm, abiNames[ins->rs1]);
+    uint32_t t = FloatAsU32(cpu->freg[ins->rs2]);
+    if (Write32(cpu, cpu->xreg[ins->rs1] + ins->imm, t) != bcOK)
+    {
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trSTORE_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
+    }
+    InvalidateStore(cpu, cpu->xreg[ins->rs1] + ins->imm, 4);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fmadd_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- (rs1 * rs2) + rs3
+    TRACE("FMADD.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], fabiNames[ins->rs3],
+          roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = (cpu->freg[ins->rs1] * cpu->freg[ins->rs2]) + cpu->freg[ins->rs3];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fmsub_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- (rs1 x rs2) - rs3
+    TRACE("FMSUB.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], fabiNames[ins->rs3],
+          roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = (cpu->freg[ins->rs1] * cpu->freg[ins->rs2]) - cpu->freg[ins->rs3];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fnmsub_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- -(rs1 x rs2) + rs3
+    TRACE("FNMSUB.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], fabiNames[ins->rs3],
+          roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = -(cpu->freg[ins->rs1] * cpu->freg[ins->rs2]) + cpu->freg[ins->rs3];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fnmadd_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- -(rs1 x rs2) - rs3
+    TRACE("FNMADD.S %s, %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], fabiNames[ins->rs3],
+          roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = -(cpu->freg[ins->rs1] * cpu->freg[ins->rs2]) - cpu->freg[ins->rs3];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fadd_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- rs1 + rs2
+    TRACE("FADD.S %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = cpu->freg[ins->rs1] + cpu->freg[ins->rs2];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fsub_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- rs1 - rs2
+    TRACE("FSUB.S %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = cpu->freg[ins->rs1] - cpu->freg[ins->rs2];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fmul_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- rs1 * rs2
+    TRACE("FMUL.S %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = cpu->freg[ins->rs1] * cpu->freg[ins->rs2];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fdiv_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- rs1 / rs2
+    TRACE("FDIV.S %s, %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2], roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = cpu->freg[ins->rs1] / cpu->freg[ins->rs2];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fsqrt_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- sqrt(rs1)
+    TRACE("FSQRT.S %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = sqrtf(cpu->freg[ins->rs1]);
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fsgnj_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- abs(rs1) * sgn(rs2)
+    TRACE("FSGNJ.S %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->freg[ins->rd] = fabsf(cpu->freg[ins->rs1]) * (cpu->freg[ins->rs2] < 0.0f ? -1.0f : 1.0f);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fsgnjn_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- abs(rs1) * -sgn(rs2)
+    TRACE("FSGNJN.S %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->freg[ins->rd] = fabsf(cpu->freg[ins->rs1]) * (cpu->freg[ins->rs2] < 0.0f ? 1.0f : -1.0f);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fsgnjx_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    float m; // The sign bit is the XOR of the sign bits of rs1 and rs2.
+    if ((cpu->freg[ins->rs1] < 0.0f && cpu->freg[ins->rs2] >= 0.0f)
+        || (cpu->freg[ins->rs1] >= 0.0f && cpu->freg[ins->rs2] < 0.0f))
+    {
+        m = -1.0f;
+    }
+    else
+    {
+        m = 1.0f;
+    }
+    // rd <- abs(rs1) * (sgn(rs1) == sgn(rs2)) ? 1 : -1
+    TRACE("FSGNJX.S %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->freg[ins->rd] = fabsf(cpu->freg[ins->rs1]) * m;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fmin_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- min(rs1, rs2)
+    TRACE("FMIN.S %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->freg[ins->rd] = fminf(cpu->freg[ins->rs1], cpu->freg[ins->rs2]);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fmax_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- max(rs1, rs2)
+    TRACE("FMAX.S %s, %s, %s\n", fabiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->freg[ins->rd] = fmaxf(cpu->freg[ins->rs1], cpu->freg[ins->rs2]);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fcvt_w_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- int32_t(rs1)
+    TRACE("FCVT.W.S %s, %s, %s\n", abiNames[ins->rd], fabiNames[ins->rs1], roundingModes[ins->rm]);
+    cpu->xreg[ins->rd] = (int32_t)cpu->freg[ins->rs1];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fcvt_wu_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- uint32_t(rs1)
+    TRACE("FCVT.WU.S %s, %s, %s\n", abiNames[ins->rd], fabiNames[ins->rs1], roundingModes[ins->rm]);
+    cpu->xreg[ins->rd] = (uint32_t)(int32_t)cpu->freg[ins->rs1];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fmv_x_w(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // bits(rd) <- bits(rs1)
+    TRACE("FMV.X.W %s, %s\n", abiNames[ins->rd], fabiNames[ins->rs1]);
+    cpu->xreg[ins->rd] = FloatAsU32(cpu->freg[ins->rs1]);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fclass_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    TRACE("FCLASS.S %s, %s\n", abiNames[ins->rd], fabiNames[ins->rs1]);
+    const float v = cpu->freg[ins->rs1];
+    const uint32_t bits = FloatAsU32(v);
+    uint32_t result = 0;
+    if (v == -INFINITY)
+    {
+        result = (1 << 0);
+    }
+    else if (v == INFINITY)
+    {
+        result = (1 << 7);
+    }
+    else if (bits == 0x80000000) // Negative zero.
+    {
+        result = (1 << 3);
+    }
+    else if (v == 0.0f)
+    {
+        result = (1 << 4);
+    }
+    else if ((bits & 0x7f800000) == 0) // Is the exponent zero?
+    {
+        if (bits & 0x80000000)
         {
-        case 0x0:
-            switch (Bits(ins, 14, 12))
-            {
-            case 0x0:
-                // lb
-                return GenImm12RdRs1(execLb, ins);
-            case 0x1:
+            result = (1 << 2); // Negative subnormal number
+        }
+        else
+        {
+            result = (1 << 5); // Positive subnormal number.
+        }
+    }
+    else if ((bits & 0x7f800000) == 0x7f800000) // Is the exponent as large as possible?
+    {
+        if (bits & 0x00400000)
+        {
+            result = (1 << 9); // Quiet NaN.
+        }
+        else if (bits & 0x003fffff)
+        {
+            result = (1 << 8); // Signaling NaN.
+        }
+    }
+    else if (v < 0.0f)
+    {
+        result = (1 << 1);
+    }
+    else if (v > 0.0f)
+    {
+        result = (1 << 6);
+    }
+    cpu->xreg[ins->rd] = result;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Feq_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- (rs1 == rs2) ? 1 : 0;
+    TRACE("FEQ.S %s, %s, %s\n", abiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->freg[ins->rs1] == cpu->freg[ins->rs2] ? 1 : 0;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Flt_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- (rs1 < rs2) ? 1 : 0;
+    TRACE("FLT.S %s, %s, %s\n", abiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->freg[ins->rs1] < cpu->freg[ins->rs2] ? 1 : 0;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fle_s(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- (rs1 <= rs2) ? 1 : 0;
+    TRACE("FLE.S %s, %s, %s\n", abiNames[ins->rd], fabiNames[ins->rs1], fabiNames[ins->rs2]);
+    cpu->xreg[ins->rd] = cpu->freg[ins->rs1] <= cpu->freg[ins->rs2] ? 1 : 0;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Fcvt_s_w(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- float(int32_t((rs1))
+    TRACE("FCVT.S.W %s, %s, %s\n", fabiNames[ins->rd], abiNames[ins->rs1], roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = (float)(int32_t)cpu->xreg[ins->rs1];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fcvt_s_wu(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- float(rs1)
+    TRACE("FVCT.S.WU %s, %s, %s\n", fabiNames[ins->rd], abiNames[ins->rs1], roundingModes[ins->rm]);
+    cpu->freg[ins->rd] = (float)cpu->xreg[ins->rs1];
+    cpu->pc += 4;
+    // TODO: rounding.
+}
+
+inline static void Exec_Fmv_w_x(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // bits(rd) <- bits(rs1)
+    TRACE("FMV.W.X %s, %s\n", fabiNames[ins->rd], abiNames[ins->rs1]);
+    cpu->freg[ins->rd] = U32AsFloat(cpu->xreg[ins->rs1]);
+    cpu->pc += 4;
+}
+
+inline static void Exec_Nop(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc += 4
+    TRACE("NOP\n");
+    cpu->pc += 4;
+}
+
+inline static void Exec_Li(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- imm, pc += 4
+    TRACE("LI %s, %d\n", abiNames[ins->rd], ins->imm);
+    cpu->xreg[ins->rd] = ins->imm;
+    cpu->pc += 4;
+}
+
+inline static void Exec_Mv(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // rd <- rs1, pc += 4
+    TRACE("MV %s, %s\n", abiNames[ins->rd], abiNames[ins->rs1]);
+    cpu->xreg[ins->rd] = cpu->xreg[ins->rs1];
+    cpu->pc += 4;
+}
+
+inline static void Exec_J(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- pc + imm_j
+    TRACE("J %d\n", ins->imm);
+    cpu->pc += ins->imm;
+}
+
+inline static void Exec_Jr(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // pc <- (rs1 + imm_i) & ~1
+    TRACE("JR %s, %d\n", abiNames[ins->rs1], ins->imm);
+    cpu->pc = (cpu->xreg[ins->rs1] + ins->imm) & ~1;
+}
+
+inline static void Exec_LbDiscard(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // m8(rs1 + imm_i), pc += 4
+    TRACE("LB zero, %d(%s)\n", ins->imm, abiNames[ins->rs1]);
+    if (ArvissBusResultIsFault(Read8(cpu, cpu->xreg[ins->rs1] + ins->imm)))
+    {
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
+    }
+    cpu->pc += 4;
+}
+
+inline static void Exec_LhDiscard(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // m16(rs1 + imm_i), pc += 4
+    TRACE("LH zero, %d(%s)\n", ins->imm, abiNames[ins->rs1]);
+    if (ArvissBusResultIsFault(Read16(cpu, cpu->xreg[ins->rs1] + ins->imm)))
+    {
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
+    }
+    cpu->pc += 4;
+}
+
+inline static void Exec_LwDiscard(ArvissCpu* cpu, const DecodedInstruction* ins)
+{
+    // m32(rs1 + imm_i), pc += 4
+    TRACE("LW zero, %d(%s)\n", ins->imm, abiNames[ins->rs1]);
+    if (ArvissBusResultIsFault(Read32(cpu, cpu->xreg[ins->rs1] + ins->imm)))
+    {
+        cpu->result = TakeTrap(cpu, ArvissMakeTrap(trLOAD_ACCESS_FAULT, cpu->xreg[ins->rs1] + ins->imm));
+        return;
+    }
+    cpu->pc += 4;
+}
+
+static void RunOne(ArvissCpu* cpu, DecodedInstruction* ins)
+{
+    switch (ins->opcode)
+    {
+#if !defined(ARVISS_BLOCK_CACHE)
+    case execFetchDecodeReplace:
+        Exec_FetchDecodeReplace(cpu, ins);
+        break;
+#endif
+    case execLui:
+    case execLuiAddi: // Superinstructions run one instruction at a time here.
+        Exec_Lui(cpu, ins);
+        break;
+    case execAuipc:
+    case execAuipcAddi:
+    case execAuipcJalr:
+        Exec_Auipc(cpu, ins);
+        break;
+    case execJal:
+        Exec_Jal(cpu, ins);
+        break;
+    case execJalr:
+        Exec_Jalr(cpu, ins);
+        break;
+    case execBeq:
+        Exec_Beq(cpu, ins);
+        break;
+    case execBne:
+        Exec_Bne(cpu, ins);
+        break;
+    case execBlt:
+        Exec_Blt(cpu, ins);
+        break;
+    case execBge:
+        Exec_Bge(cpu, ins);
+        break;
+    case execBltu:
+        Exec_Bltu(cpu, ins);
+        break;
+    case execBgeu:
+        Exec_Bgeu(cpu, ins);
+        break;
+    case execLb:
+        Exec_Lb(cpu, ins);
+        break;
+    case execLh:
+        Exec_Lh(cpu, ins);
+        break;
+    case execLw:
+    case execLwAdd:
+    case execLwAddi:
+        Exec_Lw(cpu, ins);
+        break;
+    case execLbu:
+        Exec_Lbu(cpu, ins);
+        break;
+    case execLhu:
+        Exec_Lhu(cpu, ins);
+        break;
+    case execSb:
+        Exec_Sb(cpu, ins);
+        break;
+    case execSh:
+        Exec_Sh(cpu, ins);
+        break;
+    case execSw:
+        Exec_Sw(cpu, ins);
+        break;
+    case execAddi:
+        Exec_Addi(cpu, ins);
+        break;
+    case execSlti:
+        Exec_Slti(cpu, ins);
+        break;
+    case execSltiu:
+        Exec_Sltiu(cpu, ins);
+        break;
+    case execXori:
+        Exec_Xori(cpu, ins);
+        break;
+    case execOri:
+        Exec_Ori(cpu, ins);
+        break;
+    case execAndi:
+        Exec_Andi(cpu, ins);
+        break;
+    case execSlli:
+        Exec_Slli(cpu, ins);
+        break;
+    case execSrli:
+        Exec_Srli(cpu, ins);
+        break;
+    case execSrai:
+        Exec_Srai(cpu, ins);
+        break;
+    case execAdd:
+        Exec_Add(cpu, ins);
+        break;
+    case execSub:
+        Exec_Sub(cpu, ins);
+        break;
+    case execMul:
+        Exec_Mul(cpu, ins);
+        break;
+    case execSll:
+        Exec_Sll(cpu, ins);
+        break;
+    case execMulh:
+        Exec_Mulh(cpu, ins);
+        break;
+    case execSlt:
+    case execSltBne:
+        Exec_Slt(cpu, ins);
+        break;
+    case execMulhsu:
+        Exec_Mulhsu(cpu, ins);
+        break;
+    case execSltu:
+    case execSltuBne:
+        Exec_Sltu(cpu, ins);
+        break;
+    case execMulhu:
+        Exec_Mulhu(cpu, ins);
+        break;
+    case execXor:
+        Exec_Xor(cpu, ins);
+        break;
+    case execDiv:
+        Exec_Div(cpu, ins);
+        break;
+    case execSrl:
+        Exec_Srl(cpu, ins);
+        break;
+    case execSra:
+        Exec_Sra(cpu, ins);
+        break;
+    case execDivu:
+        Exec_Divu(cpu, ins);
+        break;
+    case execOr:
+        Exec_Or(cpu, ins);
+        break;
+    case execRem:
+        Exec_Rem(cpu, ins);
+        break;
+    case execAnd:
+        Exec_And(cpu, ins);
+        break;
+    case execRemu:
+        Exec_Remu(cpu, ins);
+        break;
+    case execFence:
+        Exec_Fence(cpu, ins);
+        break;
+    case execFenceI:
+        Exec_FenceI(cpu, ins);
+        break;
+    case execEcall:
+        Exec_Ecall(cpu, ins);
+        break;
+    case execEbreak:
+        Exec_Ebreak(cpu, ins);
+        break;
+    case execUret:
+        Exec_Uret(cpu, ins);
+        break;
+    case execSret:
+        Exec_Sret(cpu, ins);
+        break;
+    case execMret:
+        Exec_Mret(cpu, ins);
+        break;
+    case execFlw:
+        Exec_Flw(cpu, ins);
+        break;
+    case execFsw:
+        Exec_Fsw(cpu, ins);
+        break;
+    case execFmaddS:
+        Exec_Fmadd_s(cpu, ins);
+        break;
+    case execFmsubS:
+        Exec_Fmsub_s(cpu, ins);
+        break;
+    case execFnmsubS:
+        Exec_Fnmsub_s(cpu, ins);
+        break;
+    case execFnmaddS:
+        Exec_Fnmadd_s(cpu, ins);
+        break;
+    case execFaddS:
+        Exec_Fadd_s(cpu, ins);
+        break;
+    case execFsubS:
+        Exec_Fsub_s(cpu, ins);
+        break;
+    case execFmulS:
+        Exec_Fmul_s(cpu, ins);
+        break;
+    case execFdivS:
+        Exec_Fdiv_s(cpu, ins);
+        break;
+    case execFsqrtS:
+        Exec_Fsqrt_s(cpu, ins);
+        break;
+    case execFsgnjS:
+        Exec_Fsgnj_s(cpu, ins);
+        break;
+    case execFsgnjnS:
+        Exec_Fsgnjn_s(cpu, ins);
+        break;
+    case execFsgnjxS:
+        Exec_Fsgnjx_s(cpu, ins);
+        break;
+    case execFminS:
+        Exec_Fmin_s(cpu, ins);
+        break;
+    case execFmaxS:
+        Exec_Fmax_s(cpu, ins);
+        break;
+    case execFcvtWS:
+        Exec_Fcvt_w_s(cpu, ins);
+        break;
+    case execFcvtWuS:
+        Exec_Fcvt_wu_s(cpu, ins);
+        break;
+    case execFmvXW:
+        Exec_Fmv_x_w(cpu, ins);
+        break;
+    case execFclassS:
+        Exec_Fclass_s(cpu, ins);
+        break;
+    case execFeqS:
+        Exec_Feq_s(cpu, ins);
+        break;
+    case execFltS:
+        Exec_Flt_s(cpu, ins);
+        break;
+    case execFleS:
+        Exec_Fle_s(cpu, ins);
+        break;
+    case execFcvtSW:
+        Exec_Fcvt_s_w(cpu, ins);
+        break;
+    case execFcvtSWu:
+        Exec_Fcvt_s_wu(cpu, ins);
+        break;
+    case execFmvWX:
+        Exec_Fmv_w_x(cpu, ins);
+        break;
+    case execNop:
+        Exec_Nop(cpu, ins);
+        break;
+    case execLi:
+        Exec_Li(cpu, ins);
+        break;
+    case execMv:
+        Exec_Mv(cpu, ins);
+        break;
+    case execJ:
+        Exec_J(cpu, ins);
+        break;
+    case execJr:
+        Exec_Jr(cpu, ins);
+        break;
+    case execLbDiscard:
+        Exec_LbDiscard(cpu, ins);
+        break;
+    case execLhDiscard:
+        Exec_LhDiscard(cpu, ins);
+        break;
+    case execLwDiscard:
+        Exec_LwDiscard(cpu, ins);
+        break;
+    case execIllegalInstruction:
+    default:
+        Exec_IllegalInstruction(cpu, ins);
+        break;
+    }
+}
+
+// --- Decoding --------------------------------------------------------------------------------------------------------------------
+//
+// Functions in this section decode instructions into their executable form.
+
+static inline int32_t IImmediate(uint32_t instruction)
+{
+    return (int32_t)instruction >> 20; // inst[31:20] -> sext(imm[11:0])
+}
+
+static inline int32_t SImmediate(uint32_t instruction)
+{
+    return ((int32_t)(instruction & 0xfe000000) >> 20) // inst[31:25] -> sext(imm[11:5])
+            | (instruction & 0x00000f80) >> 7          // inst[11:7]  -> imm[4:0]
+            ;
+}
+
+static inline int32_t BImmediate(uint32_t instruction)
+{
+    return ((int32_t)(instruction & 0x80000000) >> 19) // inst[31]    -> sext(imm[12])
+            | (instruction & 0x00000080) << 4          // inst[7]     -> imm[11]
+            | (instruction & 0x7e000000) >> 20         // inst[30:25] -> imm[10:5]
+            | (instruction & 0x00000f00) >> 7          // inst[11:8]  -> imm[4:1]
+            ;
+}
+
+static inline int32_t UImmediate(uint32_t instruction)
+{
+    return instruction & 0xfffff000; // inst[31:12] -> imm[31:12]
+}
+
+static inline int32_t JImmediate(uint32_t instruction)
+{
+    return ((int32_t)(instruction & 0x80000000) >> 11) // inst[31]    -> sext(imm[20])
+            | (instruction & 0x000ff000)               // inst[19:12] -> imm[19:12]
+            | (instruction & 0x00100000) >> 9          // inst[20]    -> imm[11]
+            | (instruction & 0x7fe00000) >> 20         // inst[30:21] -> imm[10:1]
+            ;
+}
+
+static inline uint32_t Rd(uint32_t instruction)
+{
+    return (instruction >> 7) & 0x1f;
+}
+
+static inline uint32_t Rs1(uint32_t instruction)
+{
+    return (instruction >> 15) & 0x1f;
+}
+
+static inline uint32_t Rs2(uint32_t instruction)
+{
+    return (instruction >> 20) & 0x1f;
+}
+
+static inline uint32_t Rs3(uint32_t instruction)
+{
+    return (instruction >> 27) & 0x1f;
+}
+
+static inline uint32_t Rm(uint32_t instruction)
+{
+    return (instruction >> 12) & 7;
+}
+
+static inline uint32_t Bits(uint32_t n, uint32_t hi, uint32_t lo)
+{
+    const uint32_t run = (hi - lo) + 1;
+    const uint32_t mask = ((1 << run) - 1) << lo;
+    const uint32_t result = (n & mask) >> lo;
+    return result;
+}
+
+static inline DecodedInstruction GenFetchDecodeReplace(ExecFn opcode, uint32_t cacheLine, uint32_t index)
+{
+    return (DecodedInstruction){.opcode = opcode, .fdr = {.cacheLine = cacheLine, .index = index}};
+}
+
+static inline DecodedInstruction GenImm12RdRs1(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .rs1 = Rs1(ins), .imm = IImmediate(ins)};
+}
+
+static inline DecodedInstruction GenTrap(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .ins = ins};
+}
+
+static inline DecodedInstruction GenFmPredRdRs1Succ(ExecFn opcode, uint32_t ins)
+{
+    // TODO: implement this.
+    return (DecodedInstruction){.opcode = opcode};
+}
+
+static inline DecodedInstruction GenRdRs1Shamtw(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .rs1 = Rs1(ins), .imm = IImmediate(ins) & 0x1f};
+}
+
+static inline DecodedInstruction GenImm20Rd(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .imm = UImmediate(ins)};
+}
+
+static inline DecodedInstruction GenImm12hiImm12loRs1Rs2(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rs1 = Rs1(ins), .rs2 = Rs2(ins), .imm = SImmediate(ins)};
+}
+
+static inline DecodedInstruction GenRdRs1Rs2(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .rs1 = Rs1(ins), .rs2 = Rs2(ins)};
+}
+
+static inline DecodedInstruction GenRdRmRs1Rs2Rs3(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .rs1 = Rs1(ins), .rs2 = Rs2(ins), .rs3 = Rs3(ins), .rm = Rm(ins)};
+}
+
+static inline DecodedInstruction GenRdRs1(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .rs1 = Rs1(ins)};
+}
+
+static inline DecodedInstruction GenRdRmRs1(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .rs1 = Rs1(ins), .rm = Rm(ins)};
+}
+
+static inline DecodedInstruction GenRdRmRs1Rs2(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .rs1 = Rs1(ins), .rs2 = Rs2(ins), .rm = Rm(ins)};
+}
+
+static inline DecodedInstruction GenBimm12hiBimm12loRs1Rs2(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rs1 = Rs1(ins), .rs2 = Rs2(ins), .imm = BImmediate(ins)};
+}
+
+static inline DecodedInstruction GenJimm20Rd(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode, .rd = Rd(ins), .imm = JImmediate(ins)};
+}
+
+static inline DecodedInstruction GenNoArgs(ExecFn opcode, uint32_t ins)
+{
+    return (DecodedInstruction){.opcode = opcode};
+}
+
+static DecodedInstruction ArvissDecode(uint32_t ins)
+{
+    // This function is generated by make_decoder.py. Do not edit.
+    switch (Bits(ins, 1, 0))
+    {
+    case 0x3:
+        switch (Bits(ins, 6, 2))
+        {
+        case 0x0:
+            switch (Bits(ins, 14, 12))
+            {
+            case 0x0:
+                // lb
+                return GenImm12RdRs1(execLb, ins);
+            case 0x1:
                 // lh
                 return GenImm12RdRs1(execLh, ins);
             case 0x2:
@@ -1911,524 +3548,3013 @@ static DecodedInstruction ArvissDecode(uint32_t ins)
                 // lbu
                 return GenImm12RdRs1(execLbu, ins);
             case 0x5:
-                // lhu
-                return GenImm12RdRs1(execLhu, ins);
+                // lhu
+                return GenImm12RdRs1(execLhu, ins);
+            default:
+                break;
+            }
+        case 0x1:
+            switch (Bits(ins, 14, 12))
+            {
+            case 0x2:
+                // flw
+                return GenImm12RdRs1(execFlw, ins);
+            default:
+                break;
+            }
+        case 0x3:
+            switch (Bits(ins, 14, 12))
+            {
+            case 0x0:
+                // fence
+                return GenFmPredRdRs1Succ(execFence, ins);
+            case 0x1:
+                // fence.i
+                return GenImm12RdRs1(execFenceI, ins);
+            default:
+                break;
+            }
+        case 0x4:
+            switch (Bits(ins, 14, 12))
+            {
+            case 0x0:
+                // addi
+                return GenImm12RdRs1(execAddi, ins);
+            case 0x1:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // slli
+                    return GenRdRs1Shamtw(execSlli, ins);
+                default:
+                    break;
+                }
+            case 0x2:
+                // slti
+                return GenImm12RdRs1(execSlti, ins);
+            case 0x3:
+                // sltiu
+                return GenImm12RdRs1(execSltiu, ins);
+            case 0x4:
+                // xori
+                return GenImm12RdRs1(execXori, ins);
+            case 0x5:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // srli
+                    return GenRdRs1Shamtw(execSrli, ins);
+                case 0x20:
+                    // srai
+                    return GenRdRs1Shamtw(execSrai, ins);
+                default:
+                    break;
+                }
+            case 0x6:
+                // ori
+                return GenImm12RdRs1(execOri, ins);
+            case 0x7:
+                // andi
+                return GenImm12RdRs1(execAndi, ins);
+            default:
+                break;
+            }
+        case 0x5:
+            // auipc
+            return GenImm20Rd(execAuipc, ins);
+        case 0x8:
+            switch (Bits(ins, 14, 12))
+            {
+            case 0x0:
+                // sb
+                return GenImm12hiImm12loRs1Rs2(execSb, ins);
+            case 0x1:
+                // sh
+                return GenImm12hiImm12loRs1Rs2(execSh, ins);
+            case 0x2:
+                // sw
+                return GenImm12hiImm12loRs1Rs2(execSw, ins);
+            default:
+                break;
+            }
+        case 0x9:
+            switch (Bits(ins, 14, 12))
+            {
+            case 0x2:
+                // fsw
+                return GenImm12hiImm12loRs1Rs2(execFsw, ins);
+            default:
+                break;
+            }
+        case 0xc:
+            switch (Bits(ins, 14, 12))
+            {
+            case 0x0:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // add
+                    return GenRdRs1Rs2(execAdd, ins);
+                case 0x1:
+                    // mul
+                    return GenRdRs1Rs2(execMul, ins);
+                case 0x20:
+                    // sub
+                    return GenRdRs1Rs2(execSub, ins);
+                default:
+                    break;
+                }
+            case 0x1:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // sll
+                    return GenRdRs1Rs2(execSll, ins);
+                case 0x1:
+                    // mulh
+                    return GenRdRs1Rs2(execMulh, ins);
+                default:
+                    break;
+                }
+            case 0x2:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // slt
+                    return GenRdRs1Rs2(execSlt, ins);
+                case 0x1:
+                    // mulhsu
+                    return GenRdRs1Rs2(execMulhsu, ins);
+                default:
+                    break;
+                }
+            case 0x3:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // sltu
+                    return GenRdRs1Rs2(execSltu, ins);
+                case 0x1:
+                    // mulhu
+                    return GenRdRs1Rs2(execMulhu, ins);
+                default:
+                    break;
+                }
+            case 0x4:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // xor
+                    return GenRdRs1Rs2(execXor, ins);
+                case 0x1:
+                    // div
+                    return GenRdRs1Rs2(execDiv, ins);
+                default:
+                    break;
+                }
+            case 0x5:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // srl
+                    return GenRdRs1Rs2(execSrl, ins);
+                case 0x1:
+                    // divu
+                    return GenRdRs1Rs2(execDivu, ins);
+                case 0x20:
+                    // sra
+                    return GenRdRs1Rs2(execSra, ins);
+                default:
+                    break;
+                }
+            case 0x6:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // or
+                    return GenRdRs1Rs2(execOr, ins);
+                case 0x1:
+                    // rem
+                    return GenRdRs1Rs2(execRem, ins);
+                default:
+                    break;
+                }
+            case 0x7:
+                switch (Bits(ins, 31, 25))
+                {
+                case 0x0:
+                    // and
+                    return GenRdRs1Rs2(execAnd, ins);
+                case 0x1:
+                    // remu
+                    return GenRdRs1Rs2(execRemu, ins);
+                default:
+                    break;
+                }
             default:
                 break;
             }
-        case 0x1:
-            switch (Bits(ins, 14, 12))
+        case 0xd:
+            // lui
+            return GenImm20Rd(execLui, ins);
+        case 0x10:
+            switch (Bits(ins, 26, 25))
             {
-            case 0x2:
-                // flw
-                return GenImm12RdRs1(execFlw, ins);
+            case 0x0:
+                // fmadd.s
+                return GenRdRmRs1Rs2Rs3(execFmaddS, ins);
             default:
                 break;
             }
-        case 0x3:
-            switch (Bits(ins, 14, 12))
+        case 0x11:
+            switch (Bits(ins, 26, 25))
             {
             case 0x0:
-                // fence
-                return GenFmPredRdRs1Succ(execFence, ins);
-            case 0x1:
-                // fence.i
-                return GenImm12RdRs1(execFenceI, ins);
+                // fmsub.s
+                return GenRdRmRs1Rs2Rs3(execFmsubS, ins);
             default:
                 break;
             }
-        case 0x4:
-            switch (Bits(ins, 14, 12))
+        case 0x12:
+            switch (Bits(ins, 26, 25))
             {
             case 0x0:
-                // addi
-                return GenImm12RdRs1(execAddi, ins);
-            case 0x1:
-                switch (Bits(ins, 31, 25))
+                // fnmsub.s
+                return GenRdRmRs1Rs2Rs3(execFnmsubS, ins);
+            default:
+                break;
+            }
+        case 0x13:
+            switch (Bits(ins, 26, 25))
+            {
+            case 0x0:
+                // fnmadd.s
+                return GenRdRmRs1Rs2Rs3(execFnmaddS, ins);
+            default:
+                break;
+            }
+        case 0x14:
+            switch (Bits(ins, 26, 25))
+            {
+            case 0x0:
+                switch (Bits(ins, 14, 12))
                 {
                 case 0x0:
-                    // slli
-                    return GenRdRs1Shamtw(execSlli, ins);
+                    switch (Bits(ins, 31, 27))
+                    {
+                    case 0x4:
+                        // fsgnj.s
+                        return GenRdRs1Rs2(execFsgnjS, ins);
+                    case 0x5:
+                        // fmin.s
+                        return GenRdRs1Rs2(execFminS, ins);
+                    case 0x14:
+                        // fle.s
+                        return GenRdRs1Rs2(execFleS, ins);
+                    case 0x1c:
+                        switch (Bits(ins, 24, 20))
+                        {
+                        case 0x0:
+                            // fmv.x.w
+                            return GenRdRs1(execFmvXW, ins);
+                        default:
+                            break;
+                        }
+                    case 0x1e:
+                        switch (Bits(ins, 24, 20))
+                        {
+                        case 0x0:
+                            // fmv.w.x
+                            return GenRdRs1(execFmvWX, ins);
+                        default:
+                            break;
+                        }
+                    default:
+                        break;
+                    }
+                case 0x1:
+                    switch (Bits(ins, 31, 27))
+                    {
+                    case 0x4:
+                        // fsgnjn.s
+                        return GenRdRs1Rs2(execFsgnjnS, ins);
+                    case 0x5:
+                        // fmax.s
+                        return GenRdRs1Rs2(execFmaxS, ins);
+                    case 0x14:
+                        // flt.s
+                        return GenRdRs1Rs2(execFltS, ins);
+                    case 0x1c:
+                        switch (Bits(ins, 24, 20))
+                        {
+                        case 0x0:
+                            // fclass.s
+                            return GenRdRs1(execFclassS, ins);
+                        default:
+                            break;
+                        }
+                    default:
+                        break;
+                    }
+                case 0x2:
+                    switch (Bits(ins, 31, 27))
+                    {
+                    case 0x4:
+                        // fsgnjx.s
+                        return GenRdRs1Rs2(execFsgnjxS, ins);
+                    case 0x14:
+                        // feq.s
+                        return GenRdRs1Rs2(execFeqS, ins);
+                    default:
+                        break;
+                    }
                 default:
                     break;
                 }
-            case 0x2:
-                // slti
-                return GenImm12RdRs1(execSlti, ins);
-            case 0x3:
-                // sltiu
-                return GenImm12RdRs1(execSltiu, ins);
-            case 0x4:
-                // xori
-                return GenImm12RdRs1(execXori, ins);
-            case 0x5:
-                switch (Bits(ins, 31, 25))
+                switch (Bits(ins, 31, 27))
                 {
                 case 0x0:
-                    // srli
-                    return GenRdRs1Shamtw(execSrli, ins);
-                case 0x20:
-                    // srai
-                    return GenRdRs1Shamtw(execSrai, ins);
+                    // fadd.s
+                    return GenRdRmRs1Rs2(execFaddS, ins);
+                case 0x1:
+                    // fsub.s
+                    return GenRdRmRs1Rs2(execFsubS, ins);
+                case 0x2:
+                    // fmul.s
+                    return GenRdRmRs1Rs2(execFmulS, ins);
+                case 0x3:
+                    // fdiv.s
+                    return GenRdRmRs1Rs2(execFdivS, ins);
+                case 0xb:
+                    switch (Bits(ins, 24, 20))
+                    {
+                    case 0x0:
+                        // fsqrt.s
+                        return GenRdRmRs1(execFsqrtS, ins);
+                    default:
+                        break;
+                    }
+                case 0x18:
+                    switch (Bits(ins, 24, 20))
+                    {
+                    case 0x0:
+                        // fcvt.w.s
+                        return GenRdRmRs1(execFcvtWS, ins);
+                    case 0x1:
+                        // fcvt.wu.s
+                        return GenRdRmRs1(execFcvtWuS, ins);
+                    default:
+                        break;
+                    }
+                case 0x1a:
+                    switch (Bits(ins, 24, 20))
+                    {
+                    case 0x0:
+                        // fcvt.s.w
+                        return GenRdRmRs1(execFcvtSW, ins);
+                    case 0x1:
+                        // fcvt.s.wu
+                        return GenRdRmRs1(execFcvtSWu, ins);
+                    default:
+                        break;
+                    }
                 default:
                     break;
                 }
-            case 0x6:
-                // ori
-                return GenImm12RdRs1(execOri, ins);
-            case 0x7:
-                // andi
-                return GenImm12RdRs1(execAndi, ins);
             default:
                 break;
             }
-        case 0x5:
-            // auipc
-            return GenImm20Rd(execAuipc, ins);
-        case 0x8:
+        case 0x18:
             switch (Bits(ins, 14, 12))
             {
             case 0x0:
-                // sb
-                return GenImm12hiImm12loRs1Rs2(execSb, ins);
+                // beq
+                return GenBimm12hiBimm12loRs1Rs2(execBeq, ins);
             case 0x1:
-                // sh
-                return GenImm12hiImm12loRs1Rs2(execSh, ins);
-            case 0x2:
-                // sw
-                return GenImm12hiImm12loRs1Rs2(execSw, ins);
+                // bne
+                return GenBimm12hiBimm12loRs1Rs2(execBne, ins);
+            case 0x4:
+                // blt
+                return GenBimm12hiBimm12loRs1Rs2(execBlt, ins);
+            case 0x5:
+                // bge
+                return GenBimm12hiBimm12loRs1Rs2(execBge, ins);
+            case 0x6:
+                // bltu
+                return GenBimm12hiBimm12loRs1Rs2(execBltu, ins);
+            case 0x7:
+                // bgeu
+                return GenBimm12hiBimm12loRs1Rs2(execBgeu, ins);
             default:
                 break;
             }
-        case 0x9:
+        case 0x19:
             switch (Bits(ins, 14, 12))
             {
-            case 0x2:
-                // fsw
-                return GenImm12hiImm12loRs1Rs2(execFsw, ins);
+            case 0x0:
+                // jalr
+                return GenImm12RdRs1(execJalr, ins);
             default:
                 break;
             }
-        case 0xc:
+        case 0x1b:
+            // jal
+            return GenJimm20Rd(execJal, ins);
+        case 0x1c:
             switch (Bits(ins, 14, 12))
             {
             case 0x0:
-                switch (Bits(ins, 31, 25))
-                {
-                case 0x0:
-                    // add
-                    return GenRdRs1Rs2(execAdd, ins);
-                case 0x1:
-                    // mul
-                    return GenRdRs1Rs2(execMul, ins);
-                case 0x20:
-                    // sub
-                    return GenRdRs1Rs2(execSub, ins);
-                default:
-                    break;
-                }
-            case 0x1:
-                switch (Bits(ins, 31, 25))
-                {
-                case 0x0:
-                    // sll
-                    return GenRdRs1Rs2(execSll, ins);
-                case 0x1:
-                    // mulh
-                    return GenRdRs1Rs2(execMulh, ins);
-                default:
-                    break;
-                }
-            case 0x2:
-                switch (Bits(ins, 31, 25))
-                {
-                case 0x0:
-                    // slt
-                    return GenRdRs1Rs2(execSlt, ins);
-                case 0x1:
-                    // mulhsu
-                    return GenRdRs1Rs2(execMulhsu, ins);
-                default:
-                    break;
-                }
-            case 0x3:
-                switch (Bits(ins, 31, 25))
-                {
-                case 0x0:
-                    // sltu
-                    return GenRdRs1Rs2(execSltu, ins);
-                case 0x1:
-                    // mulhu
-                    return GenRdRs1Rs2(execMulhu, ins);
-                default:
-                    break;
-                }
-            case 0x4:
-                switch (Bits(ins, 31, 25))
-                {
-                case 0x0:
-                    // xor
-                    return GenRdRs1Rs2(execXor, ins);
-                case 0x1:
-                    // div
-                    return GenRdRs1Rs2(execDiv, ins);
-                default:
-                    break;
-                }
-            case 0x5:
-                switch (Bits(ins, 31, 25))
-                {
-                case 0x0:
-                    // srl
-                    return GenRdRs1Rs2(execSrl, ins);
-                case 0x1:
-                    // divu
-                    return GenRdRs1Rs2(execDivu, ins);
-                case 0x20:
-                    // sra
-                    return GenRdRs1Rs2(execSra, ins);
-                default:
-                    break;
-                }
-            case 0x6:
-                switch (Bits(ins, 31, 25))
+                switch (Bits(ins, 31, 20))
                 {
                 case 0x0:
-                    // or
-                    return GenRdRs1Rs2(execOr, ins);
+                    switch (Bits(ins, 19, 15))
+                    {
+                    case 0x0:
+                        switch (Bits(ins, 11, 7))
+                        {
+                        case 0x0:
+                            // ecall
+                            return GenNoArgs(execEcall, ins);
+                        default:
+                            break;
+                        }
+                    default:
+                        break;
+                    }
                 case 0x1:
-                    // rem
-                    return GenRdRs1Rs2(execRem, ins);
+                    switch (Bits(ins, 19, 15))
+                    {
+                    case 0x0:
+                        switch (Bits(ins, 11, 7))
+                        {
+                        case 0x0:
+                            // ebreak
+                            return GenNoArgs(execEbreak, ins);
+                        default:
+                            break;
+                        }
+                    default:
+                        break;
+                    }
+                case 0x102:
+                    switch (Bits(ins, 19, 15))
+                    {
+                    case 0x0:
+                        switch (Bits(ins, 11, 7))
+                        {
+                        case 0x0:
+                            // sret
+                            return GenNoArgs(execSret, ins);
+                        default:
+                            break;
+                        }
+                    default:
+                        break;
+                    }
+                case 0x302:
+                    switch (Bits(ins, 19, 15))
+                    {
+                    case 0x0:
+                        switch (Bits(ins, 11, 7))
+                        {
+                        case 0x0:
+                            // mret
+                            return GenNoArgs(execMret, ins);
+                        default:
+                            break;
+                        }
+                    default:
+                        break;
+                    }
                 default:
                     break;
                 }
-            case 0x7:
-                switch (Bits(ins, 31, 25))
+            default:
+                break;
+            }
+        default:
+            break;
+        }
+    default:
+        break;
+    }
+    // Illegal instruction.
+    return GenTrap(execIllegalInstruction, ins);
+}
+
+// Rewrites a decoded instruction into a simpler form where there is one. In particular, instructions that would write to x0 are
+// rewritten so that they don't, which means that x0 is never written and doesn't need to be reset after every instruction.
+static DecodedInstruction Canonicalise(DecodedInstruction decoded)
+{
+    switch (decoded.opcode)
+    {
+    case execLui:
+    case execAuipc:
+        return decoded.rd == 0 ? GenNoArgs(execNop, 0) : decoded;
+    case execJal:
+        decoded.opcode = decoded.rd == 0 ? execJ : execJal;
+        return decoded;
+    case execJalr:
+        decoded.opcode = decoded.rd == 0 ? execJr : execJalr;
+        return decoded;
+    case execLb:
+    case execLbu:
+        // Loads into x0 are still made, as they may fault.
+        decoded.opcode = decoded.rd == 0 ? execLbDiscard : decoded.opcode;
+        return decoded;
+    case execLh:
+    case execLhu:
+        decoded.opcode = decoded.rd == 0 ? execLhDiscard : decoded.opcode;
+        return decoded;
+    case execLw:
+        decoded.opcode = decoded.rd == 0 ? execLwDiscard : decoded.opcode;
+        return decoded;
+    case execAddi:
+        if (decoded.rd == 0)
+        {
+            return GenNoArgs(execNop, 0);
+        }
+        if (decoded.rs1 == 0)
+        {
+            // addi rd, x0, imm is li rd, imm.
+            const uint8_t rd = decoded.rd;
+            const int32_t imm = decoded.imm;
+            return (DecodedInstruction){.opcode = execLi, .rd = rd, .imm = imm};
+        }
+        if (decoded.imm == 0)
+        {
+            // addi rd, rs1, 0 is mv rd, rs1.
+            const uint8_t rd = decoded.rd;
+            const uint8_t rs1 = decoded.rs1;
+            return (DecodedInstruction){.opcode = execMv, .rd = rd, .rs1 = rs1};
+        }
+        return decoded;
+    case execSlti:
+    case execSltiu:
+    case execXori:
+    case execOri:
+    case execAndi:
+    case execSlli:
+    case execSrli:
+    case execSrai:
+        return decoded.rd == 0 ? GenNoArgs(execNop, 0) : decoded;
+    case execAdd:
+    case execSub:
+    case execMul:
+    case execSll:
+    case execMulh:
+    case execSlt:
+    case execMulhsu:
+    case execSltu:
+    case execMulhu:
+    case execXor:
+    case execDiv:
+    case execSrl:
+    case execSra:
+    case execDivu:
+    case execOr:
+    case execRem:
+    case execAnd:
+    case execRemu:
+    case execFeqS:
+    case execFltS:
+    case execFleS:
+        return decoded.rd == 0 ? GenNoArgs(execNop, 0) : decoded;
+    case execFcvtWS:
+    case execFcvtWuS:
+        return decoded.rd == 0 ? GenNoArgs(execNop, 0) : decoded;
+    case execFmvXW:
+    case execFclassS:
+        return decoded.rd == 0 ? GenNoArgs(execNop, 0) : decoded;
+    default:
+        return decoded;
+    }
+}
+
+#if defined(ARVISS_BLOCK_CACHE)
+
+// Returns the slot in the block hash table where probing for the block that starts at the given address should begin.
+static inline uint32_t BlockHash(uint32_t addr)
+{
+    return (addr / 4) % BLOCK_CACHE_BLOCKS;
+}
+
+// Returns true if the given instruction ends a basic block, i.e., if it transfers control or always traps.
+static inline bool EndsBlock(ExecFn opcode)
+{
+    switch (opcode)
+    {
+    case execJal:
+    case execJalr:
+    case execJ:
+    case execJr:
+    case execBeq:
+    case execBne:
+    case execBlt:
+    case execBge:
+    case execBltu:
+    case execBgeu:
+    case execMret:
+    case execIllegalInstruction:
+    case execFence:
+    case execFenceI:
+    case execEcall:
+    case execEbreak:
+    case execUret:
+    case execSret:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Fetches and decodes the basic block that starts at the program counter, adds it to the block cache, and returns it, or NULL if
+// its first instruction could not be fetched.
+static struct Block* DecodeBlock(ArvissCpu* cpu)
+{
+    DecodedInstructionCache* cache = cpu->cache;
+
+    // If there's no room for another block then start again with an empty cache. The hash table is never allowed to get more
+    // than 3/4 full, so that probing stays cheap.
+    COUNT(cache, misses, 1);
+    if (cache->used + BLOCK_MAX_LENGTH + 1 > BLOCK_CACHE_INSTRUCTIONS || cache->blockCount >= BLOCK_CACHE_BLOCKS * 3 / 4)
+    {
+        COUNT(cache, evictions, cache->blockCount);
+        FlushBlocks(cache);
+    }
+
+    const uint32_t pc = cpu->pc;
+    DecodedInstruction* start = &cache->instructions[cache->used];
+    DecodedInstruction* ins = start;
+#if defined(ARVISS_USE_FUSION)
+    DecodedInstruction* first = NULL; // The instruction that the next one might be fused with.
+#endif
+    uint32_t addr = pc;
+    for (int i = 0; i < BLOCK_MAX_LENGTH; i++, addr += 4)
+    {
+        // Code that's shared with other CPUs is already decoded, so it only has to be copied into the block.
+        const DecodedInstruction* shared = FindSharedCode(cpu, addr);
+        if (shared != NULL)
+        {
+            *ins = *shared;
+        }
+        else
+        {
+            const BusResult fetched = Read32(cpu, addr);
+            if (ArvissBusResultIsFault(fetched))
+            {
+                if (i == 0)
                 {
-                case 0x0:
-                    // and
-                    return GenRdRs1Rs2(execAnd, ins);
-                case 0x1:
-                    // remu
-                    return GenRdRs1Rs2(execRemu, ins);
-                default:
-                    break;
+                    cpu->result = ArvissMakeTrap(trINSTRUCTION_ACCESS_FAULT, addr);
+                    return NULL;
                 }
-            default:
+
+                // End the block here. If execution reaches this address then the fault will be raised when its block is decoded.
+                ReleaseGuardPages(cpu);
                 break;
             }
-        case 0xd:
-            // lui
-            return GenImm20Rd(execLui, ins);
-        case 0x10:
-            switch (Bits(ins, 26, 25))
+
+            // All instructions are decodable into something executable, because all illegal instructions become
+            // Exec_IllegalInstruction, which is itself executable.
+            *ins = Canonicalise(ArvissDecode(ArvissBusResultAsValue(fetched)));
+        }
+#if defined(ARVISS_USE_FUSION)
+        if (cache->fuse)
+        {
+            // Each instruction is fused with at most one other, so one that completes a superinstruction can't start another.
+            first = first != NULL && Fuse(first, ins) ? NULL : ins;
+        }
+#endif
+        if (EndsBlock((ins++)->opcode))
+        {
+            break;
+        }
+    }
+
+    // Every block ends with a marker that looks up the next block.
+    const uint32_t length = (uint32_t)(ins - start);
+    *ins = (DecodedInstruction){.opcode = execNextBlock};
+    COUNT(cache, decodes, length);
+    MarkCode(cache, pc, length * 4);
+
+    // Add the block to the hash table.
+    uint32_t slot = BlockHash(pc);
+    while (cache->blocks[slot].generation == cache->generation)
+    {
+        slot = (slot + 1) % BLOCK_CACHE_BLOCKS;
+    }
+    struct Block* block = &cache->blocks[slot];
+    *block = (struct Block){.pc = pc, .start = (uint32_t)cache->used, .generation = cache->generation};
+#if defined(ARVISS_USE_JIT)
+    block->length = length;
+#endif
+    cache->blockCount++;
+    cache->used += (int)length + 1;
+
+    return block;
+}
+
+// Returns the basic block that starts at the program counter, decoding it if it isn't already in the block cache. Returns NULL if
+// the block could not be fetched.
+static inline struct Block* FindBlock(ArvissCpu* cpu)
+{
+    const uint32_t pc = cpu->pc;
+    DecodedInstructionCache* cache = cpu->cache;
+    COUNT(cache, lookups, 1);
+    for (uint32_t slot = BlockHash(pc); cache->blocks[slot].generation == cache->generation; slot = (slot + 1) % BLOCK_CACHE_BLOCKS)
+    {
+        if (cache->blocks[slot].pc == pc)
+        {
+            return &cache->blocks[slot];
+        }
+    }
+
+    return DecodeBlock(cpu);
+}
+
+// Returns the basic block that starts at the program counter, given the block that was run before it, or NULL if there wasn't one.
+// The blocks that a block leads to are linked to it, so a block that keeps going to the same places, e.g., the body of a loop,
+// doesn't need to look them up. Links are only ever held by blocks in the cache, so they are discarded with them when it is
+// flushed, and a block that has been flushed is treated as if there wasn't one. Returns NULL if the block could not be fetched.
+static inline struct Block* NextBlock(ArvissCpu* cpu, struct Block* from)
+{
+    const uint32_t pc = cpu->pc;
+    if (from == NULL || from->generation != cpu->cache->generation)
+    {
+        return FindBlock(cpu);
+    }
+    if (from->links[0].block != NULL && from->links[0].pc == pc)
+    {
+        return from->links[0].block;
+    }
+    if (from->links[1].block != NULL && from->links[1].pc == pc)
+    {
+        return from->links[1].block;
+    }
+
+    // Look the block up, and link to it in place of the least recently added link. If the lookup flushed the cache then the
+    // block we came from is gone, but the new link is still correct as it is keyed on the address.
+    struct Block* to = FindBlock(cpu);
+    if (to != NULL)
+    {
+        from->links[1] = from->links[0];
+        from->links[0] = (struct BlockLink){.pc = pc, .block = to};
+    }
+    return to;
+}
+
+// Returns true if the given register is a link register, i.e., ra (x1) or its alternate, t0 (x5).
+static inline bool IsLinkRegister(uint8_t reg)
+{
+    return reg == 1 || reg == 5;
+}
+
+// Predicts the block at the target of the jal, jalr or jr that ends the given block and has just been run, returning it if the
+// prediction was correct. Otherwise returns NULL and sets *miss to where the target should be recorded for next time, or NULL if
+// there is nowhere to record it.
+//
+// Calls push their return address onto the return address stack, and returns pop it. The popped entry leads to the block that made
+// the call, and that block remembers where its calls return to, so a function that is called from many places returns to each of
+// them without a lookup. Other jumps through jalr are predicted by a direct-mapped cache of recent targets. Jumps through jal
+// always go to the same place, so they are left to the block's links.
+static inline struct Block* PredictJump(ArvissCpu* cpu, struct Block* from, const DecodedInstruction* ins, struct BlockLink** miss)
+{
+    DecodedInstructionCache* cache = cpu->cache;
+    const uint32_t pc = cpu->pc;
+    struct BlockLink* link = NULL;
+    struct Block* predicted = NULL;
+    const uint8_t rd = ins->rd;
+    if (ins->opcode == execJalr || ins->opcode == execJr)
+    {
+        const uint8_t rs1 = ins->rs1;
+        if (IsLinkRegister(rs1) && rs1 != rd)
+        {
+            // It's a return, so pop the return address and see if it leads back to the block that made the call. The stack is
+            // emptied whenever the cache is flushed, so that block is still in the cache.
+            const struct ReturnAddress* ra = &cache->jumps.returnStack[cache->jumps.returnTop];
+            cache->jumps.returnTop = (cache->jumps.returnTop - 1) % RETURN_STACK_DEPTH;
+            if (ra->caller != NULL && ra->pc == pc)
             {
-            case 0x0:
-                // fmadd.s
-                return GenRdRmRs1Rs2Rs3(execFmaddS, ins);
-            default:
-                break;
+                link = &ra->caller->returnLink;
             }
-        case 0x11:
-            switch (Bits(ins, 26, 25))
+            if (link != NULL && link->block != NULL && link->pc == pc)
             {
-            case 0x0:
-                // fmsub.s
-                return GenRdRmRs1Rs2Rs3(execFmsubS, ins);
-            default:
-                break;
+                predicted = link->block;
+                COUNT(&cache->jumps, returnHits, 1);
             }
-        case 0x12:
-            switch (Bits(ins, 26, 25))
+            else
+            {
+                COUNT(&cache->jumps, returnMisses, 1);
+            }
+        }
+        else
+        {
+            link = &cache->jumps.jumpTargets[(pc / 4) % JUMP_TARGET_CACHE_SIZE];
+            if (link->block != NULL && link->pc == pc)
+            {
+                predicted = link->block;
+                COUNT(&cache->jumps, targetHits, 1);
+            }
+            else
+            {
+                COUNT(&cache->jumps, targetMisses, 1);
+            }
+        }
+    }
+
+    if (IsLinkRegister(rd))
+    {
+        // It's a call, so push the return address. A block that has been flushed can't be the caller, as its return link would
+        // outlive it.
+        cache->jumps.returnTop = (cache->jumps.returnTop + 1) % RETURN_STACK_DEPTH;
+        struct Block* caller = from->generation == cache->generation ? from : NULL;
+        cache->jumps.returnStack[cache->jumps.returnTop] = (struct ReturnAddress){.pc = cpu->xreg[rd], .caller = caller};
+    }
+
+    *miss = predicted == NULL ? link : NULL;
+    return predicted;
+}
+
+// Returns the block at the program counter after a jump whose target wasn't predicted, and records it in the given link, if any,
+// so that it will be predicted next time. Returns NULL if the block could not be fetched.
+static inline struct Block* ResolveJump(ArvissCpu* cpu, struct Block* from, struct BlockLink* miss)
+{
+    struct Block* to = NextBlock(cpu, from);
+    if (to != NULL && miss != NULL)
+    {
+        // This is safe even if the lookup flushed the cache, for the same reason that it's safe for NextBlock() to link to it.
+        *miss = (struct BlockLink){.pc = cpu->pc, .block = to};
+    }
+    return to;
+}
+
+#if defined(ARVISS_USE_JIT)
+
+// --- JIT -------------------------------------------------------------------------------------------------------------------------
+//
+// Functions in this section translate blocks into native x86-64 code. A translated block is a function that takes the CPU, runs the
+// whole block, and returns the number of instructions that it retired. The Exec_* functions are the reference for what each
+// instruction does. Instructions that are simple to express natively are translated directly, with guest X registers cached in
+// host registers for the lifetime of the block. Everything else, including memory accesses, is handed to RunOne() with the program
+// counter set exactly as the interpreter would have it, so traps are indistinguishable from those raised by the interpreter.
+
+#define JIT_CACHED_REGS 4                // The number of host registers that can hold guest X registers.
+#define JIT_MAX_INSTRUCTION_BYTES 128    // An upper bound on the native code needed to translate one instruction.
+#define JIT_EXIT_BYTES 15                // The size of the code emitted by JitEmitExit().
+#define JIT_STORE_PC_BYTES 10            // The size of the code emitted by JitEmitStorePc().
+
+// Host (x86-64) registers.
+typedef enum
+{
+    hrRAX = 0,
+    hrRCX = 1,
+    hrRDX = 2,
+    hrRBX = 3, // Holds the CPU pointer throughout a translated block.
+    hrRSI = 6,
+    hrRDI = 7,
+    hrR12 = 12, // R12 to R15 are callee-saved, so they hold guest registers.
+    hrR13 = 13,
+    hrR14 = 14,
+    hrR15 = 15
+} HostReg;
+
+// Host (x86-64) condition codes.
+typedef enum
+{
+    ccB = 0x2,
+    ccAE = 0x3,
+    ccE = 0x4,
+    ccNE = 0x5,
+    ccL = 0xc,
+    ccGE = 0xd
+} HostCond;
+
+typedef struct
+{
+    uint8_t* code; // Where the next byte of native code will be written.
+    struct
+    {
+        int guest;    // The guest X register held in this host register, or 0 if it's free.
+        bool isDirty; // True if the host register has been written to, but the guest register hasn't.
+        uint32_t age; // When the host register was last used, for picking one to evict.
+    } regs[JIT_CACHED_REGS];
+    uint32_t clock; // Incremented whenever a host register is used.
+} JitEmitter;
+
+static inline void JitEmit8(JitEmitter* e, uint8_t byte)
+{
+    *e->code++ = byte;
+}
+
+static inline void JitEmit32(JitEmitter* e, uint32_t word)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        JitEmit8(e, (uint8_t)(word >> (i * 8)));
+    }
+}
+
+static inline void JitEmit64(JitEmitter* e, uint64_t dword)
+{
+    JitEmit32(e, (uint32_t)dword);
+    JitEmit32(e, (uint32_t)(dword >> 32));
+}
+
+// Emits a REX prefix if one is needed to address the given registers, or to use 64-bit operands.
+static inline void JitEmitRex(JitEmitter* e, bool w, int reg, int rm)
+{
+    if (w || reg >= 8 || rm >= 8)
+    {
+        JitEmit8(e, (uint8_t)(0x40 | (w << 3) | ((reg >= 8) << 2) | (rm >= 8)));
+    }
+}
+
+// Emits a ModRM byte for a register to register operation.
+static inline void JitEmitModRmReg(JitEmitter* e, int reg, int rm)
+{
+    JitEmit8(e, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// Emits a ModRM byte and displacement for an operation on a field of the CPU, i.e., [rbx + offset].
+static inline void JitEmitModRmCpu(JitEmitter* e, int reg, size_t offset)
+{
+    JitEmit8(e, (uint8_t)(0x80 | ((reg & 7) << 3) | hrRBX));
+    JitEmit32(e, (uint32_t)offset);
+}
+
+// mov r32, [rbx + offset]
+static inline void JitEmitLoad(JitEmitter* e, int reg, size_t offset)
+{
+    JitEmitRex(e, false, reg, hrRBX);
+    JitEmit8(e, 0x8b);
+    JitEmitModRmCpu(e, reg, offset);
+}
+
+// mov [rbx + offset], r32
+static inline void JitEmitStore(JitEmitter* e, size_t offset, int reg)
+{
+    JitEmitRex(e, false, reg, hrRBX);
+    JitEmit8(e, 0x89);
+    JitEmitModRmCpu(e, reg, offset);
+}
+
+// mov dword [rbx + offset], imm32
+static inline void JitEmitStoreImm(JitEmitter* e, size_t offset, uint32_t imm)
+{
+    JitEmit8(e, 0xc7);
+    JitEmitModRmCpu(e, 0, offset);
+    JitEmit32(e, imm);
+}
+
+// mov dword [rbx + offsetof(pc)], imm32
+static inline void JitEmitStorePc(JitEmitter* e, uint32_t pc)
+{
+    JitEmitStoreImm(e, offsetof(ArvissCpu, pc), pc);
+}
+
+// mov r32, imm32
+static inline void JitEmitMovImm(JitEmitter* e, int reg, uint32_t imm)
+{
+    JitEmitRex(e, false, 0, reg);
+    JitEmit8(e, (uint8_t)(0xb8 | (reg & 7)));
+    JitEmit32(e, imm);
+}
+
+// op r32, r32, where op is one of add (0x01), or (0x09), and (0x21), sub (0x29), xor (0x31), cmp (0x39) or mov (0x89).
+static inline void JitEmitAlu(JitEmitter* e, uint8_t op, int dst, int src)
+{
+    JitEmitRex(e, false, src, dst);
+    JitEmit8(e, op);
+    JitEmitModRmReg(e, src, dst);
+}
+
+// op r32, imm32, where op is one of add (0), or (1), and (4), sub (5), xor (6) or cmp (7).
+static inline void JitEmitAluImm(JitEmitter* e, int op, int reg, uint32_t imm)
+{
+    JitEmitRex(e, false, 0, reg);
+    JitEmit8(e, 0x81);
+    JitEmitModRmReg(e, op, reg);
+    JitEmit32(e, imm);
+}
+
+// op r32, imm8, where op is one of shl (4), shr (5) or sar (7).
+static inline void JitEmitShiftImm(JitEmitter* e, int op, int reg, uint8_t imm)
+{
+    JitEmitRex(e, false, 0, reg);
+    JitEmit8(e, 0xc1);
+    JitEmitModRmReg(e, op, reg);
+    JitEmit8(e, imm);
+}
+
+// op r32, cl, where op is one of shl (4), shr (5) or sar (7). The shift count is masked to 5 bits, as RISC-V requires.
+static inline void JitEmitShiftCl(JitEmitter* e, int op, int reg)
+{
+    JitEmitRex(e, false, 0, reg);
+    JitEmit8(e, 0xd3);
+    JitEmitModRmReg(e, op, reg);
+}
+
+// imul r32, r32
+static inline void JitEmitImul(JitEmitter* e, int dst, int src)
+{
+    JitEmitRex(e, false, dst, src);
+    JitEmit8(e, 0x0f);
+    JitEmit8(e, 0xaf);
+    JitEmitModRmReg(e, dst, src);
+}
+
+// setcc al, then movzx eax, al.
+static inline void JitEmitSetEax(JitEmitter* e, HostCond cc)
+{
+    JitEmit8(e, 0x0f);
+    JitEmit8(e, (uint8_t)(0x90 | cc));
+    JitEmit8(e, 0xc0);
+    JitEmit8(e, 0x0f);
+    JitEmit8(e, 0xb6);
+    JitEmit8(e, 0xc0);
+}
+
+// jcc rel8
+static inline void JitEmitJcc8(JitEmitter* e, HostCond cc, int8_t rel)
+{
+    JitEmit8(e, (uint8_t)(0x70 | cc));
+    JitEmit8(e, (uint8_t)rel);
+}
+
+static inline void JitEmitPush(JitEmitter* e, int reg)
+{
+    JitEmitRex(e, false, 0, reg);
+    JitEmit8(e, (uint8_t)(0x50 | (reg & 7)));
+}
+
+static inline void JitEmitPop(JitEmitter* e, int reg)
+{
+    JitEmitRex(e, false, 0, reg);
+    JitEmit8(e, (uint8_t)(0x58 | (reg & 7)));
+}
+
+// Emits the code that starts a translated block. On entry, rdi holds the CPU.
+static inline void JitEmitEntry(JitEmitter* e)
+{
+    // Save the callee-saved registers that we use. Together with the return address this keeps the stack 16-byte aligned.
+    JitEmitPush(e, hrRBX);
+    JitEmitPush(e, hrR12);
+    JitEmitPush(e, hrR13);
+    JitEmitPush(e, hrR14);
+    JitEmitPush(e, hrR15);
+
+    // mov rbx, rdi
+    JitEmitRex(e, true, hrRDI, hrRBX);
+    JitEmit8(e, 0x89);
+    JitEmitModRmReg(e, hrRDI, hrRBX);
+}
+
+// Emits the code that leaves a translated block, returning the number of instructions that were retired.
+static inline void JitEmitExit(JitEmitter* e, uint32_t retired)
+{
+    JitEmitMovImm(e, hrRAX, retired);
+    JitEmitPop(e, hrR15);
+    JitEmitPop(e, hrR14);
+    JitEmitPop(e, hrR13);
+    JitEmitPop(e, hrR12);
+    JitEmitPop(e, hrRBX);
+    JitEmit8(e, 0xc3); // ret
+}
+
+static inline size_t JitXRegOffset(int reg)
+{
+    return offsetof(ArvissCpu, xreg) + (size_t)reg * sizeof(uint32_t);
+}
+
+static inline int JitHostReg(int index)
+{
+    return hrR12 + index;
+}
+
+// Writes any cached guest registers that have been modified back to the CPU. If forget is true then the host registers are also
+// released, e.g., because the code that follows might change the guest registers behind our back.
+static inline void JitFlushRegs(JitEmitter* e, bool forget)
+{
+    for (int i = 0; i < JIT_CACHED_REGS; i++)
+    {
+        if (e->regs[i].guest != 0 && e->regs[i].isDirty)
+        {
+            JitEmitStore(e, JitXRegOffset(e->regs[i].guest), JitHostReg(i));
+            e->regs[i].isDirty = false;
+        }
+        if (forget)
+        {
+            e->regs[i].guest = 0;
+        }
+    }
+}
+
+// Returns the index of a host register to hold the given guest register, which must not be x0. If the guest register is not
+// already cached then the least recently used host register is evicted to make room for it, and if load is true then the guest
+// register is loaded into it.
+static int JitCacheReg(JitEmitter* e, int guest, bool load)
+{
+    int index = 0;
+    for (int i = 0; i < JIT_CACHED_REGS; i++)
+    {
+        if (e->regs[i].guest == guest)
+        {
+            e->regs[i].age = ++e->clock;
+            return i;
+        }
+        if (e->regs[i].guest == 0 || (e->regs[index].guest != 0 && e->regs[i].age < e->regs[index].age))
+        {
+            index = i;
+        }
+    }
+
+    // Evict the chosen host register's current occupant.
+    if (e->regs[index].guest != 0 && e->regs[index].isDirty)
+    {
+        JitEmitStore(e, JitXRegOffset(e->regs[index].guest), JitHostReg(index));
+    }
+    e->regs[index].guest = guest;
+    e->regs[index].isDirty = false;
+    e->regs[index].age = ++e->clock;
+    if (load)
+    {
+        JitEmitLoad(e, JitHostReg(index), JitXRegOffset(guest));
+    }
+    return index;
+}
+
+// Emits code to put the value of the given guest register into a scratch host register.
+static inline void JitEmitReadXReg(JitEmitter* e, int dst, int guest)
+{
+    if (guest == 0)
+    {
+        JitEmitAlu(e, 0x31, dst, dst); // xor dst, dst
+        return;
+    }
+    JitEmitAlu(e, 0x89, dst, JitHostReg(JitCacheReg(e, guest, true)));
+}
+
+// Emits code to put the value in a scratch host register into the given guest register. Writes to x0 are discarded.
+static inline void JitEmitWriteXReg(JitEmitter* e, int guest, int src)
+{
+    if (guest == 0)
+    {
+        return;
+    }
+    const int index = JitCacheReg(e, guest, false);
+    JitEmitAlu(e, 0x89, JitHostReg(index), src);
+    e->regs[index].isDirty = true;
+}
+
+// rd <- rs1 op rs2
+static inline void JitEmitRegReg(JitEmitter* e, uint8_t op, const DecodedInstruction* ins)
+{
+    JitEmitReadXReg(e, hrRAX, ins->rs1);
+    JitEmitReadXReg(e, hrRCX, ins->rs2);
+    JitEmitAlu(e, op, hrRAX, hrRCX);
+    JitEmitWriteXReg(e, ins->rd, hrRAX);
+}
+
+// rd <- rs1 op imm
+static inline void JitEmitRegImm(JitEmitter* e, int op, const DecodedInstruction* ins)
+{
+    JitEmitReadXReg(e, hrRAX, ins->rs1);
+    JitEmitAluImm(e, op, hrRAX, (uint32_t)ins->imm);
+    JitEmitWriteXReg(e, ins->rd, hrRAX);
+}
+
+// rd <- rs1 shift shamt
+static inline void JitEmitShiftRegImm(JitEmitter* e, int op, const DecodedInstruction* ins)
+{
+    JitEmitReadXReg(e, hrRAX, ins->rs1);
+    JitEmitShiftImm(e, op, hrRAX, (uint8_t)(ins->imm & 0x1f));
+    JitEmitWriteXReg(e, ins->rd, hrRAX);
+}
+
+// rd <- rs1 shift (rs2 % XLEN)
+static inline void JitEmitShiftRegReg(JitEmitter* e, int op, const DecodedInstruction* ins)
+{
+    JitEmitReadXReg(e, hrRAX, ins->rs1);
+    JitEmitReadXReg(e, hrRCX, ins->rs2);
+    JitEmitShiftCl(e, op, hrRAX);
+    JitEmitWriteXReg(e, ins->rd, hrRAX);
+}
+
+// rd <- (rs1 cc rs2) ? 1 : 0
+static inline void JitEmitSetRegReg(JitEmitter* e, HostCond cc, const DecodedInstruction* ins)
+{
+    JitEmitReadXReg(e, hrRAX, ins->rs1);
+    JitEmitReadXReg(e, hrRCX, ins->rs2);
+    JitEmitAlu(e, 0x39, hrRAX, hrRCX); // cmp eax, ecx
+    JitEmitSetEax(e, cc);
+    JitEmitWriteXReg(e, ins->rd, hrRAX);
+}
+
+// rd <- (rs1 cc imm) ? 1 : 0
+static inline void JitEmitSetRegImm(JitEmitter* e, HostCond cc, const DecodedInstruction* ins)
+{
+    JitEmitReadXReg(e, hrRAX, ins->rs1);
+    JitEmitAluImm(e, 7, hrRAX, (uint32_t)ins->imm); // cmp eax, imm
+    JitEmitSetEax(e, cc);
+    JitEmitWriteXReg(e, ins->rd, hrRAX);
+}
+
+// Ends the block with a conditional branch: pc <- pc + ((rs1 cc rs2) ? imm_b : 4)
+static inline void JitEmitBranch(JitEmitter* e, HostCond notTaken, const DecodedInstruction* ins, uint32_t pc, uint32_t retired)
+{
+    JitFlushRegs(e, false);
+    JitEmitReadXReg(e, hrRAX, ins->rs1);
+    JitEmitReadXReg(e, hrRCX, ins->rs2);
+    JitEmitAlu(e, 0x39, hrRAX, hrRCX); // cmp eax, ecx
+    JitEmitStorePc(e, pc + 4);         // This doesn't affect the flags.
+    JitEmitJcc8(e, notTaken, JIT_STORE_PC_BYTES);
+    JitEmitStorePc(e, pc + ins->imm);
+    JitEmitExit(e, retired);
+}
+
+// Emits a call to RunOne() to execute an instruction that isn't translated natively, leaving the block if it traps.
+static inline void JitEmitRunOne(JitEmitter* e, const DecodedInstruction* ins, uint32_t pc, uint32_t retired)
+{
+    JitFlushRegs(e, true);
+    JitEmitStorePc(e, pc);
+
+    // mov rdi, rbx
+    JitEmitRex(e, true, hrRBX, hrRDI);
+    JitEmit8(e, 0x89);
+    JitEmitModRmReg(e, hrRBX, hrRDI);
+
+    // mov rsi, imm64
+    JitEmit8(e, 0x48);
+    JitEmit8(e, 0xb8 | hrRSI);
+    JitEmit64(e, (uint64_t)(uintptr_t)ins);
+
+    // mov rax, imm64
+    JitEmit8(e, 0x48);
+    JitEmit8(e, 0xb8 | hrRAX);
+    JitEmit64(e, (uint64_t)(uintptr_t)RunOne);
+
+    // call rax
+    JitEmit8(e, 0xff);
+    JitEmit8(e, 0xd0);
+
+    // cmp dword [rbx + offsetof(result.type)], rtTRAP, then leave if it's a trap.
+    JitEmit8(e, 0x83);
+    JitEmitModRmCpu(e, 7, offsetof(ArvissCpu, result) + offsetof(ArvissResult, type));
+    JitEmit8(e, rtTRAP);
+    JitEmitJcc8(e, ccNE, JIT_EXIT_BYTES);
+    JitEmitExit(e, retired);
+}
+
+// Emits a check after a store, which is executed by RunOne(), that leaves the block if the store overwrote decoded code. The block
+// cache is flushed when that happens, so the rest of the block, which was translated from what the code used to be, may be stale.
+static inline void JitEmitLeaveIfFlushed(JitEmitter* e, const DecodedInstructionCache* cache, uint32_t generation, uint32_t retired)
+{
+    // mov rax, imm64
+    JitEmit8(e, 0x48);
+    JitEmit8(e, 0xb8 | hrRAX);
+    JitEmit64(e, (uint64_t)(uintptr_t)&cache->generation);
+
+    // cmp dword [rax], imm32, then leave if the generation has moved on. The program counter is already past the store.
+    JitEmit8(e, 0x81);
+    JitEmit8(e, 0x38);
+    JitEmit32(e, generation);
+    JitEmitJcc8(e, ccE, JIT_EXIT_BYTES);
+    JitEmitExit(e, retired);
+}
+
+// Makes the executable memory from the given address onwards writable, so that blocks can be translated into it, or executable, so
+// that they can be run, but never both at once. Returns false if its protection can't be changed.
+static inline bool JitProtect(DecodedInstructionCache* cache, const uint8_t* from, bool writable)
+{
+    const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t offset = (size_t)(from - cache->code) / pageSize * pageSize;
+    return mprotect(cache->code + offset, JIT_CODE_SIZE - offset, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+// Translates the given block into native code. Returns NULL if there isn't enough executable memory left to hold it, or if the
+// memory can't be made writable to hold it or executable to run it.
+static int (*JitTranslate(ArvissCpu* cpu, const struct Block* block))(ArvissCpu* cpu)
+{
+    DecodedInstructionCache* cache = cpu->cache;
+    uint8_t* const start = cache->code + cache->codeUsed;
+    uint8_t* const end = cache->code + JIT_CODE_SIZE;
+    JitEmitter emitter = {.code = start};
+    JitEmitter* e = &emitter;
+
+    if (!JitProtect(cache, start, true))
+    {
+        return NULL;
+    }
+    JitEmitEntry(e);
+
+    const DecodedInstruction* ins = &cache->instructions[block->start];
+    uint32_t pc = block->pc;
+    for (uint32_t i = 0; i <= block->length; i++, ins++, pc += 4)
+    {
+        if (end - e->code < JIT_MAX_INSTRUCTION_BYTES)
+        {
+            JitProtect(cache, start, false);
+            return NULL;
+        }
+
+        switch (ins->opcode)
+        {
+        case execLui:
+            JitEmitMovImm(e, hrRAX, (uint32_t)ins->imm);
+            JitEmitWriteXReg(e, ins->rd, hrRAX);
+            break;
+        case execAuipc:
+            JitEmitMovImm(e, hrRAX, pc + ins->imm);
+            JitEmitWriteXReg(e, ins->rd, hrRAX);
+            break;
+        case execJal:
+        case execJ:
+            JitFlushRegs(e, false);
+            if (ins->rd != 0)
             {
-            case 0x0:
-                // fnmsub.s
-                return GenRdRmRs1Rs2Rs3(execFnmsubS, ins);
-            default:
-                break;
+                JitEmitStoreImm(e, JitXRegOffset(ins->rd), pc + 4);
             }
-        case 0x13:
-            switch (Bits(ins, 26, 25))
+            JitEmitStorePc(e, pc + ins->imm);
+            JitEmitExit(e, i + 1);
+            break;
+        case execJalr:
+        case execJr:
+            JitFlushRegs(e, false);
+            JitEmitReadXReg(e, hrRAX, ins->rs1);
+            JitEmitAluImm(e, 0, hrRAX, (uint32_t)ins->imm); // add eax, imm
+            JitEmitAluImm(e, 4, hrRAX, ~1u);                            // and eax, ~1
+            if (ins->rd != 0)
             {
-            case 0x0:
-                // fnmadd.s
-                return GenRdRmRs1Rs2Rs3(execFnmaddS, ins);
-            default:
-                break;
+                JitEmitStoreImm(e, JitXRegOffset(ins->rd), pc + 4);
             }
-        case 0x14:
-            switch (Bits(ins, 26, 25))
+            JitEmitStore(e, offsetof(ArvissCpu, pc), hrRAX);
+            JitEmitExit(e, i + 1);
+            break;
+        case execBeq:
+            JitEmitBranch(e, ccNE, ins, pc, i + 1);
+            break;
+        case execBne:
+            JitEmitBranch(e, ccE, ins, pc, i + 1);
+            break;
+        case execBlt:
+            JitEmitBranch(e, ccGE, ins, pc, i + 1);
+            break;
+        case execBge:
+            JitEmitBranch(e, ccL, ins, pc, i + 1);
+            break;
+        case execBltu:
+            JitEmitBranch(e, ccAE, ins, pc, i + 1);
+            break;
+        case execBgeu:
+            JitEmitBranch(e, ccB, ins, pc, i + 1);
+            break;
+        case execAddi:
+            JitEmitRegImm(e, 0, ins);
+            break;
+        case execNop:
+            break;
+        case execLi:
+            JitEmitMovImm(e, hrRAX, (uint32_t)ins->imm);
+            JitEmitWriteXReg(e, ins->rd, hrRAX);
+            break;
+        case execMv:
+            JitEmitReadXReg(e, hrRAX, ins->rs1);
+            JitEmitWriteXReg(e, ins->rd, hrRAX);
+            break;
+        case execSlti:
+            JitEmitSetRegImm(e, ccL, ins);
+            break;
+        case execSltiu:
+            JitEmitSetRegImm(e, ccB, ins);
+            break;
+        case execXori:
+            JitEmitRegImm(e, 6, ins);
+            break;
+        case execOri:
+            JitEmitRegImm(e, 1, ins);
+            break;
+        case execAndi:
+            JitEmitRegImm(e, 4, ins);
+            break;
+        case execSlli:
+            JitEmitShiftRegImm(e, 4, ins);
+            break;
+        case execSrli:
+            JitEmitShiftRegImm(e, 5, ins);
+            break;
+        case execSrai:
+            JitEmitShiftRegImm(e, 7, ins);
+            break;
+        case execAdd:
+            JitEmitRegReg(e, 0x01, ins);
+            break;
+        case execSub:
+            JitEmitRegReg(e, 0x29, ins);
+            break;
+        case execMul:
+            JitEmitReadXReg(e, hrRAX, ins->rs1);
+            JitEmitReadXReg(e, hrRCX, ins->rs2);
+            JitEmitImul(e, hrRAX, hrRCX);
+            JitEmitWriteXReg(e, ins->rd, hrRAX);
+            break;
+        case execSll:
+            JitEmitShiftRegReg(e, 4, ins);
+            break;
+        case execSlt:
+            JitEmitSetRegReg(e, ccL, ins);
+            break;
+        case execSltu:
+            JitEmitSetRegReg(e, ccB, ins);
+            break;
+        case execXor:
+            JitEmitRegReg(e, 0x31, ins);
+            break;
+        case execSrl:
+            JitEmitShiftRegReg(e, 5, ins);
+            break;
+        case execSra:
+            JitEmitShiftRegReg(e, 7, ins);
+            break;
+        case execOr:
+            JitEmitRegReg(e, 0x09, ins);
+            break;
+        case execAnd:
+            JitEmitRegReg(e, 0x21, ins);
+            break;
+        case execNextBlock:
+            // The block ended without a jump or branch, so carry on from the next instruction.
+            JitFlushRegs(e, false);
+            JitEmitStorePc(e, pc);
+            JitEmitExit(e, i);
+            break;
+        default:
+            // Everything else is executed by the interpreter. This includes instructions that always trap, and mret, any of which
+            // may be the last instruction in the block.
+            JitEmitRunOne(e, ins, pc, i);
+            if (EndsBlock(ins->opcode))
             {
-            case 0x0:
-                switch (Bits(ins, 14, 12))
-                {
-                case 0x0:
-                    switch (Bits(ins, 31, 27))
-                    {
-                    case 0x4:
-                        // fsgnj.s
-                        return GenRdRs1Rs2(execFsgnjS, ins);
-                    case 0x5:
-                        // fmin.s
-                        return GenRdRs1Rs2(execFminS, ins);
-                    case 0x14:
-                        // fle.s
-                        return GenRdRs1Rs2(execFleS, ins);
-                    case 0x1c:
-                        switch (Bits(ins, 24, 20))
-                        {
-                        case 0x0:
-                            // fmv.x.w
-                            return GenRdRs1(execFmvXW, ins);
-                        default:
-                            break;
-                        }
-                    case 0x1e:
-                        switch (Bits(ins, 24, 20))
-                        {
-                        case 0x0:
-                            // fmv.w.x
-                            return GenRdRs1(execFmvWX, ins);
-                        default:
-                            break;
-                        }
-                    default:
-                        break;
-                    }
-                case 0x1:
-                    switch (Bits(ins, 31, 27))
-                    {
-                    case 0x4:
-                        // fsgnjn.s
-                        return GenRdRs1Rs2(execFsgnjnS, ins);
-                    case 0x5:
-                        // fmax.s
-                        return GenRdRs1Rs2(execFmaxS, ins);
-                    case 0x14:
-                        // flt.s
-                        return GenRdRs1Rs2(execFltS, ins);
-                    case 0x1c:
-                        switch (Bits(ins, 24, 20))
-                        {
-                        case 0x0:
-                            // fclass.s
-                            return GenRdRs1(execFclassS, ins);
-                        default:
-                            break;
-                        }
-                    default:
-                        break;
-                    }
-                case 0x2:
-                    switch (Bits(ins, 31, 27))
-                    {
-                    case 0x4:
-                        // fsgnjx.s
-                        return GenRdRs1Rs2(execFsgnjxS, ins);
-                    case 0x14:
-                        // feq.s
-                        return GenRdRs1Rs2(execFeqS, ins);
-                    default:
-                        break;
-                    }
-                default:
-                    break;
-                }
-                switch (Bits(ins, 31, 27))
-                {
-                case 0x0:
-                    // fadd.s
-                    return GenRdRmRs1Rs2(execFaddS, ins);
-                case 0x1:
-                    // fsub.s
-                    return GenRdRmRs1Rs2(execFsubS, ins);
-                case 0x2:
-                    // fmul.s
-                    return GenRdRmRs1Rs2(execFmulS, ins);
-                case 0x3:
-                    // fdiv.s
-                    return GenRdRmRs1Rs2(execFdivS, ins);
-                case 0xb:
-                    switch (Bits(ins, 24, 20))
-                    {
-                    case 0x0:
-                        // fsqrt.s
-                        return GenRdRmRs1(execFsqrtS, ins);
-                    default:
-                        break;
-                    }
-                case 0x18:
-                    switch (Bits(ins, 24, 20))
-                    {
-                    case 0x0:
-                        // fcvt.w.s
-                        return GenRdRmRs1(execFcvtWS, ins);
-                    case 0x1:
-                        // fcvt.wu.s
-                        return GenRdRmRs1(execFcvtWuS, ins);
-                    default:
-                        break;
-                    }
-                case 0x1a:
-                    switch (Bits(ins, 24, 20))
-                    {
-                    case 0x0:
-                        // fcvt.s.w
-                        return GenRdRmRs1(execFcvtSW, ins);
-                    case 0x1:
-                        // fcvt.s.wu
-                        return GenRdRmRs1(execFcvtSWu, ins);
-                    default:
-                        break;
-                    }
-                default:
-                    break;
-                }
-            default:
-                break;
+                JitEmitExit(e, i + 1);
             }
-        case 0x18:
-            switch (Bits(ins, 14, 12))
+            else if (ins->opcode == execSb || ins->opcode == execSh || ins->opcode == execSw || ins->opcode == execFsw)
             {
-            case 0x0:
-                // beq
-                return GenBimm12hiBimm12loRs1Rs2(execBeq, ins);
-            case 0x1:
-                // bne
-                return GenBimm12hiBimm12loRs1Rs2(execBne, ins);
-            case 0x4:
-                // blt
-                return GenBimm12hiBimm12loRs1Rs2(execBlt, ins);
-            case 0x5:
-                // bge
-                return GenBimm12hiBimm12loRs1Rs2(execBge, ins);
-            case 0x6:
-                // bltu
-                return GenBimm12hiBimm12loRs1Rs2(execBltu, ins);
-            case 0x7:
-                // bgeu
-                return GenBimm12hiBimm12loRs1Rs2(execBgeu, ins);
-            default:
-                break;
+                JitEmitLeaveIfFlushed(e, cache, block->generation, i + 1);
             }
-        case 0x19:
-            switch (Bits(ins, 14, 12))
+            break;
+        }
+
+        if (EndsBlock(ins->opcode) || ins->opcode == execNextBlock)
+        {
+            break;
+        }
+    }
+
+    if (!JitProtect(cache, start, false))
+    {
+        return NULL;
+    }
+    cache->codeUsed += (uint32_t)(e->code - start);
+    return (int (*)(ArvissCpu*))(void*)start;
+}
+
+// Runs up to count instructions, using native code for blocks that have been translated, and returns the number of instructions
+// retired.
+static int RunJit(ArvissCpu* cpu, int count)
+{
+    DecodedInstructionCache* cache = cpu->cache;
+#if defined(ARVISS_USE_FUSION)
+    cache->fuse = false; // The JIT doesn't translate superinstructions.
+#endif
+    int retired = 0;
+    struct Block* block = NULL;
+    struct Block* predicted = NULL;
+    struct BlockLink* miss = NULL;
+    while (retired < count)
+    {
+        block = predicted != NULL ? predicted : ResolveJump(cpu, block, miss);
+        if (block == NULL)
+        {
+            break;
+        }
+        predicted = NULL;
+        miss = NULL;
+
+        // Translate the block once it is hot.
+        if (block->code == NULL && ++block->hits == JIT_THRESHOLD)
+        {
+            block->code = JitTranslate(cpu, block);
+            if (block->code == NULL)
             {
-            case 0x0:
-                // jalr
-                return GenImm12RdRs1(execJalr, ins);
-            default:
-                break;
+                // We've run out of executable memory, so start again.
+                FlushBlocks(cache);
+                block = NULL;
+                continue;
             }
-        case 0x1b:
-            // jal
-            return GenJimm20Rd(execJal, ins);
-        case 0x1c:
-            switch (Bits(ins, 14, 12))
+        }
+
+        if (block->code != NULL && (int)block->length <= count - retired)
+        {
+            retired += block->code(cpu);
+        }
+        else
+        {
+            // Interpret the block, stopping early if we run out of instructions, or if a store flushed the cache.
+            DecodedInstruction* ins = &cache->instructions[block->start];
+            for (; ins->opcode != execNextBlock && retired < count && !ArvissResultIsTrap(cpu->result); ins++)
             {
-            case 0x0:
-                switch (Bits(ins, 31, 20))
+                RunOne(cpu, ins);
+                if (!ArvissResultIsTrap(cpu->result))
+                {
+                    retired++;
+                }
+                if (block->generation != cache->generation)
                 {
-                case 0x0:
-                    switch (Bits(ins, 19, 15))
-                    {
-                    case 0x0:
-                        switch (Bits(ins, 11, 7))
-                        {
-                        case 0x0:
-                            // ecall
-                            return GenNoArgs(execEcall, ins);
-                        default:
-                            break;
-                        }
-                    default:
-                        break;
-                    }
-                case 0x1:
-                    switch (Bits(ins, 19, 15))
-                    {
-                    case 0x0:
-                        switch (Bits(ins, 11, 7))
-                        {
-                        case 0x0:
-                            // ebreak
-                            return GenNoArgs(execEbreak, ins);
-                        default:
-                            break;
-                        }
-                    default:
-                        break;
-                    }
-                case 0x102:
-                    switch (Bits(ins, 19, 15))
-                    {
-                    case 0x0:
-                        switch (Bits(ins, 11, 7))
-                        {
-                        case 0x0:
-                            // sret
-                            return GenNoArgs(execSret, ins);
-                        default:
-                            break;
-                        }
-                    default:
-                        break;
-                    }
-                case 0x302:
-                    switch (Bits(ins, 19, 15))
-                    {
-                    case 0x0:
-                        switch (Bits(ins, 11, 7))
-                        {
-                        case 0x0:
-                            // mret
-                            return GenNoArgs(execMret, ins);
-                        default:
-                            break;
-                        }
-                    default:
-                        break;
-                    }
-                default:
                     break;
                 }
-            default:
+            }
+            if (ins->opcode != execNextBlock && block->generation == cache->generation)
+            {
+                break; // We ran out of instructions or trapped part way through the block.
+            }
+        }
+
+        if (ArvissResultIsTrap(cpu->result))
+        {
+            break;
+        }
+        if (block->generation != cache->generation)
+        {
+            // A store overwrote decoded code and flushed the cache part way through the block, so carry on from the block at the
+            // program counter without predicting anything.
+            continue;
+        }
+
+        // The whole block has run, so if it ended in a jal, jalr or jr then predict where it went.
+        const DecodedInstruction* last = block->length > 0 ? &cache->instructions[block->start + block->length - 1] : NULL;
+        if (last != NULL && (last->opcode == execJal || last->opcode == execJalr || last->opcode == execJr))
+        {
+            predicted = PredictJump(cpu, block, last, &miss);
+        }
+    }
+
+    cpu->busCode = bcOK; // Reset any memory fault.
+    return retired;
+}
+
+#endif
+
+#else
+
+#if CACHE_WAYS > 1
+// Returns the index of the cache line in the owner's set that holds it or, if none of them does, the index of the line that should
+// be replaced by it. This is an invalid line if there is one, otherwise it is the least recently used line in the set.
+static inline uint32_t FindLine(DecodedInstructionCache* cache, uint32_t owner)
+{
+    uint32_t ways;
+    const uint32_t first = FirstLineOfSet(cache, owner, &ways);
+    const uint32_t now = ++cache->clock;
+    for (uint32_t i = first; i < first + ways; i++)
+    {
+        struct CacheLine* line = &cache->line[i];
+        if (line->generation == cache->generation && line->owner == owner)
+        {
+            line->lastUsed = now;
+            return i;
+        }
+    }
+
+    // It's a miss, so find the line to replace.
+    uint32_t found = first;
+    uint32_t oldest = 0;
+    for (uint32_t i = first; i < first + ways; i++)
+    {
+        const struct CacheLine* line = &cache->line[i];
+        const uint32_t age = line->generation == cache->generation ? now - line->lastUsed : UINT32_MAX;
+        if (age > oldest)
+        {
+            oldest = age;
+            found = i;
+        }
+    }
+    cache->line[found].lastUsed = now;
+    return found;
+}
+#endif
+
+#if defined(ARVISS_USE_ADAPTIVE_CACHE)
+// Called every ADAPTIVE_CACHE_INTERVAL lookups. Doubles the number of ways that the cache uses, up to CACHE_WAYS, if too many of
+// the lookups since the last call evicted a line. This changes which set each address maps to, so it invalidates the cache.
+static void AdaptCache(DecodedInstructionCache* cache)
+{
+    if (cache->stats.evictions - cache->evictionsSoFar > ADAPTIVE_CACHE_EVICTIONS && cache->ways < CACHE_WAYS)
+    {
+        cache->ways *= 2;
+        cache->setMask = CACHE_LINES / cache->ways - 1;
+        FlushLines(cache);
+        COUNT(cache, adaptations, 1);
+    }
+    cache->nextCheck = cache->stats.lookups + ADAPTIVE_CACHE_INTERVAL;
+    cache->evictionsSoFar = cache->stats.evictions;
+}
+#endif
+
+// Fills a cache line that has just been given to a new owner. Wherever up to PREDECODE_WORDS instructions can be read in one go,
+// e.g., from one of the memory map's regions, they're decoded straight away, which saves making a call to fetch each of them. The
+// rest of the line is populated with fetch/decode/replace operations which, when called, replace themselves with a decoded version
+// of the instruction at the corresponding address, so that those that can't be fetched only trap if they are run.
+static void FillLine(ArvissCpu* cpu, struct CacheLine* line, uint32_t cacheLine)
+{
+    const uint32_t base = line->owner * CACHE_LINE_LENGTH * 4;
+    for (uint32_t i = 0u; i < CACHE_LINE_LENGTH; i += PREDECODE_WORDS)
+    {
+        const uint32_t count = CACHE_LINE_LENGTH - i < PREDECODE_WORDS ? CACHE_LINE_LENGTH - i : PREDECODE_WORDS;
+        uint32_t words[PREDECODE_WORDS];
+        if (ReadBlock(cpu, base + i * 4, (uint8_t*)words, count * 4, false) == bcOK)
+        {
+            for (uint32_t j = 0u; j < count; j++)
+            {
+                line->instructions[i + j] = Canonicalise(ArvissDecode(words[j]));
+            }
+            COUNT(cpu->cache, decodes, count);
+        }
+        else
+        {
+            for (uint32_t j = 0u; j < count; j++)
+            {
+                line->instructions[i + j] = GenFetchDecodeReplace(execFetchDecodeReplace, cacheLine, i + j);
+            }
+        }
+    }
+#if defined(ARVISS_USE_FUSION)
+    for (uint32_t i = 0u; i + 1 < CACHE_LINE_LENGTH; i++)
+    {
+        Fuse(&line->instructions[i], &line->instructions[i + 1]);
+    }
+#endif
+}
+
+// Returns the decoded instruction at the program counter, filling its cache line if need be. The CPU's cache is passed in, so that
+// the caller can keep it in a register while it runs.
+static inline DecodedInstruction* FetchFromCache(ArvissCpu* cpu, DecodedInstructionCache* cache)
+{
+    COUNT(cache, lookups, 1);
+#if defined(ARVISS_USE_ADAPTIVE_CACHE)
+    if (cache->stats.lookups >= cache->nextCheck)
+    {
+        AdaptCache(cache);
+    }
+#endif
+
+    // Code that's shared with other CPUs is already decoded, so it never needs a cache line.
+    DecodedInstruction* shared = FindSharedCode(cpu, cpu->pc);
+    if (shared != NULL)
+    {
+        return shared;
+    }
+
+    // Use the PC to figure out which cache line we need and where we are in it (the line index).
+    const uint32_t addr = cpu->pc;
+    const uint32_t owner = ((addr / 4) / CACHE_LINE_LENGTH);
+#if CACHE_WAYS > 1
+    const uint32_t cacheLine = FindLine(cache, owner);
+#else
+    const uint32_t cacheLine = owner % CACHE_LINES;
+#endif
+    const uint32_t lineIndex = (addr / 4) % CACHE_LINE_LENGTH;
+    struct CacheLine* line = &cache->line[cacheLine];
+
+    // If we don't own the cache line, or it's invalid, then populate it.
+    if (owner != line->owner || line->generation != cache->generation)
+    {
+        COUNT(cache, misses, 1);
+        COUNT(cache, evictions, line->generation == cache->generation ? 1 : 0);
+
+        line->generation = cache->generation;
+        line->owner = owner;
+        FillLine(cpu, line, cacheLine);
+        MarkCode(cache, owner * CACHE_LINE_LENGTH * 4, CACHE_LINE_LENGTH * 4);
+    }
+
+    return &line->instructions[lineIndex];
+}
+
+#endif
+
+#if defined(ARVISS_USE_THREADED_DISPATCH)
+
+// Runs up to count instructions using threaded dispatch and returns the number of instructions retired. Each decoded instruction's
+// opcode indexes a table of handler addresses, and each handler dispatches directly to the next instruction's handler rather
+// than returning to a central switch. This gives the host's branch predictor one indirect branch per handler to learn from, rather
+// than a single, highly unpredictable one.
+static int RunThreaded(ArvissCpu* cpu, int count)
+{
+    static const void* const handlers[] = {
+            [execIllegalInstruction] = &&do_IllegalInstruction,
+#if defined(ARVISS_BLOCK_CACHE)
+            [execFetchDecodeReplace] = &&do_IllegalInstruction,
+            [execNextBlock] = &&do_NextBlock,
+#else
+            [execFetchDecodeReplace] = &&do_FetchDecodeReplace,
+            [execNextBlock] = &&do_IllegalInstruction,
+#endif
+            [execLui] = &&do_Lui,
+            [execAuipc] = &&do_Auipc,
+            [execJal] = &&do_Jal,
+            [execJalr] = &&do_Jalr,
+            [execBeq] = &&do_Beq,
+            [execBne] = &&do_Bne,
+            [execBlt] = &&do_Blt,
+            [execBge] = &&do_Bge,
+            [execBltu] = &&do_Bltu,
+            [execBgeu] = &&do_Bgeu,
+            [execLb] = &&do_Lb,
+            [execLh] = &&do_Lh,
+            [execLw] = &&do_Lw,
+            [execLbu] = &&do_Lbu,
+            [execLhu] = &&do_Lhu,
+            [execSb] = &&do_Sb,
+            [execSh] = &&do_Sh,
+            [execSw] = &&do_Sw,
+            [execAddi] = &&do_Addi,
+            [execSlti] = &&do_Slti,
+            [execSltiu] = &&do_Sltiu,
+            [execXori] = &&do_Xori,
+            [execOri] = &&do_Ori,
+            [execAndi] = &&do_Andi,
+            [execSlli] = &&do_Slli,
+            [execSrli] = &&do_Srli,
+            [execSrai] = &&do_Srai,
+            [execAdd] = &&do_Add,
+            [execSub] = &&do_Sub,
+            [execMul] = &&do_Mul,
+            [execSll] = &&do_Sll,
+            [execMulh] = &&do_Mulh,
+            [execSlt] = &&do_Slt,
+            [execMulhsu] = &&do_Mulhsu,
+            [execSltu] = &&do_Sltu,
+            [execMulhu] = &&do_Mulhu,
+            [execXor] = &&do_Xor,
+            [execDiv] = &&do_Div,
+            [execSrl] = &&do_Srl,
+            [execSra] = &&do_Sra,
+            [execDivu] = &&do_Divu,
+            [execOr] = &&do_Or,
+            [execRem] = &&do_Rem,
+            [execAnd] = &&do_And,
+            [execRemu] = &&do_Remu,
+            [execFence] = &&do_Fence,
+            [execFenceI] = &&do_FenceI,
+            [execEcall] = &&do_Ecall,
+            [execEbreak] = &&do_Ebreak,
+            [execUret] = &&do_Uret,
+            [execSret] = &&do_Sret,
+            [execMret] = &&do_Mret,
+            [execFlw] = &&do_Flw,
+            [execFsw] = &&do_Fsw,
+            [execFmaddS] = &&do_Fmadd_s,
+            [execFmsubS] = &&do_Fmsub_s,
+            [execFnmsubS] = &&do_Fnmsub_s,
+            [execFnmaddS] = &&do_Fnmadd_s,
+            [execFaddS] = &&do_Fadd_s,
+            [execFsubS] = &&do_Fsub_s,
+            [execFmulS] = &&do_Fmul_s,
+            [execFdivS] = &&do_Fdiv_s,
+            [execFsqrtS] = &&do_Fsqrt_s,
+            [execFsgnjS] = &&do_Fsgnj_s,
+            [execFsgnjnS] = &&do_Fsgnjn_s,
+            [execFsgnjxS] = &&do_Fsgnjx_s,
+            [execFminS] = &&do_Fmin_s,
+            [execFmaxS] = &&do_Fmax_s,
+            [execFcvtWS] = &&do_Fcvt_w_s,
+            [execFcvtWuS] = &&do_Fcvt_wu_s,
+            [execFmvXW] = &&do_Fmv_x_w,
+            [execFclassS] = &&do_Fclass_s,
+            [execFeqS] = &&do_Feq_s,
+            [execFltS] = &&do_Flt_s,
+            [execFleS] = &&do_Fle_s,
+            [execFcvtSW] = &&do_Fcvt_s_w,
+            [execFcvtSWu] = &&do_Fcvt_s_wu,
+            [execFmvWX] = &&do_Fmv_w_x,
+            [execNop] = &&do_Nop,
+            [execLi] = &&do_Li,
+            [execMv] = &&do_Mv,
+            [execJ] = &&do_J,
+            [execJr] = &&do_Jr,
+            [execLbDiscard] = &&do_LbDiscard,
+            [execLhDiscard] = &&do_LhDiscard,
+            [execLwDiscard] = &&do_LwDiscard,
+            [execLuiAddi] = &&do_LuiAddi,
+            [execAuipcAddi] = &&do_AuipcAddi,
+            [execAuipcJalr] = &&do_AuipcJalr,
+            [execSltBne] = &&do_SltBne,
+            [execSltuBne] = &&do_SltuBne,
+            [execLwAdd] = &&do_LwAdd,
+            [execLwAddi] = &&do_LwAddi,
+    };
+
+    // The cache can't be replaced while the CPU is running, so keep it in a register rather than loading it again after each store.
+    DecodedInstructionCache* const cache = cpu->cache;
+#if defined(ARVISS_USE_FUSION)
+    cache->fuse = true;
+#endif
+
+    int retired = 0;
+    DecodedInstruction* ins;
+#if defined(ARVISS_BLOCK_CACHE)
+    struct Block* block = NULL;
+#endif
+
+#if defined(ARVISS_BLOCK_CACHE)
+// Retires the current instruction then dispatches to the next one. Blocks are contiguous, so the next instruction is always the
+// next entry. Blocks that don't end in a jump or a branch end with a marker that looks up the next block.
+#define DISPATCH_NEXT()                                                                                                            \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        if (++retired == count)                                                                                                    \
+        {                                                                                                                          \
+            goto done;                                                                                                             \
+        }                                                                                                                          \
+        ins++;                                                                                                                     \
+        goto* handlers[ins->opcode];                                                                                               \
+    } while (0)
+
+// Retires the current instruction then dispatches to the start of the block at the program counter.
+#define DISPATCH_JUMP()                                                                                                            \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        if (++retired == count)                                                                                                    \
+        {                                                                                                                          \
+            goto done;                                                                                                             \
+        }                                                                                                                          \
+        if ((block = NextBlock(cpu, block)) == NULL)                                                                               \
+        {                                                                                                                          \
+            goto trapped;                                                                                                          \
+        }                                                                                                                          \
+        ins = &cache->instructions[block->start];                                                                             \
+        goto* handlers[ins->opcode];                                                                                               \
+    } while (0)
+
+// Retires a jal or jalr then dispatches to the start of the block at its target, which is predicted if it can be.
+#define DISPATCH_PREDICTED()                                                                                                       \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        struct BlockLink* miss;                                                                                                    \
+        struct Block* predicted = PredictJump(cpu, block, ins, &miss);                                                             \
+        if (++retired == count)                                                                                                    \
+        {                                                                                                                          \
+            goto done;                                                                                                             \
+        }                                                                                                                          \
+        if ((block = predicted != NULL ? predicted : ResolveJump(cpu, block, miss)) == NULL)                                       \
+        {                                                                                                                          \
+            goto trapped;                                                                                                          \
+        }                                                                                                                          \
+        ins = &cache->instructions[block->start];                                                                             \
+        goto* handlers[ins->opcode];                                                                                               \
+    } while (0)
+#else
+// Retires the current instruction then dispatches to the next one, which is the next entry in the cache line unless the program
+// counter has moved into a different cache line.
+#define DISPATCH_NEXT()                                                                                                            \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        if (++retired == count)                                                                                                    \
+        {                                                                                                                          \
+            goto done;                                                                                                             \
+        }                                                                                                                          \
+        ins = ((cpu->pc / 4) % CACHE_LINE_LENGTH) != 0 ? ins + 1 : FetchFromCache(cpu, cache);                                     \
+        goto* handlers[ins->opcode];                                                                                               \
+    } while (0)
+
+// Retires the current instruction then dispatches to the instruction at the program counter, wherever it is.
+#define DISPATCH_JUMP()                                                                                                            \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        if (++retired == count)                                                                                                    \
+        {                                                                                                                          \
+            goto done;                                                                                                             \
+        }                                                                                                                          \
+        ins = FetchFromCache(cpu, cache);                                                                                          \
+        goto* handlers[ins->opcode];                                                                                               \
+    } while (0)
+
+// Only the block cache predicts jumps.
+#define DISPATCH_PREDICTED() DISPATCH_JUMP()
+#endif
+
+// Stops if the current instruction trapped, otherwise behaves like DISPATCH_NEXT().
+#define DISPATCH_CHECKED()                                                                                                         \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        if (ArvissResultIsTrap(cpu->result))                                                                                       \
+        {                                                                                                                          \
+            goto trapped;                                                                                                          \
+        }                                                                                                                          \
+        DISPATCH_NEXT();                                                                                                           \
+    } while (0)
+
+#if defined(ARVISS_BLOCK_CACHE)
+// Stops if the current store trapped. If it overwrote decoded code then it flushed the block cache, and the rest of the block may
+// be stale, so dispatches to the block at the program counter. Otherwise behaves like DISPATCH_NEXT().
+#define DISPATCH_STORED()                                                                                                          \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        if (ArvissResultIsTrap(cpu->result))                                                                                       \
+        {                                                                                                                          \
+            goto trapped;                                                                                                          \
+        }                                                                                                                          \
+        if (block->generation != cache->generation)                                                                                \
+        {                                                                                                                          \
+            DISPATCH_JUMP();                                                                                                       \
+        }                                                                                                                          \
+        DISPATCH_NEXT();                                                                                                           \
+    } while (0)
+#else
+// Cache lines discard overwritten instructions in place, so a store is no different to any other instruction that can trap.
+#define DISPATCH_STORED() DISPATCH_CHECKED()
+#endif
+
+// Runs only the first half of a superinstruction, via its own handler, if there is only room to retire one more instruction.
+#define FUSED_OR(handler)                                                                                                          \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        if (count - retired == 1)                                                                                                  \
+        {                                                                                                                          \
+            goto handler;                                                                                                          \
+        }                                                                                                                          \
+    } while (0)
+
+    if (count <= 0)
+    {
+        goto done;
+    }
+#if defined(ARVISS_BLOCK_CACHE)
+    // Fall through to start at the block at the program counter.
+do_NextBlock:
+    // Move on to the block at the program counter. This doesn't retire anything in its own right.
+    if ((block = NextBlock(cpu, block)) == NULL)
+    {
+        goto trapped;
+    }
+    ins = &cache->instructions[block->start];
+    goto* handlers[ins->opcode];
+#else
+    ins = FetchFromCache(cpu, cache);
+    goto* handlers[ins->opcode];
+
+do_FetchDecodeReplace:
+    // Replace the stub with the decoded instruction, then execute that instead. This doesn't retire anything in its own right.
+    ins = FetchDecodeReplace(cpu, ins);
+    if (ins == NULL)
+    {
+        goto trapped;
+    }
+    goto* handlers[ins->opcode];
+#endif
+
+do_IllegalInstruction:
+    Exec_IllegalInstruction(cpu, ins);
+    goto trapped;
+
+do_Lui:
+    Exec_Lui(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Auipc:
+    Exec_Auipc(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Jal:
+    Exec_Jal(cpu, ins);
+    DISPATCH_PREDICTED();
+
+do_Jalr:
+    Exec_Jalr(cpu, ins);
+    DISPATCH_PREDICTED();
+
+do_Beq:
+    Exec_Beq(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Bne:
+    Exec_Bne(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Blt:
+    Exec_Blt(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Bge:
+    Exec_Bge(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Bltu:
+    Exec_Bltu(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Bgeu:
+    Exec_Bgeu(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Lb:
+    Exec_Lb(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_Lh:
+    Exec_Lh(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_Lw:
+    Exec_Lw(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_Lbu:
+    Exec_Lbu(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_Lhu:
+    Exec_Lhu(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_Sb:
+    Exec_Sb(cpu, ins);
+    DISPATCH_STORED();
+
+do_Sh:
+    Exec_Sh(cpu, ins);
+    DISPATCH_STORED();
+
+do_Sw:
+    Exec_Sw(cpu, ins);
+    DISPATCH_STORED();
+
+do_Addi:
+    Exec_Addi(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Slti:
+    Exec_Slti(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Sltiu:
+    Exec_Sltiu(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Xori:
+    Exec_Xori(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Ori:
+    Exec_Ori(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Andi:
+    Exec_Andi(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Slli:
+    Exec_Slli(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Srli:
+    Exec_Srli(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Srai:
+    Exec_Srai(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Add:
+    Exec_Add(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Sub:
+    Exec_Sub(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Mul:
+    Exec_Mul(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Sll:
+    Exec_Sll(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Mulh:
+    Exec_Mulh(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Slt:
+    Exec_Slt(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Mulhsu:
+    Exec_Mulhsu(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Sltu:
+    Exec_Sltu(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Mulhu:
+    Exec_Mulhu(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Xor:
+    Exec_Xor(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Div:
+    Exec_Div(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Srl:
+    Exec_Srl(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Sra:
+    Exec_Sra(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Divu:
+    Exec_Divu(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Or:
+    Exec_Or(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Rem:
+    Exec_Rem(cpu, ins);
+    DISPATCH_NEXT();
+
+do_And:
+    Exec_And(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Remu:
+    Exec_Remu(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fence:
+    Exec_Fence(cpu, ins);
+    goto trapped;
+
+do_FenceI:
+    Exec_FenceI(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Ecall:
+    Exec_Ecall(cpu, ins);
+    goto trapped;
+
+do_Ebreak:
+    Exec_Ebreak(cpu, ins);
+    goto trapped;
+
+do_Uret:
+    Exec_Uret(cpu, ins);
+    goto trapped;
+
+do_Sret:
+    Exec_Sret(cpu, ins);
+    goto trapped;
+
+do_Mret:
+    Exec_Mret(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Flw:
+    Exec_Flw(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_Fsw:
+    Exec_Fsw(cpu, ins);
+    DISPATCH_STORED();
+
+do_Fmadd_s:
+    Exec_Fmadd_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fmsub_s:
+    Exec_Fmsub_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fnmsub_s:
+    Exec_Fnmsub_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fnmadd_s:
+    Exec_Fnmadd_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fadd_s:
+    Exec_Fadd_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fsub_s:
+    Exec_Fsub_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fmul_s:
+    Exec_Fmul_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fdiv_s:
+    Exec_Fdiv_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fsqrt_s:
+    Exec_Fsqrt_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fsgnj_s:
+    Exec_Fsgnj_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fsgnjn_s:
+    Exec_Fsgnjn_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fsgnjx_s:
+    Exec_Fsgnjx_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fmin_s:
+    Exec_Fmin_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fmax_s:
+    Exec_Fmax_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fcvt_w_s:
+    Exec_Fcvt_w_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fcvt_wu_s:
+    Exec_Fcvt_wu_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fmv_x_w:
+    Exec_Fmv_x_w(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fclass_s:
+    Exec_Fclass_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Feq_s:
+    Exec_Feq_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Flt_s:
+    Exec_Flt_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fle_s:
+    Exec_Fle_s(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fcvt_s_w:
+    Exec_Fcvt_s_w(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fcvt_s_wu:
+    Exec_Fcvt_s_wu(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Fmv_w_x:
+    Exec_Fmv_w_x(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Nop:
+    Exec_Nop(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Li:
+    Exec_Li(cpu, ins);
+    DISPATCH_NEXT();
+
+do_Mv:
+    Exec_Mv(cpu, ins);
+    DISPATCH_NEXT();
+
+do_J:
+    Exec_J(cpu, ins);
+    DISPATCH_JUMP();
+
+do_Jr:
+    Exec_Jr(cpu, ins);
+    DISPATCH_PREDICTED();
+
+do_LbDiscard:
+    Exec_LbDiscard(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_LhDiscard:
+    Exec_LhDiscard(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_LwDiscard:
+    Exec_LwDiscard(cpu, ins);
+    DISPATCH_CHECKED();
+
+do_LuiAddi:
+    FUSED_OR(do_Lui);
+    Exec_Lui(cpu, ins);
+    retired++;
+    Exec_Addi(cpu, ++ins);
+    DISPATCH_NEXT();
+
+do_AuipcAddi:
+    FUSED_OR(do_Auipc);
+    Exec_Auipc(cpu, ins);
+    retired++;
+    Exec_Addi(cpu, ++ins);
+    DISPATCH_NEXT();
+
+do_AuipcJalr:
+    FUSED_OR(do_Auipc);
+    Exec_Auipc(cpu, ins);
+    retired++;
+    Exec_Jalr(cpu, ++ins);
+    DISPATCH_PREDICTED();
+
+do_SltBne:
+    FUSED_OR(do_Slt);
+    Exec_Slt(cpu, ins);
+    retired++;
+    Exec_Bne(cpu, ++ins);
+    DISPATCH_JUMP();
+
+do_SltuBne:
+    FUSED_OR(do_Sltu);
+    Exec_Sltu(cpu, ins);
+    retired++;
+    Exec_Bne(cpu, ++ins);
+    DISPATCH_JUMP();
+
+do_LwAdd:
+    FUSED_OR(do_Lw);
+    Exec_Lw(cpu, ins);
+    if (ArvissResultIsTrap(cpu->result))
+    {
+        goto trapped;
+    }
+    retired++;
+    Exec_Add(cpu, ++ins);
+    DISPATCH_NEXT();
+
+do_LwAddi:
+    FUSED_OR(do_Lw);
+    Exec_Lw(cpu, ins);
+    if (ArvissResultIsTrap(cpu->result))
+    {
+        goto trapped;
+    }
+    retired++;
+    Exec_Addi(cpu, ++ins);
+    DISPATCH_NEXT();
+
+trapped:
+    cpu->busCode = bcOK; // Reset any memory fault.
+
+done:
+    return retired;
+
+#undef DISPATCH_NEXT
+#undef DISPATCH_JUMP
+#undef DISPATCH_PREDICTED
+#undef DISPATCH_CHECKED
+#undef DISPATCH_STORED
+#undef FUSED_OR
+}
+
+#else
+
+// Runs up to count instructions, dispatching each one via RunOne(), and returns the number of instructions retired.
+static int RunSwitched(ArvissCpu* cpu, int count)
+{
+    DecodedInstructionCache* const cache = cpu->cache; // As in RunThreaded(), it can't be replaced while the CPU is running.
+    int retired = 0;
+#if defined(ARVISS_BLOCK_CACHE)
+    struct Block* block = NULL;
+    struct Block* predicted = NULL;
+    struct BlockLink* miss = NULL;
+    DecodedInstruction* decoded = NULL;
+    for (; retired < count; retired++)
+    {
+        // Move on to the next block if we're at the end of the current one.
+        if (decoded == NULL || decoded->opcode == execNextBlock)
+        {
+            if ((block = predicted != NULL ? predicted : ResolveJump(cpu, block, miss)) == NULL)
+            {
+                cpu->busCode = bcOK; // Reset any memory fault.
                 break;
             }
-        default:
+            predicted = NULL;
+            miss = NULL;
+            decoded = &cache->instructions[block->start];
+        }
+        RunOne(cpu, decoded);
+
+        if (ArvissResultIsTrap(cpu->result))
+        {
+            // Stop, as we can no longer proceeed.
+            cpu->busCode = bcOK; // Reset any memory fault.
+            break;
+        }
+
+        if (decoded->opcode == execJal || decoded->opcode == execJalr || decoded->opcode == execJr)
+        {
+            predicted = PredictJump(cpu, block, decoded, &miss);
+        }
+
+        // A store that overwrote decoded code flushed the block cache, and the rest of the block may be stale, so carry on from
+        // the block at the program counter.
+        decoded = block->generation == cache->generation ? decoded + 1 : NULL;
+    }
+#else
+    for (; retired < count; retired++)
+    {
+        DecodedInstruction* decoded = FetchFromCache(cpu, cache); // Fetch a decoded instruction from the decoded instruction cache.
+        RunOne(cpu, decoded);
+
+        if (ArvissResultIsTrap(cpu->result))
+        {
+            // Stop, as we can no longer proceeed.
+            cpu->busCode = bcOK; // Reset any memory fault.
+            break;
+        }
+    }
+#endif
+    return retired;
+}
+
+#endif
+
+// Empties the decoded instruction cache and its counts, e.g., when the CPU is reset.
+static void ResetCache(DecodedInstructionCache* cache)
+{
+#if defined(ARVISS_BLOCK_CACHE)
+    FlushBlocks(cache);
+    cache->jumps.returnTop = 0;
+#if defined(ARVISS_CACHE_STATS)
+    cache->jumps.stats = (ArvissJumpStats){0};
+#endif
+#else
+    FlushLines(cache);
+#if defined(ARVISS_USE_ADAPTIVE_CACHE)
+    cache->ways = 1;
+    cache->setMask = CACHE_LINES - 1;
+    cache->nextCheck = ADAPTIVE_CACHE_INTERVAL;
+    cache->evictionsSoFar = 0;
+#endif
+#endif
+#if defined(ARVISS_CACHE_STATS)
+    cache->stats = (ArvissCacheStats){0};
+#endif
+}
+
+// Allocates the CPU's decoded instruction cache if it doesn't have one yet, and returns false if there's no memory for it. The
+// cache is zeroed, so every line or block in it is from generation 0, and is discarded as soon as the cache moves on to its next
+// generation. Nothing else needs to be written, so the host only allocates the pages of the cache that are actually used.
+static inline bool EnsureCache(ArvissCpu* cpu)
+{
+    if (cpu->cache == NULL)
+    {
+        cpu->cache = calloc(1, sizeof(DecodedInstructionCache));
+        if (cpu->cache == NULL)
+        {
+            return false;
+        }
+        ResetCache(cpu->cache);
+    }
+    return true;
+}
+
+// Runs up to count instructions without the decoded instruction cache, fetching and decoding each one as it's run, and returns the
+// number of instructions retired. This is only used if there's no memory for the cache.
+static int RunUncached(ArvissCpu* cpu, int count)
+{
+    int retired = 0;
+    for (; retired < count; retired++)
+    {
+        const BusResult fetched = Read32(cpu, cpu->pc);
+        if (ArvissBusResultIsFault(fetched))
+        {
+            cpu->result = ArvissMakeTrap(trINSTRUCTION_ACCESS_FAULT, cpu->pc);
+            cpu->busCode = bcOK; // Reset any memory fault.
+            break;
+        }
+        DecodedInstruction decoded = Canonicalise(ArvissDecode(ArvissBusResultAsValue(fetched)));
+        RunOne(cpu, &decoded);
+
+        if (ArvissResultIsTrap(cpu->result))
+        {
+            cpu->busCode = bcOK; // Reset any memory fault.
+            break;
+        }
+    }
+    return retired;
+}
+
+// --- Batches ---------------------------------------------------------------------------------------------------------------------
+//
+// ArvissRunBatch() runs CPUs that share code in lock-step, in batches of up to BATCH_LANES of them. A batch holds its lanes'
+// registers side by side, so that an instruction that several lanes are at is looked up once and executed for all of them by a loop
+// over the lanes that the compiler can turn into vector instructions. The lanes at the lowest program counter are run together,
+// and the others wait. Lanes that take different paths through an if-else have to pass through the same instruction where the
+// paths meet, so the lanes that are behind catch up with the others there, and they carry on together. Instructions that aren't
+// executed lane by lane, such as floating point ones, are run with RunOne() for each lane in turn.
+//
+// While the active lanes are together they share a program counter and a count of the instructions that they've retired, so that
+// running an instruction only has to update its destination register in each lane. The lanes' own program counters and counts
+// are only brought up to date when they split up.
+
+typedef struct
+{
+    uint32_t x[32][BATCH_LANES];   // Each lane's registers, x0-x31, held register by register.
+    uint32_t pc[BATCH_LANES];      // Each lane's program counter, apart from the active lanes' while they're together.
+    int retired[BATCH_LANES];      // How many instructions each lane has retired, likewise.
+    uint32_t active[BATCH_LANES];  // All ones for the lanes that are executing the current instruction, otherwise zero.
+    uint32_t running[BATCH_LANES]; // All ones for the lanes that haven't trapped or retired their count yet, otherwise zero.
+    ArvissCpu* cpu[BATCH_LANES];   // The CPU in each lane, or NULL if the lane isn't used.
+    uint32_t groupPc;              // The program counter of the active lanes while they're together.
+    int groupRetired;              // How many instructions the active lanes have retired since they came together.
+    uint8_t held[31];              // The registers that are held here, other than x0. The others are left in the lanes' CPUs.
+    int numHeld;                   // How many registers are held here.
+} Batch;
+
+// Executes an instruction that only writes to rd, as the given expression of the lane's s1, s2, imm and pc, for the active lanes.
+// The lanes that aren't active keep what they had.
+#define BATCH_ALU(expr)                                                                                                            \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        const uint32_t* const rs1 = b->x[ins->rs1];                                                                                \
+        const uint32_t* const rs2 = b->x[ins->rs2];                                                                                \
+        uint32_t* const rd = b->x[ins->rd];                                                                                        \
+        for (int l = 0; l < BATCH_LANES; l++)                                                                                      \
+        {                                                                                                                          \
+            const uint32_t s1 = rs1[l];                                                                                            \
+            const uint32_t s2 = rs2[l];                                                                                            \
+            (void)s1;                                                                                                              \
+            (void)s2;                                                                                                              \
+            rd[l] = ((uint32_t)(expr) & b->active[l]) | (rd[l] & ~b->active[l]);                                                   \
+        }                                                                                                                          \
+    } while (0)
+
+// Executes a conditional branch for the active lanes, taking it in the lanes where the given expression of s1 and s2 is true.
+#define BATCH_BRANCH(cond)                                                                                                         \
+    do                                                                                                                             \
+    {                                                                                                                              \
+        const uint32_t* const rs1 = b->x[ins->rs1];                                                                                \
+        const uint32_t* const rs2 = b->x[ins->rs2];                                                                                \
+        for (int l = 0; l < BATCH_LANES; l++)                                                                                      \
+        {                                                                                                                          \
+            const uint32_t s1 = rs1[l];                                                                                            \
+            const uint32_t s2 = rs2[l];                                                                                            \
+            target[l] = (cond) ? pc + imm : pc + 4;                                                                                \
+        }                                                                                                                          \
+    } while (0)
+
+// Brings the active lanes' own program counters and counts of retired instructions up to date, so that they can go their own ways.
+static inline void SplitBatch(Batch* b)
+{
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        b->pc[l] = (b->groupPc & b->active[l]) | (b->pc[l] & ~b->active[l]);
+        b->retired[l] += b->groupRetired & (int)b->active[l];
+    }
+    b->groupRetired = 0;
+}
+
+// Moves the active lanes on to the given targets, and returns true if they're still together.
+static inline bool JumpBatch(Batch* b, const uint32_t* target)
+{
+    uint32_t lowest = UINT32_MAX;
+    uint32_t highest = 0;
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        const uint32_t t = target[l] | ~b->active[l];
+        const uint32_t u = target[l] & b->active[l];
+        lowest = t < lowest ? t : lowest;
+        highest = u > highest ? u : highest;
+    }
+    if (lowest == highest)
+    {
+        b->groupPc = lowest;
+        b->groupRetired++;
+        return true;
+    }
+    SplitBatch(b);
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        b->pc[l] = (target[l] & b->active[l]) | (b->pc[l] & ~b->active[l]);
+        b->retired[l] += 1 & (int)b->active[l];
+    }
+    return false;
+}
+
+// Stops a lane at the current instruction because its CPU has trapped there. The CPU's registers are written back when the batch
+// finishes.
+static inline void StopLane(Batch* b, int l)
+{
+    b->pc[l] = b->groupPc;
+    b->retired[l] += b->groupRetired;
+    b->cpu[l]->pc = b->groupPc;
+    b->running[l] = 0;
+    b->active[l] = 0;
+}
+
+// Raises the given trap in each active lane, as an ecall or an ebreak does.
+static inline void TrapBatch(Batch* b, ArvissTrapType trap)
+{
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        if (b->active[l])
+        {
+            StopLane(b, l);
+            b->cpu[l]->result = CreateTrap(b->cpu[l], trap, 0);
+        }
+    }
+}
+
+// Runs an instruction in one lane that has gone its own way with RunOne(), on the lane's CPU, or fetches and decodes it first if it
+// isn't given.
+static void RunLane(Batch* b, int l, const DecodedInstruction* ins)
+{
+    ArvissCpu* cpu = b->cpu[l];
+    for (int i = 0; i < b->numHeld; i++)
+    {
+        cpu->xreg[b->held[i]] = b->x[b->held[i]][l];
+    }
+    cpu->pc = b->pc[l];
+    ArvissCpu* outer = EnterGuard(cpu);
+    DecodedInstruction decoded;
+    if (ins != NULL)
+    {
+        decoded = *ins;
+        RunOne(cpu, &decoded);
+    }
+    else
+    {
+        const BusResult fetched = Read32(cpu, cpu->pc);
+        if (ArvissBusResultIsFault(fetched))
+        {
+            cpu->result = ArvissMakeTrap(trINSTRUCTION_ACCESS_FAULT, cpu->pc);
+        }
+        else
+        {
+            decoded = Canonicalise(ArvissDecode(ArvissBusResultAsValue(fetched)));
+            RunOne(cpu, &decoded);
+        }
+    }
+    LeaveGuard(cpu, outer);
+    for (int i = 0; i < b->numHeld; i++)
+    {
+        b->x[b->held[i]][l] = cpu->xreg[b->held[i]];
+    }
+    b->pc[l] = cpu->pc;
+    if (ArvissResultIsTrap(cpu->result))
+    {
+        cpu->busCode = bcOK; // Reset any memory fault.
+        b->running[l] = 0;
+    }
+    else
+    {
+        b->retired[l]++;
+    }
+}
+
+// Splits up the active lanes and runs the current instruction in each of them in turn.
+static void RunLanes(Batch* b, const DecodedInstruction* ins)
+{
+    SplitBatch(b);
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        if (b->active[l])
+        {
+            RunLane(b, l, ins);
+        }
+    }
+}
+
+// Runs a load or a store in each active lane in turn, on the lane's CPU, and returns true if it faulted in none of them. The lanes
+// in which it faulted are stopped, and the others are split up.
+static bool AccessBatch(Batch* b, const DecodedInstruction* ins)
+{
+    bool together = true;
+    for (int l = 0; l < BATCH_LANES; l++)
+    {
+        if (!b->active[l])
+        {
+            continue;
+        }
+        ArvissCpu* cpu = b->cpu[l];
+        const uint32_t addr = b->x[ins->rs1][l] + ins->imm;
+        const uint32_t value = b->x[ins->rs2][l];
+        ArvissCpu* outer = EnterGuard(cpu);
+        BusResult loaded = ArvissMakeBusValue(0);
+        BusCode stored = bcOK;
+        switch (ins->opcode)
+        {
+        case execLb:
+        case execLbu:
+        case execLbDiscard:
+            loaded = Read8(cpu, addr);
+            break;
+        case execLh:
+        case execLhu:
+        case execLhDiscard:
+            loaded = Read16(cpu, addr);
+            break;
+        case execLw:
+        case execLwDiscard:
+        case execLwAdd:
+        case execLwAddi:
+            loaded = Read32(cpu, addr);
+            break;
+        case execSb:
+            stored = Write8(cpu, addr, value & 0xff);
+            break;
+        case execSh:
+            stored = Write16(cpu, addr, value & 0xffff);
+            break;
+        default: // execSw
+            stored = Write32(cpu, addr, value);
+            break;
+        }
+        LeaveGuard(cpu, outer);
+        if (ArvissBusResultIsFault(loaded) || stored != bcOK)
+        {
+            StopLane(b, l);
+            cpu->result = TakeTrap(cpu, ArvissMakeTrap(stored != bcOK ? trSTORE_ACCESS_FAULT : trLOAD_ACCESS_FAULT, addr));
+            cpu->busCode = bcOK;
+            together = false;
+            continue;
+        }
+        const uint32_t word = ArvissBusResultAsValue(loaded);
+        switch (ins->opcode)
+        {
+        case execLb:
+            b->x[ins->rd][l] = (uint32_t)(int32_t)(int8_t)word;
+            break;
+        case execLh:
+            b->x[ins->rd][l] = (uint32_t)(int32_t)(int16_t)word;
+            break;
+        case execLbu:
+        case execLhu:
+        case execLw:
+        case execLwAdd:
+        case execLwAddi:
+            b->x[ins->rd][l] = word;
+            break;
+        case execSb:
+            InvalidateStore(cpu, addr, 1);
+            break;
+        case execSh:
+            InvalidateStore(cpu, addr, 2);
             break;
+        case execSw:
+            InvalidateStore(cpu, addr, 4);
+            break;
+        default: // Discarded loads.
+            break;
+        }
+    }
+    b->groupPc += 4;
+    b->groupRetired++;
+    if (!together)
+    {
+        SplitBatch(b);
+    }
+    return together;
+}
+
+// Executes the instruction that the active lanes are at, and returns true if they're still together. If they aren't, then they've
+// been split up.
+static bool ExecuteBatch(Batch* b, const DecodedInstruction* ins)
+{
+    const uint32_t pc = b->groupPc;
+    const uint32_t imm = (uint32_t)ins->imm;
+    uint32_t target[BATCH_LANES];
+    switch (ins->opcode)
+    {
+    case execLui:
+    case execLuiAddi: // Superinstructions run one instruction at a time here.
+    case execLi:
+        BATCH_ALU(imm);
+        break;
+    case execAuipc:
+    case execAuipcAddi:
+    case execAuipcJalr:
+        BATCH_ALU(pc + imm);
+        break;
+    case execMv:
+        BATCH_ALU(s1);
+        break;
+    case execAddi:
+        BATCH_ALU(s1 + imm);
+        break;
+    case execSlti:
+        BATCH_ALU((int32_t)s1 < (int32_t)imm);
+        break;
+    case execSltiu:
+        BATCH_ALU(s1 < imm);
+        break;
+    case execXori:
+        BATCH_ALU(s1 ^ imm);
+        break;
+    case execOri:
+        BATCH_ALU(s1 | imm);
+        break;
+    case execAndi:
+        BATCH_ALU(s1 & imm);
+        break;
+    case execSlli:
+        BATCH_ALU(s1 << imm);
+        break;
+    case execSrli:
+        BATCH_ALU(s1 >> imm);
+        break;
+    case execSrai:
+        BATCH_ALU((int32_t)s1 >> imm);
+        break;
+    case execAdd:
+        BATCH_ALU(s1 + s2);
+        break;
+    case execSub:
+        BATCH_ALU(s1 - s2);
+        break;
+    case execMul:
+        BATCH_ALU(s1 * s2);
+        break;
+    case execSll:
+        BATCH_ALU(s1 << (s2 % 32));
+        break;
+    case execMulh:
+        BATCH_ALU(((int64_t)(int32_t)s1 * (int64_t)(int32_t)s2) >> 32);
+        break;
+    case execSlt:
+    case execSltBne:
+        BATCH_ALU((int32_t)s1 < (int32_t)s2);
+        break;
+    case execMulhsu:
+        BATCH_ALU(((int64_t)(int32_t)s1 * (uint64_t)s2) >> 32);
+        break;
+    case execSltu:
+    case execSltuBne:
+        BATCH_ALU(s1 < s2);
+        break;
+    case execMulhu:
+        BATCH_ALU(((uint64_t)s1 * (uint64_t)s2) >> 32);
+        break;
+    case execXor:
+        BATCH_ALU(s1 ^ s2);
+        break;
+    case execSrl:
+        BATCH_ALU(s1 >> (s2 % 32));
+        break;
+    case execSra:
+        BATCH_ALU((int32_t)s1 >> (s2 % 32));
+        break;
+    case execOr:
+        BATCH_ALU(s1 | s2);
+        break;
+    case execAnd:
+        BATCH_ALU(s1 & s2);
+        break;
+    case execNop:
+        break;
+    case execJal:
+        BATCH_ALU(pc + 4);
+        b->groupPc += imm;
+        b->groupRetired++;
+        return true;
+    case execJ:
+        b->groupPc += imm;
+        b->groupRetired++;
+        return true;
+    case execJalr:
+    case execJr:
+        // Work out where each lane goes before rd is written, as rd may be rs1.
+        for (int l = 0; l < BATCH_LANES; l++)
+        {
+            target[l] = (b->x[ins->rs1][l] + imm) & ~1u;
+        }
+        if (ins->opcode == execJalr)
+        {
+            BATCH_ALU(pc + 4);
         }
+        return JumpBatch(b, target);
+    case execBeq:
+        BATCH_BRANCH(s1 == s2);
+        return JumpBatch(b, target);
+    case execBne:
+        BATCH_BRANCH(s1 != s2);
+        return JumpBatch(b, target);
+    case execBlt:
+        BATCH_BRANCH((int32_t)s1 < (int32_t)s2);
+        return JumpBatch(b, target);
+    case execBge:
+        BATCH_BRANCH((int32_t)s1 >= (int32_t)s2);
+        return JumpBatch(b, target);
+    case execBltu:
+        BATCH_BRANCH(s1 < s2);
+        return JumpBatch(b, target);
+    case execBgeu:
+        BATCH_BRANCH(s1 >= s2);
+        return JumpBatch(b, target);
+    case execLb:
+    case execLh:
+    case execLw:
+    case execLbu:
+    case execLhu:
+    case execLbDiscard:
+    case execLhDiscard:
+    case execLwDiscard:
+    case execLwAdd:
+    case execLwAddi:
+    case execSb:
+    case execSh:
+    case execSw:
+        return AccessBatch(b, ins);
+    case execEcall:
+        TrapBatch(b, trENVIRONMENT_CALL_FROM_M_MODE);
+        return false;
+    case execEbreak:
+        TrapBatch(b, trBREAKPOINT);
+        return false;
     default:
-        break;
+        // Anything else, including instructions that may trap, is run lane by lane.
+        RunLanes(b, ins);
+        return false;
     }
-    // Illegal instruction.
-    return GenTrap(execIllegalInstruction, ins);
+    b->groupPc += 4;
+    b->groupRetired++;
+    return true;
 }
 
-static inline DecodedInstruction* FetchFromCache(ArvissCpu* cpu)
+// Runs the lanes of a batch, whose CPUs share the given code, until each of them has trapped or retired count instructions.
+static void RunBatch(Batch* b, const ArvissCode* code, int count)
 {
-    // Use the PC to figure out which cache line we need and where we are in it (the line index).
-    const uint32_t addr = cpu->pc;
-    const uint32_t owner = ((addr / 4) / CACHE_LINE_LENGTH);
-    const uint32_t cacheLine = owner % CACHE_LINES;
-    const uint32_t lineIndex = (addr / 4) % CACHE_LINE_LENGTH;
-    struct CacheLine* line = &cpu->cache.line[cacheLine];
-
-    // If we don't own the cache line, or it's invalid, then populate it.
-    if (owner != line->owner || !line->isValid)
+    for (;;)
     {
-        // Populate this cache line with fetch/decode/replace operations which, when called, replace themselves with a decoded
-        // version of the instruction at the corresponding address. This way we don't incur an overhead for decoding instructions
-        // that are never run.
-        for (uint32_t i = 0u; i < CACHE_LINE_LENGTH; i++)
+        // Bring together the lanes at the lowest program counter, and leave the rest waiting for them. These loops don't branch, so
+        // that they're cheap even when the lanes split up and come together again every few instructions.
+        uint32_t anyRunning = 0;
+        uint32_t pc = UINT32_MAX;
+        for (int l = 0; l < BATCH_LANES; l++)
         {
-            line->instructions[i] = GenFetchDecodeReplace(execFetchDecodeReplace, cacheLine, i);
+            const uint32_t lanePc = b->pc[l] | ~b->running[l];
+            anyRunning |= b->running[l];
+            pc = lanePc < pc ? lanePc : pc;
+        }
+        if (anyRunning == 0)
+        {
+            return;
+        }
+        uint32_t next = UINT32_MAX; // The lowest program counter of the lanes that are waiting.
+        int mostRetired = 0;        // The most instructions that any of the active lanes has retired.
+        for (int l = 0; l < BATCH_LANES; l++)
+        {
+            b->active[l] = b->running[l] & (b->pc[l] == pc ? ~0u : 0u);
+            const uint32_t waitingPc = b->pc[l] | ~(b->running[l] & ~b->active[l]);
+            const int retired = b->retired[l] & (int)b->active[l];
+            next = waitingPc < next ? waitingPc : next;
+            mostRetired = retired > mostRetired ? retired : mostRetired;
+        }
+        const int budget = count - mostRetired; // How many instructions the active lanes can run together.
+        b->groupPc = pc;
+        b->groupRetired = 0;
+
+        // Run them together until they split up or stop, until they've run for long enough, or until they catch up with a lane
+        // that's waiting. If they leave their shared code then they run its instructions one by one.
+        bool together = true;
+        while (together && b->groupRetired < budget && b->groupPc < next)
+        {
+            const uint32_t offset = b->groupPc - code->start;
+            if (offset < code->size)
+            {
+                together = ExecuteBatch(b, &code->instructions[offset / 4]);
+            }
+            else
+            {
+                RunLanes(b, NULL);
+                together = false;
+            }
+        }
+        if (together)
+        {
+            SplitBatch(b);
         }
-        line->isValid = true;
-        line->owner = owner;
-    }
 
-    return &line->instructions[lineIndex];
+        // Stop the lanes that have run for long enough.
+        for (int l = 0; l < BATCH_LANES; l++)
+        {
+            b->running[l] &= b->retired[l] < count ? ~0u : 0u;
+        }
+    }
 }
 
 // --- The Arviss API --------------------------------------------------------------------------------------------------------------
@@ -2436,30 +6562,510 @@ static inline DecodedInstruction* FetchFromCache(ArvissCpu* cpu)
 ArvissResult ArvissRun(ArvissCpu* cpu, int count)
 {
     cpu->result = ArvissMakeOk();
-    int retired = 0;
-    for (; retired < count; retired++)
+    ArvissCpu* outer = EnterGuard(cpu);
+    if (!EnsureCache(cpu))
     {
-        DecodedInstruction* decoded = FetchFromCache(cpu); // Fetch a decoded instruction from the decoded instruction cache.
-        RunOne(cpu, decoded);
+        // Run slowly rather than not at all.
+        cpu->retired = RunUncached(cpu, count);
+        LeaveGuard(cpu, outer);
+        return cpu->result;
+    }
+#if defined(ARVISS_USE_JIT)
+    if (cpu->cache->code != NULL)
+    {
+        cpu->retired = RunJit(cpu, count);
+        LeaveGuard(cpu, outer);
+        return cpu->result;
+    }
+#endif
+#if defined(ARVISS_USE_THREADED_DISPATCH)
+    cpu->retired = RunThreaded(cpu, count);
+#else
+    cpu->retired = RunSwitched(cpu, count);
+#endif
+    LeaveGuard(cpu, outer);
+    return cpu->result;
+}
 
-        if (ArvissResultIsTrap(cpu->result))
+void ArvissRunBatch(ArvissCpu* const* cpus, int n, int count)
+{
+    int first = 0;
+    while (first < n)
+    {
+        // Batch the CPUs that follow this one and share its code. CPUs without shared code are run on their own.
+        const ArvissCode* code = cpus[first]->code;
+        int lanes = 1;
+        while (code != NULL && lanes < BATCH_LANES && first + lanes < n && cpus[first + lanes]->code == code)
         {
-            // Stop, as we can no longer proceeed.
-            cpu->busCode = bcOK; // Reset any memory fault.
-            break;
+            lanes++;
+        }
+        if (lanes == 1)
+        {
+            ArvissRun(cpus[first], count);
+            first++;
+            continue;
+        }
+
+        // Only the registers that the code names are moved into the batch, as the guest can't touch the others while it's in the
+        // code. If it leaves it then its instructions are run lane by lane, on the CPUs, which hold the others.
+        Batch b;
+        b.numHeld = 0;
+        for (int r = 1; r < 32; r++)
+        {
+            if (code->registers & (1u << r))
+            {
+                b.held[b.numHeld++] = (uint8_t)r;
+            }
         }
+        for (int l = 0; l < BATCH_LANES; l++)
+        {
+            ArvissCpu* cpu = l < lanes ? cpus[first + l] : NULL;
+            b.x[0][l] = 0;
+            for (int i = 0; i < b.numHeld; i++)
+            {
+                b.x[b.held[i]][l] = cpu != NULL ? cpu->xreg[b.held[i]] : 0;
+            }
+            b.pc[l] = cpu != NULL ? cpu->pc : 0;
+            b.active[l] = 0;
+            b.running[l] = cpu != NULL && count > 0 ? ~0u : 0u;
+            b.retired[l] = 0;
+            b.cpu[l] = cpu;
+            if (cpu != NULL)
+            {
+                cpu->result = ArvissMakeOk();
+            }
+        }
+
+        RunBatch(&b, code, count);
+
+        for (int l = 0; l < lanes; l++)
+        {
+            ArvissCpu* cpu = b.cpu[l];
+            for (int i = 0; i < b.numHeld; i++)
+            {
+                cpu->xreg[b.held[i]] = b.x[b.held[i]][l];
+            }
+            cpu->pc = b.pc[l];
+            cpu->retired = b.retired[l];
+        }
+        first += lanes;
     }
-    cpu->retired = retired;
-    return cpu->result;
 }
 
 ArvissResult ArvissExecute(ArvissCpu* cpu, uint32_t instruction)
 {
-    DecodedInstruction decoded = ArvissDecode(instruction);
+    DecodedInstruction decoded = Canonicalise(ArvissDecode(instruction));
+    ArvissCpu* outer = EnterGuard(cpu);
     RunOne(cpu, &decoded);
+    LeaveGuard(cpu, outer);
     return cpu->result;
 }
 
+bool ArvissEnableJit(ArvissCpu* cpu, bool enable)
+{
+#if defined(ARVISS_USE_JIT)
+    if (!EnsureCache(cpu))
+    {
+        return false;
+    }
+    if (enable && cpu->cache->code == NULL)
+    {
+        // The memory is only made executable once blocks have been translated into it, as hosts may refuse memory that's writable
+        // and executable at once.
+        void* code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED)
+        {
+            return false;
+        }
+        cpu->cache->code = code;
+    }
+    else if (!enable && cpu->cache->code != NULL)
+    {
+        munmap(cpu->cache->code, JIT_CODE_SIZE);
+        cpu->cache->code = NULL;
+    }
+
+    // Start again with an empty cache, as blocks are decoded differently with and without the JIT.
+    FlushBlocks(cpu->cache);
+    return enable;
+#else
+    (void)cpu;
+    (void)enable;
+    return false;
+#endif
+}
+
+ArvissJumpStats ArvissGetJumpStats(ArvissCpu* cpu)
+{
+#if defined(ARVISS_BLOCK_CACHE) && defined(ARVISS_CACHE_STATS)
+    return cpu->cache != NULL ? cpu->cache->jumps.stats : (ArvissJumpStats){0};
+#else
+    (void)cpu;
+    return (ArvissJumpStats){0};
+#endif
+}
+
+ArvissCacheStats ArvissGetCacheStats(ArvissCpu* cpu)
+{
+#if defined(ARVISS_CACHE_STATS)
+    return cpu->cache != NULL ? cpu->cache->stats : (ArvissCacheStats){0};
+#else
+    (void)cpu;
+    return (ArvissCacheStats){0};
+#endif
+}
+
+// Returns true if the given bus has any callbacks.
+static inline bool HasBusCallbacks(const BusV2* bus)
+{
+    return bus->Read8 != NULL || bus->Read16 != NULL || bus->Read32 != NULL || bus->Write8 != NULL || bus->Write16 != NULL
+           || bus->Write32 != NULL || bus->ReadBlock != NULL || bus->WriteBlock != NULL || bus->ZeroBlock != NULL;
+}
+
+// Disables guard pages if the CPU's bus has any callbacks, as accesses to the window bypass the bus.
+static inline void DisableGuardPagesForBus(ArvissCpu* cpu)
+{
+#if defined(ARVISS_USE_GUARD_PAGES)
+    if (cpu->guard.window != NULL && HasBusCallbacks(&cpu->bus))
+    {
+        ArvissEnableGuardPages(cpu, false);
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+void ArvissSetBus(ArvissCpu* cpu, const Bus* bus)
+{
+    cpu->busV1 = *bus;
+    cpu->bus.token.t = cpu;
+    cpu->bus.Read8 = bus->Read8 != NULL ? AdaptRead8 : NULL;
+    cpu->bus.Read16 = bus->Read16 != NULL ? AdaptRead16 : NULL;
+    cpu->bus.Read32 = bus->Read32 != NULL ? AdaptRead32 : NULL;
+    cpu->bus.Write8 = bus->Write8 != NULL ? AdaptWrite8 : NULL;
+    cpu->bus.Write16 = bus->Write16 != NULL ? AdaptWrite16 : NULL;
+    cpu->bus.Write32 = bus->Write32 != NULL ? AdaptWrite32 : NULL;
+    cpu->bus.ReadBlock = bus->ReadBlock != NULL ? AdaptReadBlock : NULL;
+    cpu->bus.WriteBlock = bus->WriteBlock != NULL ? AdaptWriteBlock : NULL;
+    cpu->bus.ZeroBlock = bus->ZeroBlock != NULL ? AdaptZeroBlock : NULL;
+    DisableGuardPagesForBus(cpu);
+}
+
+void ArvissSetBusV2(ArvissCpu* cpu, const BusV2* bus)
+{
+    cpu->bus = *bus;
+    cpu->busV1 = (Bus){0};
+    DisableGuardPagesForBus(cpu);
+}
+
+void ArvissInvalidateRange(ArvissCpu* cpu, uint32_t addr, uint32_t len)
+{
+    if (cpu->cache != NULL)
+    {
+        InvalidateDecoded(cpu, addr, len);
+    }
+}
+
+ArvissCode* ArvissCreateCode(const ArvissMemoryRegion* region)
+{
+    const uint32_t lineSize = CACHE_LINE_LENGTH * 4;
+    if (region->isWritable || region->start % lineSize != 0 || region->size % lineSize != 0 || region->size == 0)
+    {
+        return NULL;
+    }
+    const uint32_t count = region->size / 4;
+    ArvissCode* code = malloc(sizeof(ArvissCode) + count * sizeof(DecodedInstruction));
+    if (code == NULL)
+    {
+        return NULL;
+    }
+    code->refs = 1;
+    code->start = region->start;
+    code->size = region->size;
+    code->instructions = (DecodedInstruction*)(code + 1);
+    code->registers = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t word;
+        memcpy(&word, region->mem + i * 4, sizeof(word));
+        const DecodedInstruction decoded = Canonicalise(ArvissDecode(word));
+        code->instructions[i] = decoded;
+        code->registers |= (1u << (decoded.rd & 31)) | (1u << (decoded.rs1 & 31)) | (1u << (decoded.rs2 & 31));
+    }
+    code->registers &= ~1u;
+#if defined(ARVISS_USE_FUSION) && !defined(ARVISS_BLOCK_CACHE)
+    // Fuse pairs within each cache line, as FillLine() does. Blocks are fused when they're copied, as blocks for the JIT aren't.
+    for (uint32_t i = 0; i + 1 < count; i++)
+    {
+        if ((i + 1) % CACHE_LINE_LENGTH != 0)
+        {
+            Fuse(&code->instructions[i], &code->instructions[i + 1]);
+        }
+    }
+#endif
+    return code;
+}
+
+void ArvissReleaseCode(ArvissCode* code)
+{
+    if (code != NULL && --code->refs == 0)
+    {
+        free(code);
+    }
+}
+
+bool ArvissAttachCode(ArvissCpu* cpu, ArvissCode* code)
+{
+    if (code != NULL)
+    {
+        const ArvissMemoryRegion* region = FindBlockRegion(cpu, code->start, code->size);
+        if (region == NULL || region->start != code->start || region->size != code->size || region->isWritable)
+        {
+            return false;
+        }
+        code->refs++;
+    }
+    ArvissReleaseCode(cpu->code);
+    cpu->code = code;
+    return true;
+}
+
+bool ArvissSetMemoryMap(ArvissCpu* cpu, const ArvissMemoryMap* map)
+{
+    if (map->count < 0 || map->count > MEMORY_MAP_REGIONS)
+    {
+        return false;
+    }
+    for (int i = 0; i < map->count; i++)
+    {
+        if (map->regions[i].size < 4)
+        {
+            return false;
+        }
+    }
+
+#if defined(ARVISS_USE_GUARD_PAGES)
+    // Move the old regions out of the window, and the new ones into it.
+    const bool isGuarded = cpu->guard.window != NULL;
+    ArvissEnableGuardPages(cpu, false);
+#endif
+    if (HasBusCallbacks(&map->busV2))
+    {
+        ArvissSetBusV2(cpu, &map->busV2);
+    }
+    else
+    {
+        ArvissSetBus(cpu, &map->bus);
+    }
+    for (int i = 0; i < map->count; i++)
+    {
+        cpu->memory[i] = map->regions[i];
+    }
+    cpu->memoryRegions = map->count;
+#if defined(ARVISS_USE_GUARD_PAGES)
+    if (isGuarded)
+    {
+        ArvissEnableGuardPages(cpu, true);
+    }
+#endif
+    ArvissFlushTlb(cpu);
+    FlushDecoded(cpu->cache);
+    ArvissAttachCode(cpu, NULL);
+    return true;
+}
+
+uint32_t ArvissRead32(ArvissCpu* cpu, uint32_t addr, BusCode* busCode)
+{
+    ArvissCpu* outer = EnterGuard(cpu);
+    const BusResult loaded = Read32(cpu, addr);
+    LeaveGuard(cpu, outer);
+    if (ArvissBusResultIsFault(loaded))
+    {
+        *busCode = bcLOAD_ACCESS_FAULT;
+    }
+    return ArvissBusResultAsValue(loaded);
+}
+
+void ArvissWrite32(ArvissCpu* cpu, uint32_t addr, uint32_t word, BusCode* busCode)
+{
+    ArvissCpu* outer = EnterGuard(cpu);
+    const BusCode stored = Write32(cpu, addr, word);
+    LeaveGuard(cpu, outer);
+    if (stored != bcOK)
+    {
+        *busCode = bcSTORE_ACCESS_FAULT;
+        return;
+    }
+    InvalidateStore(cpu, addr, 4);
+}
+
+void ArvissReadBlock(ArvissCpu* cpu, uint32_t addr, void* bytes, uint32_t len, BusCode* busCode)
+{
+    ArvissCpu* outer = EnterGuard(cpu);
+    const BusCode loaded = ReadBlock(cpu, addr, (uint8_t*)bytes, len, true);
+    LeaveGuard(cpu, outer);
+    if (loaded != bcOK)
+    {
+        *busCode = bcLOAD_ACCESS_FAULT;
+    }
+}
+
+void ArvissWriteBlock(ArvissCpu* cpu, uint32_t addr, const void* bytes, uint32_t len, BusCode* busCode)
+{
+    ArvissCpu* outer = EnterGuard(cpu);
+    const BusCode stored = WriteBlock(cpu, addr, (const uint8_t*)bytes, len);
+    LeaveGuard(cpu, outer);
+    if (stored != bcOK)
+    {
+        *busCode = bcSTORE_ACCESS_FAULT;
+    }
+    InvalidateBlock(cpu, addr, len);
+}
+
+void ArvissZeroBlock(ArvissCpu* cpu, uint32_t addr, uint32_t len, BusCode* busCode)
+{
+    ArvissCpu* outer = EnterGuard(cpu);
+    const BusCode stored = WriteBlock(cpu, addr, NULL, len);
+    LeaveGuard(cpu, outer);
+    if (stored != bcOK)
+    {
+        *busCode = bcSTORE_ACCESS_FAULT;
+    }
+    InvalidateBlock(cpu, addr, len);
+}
+
+void* ArvissTranslate(ArvissCpu* cpu, uint32_t addr, uint32_t len, ArvissAccess access)
+{
+    const ArvissMemoryRegion* region = FindBlockRegion(cpu, addr, len);
+    if (region == NULL || ((access & acWRITE) != 0 && !region->isWritable))
+    {
+        return NULL;
+    }
+    if ((access & acWRITE) != 0)
+    {
+        InvalidateBlock(cpu, addr, len);
+    }
+    return region->mem + (addr - region->start);
+}
+
+void ArvissFlushTlb(ArvissCpu* cpu)
+{
+#if defined(ARVISS_TLB)
+    FlushTlb(&cpu->tlb);
+#else
+    (void)cpu;
+#endif
+}
+
+ArvissTlbStats ArvissGetTlbStats(ArvissCpu* cpu)
+{
+#if defined(ARVISS_TLB) && defined(ARVISS_CACHE_STATS)
+    return cpu->tlb.stats;
+#else
+    (void)cpu;
+    return (ArvissTlbStats){0};
+#endif
+}
+
+bool ArvissEnableGuardPages(ArvissCpu* cpu, bool enable)
+{
+#if defined(ARVISS_USE_GUARD_PAGES)
+    GuardPages* guard = &cpu->guard;
+    if (enable && guard->window == NULL)
+    {
+        // Accesses are made directly to the window, so a bus would never see them.
+        if (sysconf(_SC_PAGESIZE) != GUARD_PAGE_SIZE || HasBusCallbacks(&cpu->bus))
+        {
+            return false;
+        }
+        for (int i = 0; i < cpu->memoryRegions; i++)
+        {
+            if (cpu->memory[i].start % GUARD_PAGE_SIZE != 0 || cpu->memory[i].size % GUARD_PAGE_SIZE != 0)
+            {
+                return false;
+            }
+        }
+
+        // Reserve the window without committing any memory to it, so that it's all guard pages, along with the pages below it that
+        // hold what faulting stores overwrite, then open up those pages and the regions. The CPU only holds a pointer to them, and
+        // nothing is committed to them until the first such store.
+        const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+        uint8_t* saved = mmap(NULL, GUARD_SAVED_SIZE + GUARD_WINDOW_SIZE, PROT_NONE, flags, -1, 0);
+        if (saved == MAP_FAILED)
+        {
+            return false;
+        }
+        uint8_t* window = saved + GUARD_SAVED_SIZE;
+        bool isOpen = mprotect(saved, GUARD_SAVED_SIZE, PROT_READ | PROT_WRITE) == 0;
+        for (int i = 0; isOpen && i < cpu->memoryRegions; i++)
+        {
+            const ArvissMemoryRegion* region = &cpu->memory[i];
+            isOpen = mprotect(window + region->start, region->size, PROT_READ | PROT_WRITE) == 0;
+        }
+        if (!isOpen || !AcquireGuardHandler())
+        {
+            munmap(saved, GUARD_SAVED_SIZE + GUARD_WINDOW_SIZE);
+            return false;
+        }
+
+        // Move the regions into the window.
+        for (int i = 0; i < cpu->memoryRegions; i++)
+        {
+            ArvissMemoryRegion* region = &cpu->memory[i];
+            memcpy(window + region->start, region->mem, region->size);
+            guard->hostMem[i] = region->mem;
+            region->mem = window + region->start;
+        }
+        for (int i = 0; i < cpu->memoryRegions; i++)
+        {
+            // Overlapping regions were copied in order, so only make read-only regions read-only once they all have been.
+            const ArvissMemoryRegion* region = &cpu->memory[i];
+            if (!region->isWritable)
+            {
+                mprotect(region->mem, region->size, PROT_READ);
+            }
+        }
+        guard->window = window;
+        guard->saved = saved;
+        guard->patches = 0;
+    }
+    else if (!enable && guard->window != NULL)
+    {
+        // Move the regions back to the host memory that they came from.
+        for (int i = 0; i < cpu->memoryRegions; i++)
+        {
+            ArvissMemoryRegion* region = &cpu->memory[i];
+            memcpy(guard->hostMem[i], region->mem, region->size);
+            region->mem = guard->hostMem[i];
+        }
+        munmap(guard->saved, GUARD_SAVED_SIZE + GUARD_WINDOW_SIZE);
+        guard->window = NULL;
+        guard->saved = NULL;
+        ReleaseGuardHandler();
+    }
+
+    // The TLB may hold pages of the regions where they were before.
+    ArvissFlushTlb(cpu);
+    return enable;
+#else
+    (void)cpu;
+    (void)enable;
+    return false;
+#endif
+}
+
+void ArvissRelease(ArvissCpu* cpu)
+{
+    ArvissEnableGuardPages(cpu, false);
+    ArvissAttachCode(cpu, NULL);
+    if (cpu->cache != NULL)
+    {
+        ArvissEnableJit(cpu, false);
+        free(cpu->cache);
+        cpu->cache = NULL;
+    }
+}
+
 void ArvissMret(ArvissCpu* cpu)
 {
     Exec_Mret(cpu, NULL);
@@ -2482,11 +7088,24 @@ void ArvissReset(ArvissCpu* cpu)
     cpu->mcause = 0;
     cpu->mtval = 0;
 
-    // Invalidate the decoded instruction cache.
-    for (int i = 0; i < CACHE_LINES; i++)
+    // Invalidate the decoded instruction cache, if it has been allocated.
+    if (cpu->cache != NULL)
     {
-        cpu->cache.line[i].isValid = false;
+#if defined(ARVISS_BLOCK_CACHE)
+        ClearBlocks(cpu->cache);
+#else
+        ClearLines(cpu->cache);
+#endif
+        ResetCache(cpu->cache);
     }
+
+    // Empty the TLB.
+#if defined(ARVISS_TLB)
+    FlushTlb(&cpu->tlb);
+#if defined(ARVISS_CACHE_STATS)
+    cpu->tlb.stats = (ArvissTlbStats){0};
+#endif
+#endif
 }
 
 #ifdef __cplusplus
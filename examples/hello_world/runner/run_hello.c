@@ -9,100 +9,28 @@
 #define TTY_STATUS IOBASE
 #define TTY_DATA (TTY_STATUS + 1)
 
-static const uint32_t membase = MEMBASE;
-static const uint32_t memsize = MEMSIZE;
-static const uint32_t rambase = RAMBASE;
-static const uint32_t ramsize = RAMSIZE;
+// Memory-mapped I/O. ROM and RAM are in the memory map, so these are only called for addresses outside them. They use the second
+// version of the bus ABI, so they return their bus codes rather than writing them through a pointer.
 
-static uint8_t Read8(BusToken token, uint32_t addr, BusCode* busCode)
+static BusResult Read8(BusToken token, uint32_t addr)
 {
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize)
-    {
-        return memory->mem[addr - membase];
-    }
-
     if (addr == TTY_STATUS)
     {
-        return 0xff; // TODO: return a real status.
+        return ArvissMakeBusValue(0xff); // TODO: return a real status.
     }
 
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
+    return ArvissMakeBusFault(bcLOAD_ACCESS_FAULT);
 }
 
-static uint16_t Read16(BusToken token, uint32_t addr, BusCode* busCode)
+static BusCode Write8(BusToken token, uint32_t addr, uint8_t byte)
 {
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize - 1)
-    {
-        // TODO: implement for big-endian ISAs.
-        const uint16_t* base = (uint16_t*)&memory->mem[addr - membase];
-        return *base;
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static uint32_t Read32(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize - 3)
-    {
-        // TODO: implement for big-endian ISAs.
-        const uint32_t* base = (uint32_t*)&memory->mem[addr - membase];
-        return *base;
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static void Write8(BusToken token, uint32_t addr, uint8_t byte, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize)
-    {
-        memory->mem[addr - membase] = byte;
-        return;
-    }
-
     if (addr == TTY_DATA)
     {
         putchar(byte);
-        return;
-    }
-
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write16(BusToken token, uint32_t addr, uint16_t halfword, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize - 1)
-    {
-        // TODO: implement for big-endian ISAs.
-        uint16_t* base = (uint16_t*)&memory->mem[addr - membase];
-        *base = halfword;
-        return;
-    }
-
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write32(BusToken token, uint32_t addr, uint32_t word, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize - 3)
-    {
-        // TODO: implement for big-endian ISAs.
-        uint32_t* base = (uint32_t*)&memory->mem[addr - membase];
-        *base = word;
-        return;
+        return bcOK;
     }
 
-    *busCode = bcSTORE_ACCESS_FAULT;
+    return bcSTORE_ACCESS_FAULT;
 }
 
 static void ZeroMem(ElfToken token, uint32_t addr, uint32_t len)
@@ -136,15 +64,18 @@ int main(void)
         return -1;
     }
 
-    // Run the program, n instructions at a time.
-    ArvissInit(&cpu,
-               &(Bus){.token = {&memory},
-                      .Read8 = Read8,
-                      .Read16 = Read16,
-                      .Read32 = Read32,
-                      .Write8 = Write8,
-                      .Write16 = Write16,
-                      .Write32 = Write32});
+    // Run the program, n instructions at a time. The CPU accesses ROM and RAM directly, and everything else via the bus.
+    ArvissInitWithMemoryMap(&cpu,
+                            &(ArvissMemoryMap){.regions = (ArvissMemoryRegion[]){{.start = RAMBASE,
+                                                                                  .size = RAMSIZE,
+                                                                                  .mem = &memory.mem[RAMBASE - MEMBASE],
+                                                                                  .isWritable = true},
+                                                                                 {.start = ROM_START,
+                                                                                  .size = ROMSIZE,
+                                                                                  .mem = &memory.mem[ROM_START - MEMBASE],
+                                                                                  .isWritable = false}},
+                                               .count = 2,
+                                               .busV2 = {.Read8 = Read8, .Write8 = Write8}});
     ArvissResult result = ArvissMakeOk();
     while (!ArvissResultIsTrap(result))
     {
@@ -153,6 +84,7 @@ int main(void)
 
     // The exit code (assuming that it exited) is in x10.
     printf("--- Program finished with exit code %d\n", ArvissReadXReg(&cpu, 10));
+    ArvissRelease(&cpu);
 
     return 0;
 }
@@ -10,6 +10,7 @@
 #include "game_loop.h"
 #include "loadelf.h"
 #include "mem.h"
+#include "pool.h"
 #include "raylib.h"
 #include "raymath.h"
 
@@ -46,7 +47,6 @@ typedef enum Syscalls
 
 typedef struct Guest
 {
-    ArvissCpu cpu;
     Memory memory;
     bool bad;
 } Guest;
@@ -65,11 +65,16 @@ static bool board[2][NUM_ROWS * NUM_COLS];
 static int current = 0;
 static int next = 1;
 
-static Guest guests[NUM_ROWS * NUM_COLS];
+static ArvissPool* pool; // Holds the guests, and runs them.
 
 static float updateRate = MAX_UPDATE_RATE / 2.0f;
 static bool isPaused = false;
 
+static inline Guest* GetGuest(int index)
+{
+    return ArvissPoolData(pool, index);
+}
+
 static inline void SetNext(int row, int col, bool value)
 {
     board[next][row * NUM_COLS + col] = value;
@@ -118,44 +123,44 @@ static void PopulateBoard(void)
     }
 }
 
-static inline void SysCountNeighbours(Guest* guest, int row, int col)
+static inline void SysCountNeighbours(ArvissCpu* cpu, int row, int col)
 {
     const int neighbours = CountNeighbours(row, col);
-    ArvissWriteXReg(&guest->cpu, abiA0, (uint32_t)neighbours);
+    ArvissWriteXReg(cpu, abiA0, (uint32_t)neighbours);
 }
 
-static inline void SysGetState(Guest* guest, int row, int col)
+static inline void SysGetState(ArvissCpu* cpu, int row, int col)
 {
     const bool isAlive = GetCurrent(row, col);
-    ArvissWriteXReg(&guest->cpu, abiA0, BoolAsU32(isAlive));
+    ArvissWriteXReg(cpu, abiA0, BoolAsU32(isAlive));
 }
 
-static inline void SysSetState(Guest* guest, int row, int col)
+static inline void SysSetState(ArvissCpu* cpu, int row, int col)
 {
-    const bool isAlive = ArvissReadXReg(&guest->cpu, abiA0) != 0;
+    const bool isAlive = ArvissReadXReg(cpu, abiA0) != 0;
     SetNext(row, col, isAlive);
 }
 
-static void HandleTrap(Guest* guest, const ArvissTrap* trap, int row, int col)
+static void HandleTrap(Guest* guest, ArvissCpu* cpu, const ArvissTrap* trap, int row, int col)
 {
     // Check for a syscall.
     if (trap->mcause == trENVIRONMENT_CALL_FROM_M_MODE)
     {
         // The syscall number is in a7 (x17).
-        const uint32_t syscall = ArvissReadXReg(&guest->cpu, abiA7);
+        const uint32_t syscall = ArvissReadXReg(cpu, abiA7);
 
         // Service the syscall.
         bool syscallHandled = true;
         switch (syscall)
         {
         case SYSCALL_COUNT:
-            SysCountNeighbours(guest, row, col);
+            SysCountNeighbours(cpu, row, col);
             break;
         case SYSCALL_GET_STATE:
-            SysGetState(guest, row, col);
+            SysGetState(cpu, row, col);
             break;
         case SYSCALL_SET_STATE:
-            SysSetState(guest, row, col);
+            SysSetState(cpu, row, col);
             break;
         default:
             // Unknown syscall.
@@ -168,7 +173,7 @@ static void HandleTrap(Guest* guest, const ArvissTrap* trap, int row, int col)
         // If we handled the syscall then perform an MRET so that we can return from the trap.
         if (syscallHandled)
         {
-            ArvissMret(&guest->cpu);
+            ArvissMret(cpu);
         }
     }
     else if (trap->mcause == trILLEGAL_INSTRUCTION)
@@ -184,111 +189,34 @@ static void HandleTrap(Guest* guest, const ArvissTrap* trap, int row, int col)
     }
 }
 
-static void UpdateGuest(Guest* guest, int row, int col)
+// Called by the pool, on whichever of its threads is running the guest. Each guest only writes to its own cell of the next board.
+static bool HandleGuestTrap(void* context, int index, ArvissCpu* cpu, ArvissTrap trap)
 {
-    int remaining = QUANTUM;
-    while (!guest->bad && remaining > 0)
+    (void)context;
+    Guest* guest = GetGuest(index);
+    HandleTrap(guest, cpu, &trap, index / NUM_COLS, index % NUM_COLS);
+    if (guest->bad)
     {
-        ArvissResult result = ArvissRun(&guest->cpu, remaining);
-        if (ArvissResultIsTrap(result))
-        {
-            const ArvissTrap trap = ArvissResultAsTrap(result);
-            HandleTrap(guest, &trap, row, col);
-            if (trap.mcause == trENVIRONMENT_CALL_FROM_M_MODE && ArvissReadXReg(&guest->cpu, abiA7) == SYSCALL_SET_STATE)
-            {
-                // The VM gives up control whenever it sets the state of a cell.
-                break;
-            }
-        }
-        remaining -= guest->cpu.retired;
+        // Stop running the cell altogether.
+        ArvissPoolExit(pool, index);
+        return false;
     }
+
+    // The VM gives up control whenever it sets the state of a cell.
+    const bool isDone = trap.mcause == trENVIRONMENT_CALL_FROM_M_MODE && ArvissReadXReg(cpu, abiA7) == SYSCALL_SET_STATE;
+    return !isDone;
 }
 
 static void Update(void)
 {
-    for (int row = 0; row < NUM_ROWS; row++)
-    {
-        for (int col = 0; col < NUM_COLS; col++)
-        {
-            Guest* guest = &guests[row * NUM_COLS + col];
-            UpdateGuest(guest, row, col);
-        }
-    }
+    // Every cell runs the same program, so the pool runs the cells next to each other in lock-step, on as many threads as the host
+    // has cores, and returns once every cell has set its state.
+    ArvissPoolRun(pool, QUANTUM);
     int t = current;
     current = next;
     next = t;
 }
 
-static uint8_t Read8(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= MEMBASE && addr < MEMBASE + MEMSIZE)
-    {
-        return memory->mem[addr - MEMBASE];
-    }
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static uint16_t Read16(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= MEMBASE && addr < MEMBASE + MEMSIZE - 1)
-    {
-        const uint16_t* base = (uint16_t*)&memory->mem[addr - MEMBASE]; // TODO: implement for big-endian ISAs.
-        return *base;
-    }
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static uint32_t Read32(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= MEMBASE && addr < MEMBASE + MEMSIZE - 3)
-    {
-        const uint32_t* base = (uint32_t*)&memory->mem[addr - MEMBASE]; // TODO: implement for big-endian ISAs.
-        return *base;
-    }
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static void Write8(BusToken token, uint32_t addr, uint8_t byte, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= RAMBASE && addr < RAMBASE + RAMSIZE)
-    {
-        memory->mem[addr - MEMBASE] = byte;
-        return;
-    }
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write16(BusToken token, uint32_t addr, uint16_t halfword, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= RAMBASE && addr < RAMBASE + RAMSIZE - 1)
-    {
-        uint16_t* base = (uint16_t*)&memory->mem[addr - MEMBASE]; // TODO: implement for big-endian ISAs.
-        *base = halfword;
-        return;
-    }
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write32(BusToken token, uint32_t addr, uint32_t word, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= RAMBASE && addr < RAMBASE + RAMSIZE - 3)
-    {
-        uint32_t* base = (uint32_t*)&memory->mem[addr - MEMBASE]; // TODO: implement for big-endian ISAs.
-        *base = word;
-        return;
-    }
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
 static void ZeroMem(ElfToken token, uint32_t addr, uint32_t len)
 {
     uint8_t* target = token.t;
@@ -303,18 +231,27 @@ static void WriteV(ElfToken token, uint32_t addr, void* src, uint32_t len)
 
 static void InitGuests(void)
 {
+    pool = ArvissPoolCreate(NUM_ROWS * NUM_COLS, sizeof(Guest), 0, HandleGuestTrap, NULL);
+    if (pool == NULL)
+    {
+        TraceLog(LOG_ERROR, "--- Failed to create the pool of guests");
+    }
     for (int i = 0; i < NUM_ROWS * NUM_COLS; i++)
     {
-        Guest* guest = &guests[i];
+        Guest* guest = GetGuest(i);
         guest->bad = false;
-        ArvissInit(&guest->cpu,
-                   &(Bus){.token = {&guest->memory},
-                          .Read8 = Read8,
-                          .Read16 = Read16,
-                          .Read32 = Read32,
-                          .Write8 = Write8,
-                          .Write16 = Write16,
-                          .Write32 = Write32});
+        // Cells have no I/O, so the CPU only needs their ROM and RAM, which it accesses directly.
+        Memory* memory = &guest->memory;
+        ArvissInitWithMemoryMap(ArvissPoolCpu(pool, i),
+                                &(ArvissMemoryMap){.regions = (ArvissMemoryRegion[]){{.start = RAMBASE,
+                                                                                      .size = RAMSIZE,
+                                                                                      .mem = &memory->mem[RAMBASE - MEMBASE],
+                                                                                      .isWritable = true},
+                                                                                     {.start = ROM_START,
+                                                                                      .size = ROMSIZE,
+                                                                                      .mem = &memory->mem[ROM_START - MEMBASE],
+                                                                                      .isWritable = false}},
+                                                   .count = 2});
 
         if (i == 0)
         {
@@ -334,9 +271,21 @@ static void InitGuests(void)
         else
         {
             // Clone the remaining guests from the first.
-            memcpy(&guest->memory.mem, &guests[0].memory.mem, MEMSIZE);
+            memcpy(&guest->memory.mem, &GetGuest(0)->memory.mem, MEMSIZE);
         }
     }
+
+    // Every cell runs the same image, so rather than each of them decoding it for itself, they share the code that was decoded
+    // from the first cell's ROM. Once they've all taken a reference to it, it's theirs.
+    ArvissCode* code = ArvissCreateCode(&(ArvissMemoryRegion){.start = ROM_START,
+                                                              .size = ROMSIZE,
+                                                              .mem = &GetGuest(0)->memory.mem[ROM_START - MEMBASE],
+                                                              .isWritable = false});
+    for (int i = 0; i < NUM_ROWS * NUM_COLS; i++)
+    {
+        ArvissAttachCode(ArvissPoolCpu(pool, i), code);
+    }
+    ArvissReleaseCode(code);
 }
 
 static void DrawBoard(void)
@@ -489,6 +438,7 @@ int main(void)
     PopulateBoard();
     RunMainLoop();
 
+    ArvissPoolDestroy(pool);
     CloseWindow();
 
     return 0;
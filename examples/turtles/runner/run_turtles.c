@@ -63,92 +63,6 @@ static const DrawCommand turtleShape[MAX_LINES] = {{MOVE, {-1, 1}},   {LINE, {0,
 
 static void Home(Turtle* turtle);
 
-// --- Bus access ------------------------------------------------------------------------------------------------------------------
-
-static const uint32_t membase = MEMBASE;
-static const uint32_t memsize = MEMSIZE;
-static const uint32_t rambase = RAMBASE;
-static const uint32_t ramsize = RAMSIZE;
-
-static uint8_t Read8(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize)
-    {
-        return memory->mem[addr - membase];
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static uint16_t Read16(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize - 1)
-    {
-        // TODO: implement for big-endian ISAs.
-        const uint16_t* base = (uint16_t*)&memory->mem[addr - membase];
-        return *base;
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static uint32_t Read32(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize - 3)
-    {
-        // TODO: implement for big-endian ISAs.
-        const uint32_t* base = (uint32_t*)&memory->mem[addr - membase];
-        return *base;
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static void Write8(BusToken token, uint32_t addr, uint8_t byte, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize)
-    {
-        memory->mem[addr - membase] = byte;
-        return;
-    }
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write16(BusToken token, uint32_t addr, uint16_t halfword, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize - 1)
-    {
-        // TODO: implement for big-endian ISAs.
-        uint16_t* base = (uint16_t*)&memory->mem[addr - membase];
-        *base = halfword;
-        return;
-    }
-
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write32(BusToken token, uint32_t addr, uint32_t word, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize - 2)
-    {
-        // TODO: implement for big-endian ISAs.
-        uint32_t* base = (uint32_t*)&memory->mem[addr - membase];
-        *base = word;
-        return;
-    }
-
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
 // --- Initialization --------------------------------------------------------------------------------------------------------------
 
 static void ZeroMem(ElfToken token, uint32_t addr, uint32_t len)
@@ -181,20 +95,26 @@ static void LoadCode(Memory* memory, const char* filename)
 
 static void InitTurtle(Turtle* turtle)
 {
-    ArvissInit(&turtle->vm.cpu,
-               &(Bus){.token = {&turtle->vm.memory},
-                      .Read8 = Read8,
-                      .Read16 = Read16,
-                      .Read32 = Read32,
-                      .Write8 = Write8,
-                      .Write16 = Write16,
-                      .Write32 = Write32});
+    // The turtle has no I/O, so the CPU only needs its ROM and RAM, which it accesses directly.
+    Memory* memory = &turtle->vm.memory;
+    ArvissInitWithMemoryMap(&turtle->vm.cpu,
+                            &(ArvissMemoryMap){.regions = (ArvissMemoryRegion[]){{.start = RAMBASE,
+                                                                                  .size = RAMSIZE,
+                                                                                  .mem = &memory->mem[RAMBASE - MEMBASE],
+                                                                                  .isWritable = true},
+                                                                                 {.start = ROM_START,
+                                                                                  .size = ROMSIZE,
+                                                                                  .mem = &memory->mem[ROM_START - MEMBASE],
+                                                                                  .isWritable = false}},
+                                               .count = 2});
     turtle->vm.isBlocked = false;
 
     const char* filename = "../../../../examples/turtles/arviss/bin/turtle";
-    Memory* memory = &turtle->vm.memory;
     LoadCode(memory, filename);
 
+    // Now that the turtle's code is loaded, move its memory behind guard pages if Arviss supports them.
+    ArvissEnableGuardPages(&turtle->vm.cpu, true);
+
     turtle->isActive = true;
 
     Home(turtle);
@@ -211,6 +131,7 @@ static void InitTurtles(Turtle* turtles, int numTurtles)
 
 static void DestroyTurtle(Turtle* turtle)
 {
+    ArvissRelease(&turtle->vm.cpu);
 }
 
 static void DestroyTurtles(Turtle* turtles, int numTurtles)
@@ -418,13 +339,13 @@ static void HandleTrap(Turtle* turtle, const ArvissTrap* trap)
             if (a0 != 0)
             {
                 // Copy the x coordinate into memory at a0 (x10).
-                Write32((BusToken){&turtle->vm.memory}, a0, *(uint32_t*)&turtle->position.x, &mc);
+                ArvissWrite32(&turtle->vm.cpu, a0, *(uint32_t*)&turtle->position.x, &mc);
             }
             uint32_t a1 = ArvissReadXReg(&turtle->vm.cpu, 11);
             if (mc == bcOK && a1 != 0)
             {
                 // Copy the y coordinate into memory at a1 (x11).
-                Write32((BusToken){&turtle->vm.memory}, a1, *(uint32_t*)&turtle->position.y, &mc);
+                ArvissWrite32(&turtle->vm.cpu, a1, *(uint32_t*)&turtle->position.y, &mc);
             }
             // Return success / failure in a0 (x10).
             ArvissWriteXReg(&turtle->vm.cpu, 10, (mc == bcOK));
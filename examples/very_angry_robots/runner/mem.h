@@ -7,8 +7,3 @@
 
 #define MEMBASE ROM_START
 #define MEMSIZE (ROMSIZE + RAMSIZE)
-
-typedef struct
-{
-    uint8_t mem[MEMSIZE];
-} Memory;
@@ -116,9 +116,9 @@ static inline void SysGetMyPosition(Guest* guest, EntityId id)
 
     // The VM address of the structure to place the result is in a0 (x10).
     const uint32_t a0 = ArvissReadXReg(&guest->cpu, abiA0);
+    const uint32_t xy[] = {FloatAsU32(position.x), FloatAsU32(position.y)};
     BusCode mc = bcOK;
-    guest->cpu.bus.Write32(guest->cpu.bus.token, a0, FloatAsU32(position.x), &mc);
-    guest->cpu.bus.Write32(guest->cpu.bus.token, a0 + 4, FloatAsU32(position.y), &mc);
+    ArvissWriteBlock(&guest->cpu, a0, xy, sizeof(xy), &mc);
 }
 
 static inline void SysGetPlayerPosition(Guest* guest, EntityId id)
@@ -127,19 +127,19 @@ static inline void SysGetPlayerPosition(Guest* guest, EntityId id)
 
     // The VM address of the structure to place the result is in a0 (x10).
     const uint32_t a0 = ArvissReadXReg(&guest->cpu, abiA0);
+    const uint32_t xy[] = {FloatAsU32(position.x), FloatAsU32(position.y)};
     BusCode mc = bcOK;
-    guest->cpu.bus.Write32(guest->cpu.bus.token, a0, FloatAsU32(position.x), &mc);
-    guest->cpu.bus.Write32(guest->cpu.bus.token, a0 + 4, FloatAsU32(position.y), &mc);
+    ArvissWriteBlock(&guest->cpu, a0, xy, sizeof(xy), &mc);
 }
 
 static inline void SysFireAt(Guest* guest, EntityId id)
 {
     // The VM address of the structure containing the target is in a0.
     const uint32_t a0 = ArvissReadXReg(&guest->cpu, abiA0);
+    uint32_t xy[2] = {0};
     BusCode mc = bcOK;
-    uint32_t x = guest->cpu.bus.Read32(guest->cpu.bus.token, a0, &mc);
-    uint32_t y = guest->cpu.bus.Read32(guest->cpu.bus.token, a0 + 4, &mc);
-    const Vector2 v = {.x = U32AsFloat(x), .y = U32AsFloat(y)};
+    ArvissReadBlock(&guest->cpu, a0, xy, sizeof(xy), &mc);
+    const Vector2 v = {.x = U32AsFloat(xy[0]), .y = U32AsFloat(xy[1])};
     FireAt(id, v);
 }
 
@@ -147,10 +147,10 @@ static inline void SysMoveTowards(Guest* guest, EntityId id)
 {
     // The VM address of the structure containing the target is in a0.
     const uint32_t a0 = ArvissReadXReg(&guest->cpu, abiA0);
+    uint32_t xy[2] = {0};
     BusCode mc = bcOK;
-    uint32_t x = guest->cpu.bus.Read32(guest->cpu.bus.token, a0, &mc);
-    uint32_t y = guest->cpu.bus.Read32(guest->cpu.bus.token, a0 + 4, &mc);
-    const Vector2 v = {.x = U32AsFloat(x), .y = U32AsFloat(y)};
+    ArvissReadBlock(&guest->cpu, a0, xy, sizeof(xy), &mc);
+    const Vector2 v = {.x = U32AsFloat(xy[0]), .y = U32AsFloat(xy[1])};
     MoveTowards(id, v);
 }
 
@@ -164,10 +164,10 @@ static inline void SysRaycastTowards(Guest* guest, EntityId id)
 {
     // The VM address of the structure containing the target is in a0.
     const uint32_t a0 = ArvissReadXReg(&guest->cpu, abiA0);
+    uint32_t xy[2] = {0};
     BusCode mc = bcOK;
-    uint32_t x = guest->cpu.bus.Read32(guest->cpu.bus.token, a0, &mc);
-    uint32_t y = guest->cpu.bus.Read32(guest->cpu.bus.token, a0 + 4, &mc);
-    const Vector2 v = {.x = U32AsFloat(x), .y = U32AsFloat(y)};
+    ArvissReadBlock(&guest->cpu, a0, xy, sizeof(xy), &mc);
+    const Vector2 v = {.x = U32AsFloat(xy[0]), .y = U32AsFloat(xy[1])};
     // The maximum distance is a float held in a1.
     const uint32_t distance = ArvissReadXReg(&guest->cpu, abiA1);
     const bool hit = RaycastTowards(id, v, U32AsFloat(distance));
@@ -2,135 +2,61 @@
 
 #include "raylib.h"
 
-#include <string.h>
-
 #define MAX_GUESTS 64
 
 static GuestId guestsByEntity[MAX_ENTITIES];
+static ArvissCode* robotCode; // The code that every robot runs, decoded once and shared between them.
 static struct
 {
     bool allocated;
     Guest guest;
 } guests[MAX_GUESTS];
 
-static const uint32_t membase = MEMBASE;
-static const uint32_t memsize = MEMSIZE;
-static const uint32_t rambase = RAMBASE;
-static const uint32_t ramsize = RAMSIZE;
-
-static uint8_t Read8(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize)
-    {
-        return memory->mem[addr - membase];
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static uint16_t Read16(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize - 1)
-    {
-        // TODO: implement for big-endian ISAs.
-        const uint16_t* base = (uint16_t*)&memory->mem[addr - membase];
-        return *base;
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static uint32_t Read32(BusToken token, uint32_t addr, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= membase && addr < membase + memsize - 3)
-    {
-        // TODO: implement for big-endian ISAs.
-        const uint32_t* base = (uint32_t*)&memory->mem[addr - membase];
-        return *base;
-    }
-
-    *busCode = bcLOAD_ACCESS_FAULT;
-    return 0;
-}
-
-static void Write8(BusToken token, uint32_t addr, uint8_t byte, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize)
-    {
-        memory->mem[addr - membase] = byte;
-        return;
-    }
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write16(BusToken token, uint32_t addr, uint16_t halfword, BusCode* busCode)
-{
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize - 1)
-    {
-        // TODO: implement for big-endian ISAs.
-        uint16_t* base = (uint16_t*)&memory->mem[addr - membase];
-        *base = halfword;
-        return;
-    }
-
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void Write32(BusToken token, uint32_t addr, uint32_t word, BusCode* busCode)
+static void Init(Guest* guest)
 {
-    Memory* memory = (Memory*)(token.t);
-    if (addr >= rambase && addr < rambase + ramsize - 2)
+    // Robots have no I/O, so the CPU only needs their ROM and RAM, which it accesses directly. They're held in sparse memory, so
+    // only the pages that a robot actually uses take up any host memory.
+    SparseMem* memory = &guest->memory;
+    if (!SparseMemInit(memory, MEMBASE, MEMSIZE, SM_NONE))
     {
-        // TODO: implement for big-endian ISAs.
-        uint32_t* base = (uint32_t*)&memory->mem[addr - membase];
-        *base = word;
+        TraceLog(LOG_WARNING, "--- Failed to allocate memory for a robot");
         return;
     }
-
-    *busCode = bcSTORE_ACCESS_FAULT;
-}
-
-static void ZeroMem(ElfToken token, uint32_t addr, uint32_t len)
-{
-    uint8_t* target = token.t;
-    memset(target + addr, 0, len);
-}
-
-static void WriteV(ElfToken token, uint32_t addr, void* src, uint32_t len)
-{
-    uint8_t* target = token.t;
-    memcpy(target + addr, src, len);
-}
-
-static void Init(Guest* guest)
-{
-    ArvissInit(&guest->cpu,
-               &(Bus){.token = {&guest->memory},
-                      .Read8 = Read8,
-                      .Read16 = Read16,
-                      .Read32 = Read32,
-                      .Write8 = Write8,
-                      .Write16 = Write16,
-                      .Write32 = Write32});
+    ArvissInitWithMemoryMap(&guest->cpu,
+                            &(ArvissMemoryMap){.regions = (ArvissMemoryRegion[]){{.start = RAMBASE,
+                                                                                  .size = RAMSIZE,
+                                                                                  .mem = &memory->mem[RAMBASE - MEMBASE],
+                                                                                  .isWritable = true},
+                                                                                 {.start = ROM_START,
+                                                                                  .size = ROMSIZE,
+                                                                                  .mem = &memory->mem[ROM_START - MEMBASE],
+                                                                                  .isWritable = false}},
+                                               .count = 2});
 
     const char* filename = "../../../../examples/very_angry_robots/arviss/bin/robot";
     if (LoadElf(filename,
-                &(ElfLoaderConfig){.token = {&guest->memory.mem},
-                                   .zeroMemFn = ZeroMem,
-                                   .writeMemFn = WriteV,
+                &(ElfLoaderConfig){.token = {memory},
+                                   .zeroMemFn = SparseMemElfZero,
+                                   .writeMemFn = SparseMemElfWrite,
                                    .targetSegments = (ElfSegmentDescriptor[]){{.start = ROM_START, .size = ROMSIZE},
                                                                               {.start = RAMBASE, .size = RAMSIZE}},
                                    .numSegments = 2}))
     {
         TraceLog(LOG_WARNING, "--- Failed to load %s", filename);
     }
+
+    // Every robot runs the same image, so share the code that was decoded from the first one's ROM.
+    if (robotCode == NULL)
+    {
+        robotCode = ArvissCreateCode(&(ArvissMemoryRegion){.start = ROM_START,
+                                                           .size = ROMSIZE,
+                                                           .mem = &memory->mem[ROM_START - MEMBASE],
+                                                           .isWritable = false});
+    }
+    ArvissAttachCode(&guest->cpu, robotCode);
+
+    // Robots don't use guard pages, even where Arviss supports them. Enabling them would copy all of a robot's memory into its
+    // window, which would take up host memory for every page of it, and undo what sparse memory saves.
 }
 
 void ClearGuests(void)
@@ -141,6 +67,11 @@ void ClearGuests(void)
     }
     for (int i = 0; i < MAX_GUESTS; i++)
     {
+        if (guests[i].allocated)
+        {
+            ArvissRelease(&guests[i].guest.cpu);
+            SparseMemFree(&guests[i].guest.memory);
+        }
         guests[i].allocated = false;
     }
 }
@@ -148,6 +79,8 @@ void ClearGuests(void)
 void FreeGuest(EntityId id)
 {
     GuestId guestId = guestsByEntity[id.id];
+    ArvissRelease(&guests[guestId.id].guest.cpu);
+    SparseMemFree(&guests[guestId.id].guest.memory);
     guests[guestId.id].allocated = false;
     guestsByEntity[id.id].id = -1;
 }
@@ -4,6 +4,7 @@
 #include "entities.h"
 #include "loadelf.h"
 #include "mem.h"
+#include "sparsemem.h"
 #include "types.h"
 
 #include <stdbool.h>
@@ -16,7 +17,7 @@ typedef struct GuestId
 typedef struct Guest
 {
     ArvissCpu cpu;
-    Memory memory;
+    SparseMem memory;
 } Guest;
 
 void ClearGuests(void);
@@ -0,0 +1,799 @@
+#include "pool.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__STDC_NO_ATOMICS__)
+#define POOL_USE_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#endif
+
+// The most guests that a thread takes from its share at a time. They're run together, so that guests that share code are run in
+// lock-step, and the thread only goes back to its share once it has finished with all of them.
+#define POOL_CHUNK (4 * BATCH_LANES)
+
+// A guest that keeps using its whole budget has its share halved for each run in a row that it does so, down to this many halvings.
+#define POOL_MAX_PENALTY 3
+
+// A thread's share of the guests is a range of them, which it takes guests from the start of, and other threads steal guests from
+// the end of. Both ends are held in one word, so that taking and stealing are both a single compare-and-swap.
+#if defined(POOL_USE_THREADS)
+typedef _Atomic uint64_t Range;
+#define LoadRange(r) atomic_load(r)
+#define StoreRange(r, v) atomic_store(r, v)
+#define SwapRange(r, expected, v) atomic_compare_exchange_weak(r, expected, v)
+#else
+typedef uint64_t Range;
+#define LoadRange(r) (*(r))
+#define StoreRange(r, v) (*(r) = (v))
+#define SwapRange(r, expected, v) (*(r) = (v), true)
+#endif
+
+// Threads count the guests that defer effects as they first do so in each epoch, so that only those guests' effects are visited.
+#if defined(POOL_USE_THREADS)
+typedef atomic_int Count;
+#define LoadCount(c) atomic_load(c)
+#define StoreCount(c, v) atomic_store(c, v)
+#define IncrementCount(c) atomic_fetch_add(c, 1)
+#else
+typedef int Count;
+#define LoadCount(c) (*(c))
+#define StoreCount(c, v) (*(c) = (v))
+#define IncrementCount(c) ((*(c))++)
+#endif
+
+// The records of deferred effects are aligned so that their data can hold anything.
+#define EFFECT_ALIGN (sizeof(max_align_t))
+
+#define MakeRange(begin, end) (((uint64_t)(uint32_t)(end) << 32) | (uint32_t)(begin))
+#define RangeBegin(r) ((int)(uint32_t)(r))
+#define RangeEnd(r) ((int)(uint32_t)((r) >> 32))
+
+// A thread that runs guests. The first worker is the thread that calls ArvissPoolRun(). Each worker has a cache line to itself, as
+// other workers steal from its range.
+typedef struct Worker
+{
+    ARVISS_ALIGNED(HOST_CACHE_LINE_SIZE) Range range; // The guests that this worker has yet to run.
+    ArvissPool* pool;                                 // The pool that the worker belongs to.
+    int index;                                        // The worker's index in the pool.
+#if defined(POOL_USE_THREADS)
+    pthread_t thread; // The worker's thread, unless it's the first worker.
+#endif
+} Worker;
+
+// The header of each deferred effect's record, which is followed by its data.
+typedef struct EffectHeader
+{
+    ArvissPoolEffect effect; // The effect.
+    size_t len;              // The length of its data.
+} EffectHeader;
+
+// The effects that a guest's trap handler has deferred until the end of the epoch. Only the thread that is running the guest adds
+// to them, so they need no locking.
+typedef struct Effects
+{
+    uint8_t* records; // The effects' records, one after another.
+    size_t size;      // The number of bytes of records.
+    size_t capacity;  // The number of bytes allocated for records.
+} Effects;
+
+// How a guest is scheduled. Only the thread that is running the guest changes it during a run.
+typedef struct Schedule
+{
+    ArvissPoolGuestState state; // Whether the guest is runnable, and if not, what it's waiting for.
+    bool isReady;               // True if the guest is in the ready queue, or is about to be added to it.
+    uint64_t until;             // The epoch that a sleeping guest is woken at.
+    int weight;                 // The guest's share of each run, in quanta.
+    int share;                  // Its share of the current run, after any penalty.
+    ArvissPoolStats stats;      // How it has been scheduled.
+} Schedule;
+
+// A sleeping guest, and the epoch that it's woken at.
+typedef struct Sleeper
+{
+    uint64_t until; // The epoch.
+    int guest;      // The guest.
+} Sleeper;
+
+struct ArvissPool
+{
+    uint8_t* guests;               // Each guest's CPU, followed by the host's state for it.
+    Worker* workers;               // The workers.
+    Effects* effects;              // The effects that each guest has deferred.
+    int* deferring;                // The guests that have deferred effects in the current epoch, in the order that they first did.
+    Count numDeferring;            // The number of guests that have deferred effects in the current epoch.
+    Schedule* schedules;           // How each guest is scheduled.
+    int* ready;                    // The ready queue, which holds the guests that are run in the current run, in order of guest.
+    int* woken;                    // The guests that have become runnable since the ready queue was last brought up to date.
+    Sleeper* sleepers;             // A min-heap of the sleeping guests, ordered by the epoch that they're woken at.
+    int numReady;                  // The number of guests in the ready queue.
+    int numWoken;                  // The number of guests that have become runnable.
+    int numSleepers;               // The number of sleepers, some of which may have been woken already.
+    int maxSleepers;               // The number of sleepers that there's room for.
+    uint64_t epoch;                // The number of runs that have started.
+    void* guestBlock;              // The allocation that the guests are aligned within.
+    void* workerBlock;             // The allocation that the workers are aligned within.
+    size_t guestSize;              // The size of each guest, rounded up to a whole number of cache lines.
+    int numGuests;                 // The number of guests.
+    int numWorkers;                // The number of workers.
+    int quantum;                   // How many instructions a guest of weight 1 is run for in the current call to ArvissPoolRun().
+    ArvissPoolTrapHandler handler; // Called when a guest traps.
+    void* context;                 // Passed to the trap handler.
+#if defined(POOL_USE_THREADS)
+    pthread_mutex_t lock;    // Guards everything below.
+    pthread_cond_t started;  // Signalled when a run starts, or the pool is destroyed.
+    pthread_cond_t finished; // Signalled when the last worker finishes a run.
+    unsigned generation;     // Incremented each time that a run starts.
+    int busy;                // The number of workers, other than the first, that haven't finished the current run.
+    bool isStopping;         // True if the pool is being destroyed.
+#endif
+};
+
+// Allocates count zeroed elements of the given size, aligned to a host cache line. The allocation to free is returned in block.
+static void* AlignedCalloc(size_t count, size_t size, void** block)
+{
+    *block = calloc(1, count * size + HOST_CACHE_LINE_SIZE - 1);
+    if (*block == NULL)
+    {
+        return NULL;
+    }
+    return (void*)(((uintptr_t)*block + HOST_CACHE_LINE_SIZE - 1) & ~(uintptr_t)(HOST_CACHE_LINE_SIZE - 1));
+}
+
+// Works out the guest's budget for the current run, which is its share, less any penalty, and what it carried forward.
+static int StartRun(const ArvissPool* pool, Schedule* schedule)
+{
+    const int penalty = schedule->stats.spins < POOL_MAX_PENALTY ? schedule->stats.spins : POOL_MAX_PENALTY;
+    int64_t share = ((int64_t)pool->quantum * schedule->weight) >> penalty;
+    share = share > INT_MAX / 2 ? INT_MAX / 2 : share;
+    schedule->share = schedule->weight > 0 && share == 0 ? 1 : (int)share;
+    schedule->stats.budget = schedule->share + schedule->stats.carried;
+    return schedule->stats.budget;
+}
+
+// Records how much of its budget the guest used, carrying what it didn't use forward if it waited for the next run, or penalising
+// it if it used the whole budget without waiting.
+static void FinishRun(Schedule* schedule, int remaining, bool hasWaited)
+{
+    ArvissPoolStats* stats = &schedule->stats;
+    stats->used = stats->budget - remaining;
+    stats->consumed += (uint64_t)stats->used;
+    if (hasWaited)
+    {
+        stats->carried = remaining < schedule->share ? remaining : schedule->share;
+        stats->spins = 0;
+    }
+    else
+    {
+        stats->carried = 0;
+        stats->spins++;
+    }
+}
+
+// Runs count guests from the ready queue, starting at first, for up to their budget each.
+static void RunGuests(ArvissPool* pool, int first, int count)
+{
+    ArvissCpu* cpus[POOL_CHUNK];
+    int guests[POOL_CHUNK];
+    int remaining[POOL_CHUNK];
+
+    // Guests are run together for as long as the one with the smallest budget has to go, then those with more of their budget left,
+    // and those that trap and carry on, are run again, so that none of them goes over its budget.
+    int slice = INT_MAX;
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const int guest = pool->ready[first + i];
+        const int budget = StartRun(pool, &pool->schedules[guest]);
+        if (budget > 0)
+        {
+            cpus[n] = ArvissPoolCpu(pool, guest);
+            guests[n] = guest;
+            remaining[n] = budget;
+            slice = budget < slice ? budget : slice;
+            n++;
+        }
+        else
+        {
+            pool->schedules[guest].stats.used = 0;
+        }
+    }
+    while (n > 0)
+    {
+        ArvissRunBatch(cpus, n, slice);
+        int kept = 0;
+        slice = INT_MAX;
+        for (int i = 0; i < n; i++)
+        {
+            ArvissCpu* cpu = cpus[i];
+            remaining[i] -= cpu->retired;
+            bool hasWaited = false;
+            if (ArvissResultIsTrap(cpu->result))
+            {
+                hasWaited = pool->handler == NULL ||
+                            !pool->handler(pool->context, guests[i], cpu, ArvissResultAsTrap(cpu->result)) ||
+                            pool->schedules[guests[i]].state != gsRUNNABLE;
+            }
+            if (remaining[i] > 0 && !hasWaited)
+            {
+                cpus[kept] = cpu;
+                guests[kept] = guests[i];
+                remaining[kept] = remaining[i];
+                slice = remaining[i] < slice ? remaining[i] : slice;
+                kept++;
+            }
+            else
+            {
+                FinishRun(&pool->schedules[guests[i]], remaining[i], hasWaited);
+            }
+        }
+        n = kept;
+    }
+}
+
+// Takes up to a chunk of guests from the start of the worker's range. Returns false if its range is empty.
+static bool Take(Worker* worker, int* first, int* count)
+{
+    uint64_t r = LoadRange(&worker->range);
+    for (;;)
+    {
+        const int begin = RangeBegin(r);
+        const int end = RangeEnd(r);
+        if (begin >= end)
+        {
+            return false;
+        }
+        const int n = end - begin < POOL_CHUNK ? end - begin : POOL_CHUNK;
+        if (SwapRange(&worker->range, &r, MakeRange(begin + n, end)))
+        {
+            *first = begin;
+            *count = n;
+            return true;
+        }
+    }
+}
+
+// Steals half of the guests that another worker has yet to run, from the end of its range, and makes them the worker's range.
+// Returns false if there was nothing to steal.
+static bool Steal(Worker* worker)
+{
+#if defined(POOL_USE_THREADS)
+    ArvissPool* pool = worker->pool;
+    for (int i = 1; i < pool->numWorkers; i++)
+    {
+        Worker* victim = &pool->workers[(worker->index + i) % pool->numWorkers];
+        uint64_t r = LoadRange(&victim->range);
+        int begin = RangeBegin(r);
+        int end = RangeEnd(r);
+        while (begin < end)
+        {
+            const int n = (end - begin + 1) / 2;
+            if (SwapRange(&victim->range, &r, MakeRange(begin, end - n)))
+            {
+                // Nobody steals from an empty range, so the worker's range can be replaced outright.
+                StoreRange(&worker->range, MakeRange(end - n, end));
+                return true;
+            }
+            begin = RangeBegin(r);
+            end = RangeEnd(r);
+        }
+    }
+#else
+    (void)worker;
+#endif
+    return false;
+}
+
+static int CompareGuests(const void* a, const void* b)
+{
+    const int x = *(const int*)a;
+    const int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+// Returns the size of the record of an effect with len bytes of data.
+static size_t RecordSize(size_t len)
+{
+    return (sizeof(EffectHeader) + len + EFFECT_ALIGN - 1) / EFFECT_ALIGN * EFFECT_ALIGN;
+}
+
+// Makes the changes that the guests deferred, in order of guest, then forgets them. Only the guests that deferred anything are
+// visited, so this costs nothing for the guests that didn't.
+static void ApplyEffects(ArvissPool* pool)
+{
+    const int numDeferring = LoadCount(&pool->numDeferring);
+    qsort(pool->deferring, (size_t)numDeferring, sizeof(int), CompareGuests);
+    for (int i = 0; i < numDeferring; i++)
+    {
+        const int guest = pool->deferring[i];
+        Effects* effects = &pool->effects[guest];
+        for (size_t offset = 0; offset < effects->size;)
+        {
+            const EffectHeader* header = (const EffectHeader*)(effects->records + offset);
+            header->effect(pool->context, guest, header + 1, header->len);
+            offset += RecordSize(header->len);
+        }
+        effects->size = 0;
+    }
+    StoreCount(&pool->numDeferring, 0);
+}
+
+// Adds a sleeper to the heap. Returns false if there's no memory for it.
+static bool PushSleeper(ArvissPool* pool, uint64_t until, int guest)
+{
+    if (pool->numSleepers == pool->maxSleepers)
+    {
+        const int maxSleepers = pool->maxSleepers > 0 ? pool->maxSleepers * 2 : 16;
+        Sleeper* sleepers = realloc(pool->sleepers, (size_t)maxSleepers * sizeof(Sleeper));
+        if (sleepers == NULL)
+        {
+            return false;
+        }
+        pool->sleepers = sleepers;
+        pool->maxSleepers = maxSleepers;
+    }
+    int i = pool->numSleepers++;
+    while (i > 0 && pool->sleepers[(i - 1) / 2].until > until)
+    {
+        pool->sleepers[i] = pool->sleepers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    pool->sleepers[i] = (Sleeper){.until = until, .guest = guest};
+    return true;
+}
+
+// Removes the sleeper that's woken first from the heap.
+static Sleeper PopSleeper(ArvissPool* pool)
+{
+    const Sleeper first = pool->sleepers[0];
+    const Sleeper last = pool->sleepers[--pool->numSleepers];
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if (child >= pool->numSleepers)
+        {
+            break;
+        }
+        if (child + 1 < pool->numSleepers && pool->sleepers[child + 1].until < pool->sleepers[child].until)
+        {
+            child++;
+        }
+        if (pool->sleepers[child].until >= last.until)
+        {
+            break;
+        }
+        pool->sleepers[i] = pool->sleepers[child];
+        i = child;
+    }
+    pool->sleepers[i] = last;
+    return first;
+}
+
+// Keeps the guest in the ready queue if it's still runnable, or if it's sleeping until this epoch. Otherwise it leaves the queue,
+// and if it's sleeping, it waits with the other sleepers. Returns true if it's kept.
+static bool StaysReady(ArvissPool* pool, int guest)
+{
+    Schedule* schedule = &pool->schedules[guest];
+    if (schedule->state == gsSLEEPING && schedule->until <= pool->epoch)
+    {
+        schedule->state = gsRUNNABLE;
+    }
+    if (schedule->state == gsRUNNABLE)
+    {
+        return true;
+    }
+    schedule->isReady = false;
+    if (schedule->state == gsSLEEPING && !PushSleeper(pool, schedule->until, guest))
+    {
+        // With no room to wait with the other sleepers, it's run again so that it isn't lost.
+        schedule->state = gsRUNNABLE;
+        schedule->isReady = true;
+        return true;
+    }
+    return false;
+}
+
+// Brings the ready queue up to date for a new epoch. Guests that are no longer runnable leave it, and guests that have been woken,
+// or whose sleep is over, join it, keeping it in order of guest. This only touches the guests that are, or are becoming, runnable.
+static void UpdateReady(ArvissPool* pool)
+{
+    int numReady = 0;
+    for (int i = 0; i < pool->numReady; i++)
+    {
+        if (StaysReady(pool, pool->ready[i]))
+        {
+            pool->ready[numReady++] = pool->ready[i];
+        }
+    }
+    int numWoken = 0;
+    for (int i = 0; i < pool->numWoken; i++)
+    {
+        if (StaysReady(pool, pool->woken[i]))
+        {
+            pool->woken[numWoken++] = pool->woken[i];
+        }
+    }
+    pool->numWoken = numWoken;
+    while (pool->numSleepers > 0 && pool->sleepers[0].until <= pool->epoch)
+    {
+        const Sleeper sleeper = PopSleeper(pool);
+        const Schedule* schedule = &pool->schedules[sleeper.guest];
+        if (schedule->state == gsSLEEPING && schedule->until == sleeper.until && !schedule->isReady)
+        {
+            ArvissPoolWake(pool, sleeper.guest);
+        }
+    }
+
+    // Merge the woken guests into the ready queue, from the back, so that it stays in order.
+    qsort(pool->woken, (size_t)pool->numWoken, sizeof(int), CompareGuests);
+    int i = numReady - 1;
+    int j = pool->numWoken - 1;
+    pool->numReady = numReady + pool->numWoken;
+    for (int k = pool->numReady - 1; j >= 0; k--)
+    {
+        pool->ready[k] = i >= 0 && pool->ready[i] > pool->woken[j] ? pool->ready[i--] : pool->woken[j--];
+    }
+    pool->numWoken = 0;
+}
+
+// Runs guests until there are none left to run or steal.
+static void RunWorker(Worker* worker)
+{
+    int first;
+    int count;
+    do
+    {
+        while (Take(worker, &first, &count))
+        {
+            RunGuests(worker->pool, first, count);
+        }
+    } while (Steal(worker));
+}
+
+#if defined(POOL_USE_THREADS)
+
+// The body of each worker's thread, other than the first's. It runs guests whenever a run starts, until the pool is destroyed.
+static void* WorkerThread(void* arg)
+{
+    Worker* worker = arg;
+    ArvissPool* pool = worker->pool;
+    unsigned generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->generation == generation && !pool->isStopping)
+        {
+            pthread_cond_wait(&pool->started, &pool->lock);
+        }
+        if (pool->isStopping)
+        {
+            break;
+        }
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        RunWorker(worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+        {
+            pthread_cond_signal(&pool->finished);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Starts the workers, other than the first, on a run.
+static void StartWorkers(ArvissPool* pool)
+{
+    if (pool->numWorkers > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy = pool->numWorkers - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->started);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Waits for the workers, other than the first, to finish the guests that they're running.
+static void WaitForWorkers(ArvissPool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0)
+    {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns the number of cores that the host has.
+static int HostCores(void)
+{
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+#else
+
+static void StartWorkers(ArvissPool* pool)
+{
+    (void)pool;
+}
+
+static void WaitForWorkers(ArvissPool* pool)
+{
+    (void)pool;
+}
+
+#endif
+
+ArvissPool* ArvissPoolCreate(int numGuests, size_t dataSize, int numThreads, ArvissPoolTrapHandler handler, void* context)
+{
+    if (numGuests < 0 || numThreads < 0)
+    {
+        return NULL;
+    }
+#if defined(POOL_USE_THREADS)
+    if (numThreads == 0)
+    {
+        numThreads = HostCores();
+    }
+#else
+    numThreads = 1;
+#endif
+    // There's no point in having more threads than guests.
+    if (numThreads > numGuests)
+    {
+        numThreads = numGuests > 0 ? numGuests : 1;
+    }
+
+    ArvissPool* pool = calloc(1, sizeof(ArvissPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->numGuests = numGuests;
+    pool->numWorkers = numThreads;
+    pool->handler = handler;
+    pool->context = context;
+    pool->guestSize = (sizeof(ArvissCpu) + dataSize + HOST_CACHE_LINE_SIZE - 1) & ~(size_t)(HOST_CACHE_LINE_SIZE - 1);
+    pool->guests = AlignedCalloc((size_t)(numGuests > 0 ? numGuests : 1), pool->guestSize, &pool->guestBlock);
+    pool->workers = AlignedCalloc((size_t)numThreads, sizeof(Worker), &pool->workerBlock);
+    pool->effects = calloc((size_t)(numGuests > 0 ? numGuests : 1), sizeof(Effects));
+    pool->deferring = calloc((size_t)(numGuests > 0 ? numGuests : 1), sizeof(int));
+    pool->schedules = calloc((size_t)(numGuests > 0 ? numGuests : 1), sizeof(Schedule));
+    pool->ready = calloc((size_t)(numGuests > 0 ? numGuests : 1), sizeof(int));
+    pool->woken = calloc((size_t)(numGuests > 0 ? numGuests : 1), sizeof(int));
+    if (pool->guests == NULL || pool->workers == NULL || pool->effects == NULL || pool->deferring == NULL || pool->schedules == NULL
+        || pool->ready == NULL || pool->woken == NULL)
+    {
+        free(pool->ready);
+        free(pool->woken);
+        free(pool->guestBlock);
+        free(pool->workerBlock);
+        free(pool->effects);
+        free(pool->deferring);
+        free(pool->schedules);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < numGuests; i++)
+    {
+        pool->schedules[i].weight = 1;
+        pool->schedules[i].state = gsRUNNABLE;
+        pool->schedules[i].isReady = true;
+        pool->ready[i] = i;
+    }
+    pool->numReady = numGuests;
+    StoreCount(&pool->numDeferring, 0);
+    for (int i = 0; i < numThreads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        StoreRange(&pool->workers[i].range, MakeRange(0, 0));
+    }
+
+#if defined(POOL_USE_THREADS)
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->started, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    for (int i = 1; i < numThreads; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, WorkerThread, &pool->workers[i]) != 0)
+        {
+            // Make do with the threads that were created.
+            pool->numWorkers = i;
+            break;
+        }
+    }
+#endif
+
+    return pool;
+}
+
+void ArvissPoolDestroy(ArvissPool* pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+#if defined(POOL_USE_THREADS)
+    pthread_mutex_lock(&pool->lock);
+    pool->isStopping = true;
+    pthread_cond_broadcast(&pool->started);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->numWorkers; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->started);
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    for (int i = 0; i < pool->numGuests; i++)
+    {
+        ArvissRelease(ArvissPoolCpu(pool, i));
+        free(pool->effects[i].records);
+    }
+    free(pool->effects);
+    free(pool->deferring);
+    free(pool->schedules);
+    free(pool->ready);
+    free(pool->woken);
+    free(pool->sleepers);
+    free(pool->guestBlock);
+    free(pool->workerBlock);
+    free(pool);
+}
+
+ArvissCpu* ArvissPoolCpu(ArvissPool* pool, int guest)
+{
+    return (ArvissCpu*)(pool->guests + (size_t)guest * pool->guestSize);
+}
+
+void* ArvissPoolData(ArvissPool* pool, int guest)
+{
+    return pool->guests + (size_t)guest * pool->guestSize + sizeof(ArvissCpu);
+}
+
+void ArvissPoolSetWeight(ArvissPool* pool, int guest, int weight)
+{
+    pool->schedules[guest].weight = weight > 0 ? weight : 0;
+}
+
+ArvissPoolStats ArvissPoolGetStats(const ArvissPool* pool, int guest)
+{
+    return pool->schedules[guest].stats;
+}
+
+int ArvissPoolGuests(const ArvissPool* pool)
+{
+    return pool->numGuests;
+}
+
+int ArvissPoolThreads(const ArvissPool* pool)
+{
+    return pool->numWorkers;
+}
+
+void ArvissPoolRun(ArvissPool* pool, int quantum)
+{
+    pool->epoch++;
+    pool->quantum = quantum;
+    UpdateReady(pool);
+
+    // Give each worker an equal share of the ready guests, next to each other, so that guests that share code are run together.
+    for (int i = 0; i < pool->numWorkers; i++)
+    {
+        const int begin = (int)((int64_t)pool->numReady * i / pool->numWorkers);
+        const int end = (int)((int64_t)pool->numReady * (i + 1) / pool->numWorkers);
+        StoreRange(&pool->workers[i].range, MakeRange(begin, end));
+    }
+
+    StartWorkers(pool);
+    RunWorker(&pool->workers[0]);
+    WaitForWorkers(pool);
+    ApplyEffects(pool);
+}
+
+bool ArvissPoolDefer(ArvissPool* pool, int guest, ArvissPoolEffect effect, const void* data, size_t len)
+{
+    Effects* effects = &pool->effects[guest];
+    const size_t size = RecordSize(len);
+    if (effects->size + size > effects->capacity)
+    {
+        size_t capacity = effects->capacity > 0 ? effects->capacity : 16 * EFFECT_ALIGN;
+        while (capacity < effects->size + size)
+        {
+            capacity *= 2;
+        }
+        uint8_t* records = realloc(effects->records, capacity);
+        if (records == NULL)
+        {
+            return false;
+        }
+        effects->records = records;
+        effects->capacity = capacity;
+    }
+    if (effects->size == 0)
+    {
+        pool->deferring[IncrementCount(&pool->numDeferring)] = guest;
+    }
+    EffectHeader* header = (EffectHeader*)(effects->records + effects->size);
+    header->effect = effect;
+    header->len = len;
+    if (len > 0)
+    {
+        memcpy(header + 1, data, len);
+    }
+    effects->size += size;
+    return true;
+}
+
+void ArvissPoolBlock(ArvissPool* pool, int guest)
+{
+    if (pool->schedules[guest].state != gsEXITED)
+    {
+        pool->schedules[guest].state = gsBLOCKED;
+    }
+}
+
+void ArvissPoolSleep(ArvissPool* pool, int guest, uint64_t until)
+{
+    Schedule* schedule = &pool->schedules[guest];
+    if (schedule->state != gsEXITED)
+    {
+        schedule->state = gsSLEEPING;
+        schedule->until = until;
+
+        // A guest that's in the ready queue joins the other sleepers when it leaves the queue, but one that isn't, because it was
+        // blocked, joins them now.
+        if (!schedule->isReady && !PushSleeper(pool, until, guest))
+        {
+            ArvissPoolWake(pool, guest);
+        }
+    }
+}
+
+void ArvissPoolExit(ArvissPool* pool, int guest)
+{
+    pool->schedules[guest].state = gsEXITED;
+}
+
+bool ArvissPoolWake(ArvissPool* pool, int guest)
+{
+    Schedule* schedule = &pool->schedules[guest];
+    if (schedule->state == gsEXITED)
+    {
+        return false;
+    }
+    schedule->state = gsRUNNABLE;
+    if (!schedule->isReady)
+    {
+        schedule->isReady = true;
+        pool->woken[pool->numWoken++] = guest;
+    }
+    return true;
+}
+
+ArvissPoolGuestState ArvissPoolGetState(const ArvissPool* pool, int guest)
+{
+    return pool->schedules[guest].state;
+}
+
+uint64_t ArvissPoolEpoch(const ArvissPool* pool)
+{
+    return pool->epoch;
+}
+
+int ArvissPoolReadyGuests(const ArvissPool* pool)
+{
+    return pool->numReady;
+}
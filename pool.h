@@ -0,0 +1,131 @@
+#pragma once
+
+#include "arviss.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A pool of guests that are run on a pool of host threads. Each call to ArvissPoolRun() runs every guest for its budget, spreading
+// the guests across the threads, and returns once they have all had their turn. That makes each call a barrier, so a host that runs
+// a frame-synchronous simulation can call it once per frame and know that every guest has finished with the frame when it returns.
+//
+// Each thread starts with a share of the guests, next to each other, and runs them a few at a time with ArvissRunBatch(). A thread
+// that runs out of guests steals half of what's left from another thread, so the threads finish together even if some guests take
+// far longer than others. The pool owns its guests' CPUs, along with any state that the host keeps for each guest, such as its
+// memory. Each guest's CPU and state start on a cache line of their own, so no two threads write to the same line, and a guest's
+// CPU and its memory are close together in the host's memory.
+//
+// Each call to ArvissPoolRun() is an epoch. A guest retires exactly its budget of instructions in each epoch, unless its trap
+// handler has it wait for the next one, and which thread runs it makes no difference to how far it gets. To keep the results of a
+// run the same from one run to the next, and from one host to the next, trap handlers shouldn't change state that other guests can
+// see. Instead, they defer those changes with ArvissPoolDefer(), and the pool makes them at the end of the epoch, on the calling
+// thread, in order of guest and then in the order that each guest deferred them. Every guest then sees the state as it was at the
+// start of the epoch, however the guests were spread across the threads.
+//
+// Each guest's budget is a share of each run that's in proportion to its weight, so that the time that a run takes is bounded
+// however many guests are busy. A guest that waits for the next run before it has used its budget carries what's left, up to its
+// share, forward to the next run. A guest that uses its whole budget without waiting, e.g., because it's spinning, has its share
+// halved for each run in a row that it does so, up to three times, until it next waits.
+//
+// A guest that is waiting for something, such as a syscall that the host can't finish straight away, or the passing of time, can be
+// parked, so that it isn't touched at all until it's woken. Only runnable guests are kept in the ready queue, so the time that each
+// run takes to schedule its guests depends on how many of them are runnable, rather than on how many guests there are. A trap
+// handler can park its own guest, and the host can park or wake any guest between runs.
+typedef struct ArvissPool ArvissPool;
+
+// The states that a guest can be in.
+typedef enum ArvissPoolGuestState
+{
+    gsRUNNABLE, // The guest is run in every run.
+    gsBLOCKED,  // The guest is waiting for the host to wake it, e.g., when it has finished a syscall.
+    gsSLEEPING, // The guest is waiting for a given epoch, or for the host to wake it before then.
+    gsEXITED    // The guest has finished, and is never run again.
+} ArvissPoolGuestState;
+
+// How a guest has been scheduled.
+typedef struct ArvissPoolStats
+{
+    uint64_t consumed; // The instructions that the guest has retired in all of its runs.
+    int budget;        // The most instructions that it could retire in the most recent run, including what it carried forward.
+    int used;          // The instructions that it retired in the most recent run.
+    int carried;       // The budget that it didn't use, which it carries forward to the next run.
+    int spins;         // The runs in a row in which it used its whole budget without waiting, for which it is penalised.
+} ArvissPoolStats;
+
+// Called when a guest traps before it has used up its budget, e.g., for a syscall. It is called on whichever thread is running the
+// guest, so it can be called for different guests at the same time, but never for the same guest at the same time. Returns true if
+// the guest should carry on with the rest of its budget, or false if it should wait for the next call to ArvissPoolRun().
+typedef bool (*ArvissPoolTrapHandler)(void* context, int guest, ArvissCpu* cpu, ArvissTrap trap);
+
+// A change that a trap handler deferred until the end of the epoch, with a copy of the len bytes of data that it was deferred with.
+typedef void (*ArvissPoolEffect)(void* context, int guest, const void* data, size_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Creates a pool of numGuests guests, each with dataSize bytes of state for the host, that runs them on numThreads threads,
+// including the thread that calls ArvissPoolRun(), or on one thread per host core if numThreads is 0. Hosts that don't support
+// threads run the guests on the calling thread. The guests' CPUs and state are zeroed, ready for the host to initialise them.
+// Returns NULL if the pool can't be created.
+ArvissPool* ArvissPoolCreate(int numGuests, size_t dataSize, int numThreads, ArvissPoolTrapHandler handler, void* context);
+
+// Stops the pool's threads, releases its guests' CPUs, and frees it.
+void ArvissPoolDestroy(ArvissPool* pool);
+
+// Returns the CPU of the given guest.
+ArvissCpu* ArvissPoolCpu(ArvissPool* pool, int guest);
+
+// Returns the host's state for the given guest.
+void* ArvissPoolData(ArvissPool* pool, int guest);
+
+// Sets the weight of the given guest, which is 1 unless it's set. A guest of weight 0 isn't run, except to use up what it carried
+// forward from its previous run.
+void ArvissPoolSetWeight(ArvissPool* pool, int guest, int weight);
+
+// Returns how the given guest has been scheduled.
+ArvissPoolStats ArvissPoolGetStats(const ArvissPool* pool, int guest);
+
+// Parks the given guest until the host wakes it. The trap handler calls this, e.g., for a syscall that the host will finish later.
+// The guest waits for the next run regardless of what the handler returns.
+void ArvissPoolBlock(ArvissPool* pool, int guest);
+
+// Parks the given guest until the run whose epoch is until, or until the host wakes it, whichever comes first.
+void ArvissPoolSleep(ArvissPool* pool, int guest, uint64_t until);
+
+// Marks the given guest as having exited, so that it's never run again.
+void ArvissPoolExit(ArvissPool* pool, int guest);
+
+// Makes a blocked or sleeping guest runnable again from the next run. A host that finishes a blocked syscall writes its result to
+// the guest's registers or memory, then calls this. It can't be called while the guests are being run, except from a deferred
+// effect. Returns false if the guest has exited.
+bool ArvissPoolWake(ArvissPool* pool, int guest);
+
+// Returns the state of the given guest.
+ArvissPoolGuestState ArvissPoolGetState(const ArvissPool* pool, int guest);
+
+// Returns the epoch of the current run, or of the most recent run if the guests aren't being run. The first run's epoch is 1.
+uint64_t ArvissPoolEpoch(const ArvissPool* pool);
+
+// Returns the number of guests in the ready queue of the current run, or of the most recent run.
+int ArvissPoolReadyGuests(const ArvissPool* pool);
+
+// Returns the number of guests in the pool.
+int ArvissPoolGuests(const ArvissPool* pool);
+
+// Returns the number of threads that the pool runs its guests on, including the thread that calls ArvissPoolRun().
+int ArvissPoolThreads(const ArvissPool* pool);
+
+// Runs each guest for up to its budget, which is quantum instructions for a guest of weight 1, calling the trap handler whenever
+// one traps, then makes the changes that were deferred while they ran, and returns.
+void ArvissPoolRun(ArvissPool* pool, int quantum);
+
+// Called by the trap handler to defer a change until every guest has been run, copying the len bytes of data that the change needs.
+// The pool calls the effect with the copy, and the pool's context, at the end of the epoch. Effects can't defer further changes.
+// Returns false if there's no memory to hold the change.
+bool ArvissPoolDefer(ArvissPool* pool, int guest, ArvissPoolEffect effect, const void* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,159 @@
+#include "sparsemem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SPARSEMEM_USE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#if defined(SPARSEMEM_USE_MMAP)
+
+// Reserves size bytes of zero-filled memory, aligned to a huge page if asked for huge pages. Nothing is allocated until it's
+// touched.
+static uint8_t* Reserve(size_t size, SparseMemFlags flags)
+{
+#if defined(MAP_NORESERVE)
+    const int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#else
+    const int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+#endif
+#if defined(MADV_HUGEPAGE)
+    if ((flags & SM_HUGE_PAGES) != 0 && size >= HUGE_PAGE_SIZE)
+    {
+        // Over-reserve, then trim either side so that what's left starts on a huge page boundary.
+        const size_t reserved = size + HUGE_PAGE_SIZE;
+        uint8_t* p = mmap(NULL, reserved, PROT_READ | PROT_WRITE, mapFlags, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            return NULL;
+        }
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned != p)
+        {
+            munmap(p, (size_t)(aligned - p));
+        }
+        if (aligned + size != p + reserved)
+        {
+            munmap(aligned + size, (size_t)(p + reserved - (aligned + size)));
+        }
+        madvise(aligned, size, MADV_HUGEPAGE);
+        return aligned;
+    }
+#else
+    (void)flags;
+#endif
+    uint8_t* p = mmap(NULL, size, PROT_READ | PROT_WRITE, mapFlags, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Discards the given whole pages of reserved memory, so that they're zero-filled when they're next touched. Returns false if it
+// can't.
+static bool Discard(uint8_t* p, size_t len)
+{
+#if defined(__linux__)
+    // This keeps the mapping, and any advice that was given for it, intact.
+    return madvise(p, len, MADV_DONTNEED) == 0;
+#else
+    // Elsewhere, MADV_DONTNEED doesn't necessarily zero the pages, so map fresh ones over the top of them.
+#if defined(MAP_NORESERVE)
+    const int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED;
+#else
+    const int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#endif
+    return mmap(p, len, PROT_READ | PROT_WRITE, mapFlags, -1, 0) != MAP_FAILED;
+#endif
+}
+
+#endif
+
+bool SparseMemInit(SparseMem* sm, uint32_t start, uint32_t size, SparseMemFlags flags)
+{
+    sm->start = start;
+    sm->size = size;
+#if defined(SPARSEMEM_USE_MMAP)
+    sm->mem = Reserve(size, flags);
+    sm->isReserved = sm->mem != NULL;
+#else
+    (void)flags;
+    sm->mem = NULL;
+    sm->isReserved = false;
+#endif
+    if (sm->mem == NULL)
+    {
+        // Fall back to the C library, which may well get large allocations from virtual memory anyway.
+        sm->mem = calloc(1, size);
+    }
+    return sm->mem != NULL;
+}
+
+void SparseMemFree(SparseMem* sm)
+{
+#if defined(SPARSEMEM_USE_MMAP)
+    if (sm->isReserved)
+    {
+        munmap(sm->mem, sm->size);
+        sm->mem = NULL;
+        return;
+    }
+#endif
+    free(sm->mem);
+    sm->mem = NULL;
+}
+
+// Returns true if the len bytes at the given guest address are all in the memory.
+static bool Contains(const SparseMem* sm, uint32_t addr, uint32_t len)
+{
+    return addr >= sm->start && len <= sm->size && addr - sm->start <= sm->size - len;
+}
+
+bool SparseMemZero(SparseMem* sm, uint32_t addr, uint32_t len)
+{
+    if (!Contains(sm, addr, len))
+    {
+        return false;
+    }
+    uint8_t* p = sm->mem + (addr - sm->start);
+#if defined(SPARSEMEM_USE_MMAP)
+    if (sm->isReserved)
+    {
+        // Give back whatever whole pages in the range were allocated, so that they read as zero again, and zero the partial pages
+        // at either end by hand.
+        const uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uint8_t* first = (uint8_t*)(((uintptr_t)p + pageSize - 1) & ~(pageSize - 1));
+        uint8_t* last = (uint8_t*)(((uintptr_t)p + len) & ~(pageSize - 1));
+        if (first < last && Discard(first, (size_t)(last - first)))
+        {
+            memset(p, 0, (size_t)(first - p));
+            memset(last, 0, (size_t)(p + len - last));
+            return true;
+        }
+    }
+#endif
+    memset(p, 0, len);
+    return true;
+}
+
+bool SparseMemWrite(SparseMem* sm, uint32_t addr, const void* src, uint32_t len)
+{
+    if (!Contains(sm, addr, len))
+    {
+        return false;
+    }
+    memcpy(sm->mem + (addr - sm->start), src, len);
+    return true;
+}
+
+void SparseMemElfZero(ElfToken token, uint32_t addr, uint32_t len)
+{
+    SparseMemZero(token.t, addr, len);
+}
+
+void SparseMemElfWrite(ElfToken token, uint32_t addr, void* src, uint32_t len)
+{
+    SparseMemWrite(token.t, addr, src, len);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "loadelf.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Guest memory that only takes up host memory once it is used. It is reserved from the host's virtual memory rather than
+// allocated, so pages that have never been written to all share the host's zero page, and a page is only allocated when it is
+// first written to. Zeroing whole pages, e.g., a program's .bss, gives them back rather than writing to them. Hosts that run many
+// guests then only pay for the pages that each guest actually touches.
+//
+// The memory is contiguous, so it can be given to a CPU as one or more of the regions in its memory map, which it accesses directly.
+typedef struct SparseMem
+{
+    uint8_t* mem;    // The host memory that holds the guest memory.
+    uint32_t start;  // The guest address of the start of the memory.
+    uint32_t size;   // The size of the memory, in bytes.
+    bool isReserved; // True if the memory was reserved from virtual memory, false if the host doesn't support that.
+} SparseMem;
+
+typedef enum SparseMemFlags
+{
+    SM_NONE = 0,
+    SM_HUGE_PAGES = 1, // Ask for transparent huge pages, which saves TLB misses on the host at the cost of allocating 2MB at once.
+} SparseMemFlags;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Reserves size bytes of sparse memory for the guest addresses starting at start. Returns false if it can't be reserved.
+bool SparseMemInit(SparseMem* sm, uint32_t start, uint32_t size, SparseMemFlags flags);
+
+// Releases the memory, and all of the pages that were allocated for it.
+void SparseMemFree(SparseMem* sm);
+
+// Zeroes len bytes of the memory at the given guest address. Returns false if they aren't all in the memory.
+bool SparseMemZero(SparseMem* sm, uint32_t addr, uint32_t len);
+
+// Copies len bytes to the memory at the given guest address. Returns false if they aren't all in the memory.
+bool SparseMemWrite(SparseMem* sm, uint32_t addr, const void* src, uint32_t len);
+
+// Callbacks for LoadElf(), whose token is a SparseMem.
+void SparseMemElfZero(ElfToken token, uint32_t addr, uint32_t len);
+void SparseMemElfWrite(ElfToken token, uint32_t addr, void* src, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -241,6 +241,11 @@ uint32_t TestDecoder::EncodeI(uint32_t n)
     return (n & 0xfff) << 20; // imm[11:0] -> s[31:20]
 }
 
+TEST(DecodedInstruction, Fits_In_Eight_Bytes)
+{
+    ASSERT_EQ(8u, sizeof(DecodedInstruction));
+}
+
 TEST_F(TestDecoder, Lui)
 {
     // rd <- imm_u, pc <- pc + 4
@@ -362,6 +367,21 @@ TEST_F(TestDecoder, Jalr_x0_Is_Zero)
     ASSERT_EQ(0, cpu.xreg[0]);
 }
 
+TEST_F(TestDecoder, Jalr_x0_Still_Jumps)
+{
+    // jr rs1, i.e., jalr x0, imm_i(rs1), jumps without writing to x0.
+    uint32_t rs1 = 5;
+    cpu.xreg[rs1] = 0x2000;
+
+    ArvissExecute(&cpu, EncodeI(-3) | EncodeRs1(rs1) | (0b000 << 12) | EncodeRd(0) | opJALR);
+
+    // pc <- (rs1 + imm_i) & ~1
+    ASSERT_EQ((0x2000 - 3) & ~1, cpu.pc);
+
+    // x0 <- 0
+    ASSERT_EQ(0, cpu.xreg[0]);
+}
+
 TEST_F(TestDecoder, Branch_Beq)
 {
     // pc <- pc + ((rs1 == rs2) ? imm_b : 4)
@@ -728,6 +748,22 @@ TEST_F(TestDecoder, Load_x0_Is_Zero)
     ASSERT_EQ(0, cpu.xreg[0]);
 }
 
+TEST_F(TestDecoder, Load_x0_Still_Faults)
+{
+    // A load into x0 still reads memory, so it still traps if the address is bad.
+    uint32_t pc = cpu.pc;
+    uint32_t rs1 = 13;
+    cpu.xreg[rs1] = 0x80000000; // Outside of memory.
+
+    ArvissResult result = ArvissExecute(&cpu, EncodeI(0) | EncodeRs1(rs1) | (0b010 << 12) | EncodeRd(0) | opLOAD);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trLOAD_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(0x80000000, ArvissResultAsTrap(result).mtval);
+    ASSERT_EQ(pc, cpu.pc);
+    ASSERT_EQ(0, cpu.xreg[0]);
+}
+
 TEST_F(TestDecoder, Store_Sb)
 {
     // m8(rs1 + imm_s) <- rs2[7:0], pc += 4
@@ -818,6 +854,33 @@ TEST_F(TestDecoder, OpImm_Addi)
     ASSERT_EQ(pc + 4, cpu.pc);
 }
 
+TEST_F(TestDecoder, OpImm_Addi_As_Mv_And_Li)
+{
+    uint32_t pc = cpu.pc;
+    uint32_t rd = 15;
+    uint32_t rs1 = 12;
+    cpu.xreg[rs1] = 0x12345678;
+
+    // mv rd, rs1, i.e., addi rd, rs1, 0
+    ArvissExecute(&cpu, EncodeI(0) | EncodeRs1(rs1) | (0b000 << 12) | EncodeRd(rd) | opOPIMM);
+
+    // rd <- rs1
+    ASSERT_EQ(0x12345678, cpu.xreg[rd]);
+
+    // pc <- pc + 4
+    ASSERT_EQ(pc + 4, cpu.pc);
+
+    // li rd, imm_i, i.e., addi rd, x0, imm_i
+    pc = cpu.pc;
+    ArvissExecute(&cpu, EncodeI(-42) | EncodeRs1(0) | (0b000 << 12) | EncodeRd(rd) | opOPIMM);
+
+    // rd <- imm_i
+    ASSERT_EQ(-42, (int32_t)cpu.xreg[rd]);
+
+    // pc <- pc + 4
+    ASSERT_EQ(pc + 4, cpu.pc);
+}
+
 TEST_F(TestDecoder, OpImm_Slti)
 {
     // rd <- (rs1 < imm_i) ? 1 : 0, pc += 4
@@ -2076,6 +2139,24 @@ TEST_F(TestDecoder, OpFp_Fcvt_w_s)
     ASSERT_EQ(pc + 4, cpu.pc);
 }
 
+TEST_F(TestDecoder, OpFp_x0_Is_Zero)
+{
+    uint32_t rs1 = 13;
+    cpu.freg[rs1] = -123.0f;
+
+    // FCVT.W.S
+    ArvissExecute(&cpu, (0b1100000 << 25) | EncodeRs2(0b00000) | EncodeRs1(rs1) | EncodeRm(rmDYN) | EncodeRd(0) | opOPFP);
+
+    // x0 <- 0
+    ASSERT_EQ(0, cpu.xreg[0]);
+
+    // FMV.X.W
+    ArvissExecute(&cpu, (0b1110000 << 25) | EncodeRs2(0b00000) | EncodeRs1(rs1) | (0b000 << 12) | EncodeRd(0) | opOPFP);
+
+    // x0 <- 0
+    ASSERT_EQ(0, cpu.xreg[0]);
+}
+
 TEST_F(TestDecoder, OpFp_Fcvt_wu_s)
 {
     // rd <- uint32_t(rs1), pc += 4
@@ -0,0 +1,364 @@
+#include "../arviss.h"
+#include "../pool.h"
+
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+class TestPool : public ::testing::Test
+{
+protected:
+    void SetUp() override;
+    void TearDown() override;
+
+    void CreatePool(int numGuests, int numThreads, bool carryOn, size_t dataSize = 0);
+
+    static bool HandleTrap(void* context, int guest, ArvissCpu* cpu, ArvissTrap trap);
+    static void ApplyEffect(void* context, int guest, const void* data, size_t len);
+
+    static constexpr uint32_t base = 0x1000;
+
+    std::vector<uint32_t> program;
+    ArvissCode* code{};
+    ArvissPool* pool{};
+    std::vector<uint32_t> counts;           // The most recent count that each guest passed to the handler.
+    std::atomic<int> calls{};               // The number of times that the handler was called.
+    bool carryOn{};                         // What the handler returns.
+    bool defers{};                          // True if the handler defers an effect for each syscall.
+    ArvissPoolGuestState parks{gsRUNNABLE}; // How the handler parks the guests with odd numbers after each syscall.
+    int shared{};                           // State that every guest sees, which only deferred effects change.
+    std::vector<int> seen;                  // The shared state that each guest saw most recently.
+    std::vector<int> applied;               // The guests whose effects were applied, in the order that they were applied.
+};
+
+void TestPool::SetUp()
+{
+    // Each guest counts up, passing the count to the host with an ecall each time.
+    program = {
+            0x00000513, // li a0, 0
+            0x00150513, // loop: addi a0, a0, 1
+            0x00000073, // ecall
+            0xff9ff06f, // j loop
+    };
+    // Shared code fills whole cache lines.
+    program.resize((program.size() + CACHE_LINE_LENGTH - 1) / CACHE_LINE_LENGTH * CACHE_LINE_LENGTH);
+    const ArvissMemoryRegion rom{base, static_cast<uint32_t>(program.size() * sizeof(uint32_t)),
+                                 reinterpret_cast<uint8_t*>(program.data()), false};
+    code = ArvissCreateCode(&rom);
+    ASSERT_NE(nullptr, code);
+}
+
+void TestPool::TearDown()
+{
+    ArvissPoolDestroy(pool);
+    ArvissReleaseCode(code);
+}
+
+void TestPool::CreatePool(int numGuests, int numThreads, bool handlerCarriesOn, size_t dataSize)
+{
+    carryOn = handlerCarriesOn;
+    counts.assign(numGuests, 0);
+    seen.assign(numGuests, -1);
+    pool = ArvissPoolCreate(numGuests, dataSize, numThreads, HandleTrap, this);
+    ASSERT_NE(nullptr, pool);
+    ASSERT_EQ(numGuests, ArvissPoolGuests(pool));
+
+    const ArvissMemoryRegion regions[] = {{base, static_cast<uint32_t>(program.size() * sizeof(uint32_t)),
+                                           reinterpret_cast<uint8_t*>(program.data()), false}};
+    const ArvissMemoryMap map{regions, 1, {}};
+    for (int i = 0; i < numGuests; i++)
+    {
+        ArvissCpu* cpu = ArvissPoolCpu(pool, i);
+        ASSERT_TRUE(ArvissInitWithMemoryMap(cpu, &map));
+        cpu->pc = base;
+        // One of the guests doesn't share the code, so it's run on its own.
+        if (i != 3)
+        {
+            ASSERT_TRUE(ArvissAttachCode(cpu, code));
+        }
+    }
+}
+
+bool TestPool::HandleTrap(void* context, int guest, ArvissCpu* cpu, ArvissTrap trap)
+{
+    auto* test = static_cast<TestPool*>(context);
+    test->calls++;
+    if (trap.mcause != trENVIRONMENT_CALL_FROM_M_MODE)
+    {
+        return false;
+    }
+    test->counts[guest] = ArvissReadXReg(cpu, abiA0);
+    if (guest % 2 == 1)
+    {
+        switch (test->parks)
+        {
+        case gsBLOCKED:
+            ArvissPoolBlock(test->pool, guest);
+            break;
+        case gsSLEEPING:
+            ArvissPoolSleep(test->pool, guest, ArvissPoolEpoch(test->pool) + 3);
+            break;
+        case gsEXITED:
+            ArvissPoolExit(test->pool, guest);
+            break;
+        default:
+            break;
+        }
+    }
+    if (test->defers)
+    {
+        test->seen[guest] = test->shared;
+        EXPECT_TRUE(ArvissPoolDefer(test->pool, guest, ApplyEffect, &guest, sizeof(guest)));
+    }
+    ArvissMret(cpu);
+    return test->carryOn;
+}
+
+void TestPool::ApplyEffect(void* context, int guest, const void* data, size_t len)
+{
+    auto* test = static_cast<TestPool*>(context);
+    EXPECT_EQ(sizeof(guest), len);
+    EXPECT_EQ(guest, *static_cast<const int*>(data));
+    test->applied.push_back(guest);
+    test->shared++;
+}
+
+TEST_F(TestPool, AlignsGuestsToCacheLines)
+{
+    // Each guest's state follows its CPU, and the next guest's CPU starts on the next cache line.
+    constexpr size_t dataSize = 100;
+    CreatePool(10, 2, true, dataSize);
+    for (int i = 0; i < ArvissPoolGuests(pool); i++)
+    {
+        const auto cpu = reinterpret_cast<uintptr_t>(ArvissPoolCpu(pool, i));
+        const auto* data = static_cast<const uint8_t*>(ArvissPoolData(pool, i));
+        ASSERT_EQ(0u, cpu % HOST_CACHE_LINE_SIZE);
+        ASSERT_LE(cpu + sizeof(ArvissCpu), reinterpret_cast<uintptr_t>(data));
+        if (i > 0)
+        {
+            ASSERT_LE(reinterpret_cast<uintptr_t>(ArvissPoolData(pool, i - 1)) + dataSize, cpu);
+        }
+        for (size_t j = 0; j < dataSize; j++)
+        {
+            ASSERT_EQ(0, data[j]);
+        }
+    }
+}
+
+TEST_F(TestPool, UsesNoMoreThreadsThanGuests)
+{
+    CreatePool(3, 8, true);
+    ASSERT_LE(ArvissPoolThreads(pool), 3);
+    ASSERT_GE(ArvissPoolThreads(pool), 1);
+}
+
+TEST_F(TestPool, RunsEveryGuestForItsQuantum)
+{
+    // Run the same guests on one thread and on several. Each guest ends up in the same place either way.
+    constexpr int numGuests = 4 * BATCH_LANES + 7;
+    CreatePool(numGuests, 1, true);
+    for (int frame = 0; frame < 10; frame++)
+    {
+        ArvissPoolRun(pool, 100);
+    }
+    const std::vector<uint32_t> expected = counts;
+    ArvissPoolDestroy(pool);
+    pool = nullptr;
+
+    CreatePool(numGuests, 4, true);
+    for (int frame = 0; frame < 10; frame++)
+    {
+        ArvissPoolRun(pool, 100);
+    }
+    for (int i = 0; i < numGuests; i++)
+    {
+        ASSERT_NE(0u, expected[i]) << "guest " << i;
+        ASSERT_EQ(expected[0], expected[i]) << "guest " << i;
+        ASSERT_EQ(expected[i], counts[i]) << "guest " << i;
+    }
+}
+
+TEST_F(TestPool, ReturnsWhenEveryGuestHasYielded)
+{
+    // The handler yields, so each guest makes one syscall per run, and every syscall has been handled when the run returns.
+    constexpr int numGuests = 200;
+    CreatePool(numGuests, 4, false);
+    for (int frame = 1; frame <= 5; frame++)
+    {
+        ArvissPoolRun(pool, 1000);
+        ASSERT_EQ(numGuests * frame, calls);
+        for (int i = 0; i < numGuests; i++)
+        {
+            ASSERT_EQ(static_cast<uint32_t>(frame), counts[i]) << "guest " << i;
+        }
+    }
+}
+
+TEST_F(TestPool, DefersEffectsToTheEndOfTheEpoch)
+{
+    // Each guest makes one syscall per epoch, whose effect is deferred. Every guest sees the shared state as it was at the start of
+    // the epoch, and the effects are applied in order of guest, however many threads the guests were run on.
+    constexpr int numGuests = 3 * BATCH_LANES + 1;
+    CreatePool(numGuests, 4, false);
+    defers = true;
+    std::vector<int> expected;
+    for (int epoch = 0; epoch < 3; epoch++)
+    {
+        ArvissPoolRun(pool, 1000);
+        for (int i = 0; i < numGuests; i++)
+        {
+            ASSERT_EQ(epoch * numGuests, seen[i]) << "guest " << i;
+            expected.push_back(i);
+        }
+        ASSERT_EQ(expected, applied);
+        ASSERT_EQ((epoch + 1) * numGuests, shared);
+    }
+}
+
+TEST_F(TestPool, AppliesTheEffectsOfOnlySomeGuestsInOrderOfGuest)
+{
+    // The guests with odd numbers block after their first syscall, so only some of the guests defer effects in later epochs. Those
+    // that do are still applied in order of guest, whichever order they deferred them in.
+    constexpr int numGuests = 3 * BATCH_LANES + 1;
+    CreatePool(numGuests, 4, false);
+    parks = gsBLOCKED;
+    defers = true;
+    ArvissPoolRun(pool, 1000);
+    ASSERT_EQ(numGuests, static_cast<int>(applied.size()));
+
+    applied.clear();
+    ASSERT_TRUE(ArvissPoolWake(pool, 5));
+    ASSERT_TRUE(ArvissPoolWake(pool, 1));
+    ArvissPoolRun(pool, 1000);
+    std::vector<int> expected;
+    for (int i = 0; i < numGuests; i++)
+    {
+        if (i % 2 == 0 || i == 1 || i == 5)
+        {
+            expected.push_back(i);
+        }
+    }
+    ASSERT_EQ(expected, applied);
+    ASSERT_EQ(numGuests + static_cast<int>(expected.size()), shared);
+
+    // Once every guest with an odd number has blocked again, none of their effects remain to be applied.
+    applied.clear();
+    ArvissPoolRun(pool, 1000);
+    expected.erase(std::remove_if(expected.begin(), expected.end(), [](int i) { return i % 2 == 1; }), expected.end());
+    ASSERT_EQ(expected, applied);
+}
+
+TEST_F(TestPool, SharesRunsByWeight)
+{
+    // The guests never wait, so they use their whole budget, which is in proportion to their weight, and are penalised for it.
+    constexpr int quantum = 300;
+    CreatePool(3, 2, true);
+    ArvissPoolSetWeight(pool, 1, 2);
+    ArvissPoolSetWeight(pool, 2, 0);
+    const int weights[] = {1, 2, 0};
+    uint64_t consumed[3]{};
+    for (int run = 0; run < 5; run++)
+    {
+        ArvissPoolRun(pool, quantum);
+        for (int i = 0; i < 3; i++)
+        {
+            // The share is halved for each run in a row that the guest has spun, up to three times.
+            const int share = (quantum * weights[i]) >> (run < 3 ? run : 3);
+            consumed[i] += static_cast<uint64_t>(share);
+            const ArvissPoolStats stats = ArvissPoolGetStats(pool, i);
+            ASSERT_EQ(share, stats.budget) << "run " << run << " guest " << i;
+            ASSERT_EQ(share, stats.used) << "run " << run << " guest " << i;
+            ASSERT_EQ(0, stats.carried);
+            ASSERT_EQ(consumed[i], stats.consumed);
+            ASSERT_EQ(weights[i] > 0 ? run + 1 : 0, stats.spins);
+        }
+    }
+
+    // The guest of weight 0 was never run.
+    ASSERT_EQ(0u, counts[2]);
+}
+
+TEST_F(TestPool, CarriesUnusedBudgetForward)
+{
+    // Each guest waits after its first syscall, so it carries what it didn't use, up to its share, forward to the next run.
+    constexpr int quantum = 100;
+    CreatePool(2, 2, false);
+    ArvissPoolRun(pool, quantum);
+    ArvissPoolStats stats = ArvissPoolGetStats(pool, 0);
+    ASSERT_EQ(quantum, stats.budget);
+    ASSERT_LT(stats.used, quantum);
+    ASSERT_EQ(quantum - stats.used, stats.carried);
+    ASSERT_EQ(0, stats.spins);
+
+    const int carried = stats.carried;
+    ArvissPoolRun(pool, quantum);
+    stats = ArvissPoolGetStats(pool, 0);
+    ASSERT_EQ(quantum + carried, stats.budget);
+    ASSERT_EQ(quantum, stats.carried);
+}
+
+TEST_F(TestPool, ParksBlockedGuestsUntilTheyAreWoken)
+{
+    constexpr int numGuests = 2 * BATCH_LANES + 2;
+    CreatePool(numGuests, 2, true);
+    parks = gsBLOCKED;
+    ArvissPoolRun(pool, 100);
+    ASSERT_EQ(numGuests, ArvissPoolReadyGuests(pool));
+    ASSERT_EQ(gsRUNNABLE, ArvissPoolGetState(pool, 2));
+    ASSERT_EQ(gsBLOCKED, ArvissPoolGetState(pool, 3));
+    ASSERT_EQ(1u, counts[3]);
+
+    // Only the runnable guests are run.
+    ArvissPoolRun(pool, 100);
+    ASSERT_EQ(numGuests / 2, ArvissPoolReadyGuests(pool));
+    ASSERT_EQ(1u, counts[3]);
+    ASSERT_LT(1u, counts[2]);
+
+    // Until the host wakes one of them, which runs until its next syscall, and blocks again.
+    ASSERT_TRUE(ArvissPoolWake(pool, 3));
+    ASSERT_EQ(gsRUNNABLE, ArvissPoolGetState(pool, 3));
+    ArvissPoolRun(pool, 100);
+    ASSERT_EQ(numGuests / 2 + 1, ArvissPoolReadyGuests(pool));
+    ASSERT_EQ(2u, counts[3]);
+    ASSERT_EQ(1u, counts[5]);
+    ASSERT_EQ(gsBLOCKED, ArvissPoolGetState(pool, 3));
+}
+
+TEST_F(TestPool, WakesSleepingGuestsAtTheirEpoch)
+{
+    constexpr int numGuests = 6;
+    CreatePool(numGuests, 2, true);
+    parks = gsSLEEPING;
+    for (uint64_t epoch = 1; epoch <= 7; epoch++)
+    {
+        ArvissPoolRun(pool, 100);
+        ASSERT_EQ(epoch, ArvissPoolEpoch(pool));
+
+        // The sleepers run in epochs 1, 4 and 7, making one syscall each time.
+        const bool isAwake = epoch % 3 == 1;
+        ASSERT_EQ(isAwake ? numGuests : numGuests / 2, ArvissPoolReadyGuests(pool)) << "epoch " << epoch;
+        ASSERT_EQ((epoch + 2) / 3, counts[1]) << "epoch " << epoch;
+    }
+
+    // The host can wake a sleeper early.
+    ASSERT_TRUE(ArvissPoolWake(pool, 1));
+    ArvissPoolRun(pool, 100);
+    ASSERT_EQ(4u, counts[1]);
+    ASSERT_EQ(3u, counts[3]);
+}
+
+TEST_F(TestPool, NeverRunsExitedGuests)
+{
+    CreatePool(4, 2, true);
+    parks = gsEXITED;
+    ArvissPoolRun(pool, 100);
+    ArvissPoolRun(pool, 100);
+    ASSERT_EQ(2, ArvissPoolReadyGuests(pool));
+    ASSERT_EQ(gsEXITED, ArvissPoolGetState(pool, 1));
+    ASSERT_FALSE(ArvissPoolWake(pool, 1));
+    ArvissPoolRun(pool, 100);
+    ASSERT_EQ(1u, counts[1]);
+    ASSERT_EQ(2, ArvissPoolReadyGuests(pool));
+}
@@ -0,0 +1,1640 @@
+#include "../arviss.h"
+
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+class TestRun : public ::testing::Test
+{
+protected:
+    void SetUp() override;
+    void TearDown() override;
+
+    static constexpr uint32_t rambase = 0x1000; // Deliberately not zero.
+    static constexpr uint32_t ramsize = 0x4000;
+
+    ArvissCpu cpu{};
+    Bus bus{};
+    uint8_t ram[ramsize]{};
+    uint32_t here = rambase; // Where the next instruction will be assembled.
+
+    void Emit(uint32_t instruction);
+    void RunAndCompare(int count);
+    void UseMemoryMap(const ArvissMemoryRegion* regions, int count, bool hasBus = true);
+    static uint64_t LineDecodes(uint64_t count);
+
+    static uint32_t Lui(uint32_t rd, uint32_t imm);
+    static uint32_t Auipc(uint32_t rd, uint32_t imm);
+    static uint32_t Addi(uint32_t rd, uint32_t rs1, int32_t imm);
+    static uint32_t OpImm(uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm);
+    static uint32_t Op(uint32_t funct7, uint32_t funct3, uint32_t rd, uint32_t rs1, uint32_t rs2);
+    static uint32_t Branch(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm);
+    static uint32_t Add(uint32_t rd, uint32_t rs1, uint32_t rs2);
+    static uint32_t Lw(uint32_t rd, uint32_t rs1, int32_t imm);
+    static uint32_t Flw(uint32_t rd, uint32_t rs1, int32_t imm);
+    static uint32_t Sw(uint32_t rs2, uint32_t rs1, int32_t imm);
+    static uint32_t Bne(uint32_t rs1, uint32_t rs2, int32_t imm);
+    static uint32_t Jal(uint32_t rd, int32_t imm);
+    static uint32_t Jalr(uint32_t rd, uint32_t rs1, int32_t imm);
+    static uint32_t FenceI();
+    static uint32_t Ecall();
+    static uint32_t Ebreak();
+
+    static uint8_t Read8(BusToken token, uint32_t addr, BusCode* busCode);
+    static uint16_t Read16(BusToken token, uint32_t addr, BusCode* busCode);
+    static uint32_t Read32(BusToken token, uint32_t addr, BusCode* busCode);
+    static void Write8(BusToken token, uint32_t addr, uint8_t byte, BusCode* busCode);
+    static void Write16(BusToken token, uint32_t addr, uint16_t halfword, BusCode* busCode);
+    static void Write32(BusToken token, uint32_t addr, uint32_t word, BusCode* busCode);
+};
+
+uint8_t TestRun::Read8(BusToken token, uint32_t addr, BusCode* busCode)
+{
+    auto ram = reinterpret_cast<uint8_t*>(token.t);
+    if (addr >= rambase && addr < rambase + ramsize)
+    {
+        return ram[addr - rambase];
+    }
+
+    *busCode = bcLOAD_ACCESS_FAULT;
+    return 0;
+}
+
+uint16_t TestRun::Read16(BusToken token, uint32_t addr, BusCode* busCode)
+{
+    auto ram = reinterpret_cast<uint8_t*>(token.t);
+    if (addr >= rambase && addr < rambase + ramsize - 1)
+    {
+        return ram[addr - rambase] | (ram[addr + 1 - rambase] << 8);
+    }
+
+    *busCode = bcLOAD_ACCESS_FAULT;
+    return 0;
+}
+
+uint32_t TestRun::Read32(BusToken token, uint32_t addr, BusCode* busCode)
+{
+    auto ram = reinterpret_cast<uint8_t*>(token.t);
+    if (addr >= rambase && addr < rambase + ramsize - 3)
+    {
+        return ram[addr - rambase] | (ram[addr + 1 - rambase] << 8) | (ram[addr + 2 - rambase] << 16)
+                | (ram[addr + 3 - rambase] << 24);
+    }
+
+    *busCode = bcLOAD_ACCESS_FAULT;
+    return 0;
+}
+
+void TestRun::Write8(BusToken token, uint32_t addr, uint8_t byte, BusCode* busCode)
+{
+    auto ram = reinterpret_cast<uint8_t*>(token.t);
+    if (addr >= rambase && addr < rambase + ramsize)
+    {
+        ram[addr - rambase] = byte;
+        return;
+    }
+
+    *busCode = bcSTORE_ACCESS_FAULT;
+}
+
+void TestRun::Write16(BusToken token, uint32_t addr, uint16_t halfword, BusCode* busCode)
+{
+    auto ram = reinterpret_cast<uint8_t*>(token.t);
+    if (addr >= rambase && addr < rambase + ramsize - 1)
+    {
+        ram[addr - rambase] = halfword & 0xff;
+        ram[addr + 1 - rambase] = (halfword >> 8) & 0xff;
+        return;
+    }
+
+    *busCode = bcSTORE_ACCESS_FAULT;
+}
+
+void TestRun::Write32(BusToken token, uint32_t addr, uint32_t word, BusCode* busCode)
+{
+    auto ram = reinterpret_cast<uint8_t*>(token.t);
+    if (addr >= rambase && addr < rambase + ramsize - 3)
+    {
+        ram[addr - rambase] = word & 0xff;
+        ram[addr + 1 - rambase] = (word >> 8) & 0xff;
+        ram[addr + 2 - rambase] = (word >> 16) & 0xff;
+        ram[addr + 3 - rambase] = (word >> 24) & 0xff;
+        return;
+    }
+
+    *busCode = bcSTORE_ACCESS_FAULT;
+}
+
+void TestRun::SetUp()
+{
+    bus.Read8 = TestRun::Read8;
+    bus.Read16 = TestRun::Read16;
+    bus.Read32 = TestRun::Read32;
+    bus.Write8 = TestRun::Write8;
+    bus.Write16 = TestRun::Write16;
+    bus.Write32 = TestRun::Write32;
+    bus.token = {ram};
+
+    // Initialise the CPU.
+    ArvissInit(&cpu, &bus);
+
+    cpu.xreg[2] = rambase + ramsize; // Set the stack pointer.
+    cpu.pc = rambase;
+
+#if defined(ARVISS_JIT)
+    ArvissEnableJit(&cpu, true);
+#endif
+}
+
+void TestRun::TearDown()
+{
+    ArvissRelease(&cpu);
+}
+
+// Initialises the CPU again with a memory map made of the given regions and, unless hasBus is false, the test's bus.
+void TestRun::UseMemoryMap(const ArvissMemoryRegion* regions, int count, bool hasBus)
+{
+    ArvissRelease(&cpu);
+    const ArvissMemoryMap map{regions, count, hasBus ? bus : Bus{}};
+    ASSERT_TRUE(ArvissInitWithMemoryMap(&cpu, &map));
+    cpu.xreg[2] = rambase + ramsize;
+    cpu.pc = rambase;
+
+#if defined(ARVISS_JIT)
+    ArvissEnableJit(&cpu, true);
+#endif
+}
+
+void TestRun::Emit(uint32_t instruction)
+{
+    BusCode busCode = bcOK;
+    Write32(bus.token, here, instruction, &busCode);
+    here += 4;
+}
+
+// Runs the program on a CPU that doesn't use the JIT, then runs it again from the same starting point on the CPU under test, and
+// checks that they end up in the same state.
+void TestRun::RunAndCompare(int count)
+{
+    const std::vector<uint8_t> initialRam(ram, ram + ramsize);
+
+    auto reference = std::make_unique<ArvissCpu>();
+    ArvissInit(reference.get(), &bus);
+    reference->xreg[2] = cpu.xreg[2];
+    reference->pc = cpu.pc;
+    ArvissResult expected = ArvissRun(reference.get(), count);
+    ArvissRelease(reference.get());
+    const std::vector<uint8_t> expectedRam(ram, ram + ramsize);
+
+    std::copy(initialRam.begin(), initialRam.end(), ram);
+    ArvissResult actual = ArvissRun(&cpu, count);
+
+    ASSERT_EQ(expected.type, actual.type);
+    ASSERT_EQ(reference->retired, cpu.retired);
+    ASSERT_EQ(reference->pc, cpu.pc);
+    ASSERT_EQ(reference->mepc, cpu.mepc);
+    ASSERT_EQ(reference->mcause, cpu.mcause);
+    ASSERT_EQ(reference->mtval, cpu.mtval);
+    ASSERT_EQ(reference->busCode, cpu.busCode);
+    for (int i = 0; i < 32; i++)
+    {
+        ASSERT_EQ(reference->xreg[i], cpu.xreg[i]) << "x" << i;
+    }
+    ASSERT_TRUE(std::equal(expectedRam.begin(), expectedRam.end(), ram));
+}
+
+// Returns how many instructions the cache lines decode to run count instructions of straight-line code from the start of a line.
+// With fusion, decoding an instruction decodes the next one in its line too, so that the two can be fused, so the last line decodes
+// one more than it runs if it runs an odd number.
+uint64_t TestRun::LineDecodes(uint64_t count)
+{
+#if defined(ARVISS_USE_FUSION)
+    return count + count % CACHE_LINE_LENGTH % 2;
+#else
+    return count;
+#endif
+}
+
+uint32_t TestRun::Lui(uint32_t rd, uint32_t imm)
+{
+    return (imm & 0xfffff000) | (rd << 7) | opLUI;
+}
+
+uint32_t TestRun::Auipc(uint32_t rd, uint32_t imm)
+{
+    return (imm & 0xfffff000) | (rd << 7) | opAUIPC;
+}
+
+uint32_t TestRun::Addi(uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (0b000 << 12) | (rd << 7) | opOPIMM;
+}
+
+uint32_t TestRun::OpImm(uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opOPIMM;
+}
+
+uint32_t TestRun::Op(uint32_t funct7, uint32_t funct3, uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opOP;
+}
+
+uint32_t TestRun::Branch(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm)
+{
+    return ((imm & 0x1000) << 19) | ((imm & 0x7e0) << 20) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((imm & 0x1e) << 7)
+            | ((imm & 0x800) >> 4) | opBRANCH;
+}
+
+uint32_t TestRun::Add(uint32_t rd, uint32_t rs1, uint32_t rs2)
+{
+    return (rs2 << 20) | (rs1 << 15) | (0b000 << 12) | (rd << 7) | opOP;
+}
+
+uint32_t TestRun::Lw(uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (0b010 << 12) | (rd << 7) | opLOAD;
+}
+
+uint32_t TestRun::Flw(uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (0b010 << 12) | (rd << 7) | opLOADFP;
+}
+
+uint32_t TestRun::Sw(uint32_t rs2, uint32_t rs1, int32_t imm)
+{
+    return ((imm & 0xfe0) << 20) | (rs2 << 20) | (rs1 << 15) | (0b010 << 12) | ((imm & 0x1f) << 7) | opSTORE;
+}
+
+uint32_t TestRun::Bne(uint32_t rs1, uint32_t rs2, int32_t imm)
+{
+    return Branch(0b001, rs1, rs2, imm);
+}
+
+uint32_t TestRun::Jal(uint32_t rd, int32_t imm)
+{
+    return ((imm & 0x100000) << 11) | ((imm & 0x7fe) << 20) | ((imm & 0x800) << 9) | (imm & 0x000ff000) | (rd << 7) | opJAL;
+}
+
+uint32_t TestRun::Jalr(uint32_t rd, uint32_t rs1, int32_t imm)
+{
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (0b000 << 12) | (rd << 7) | opJALR;
+}
+
+uint32_t TestRun::FenceI()
+{
+    return (0b001 << 12) | opMISCMEM;
+}
+
+uint32_t TestRun::Ecall()
+{
+    return opSYSTEM;
+}
+
+uint32_t TestRun::Ebreak()
+{
+    return (1 << 20) | opSYSTEM;
+}
+
+TEST_F(TestRun, StopsAfterCount)
+{
+    // Straight line code that is longer than the count.
+    for (int i = 0; i < 16; i++)
+    {
+        Emit(Addi(1, 1, 1));
+    }
+
+    ArvissResult result = ArvissRun(&cpu, 10);
+
+    ASSERT_FALSE(ArvissResultIsTrap(result));
+    ASSERT_EQ(10, cpu.retired);
+    ASSERT_EQ(10, cpu.xreg[1]);
+    ASSERT_EQ(rambase + 10 * 4, cpu.pc);
+}
+
+TEST_F(TestRun, RunsAcrossCacheLines)
+{
+    // Straight line code that spans several cache lines, followed by a breakpoint.
+    const int n = CACHE_LINE_LENGTH * 3 + 5;
+    for (int i = 0; i < n; i++)
+    {
+        Emit(Addi(1, 1, 1));
+    }
+    const uint32_t breakpoint = here;
+    Emit(Ebreak());
+
+    ArvissResult result = ArvissRun(&cpu, 1000);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(n, cpu.retired); // The trapping instruction is not retired.
+    ASSERT_EQ(n, cpu.xreg[1]);
+    ASSERT_EQ(breakpoint, cpu.pc);
+}
+
+TEST_F(TestRun, RunsLoop)
+{
+    // x1 <- 100, x2 <- 0, loop: x2 += x1, x1 -= 1, bne x1, x0, loop, ebreak
+    Emit(Addi(1, 0, 100));
+    Emit(Addi(2, 0, 0));
+    Emit(Add(2, 2, 1));
+    Emit(Addi(1, 1, -1));
+    Emit(Bne(1, 0, -8));
+    Emit(Ebreak());
+
+    ArvissResult result = ArvissRun(&cpu, 10000);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(2 + 100 * 3, cpu.retired);
+    ASSERT_EQ(5050, cpu.xreg[2]);
+}
+
+TEST_F(TestRun, RunsLoopInSlices)
+{
+    // The same loop, run a few instructions at a time, should give the same result.
+    Emit(Addi(1, 0, 100));
+    Emit(Addi(2, 0, 0));
+    Emit(Add(2, 2, 1));
+    Emit(Addi(1, 1, -1));
+    Emit(Bne(1, 0, -8));
+    Emit(Ebreak());
+
+    int total = 0;
+    ArvissResult result = ArvissMakeOk();
+    while (!ArvissResultIsTrap(result))
+    {
+        result = ArvissRun(&cpu, 7);
+        total += cpu.retired;
+    }
+
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(2 + 100 * 3, total);
+    ASSERT_EQ(5050, cpu.xreg[2]);
+}
+
+TEST_F(TestRun, RunsManyBlocks)
+{
+    // Lots of tiny blocks, so that the decoded instructions don't all fit in the cache at once, executed several times.
+    const int n = 500; // Small enough that the loop can branch back to the top.
+    Emit(Addi(2, 0, 3));
+    const uint32_t top = here;
+    for (int i = 0; i < n; i++)
+    {
+        Emit(Addi(1, 1, 1));
+        Emit(Jal(0, 4));
+    }
+    Emit(Addi(2, 2, -1));
+    Emit(Bne(2, 0, top - here));
+    Emit(Ebreak());
+
+    ArvissResult result = ArvissRun(&cpu, 100000);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(1 + 3 * (n * 2 + 2), cpu.retired);
+    ASSERT_EQ(3 * n, cpu.xreg[1]);
+}
+
+TEST_F(TestRun, CallsAndReturns)
+{
+    // Call a function that is in a different cache line, then return from it.
+    const uint32_t function = rambase + CACHE_LINE_LENGTH * 4 * 2;
+    Emit(Jal(1, function - here)); // ra <- pc + 4, pc <- function
+    Emit(Addi(5, 5, 1));           // Executed after the return.
+    Emit(Ebreak());
+
+    here = function;
+    Emit(Addi(6, 0, 42));
+    Emit(Jalr(0, 1, 0)); // ret
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(4, cpu.retired);
+    ASSERT_EQ(1, cpu.xreg[5]);
+    ASSERT_EQ(42, cpu.xreg[6]);
+}
+
+TEST_F(TestRun, StoresAndLoads)
+{
+    const uint32_t data = rambase + 0x1000;
+    Emit(Lui(10, data)); // x10 <- data
+    Emit(Addi(11, 0, 123));
+    Emit(Sw(11, 10, 4));
+    Emit(Lw(12, 10, 4));
+    Emit(Ebreak());
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(4, cpu.retired);
+    ASSERT_EQ(123, cpu.xreg[12]);
+}
+
+TEST_F(TestRun, LoadFaultStopsRun)
+{
+    Emit(Addi(1, 0, 1));
+    const uint32_t load = here;
+    Emit(Lw(2, 0, 0)); // Address zero is outside of RAM.
+    Emit(Addi(1, 0, 2));
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trLOAD_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(1, cpu.retired);
+    ASSERT_EQ(1, cpu.xreg[1]);
+    ASSERT_EQ(load, cpu.pc);
+    ASSERT_EQ(load, cpu.mepc);
+    ASSERT_EQ(bcOK, cpu.busCode);
+}
+
+TEST_F(TestRun, StoreFaultStopsRun)
+{
+    Emit(Addi(1, 0, 1));
+    Emit(Sw(1, 0, 0)); // Address zero is outside of RAM.
+    Emit(Addi(1, 0, 2));
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trSTORE_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(1, cpu.retired);
+    ASSERT_EQ(1, cpu.xreg[1]);
+    ASSERT_EQ(bcOK, cpu.busCode);
+}
+
+TEST_F(TestRun, FetchFaultStopsRun)
+{
+    cpu.pc = 0; // Outside of RAM.
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trINSTRUCTION_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(0, cpu.retired);
+    ASSERT_EQ(bcOK, cpu.busCode);
+}
+
+TEST_F(TestRun, EcallCanBeResumed)
+{
+    Emit(Addi(17, 0, 1)); // a7 <- 1
+    Emit(Ecall());
+    Emit(Addi(1, 0, 7));
+    Emit(Ebreak());
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trENVIRONMENT_CALL_FROM_M_MODE, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(1, cpu.retired);
+
+    // Return from the trap and carry on.
+    ArvissMret(&cpu);
+    result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(1, cpu.retired);
+    ASSERT_EQ(7, cpu.xreg[1]);
+}
+
+TEST_F(TestRun, ZeroCountDoesNothing)
+{
+    Emit(Addi(1, 0, 1));
+
+    ArvissResult result = ArvissRun(&cpu, 0);
+
+    ASSERT_FALSE(ArvissResultIsTrap(result));
+    ASSERT_EQ(0, cpu.retired);
+    ASSERT_EQ(rambase, cpu.pc);
+}
+
+TEST_F(TestRun, AgreesWithReference)
+{
+    // A loop that uses most of the integer instructions, and runs often enough for it to be translated if the JIT is enabled.
+    Emit(Lui(5, 0x87654000));
+    Emit(Addi(5, 5, 0x321));
+    Emit(Addi(6, 0, 100)); // Loop counter.
+    const uint32_t top = here;
+    Emit(Op(0b0000000, 0b000, 7, 5, 6));   // add
+    Emit(Op(0b0100000, 0b000, 8, 7, 5));   // sub
+    Emit(Op(0b0000000, 0b001, 9, 8, 6));   // sll
+    Emit(Op(0b0000000, 0b010, 10, 9, 5));  // slt
+    Emit(Op(0b0000000, 0b011, 11, 9, 5));  // sltu
+    Emit(Op(0b0000000, 0b100, 12, 9, 7));  // xor
+    Emit(Op(0b0000000, 0b101, 13, 5, 6));  // srl
+    Emit(Op(0b0100000, 0b101, 14, 5, 6));  // sra
+    Emit(Op(0b0000000, 0b110, 15, 13, 8)); // or
+    Emit(Op(0b0000000, 0b111, 16, 14, 9)); // and
+    Emit(Op(0b0000001, 0b000, 17, 5, 7));  // mul
+    Emit(Op(0b0000001, 0b001, 18, 5, 7));  // mulh
+    Emit(Op(0b0000001, 0b100, 19, 5, 6));  // div
+    Emit(Op(0b0000001, 0b110, 20, 5, 6));  // rem
+    Emit(OpImm(0b010, 21, 5, -5));         // slti
+    Emit(OpImm(0b011, 22, 6, -5));         // sltiu
+    Emit(OpImm(0b100, 23, 12, 0x555));     // xori
+    Emit(OpImm(0b110, 24, 13, -0x100));    // ori
+    Emit(OpImm(0b111, 25, 14, 0x7f0));     // andi
+    Emit(OpImm(0b001, 26, 5, 7));          // slli
+    Emit(OpImm(0b101, 27, 5, 9));          // srli
+    Emit(OpImm(0b101, 28, 5, 0x400 | 9));  // srai
+    Emit(Op(0b0000000, 0b000, 0, 5, 5));   // add x0, x5, x5 (discarded)
+    Emit(Sw(17, 2, -4));
+    Emit(Lw(29, 2, -4));
+    Emit(Op(0b0000000, 0b000, 5, 5, 29));
+    Emit(Branch(0b100, 5, 0, 8)); // blt x5, x0, +8
+    Emit(Addi(30, 30, 1));
+    Emit(Branch(0b111, 6, 5, 8)); // bgeu x6, x5, +8
+    Emit(Addi(31, 31, 1));
+    Emit(Jal(1, 16)); // Call a function that just returns.
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+    Emit(Jalr(0, 1, 0)); // The function.
+
+    RunAndCompare(100000);
+}
+
+TEST_F(TestRun, AgreesWithReferenceOnLoadFault)
+{
+    // A loop that reads memory until it runs off the end of RAM.
+    Emit(Lui(10, rambase + 0x1000));
+    const uint32_t top = here;
+    Emit(Lw(11, 10, 0));
+    Emit(Add(12, 12, 11));
+    Emit(Addi(10, 10, 4));
+    Emit(Jal(0, top - here));
+
+    RunAndCompare(100000);
+    ASSERT_EQ(trLOAD_ACCESS_FAULT, cpu.mcause);
+}
+
+TEST_F(TestRun, AgreesWithReferenceWhenCountRunsOut)
+{
+    // A hot loop where the count runs out part way through a block.
+    Emit(Addi(6, 0, 1000));
+    const uint32_t top = here;
+    Emit(Addi(5, 5, 3));
+    Emit(Addi(7, 7, 5));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+
+    RunAndCompare(1001);
+}
+
+TEST_F(TestRun, AgreesWithReferenceOnMemoryMap)
+{
+    // Map the first half of RAM, so that the second half is reached via the bus.
+    const ArvissMemoryRegion regions[] = {{rambase, ramsize / 2, ram, true}};
+    UseMemoryMap(regions, 1);
+
+    // A loop that copies words upwards until it runs off the end of RAM.
+    Emit(Lui(10, rambase + 0x1000));
+    const uint32_t top = here;
+    Emit(Lw(11, 10, 0));
+    Emit(Addi(11, 11, 1));
+    Emit(Sw(11, 10, 4));
+    Emit(Addi(10, 10, 4));
+    Emit(Jal(0, top - here));
+
+    RunAndCompare(100000);
+    ASSERT_EQ(trSTORE_ACCESS_FAULT, cpu.mcause);
+    ASSERT_EQ(rambase + ramsize, cpu.mtval);
+}
+
+TEST_F(TestRun, AgreesWithReferenceOnFloatLoadFault)
+{
+    // Map the first half of RAM, so that the second half is reached via the bus.
+    const ArvissMemoryRegion regions[] = {{rambase, ramsize / 2, ram, true}};
+    UseMemoryMap(regions, 1);
+
+    // A loop that loads floats until it runs off the end of RAM.
+    Emit(Lui(10, rambase + 0x1000));
+    const uint32_t top = here;
+    Emit(Flw(1, 10, 0));
+    Emit(Addi(10, 10, 4));
+    Emit(Jal(0, top - here));
+
+    RunAndCompare(100000);
+    ASSERT_EQ(trLOAD_ACCESS_FAULT, cpu.mcause);
+    ASSERT_EQ(rambase + ramsize, cpu.mtval);
+}
+
+TEST_F(TestRun, AgreesWithReferenceOnBusV2)
+{
+    // The same RAM as the test's bus, but using the second version of the bus ABI.
+    BusV2 busV2{};
+    busV2.token = bus.token;
+    busV2.Read8 = [](BusToken token, uint32_t addr) {
+        BusCode busCode = bcOK;
+        const uint8_t byte = Read8(token, addr, &busCode);
+        return busCode == bcOK ? ArvissMakeBusValue(byte) : ArvissMakeBusFault(busCode);
+    };
+    busV2.Read16 = [](BusToken token, uint32_t addr) {
+        BusCode busCode = bcOK;
+        const uint16_t halfword = Read16(token, addr, &busCode);
+        return busCode == bcOK ? ArvissMakeBusValue(halfword) : ArvissMakeBusFault(busCode);
+    };
+    busV2.Read32 = [](BusToken token, uint32_t addr) {
+        BusCode busCode = bcOK;
+        const uint32_t word = Read32(token, addr, &busCode);
+        return busCode == bcOK ? ArvissMakeBusValue(word) : ArvissMakeBusFault(busCode);
+    };
+    busV2.Write8 = [](BusToken token, uint32_t addr, uint8_t byte) {
+        BusCode busCode = bcOK;
+        Write8(token, addr, byte, &busCode);
+        return busCode;
+    };
+    busV2.Write16 = [](BusToken token, uint32_t addr, uint16_t halfword) {
+        BusCode busCode = bcOK;
+        Write16(token, addr, halfword, &busCode);
+        return busCode;
+    };
+    busV2.Write32 = [](BusToken token, uint32_t addr, uint32_t word) {
+        BusCode busCode = bcOK;
+        Write32(token, addr, word, &busCode);
+        return busCode;
+    };
+    ArvissRelease(&cpu);
+    ArvissInitWithBusV2(&cpu, &busV2);
+    cpu.xreg[2] = rambase + ramsize;
+    cpu.pc = rambase;
+#if defined(ARVISS_JIT)
+    ArvissEnableJit(&cpu, true);
+#endif
+
+    // A loop that copies words upwards until it runs off the end of RAM.
+    Emit(Lui(10, rambase + 0x1000));
+    const uint32_t top = here;
+    Emit(Lw(11, 10, 0));
+    Emit(Addi(11, 11, 1));
+    Emit(Sw(11, 10, 4));
+    Emit(Addi(10, 10, 4));
+    Emit(Jal(0, top - here));
+
+    RunAndCompare(100000);
+    ASSERT_EQ(trSTORE_ACCESS_FAULT, cpu.mcause);
+    ASSERT_EQ(rambase + ramsize, cpu.mtval);
+}
+
+TEST_F(TestRun, FaultsOnStoreToReadOnlyRegion)
+{
+    const ArvissMemoryRegion regions[] = {{rambase, 0x100, ram, false}, {rambase + 0x100, ramsize - 0x100, ram + 0x100, true}};
+    UseMemoryMap(regions, 2);
+
+    Emit(Lui(10, rambase));
+    Emit(Lw(11, 10, 0));
+    Emit(Sw(11, 10, 0x100));
+    Emit(Sw(11, 10, 0));
+    Emit(Ebreak());
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trSTORE_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(rambase, ArvissResultAsTrap(result).mtval);
+    ASSERT_EQ(Lui(10, rambase), cpu.xreg[11]);
+    ASSERT_EQ(0, std::memcmp(&ram[0], &ram[0x100], 4));
+}
+
+TEST_F(TestRun, ReadsAndWritesGuestMemory)
+{
+    const ArvissMemoryRegion regions[] = {{rambase, ramsize, ram, true}};
+    UseMemoryMap(regions, 1);
+
+    BusCode busCode = bcOK;
+    ArvissWrite32(&cpu, rambase + 0x100, 0x12345678, &busCode);
+    ASSERT_EQ(bcOK, busCode);
+    ASSERT_EQ(0x12345678, ArvissRead32(&cpu, rambase + 0x100, &busCode));
+    ASSERT_EQ(bcOK, busCode);
+
+    ArvissRead32(&cpu, rambase + ramsize, &busCode);
+    ASSERT_EQ(bcLOAD_ACCESS_FAULT, busCode);
+    busCode = bcOK;
+    ArvissWrite32(&cpu, rambase - 4, 0, &busCode);
+    ASSERT_EQ(bcSTORE_ACCESS_FAULT, busCode);
+}
+
+TEST_F(TestRun, ReadsAndWritesBlocksOfGuestMemory)
+{
+    const ArvissMemoryRegion regions[] = {{rambase, 0x100, ram, false}, {rambase + 0x100, ramsize - 0x200, ram + 0x100, true}};
+    UseMemoryMap(regions, 2);
+    here = rambase + 0x200;
+    Emit(Addi(11, 0, 1));
+    Emit(Ebreak());
+    cpu.pc = rambase + 0x200;
+    ArvissRun(&cpu, 100);
+    ASSERT_EQ(1, cpu.xreg[11]);
+
+    // Blocks in a region.
+    const uint8_t block[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    uint8_t copy[sizeof(block)]{};
+    BusCode busCode = bcOK;
+    ArvissWriteBlock(&cpu, rambase + 0x101, block, sizeof(block), &busCode);
+    ArvissReadBlock(&cpu, rambase + 0x101, copy, sizeof(copy), &busCode);
+    ASSERT_EQ(bcOK, busCode);
+    ASSERT_EQ(0, std::memcmp(block, copy, sizeof(block)));
+    ArvissZeroBlock(&cpu, rambase + 0x102, 8, &busCode);
+    ASSERT_EQ(bcOK, busCode);
+    ASSERT_EQ(1, ram[0x101]);
+    ASSERT_EQ(0, ram[0x102]);
+    ASSERT_EQ(0, ram[0x109]);
+    ASSERT_EQ(10, ram[0x10a]);
+
+    // Blocks that aren't in one region, which go a word at a time to the region and then to the bus.
+    ArvissWriteBlock(&cpu, rambase + ramsize - 0x104, block, sizeof(block), &busCode);
+    ArvissReadBlock(&cpu, rambase + ramsize - 0x104, copy, sizeof(copy), &busCode);
+    ASSERT_EQ(bcOK, busCode);
+    ASSERT_EQ(0, std::memcmp(block, copy, sizeof(block)));
+    ArvissReadBlock(&cpu, rambase + ramsize - 4, copy, 8, &busCode);
+    ASSERT_EQ(bcLOAD_ACCESS_FAULT, busCode);
+    busCode = bcOK;
+    ArvissWriteBlock(&cpu, rambase + 0xfc, block, 8, &busCode);
+    ASSERT_EQ(bcSTORE_ACCESS_FAULT, busCode);
+
+    // Code that is overwritten by a block is decoded again.
+    const uint32_t addi = Addi(11, 0, 2);
+    busCode = bcOK;
+    ArvissWriteBlock(&cpu, rambase + 0x200, &addi, sizeof(addi), &busCode);
+    ASSERT_EQ(bcOK, busCode);
+    cpu.pc = rambase + 0x200;
+    ArvissRun(&cpu, 100);
+    ASSERT_EQ(2, cpu.xreg[11]);
+}
+
+TEST_F(TestRun, TranslatesGuestMemory)
+{
+    const ArvissMemoryRegion regions[] = {{rambase, 0x100, ram, false}, {rambase + 0x100, ramsize - 0x100, ram + 0x100, true}};
+    UseMemoryMap(regions, 2);
+    here = rambase + 0x200;
+    Emit(Addi(11, 0, 1));
+    Emit(Ebreak());
+    cpu.pc = rambase + 0x200;
+    ArvissRun(&cpu, 100);
+    ASSERT_EQ(1, cpu.xreg[11]);
+
+    // Ranges that are wholly in one region, as long as it's writable if they're written.
+    ASSERT_EQ(ram + 0x10, ArvissTranslate(&cpu, rambase + 0x10, 0xf0, acREAD));
+    ASSERT_EQ(nullptr, ArvissTranslate(&cpu, rambase + 0x10, 4, acWRITE));
+    ASSERT_EQ(ram + 0x104, ArvissTranslate(&cpu, rambase + 0x104, 8, acREAD_WRITE));
+    ASSERT_EQ(nullptr, ArvissTranslate(&cpu, rambase + 0xfc, 8, acREAD));
+    ASSERT_EQ(nullptr, ArvissTranslate(&cpu, rambase + ramsize - 4, 8, acREAD));
+    ASSERT_EQ(nullptr, ArvissTranslate(&cpu, rambase - 4, 4, acREAD));
+
+    // Code that is written via a translated range is decoded again.
+    const uint32_t addi = Addi(11, 0, 2);
+    void* code = ArvissTranslate(&cpu, rambase + 0x200, sizeof(addi), acWRITE);
+    ASSERT_NE(nullptr, code);
+    std::memcpy(code, &addi, sizeof(addi));
+    cpu.pc = rambase + 0x200;
+    ArvissRun(&cpu, 100);
+    ASSERT_EQ(2, cpu.xreg[11]);
+}
+
+TEST_F(TestRun, FillsCacheLinesWithBlockReads)
+{
+    bus.ReadBlock = [](BusToken token, uint32_t addr, uint8_t* bytes, uint32_t len, BusCode* busCode) {
+        for (uint32_t i = 0; i < len && *busCode == bcOK; i++)
+        {
+            bytes[i] = Read8(token, addr + i, busCode);
+        }
+    };
+    ArvissRelease(&cpu);
+    ArvissInit(&cpu, &bus);
+
+    // Some code at the start of a cache line.
+    constexpr uint32_t lineSize = CACHE_LINE_LENGTH * 4;
+    here = (rambase + lineSize - 1) / lineSize * lineSize;
+    cpu.pc = here;
+    Emit(Addi(11, 0, 1));
+    Emit(Ebreak());
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(1, cpu.xreg[11]);
+
+#if !defined(ARVISS_BLOCK_CACHE)
+    // The whole line was decoded when it was filled, rather than an instruction at a time.
+    for (const auto& line : cpu.cache->line)
+    {
+        if (line.generation == cpu.cache->generation && line.owner == cpu.pc / lineSize)
+        {
+            for (const auto& ins : line.instructions)
+            {
+                ASSERT_NE(execFetchDecodeReplace, ins.opcode);
+            }
+        }
+    }
+#endif
+}
+
+TEST_F(TestRun, UsesReplacementMemoryMap)
+{
+    // A program that loads a word from a region outside RAM.
+    uint8_t bankA[0x1000]{1};
+    uint8_t bankB[0x1000]{2};
+    constexpr uint32_t bank = 0x10000;
+    ArvissMemoryRegion regions[] = {{rambase, ramsize, ram, true}, {bank, sizeof(bankA), bankA, false}};
+    UseMemoryMap(regions, 2);
+    Emit(Lui(10, bank));
+    Emit(Lw(11, 10, 0));
+    Emit(Ebreak());
+
+    ArvissRun(&cpu, 100);
+    ASSERT_EQ(1, cpu.xreg[11]);
+
+    // Switch banks and run it again.
+    regions[1].mem = bankB;
+    const ArvissMemoryMap map{regions, 2, bus};
+    ASSERT_TRUE(ArvissSetMemoryMap(&cpu, &map));
+    cpu.pc = rambase;
+    ArvissRun(&cpu, 100);
+    ASSERT_EQ(2, cpu.xreg[11]);
+}
+
+TEST_F(TestRun, AllocatesDecodedCacheWhenFirstRun)
+{
+    // The CPU starts on a cache line, with the registers near the start.
+    static_assert(alignof(ArvissCpu) == HOST_CACHE_LINE_SIZE, "CPUs should be aligned to a cache line");
+    static_assert(offsetof(ArvissCpu, pc) == 0, "The program counter should come first");
+    static_assert(offsetof(ArvissCpu, xreg) < HOST_CACHE_LINE_SIZE, "The registers should start in the first cache line");
+
+    // The cache isn't allocated until it's needed. Enabling the JIT needs it, so start without the JIT.
+    ArvissRelease(&cpu);
+    ASSERT_EQ(nullptr, cpu.cache);
+    Emit(Addi(11, 0, 1));
+    Emit(Ebreak());
+    ArvissRun(&cpu, 100);
+    ASSERT_EQ(1, cpu.xreg[11]);
+    ASSERT_NE(nullptr, cpu.cache);
+
+    // Releasing the CPU frees the cache, but leaves the rest of the CPU's state alone.
+    ArvissRelease(&cpu);
+    ASSERT_EQ(nullptr, cpu.cache);
+    ASSERT_EQ(1, cpu.xreg[11]);
+}
+
+TEST_F(TestRun, SharesDecodedCode)
+{
+    // RAM, and a ROM that starts and ends on cache line boundaries.
+    constexpr uint32_t lineSize = CACHE_LINE_LENGTH * 4;
+    constexpr uint32_t romStart = (rambase + lineSize - 1) / lineSize * lineSize;
+    constexpr uint32_t romSize = lineSize * 4;
+    constexpr uint32_t ramStart = romStart + romSize;
+    const ArvissMemoryRegion regions[] = {{ramStart, rambase + ramsize - ramStart, ram + (ramStart - rambase), true},
+                                          {romStart, romSize, ram + (romStart - rambase), false}};
+    UseMemoryMap(regions, 2);
+
+    // A loop in ROM that stores its result to RAM.
+    here = romStart;
+    Emit(Addi(11, 0, 0));
+    Emit(Addi(6, 0, 100));
+    const uint32_t top = here;
+    Emit(Addi(11, 11, 3));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Sw(11, 2, -4));
+    Emit(Ebreak());
+    ArvissCode* code = ArvissCreateCode(&regions[1]);
+    ASSERT_NE(nullptr, code);
+
+    // Another CPU with its own copy of the same image.
+    std::vector<uint8_t> otherRam(ram, ram + ramsize);
+    const ArvissMemoryRegion otherRegions[] = {{ramStart, rambase + ramsize - ramStart, &otherRam[ramStart - rambase], true},
+                                               {romStart, romSize, &otherRam[romStart - rambase], false}};
+    const ArvissMemoryMap otherMap{otherRegions, 2, {}};
+    auto other = std::make_unique<ArvissCpu>();
+    ASSERT_TRUE(ArvissInitWithMemoryMap(other.get(), &otherMap));
+    other->xreg[2] = rambase + ramsize;
+
+    // Each CPU takes a reference to the code, so the host can let go of its own.
+    ASSERT_TRUE(ArvissAttachCode(&cpu, code));
+    ASSERT_TRUE(ArvissAttachCode(other.get(), code));
+    ArvissReleaseCode(code);
+
+    // Both CPUs run the code that was decoded when it was created, even though the host has since wiped their ROMs.
+    std::memset(ram + (romStart - rambase), 0, romSize);
+    std::fill(otherRam.begin() + (romStart - rambase), otherRam.begin() + (ramStart - rambase), 0);
+    for (ArvissCpu* each : {&cpu, other.get()})
+    {
+        each->pc = romStart;
+        ArvissResult result = ArvissRun(each, 1000);
+        ASSERT_TRUE(ArvissResultIsTrap(result));
+        ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+        ASSERT_EQ(300, each->xreg[11]);
+    }
+    uint32_t stored;
+    std::memcpy(&stored, &otherRam[ramsize - 4], sizeof(stored));
+    ASSERT_EQ(300, stored);
+
+#if defined(ARVISS_CACHE_STATS) && !defined(ARVISS_BLOCK_CACHE)
+    // Neither CPU decoded anything for itself.
+    ASSERT_EQ(0, ArvissGetCacheStats(&cpu).decodes);
+    ASSERT_EQ(0, ArvissGetCacheStats(other.get()).decodes);
+#endif
+
+    // The code is freed when the last CPU lets it go.
+    ASSERT_TRUE(ArvissAttachCode(&cpu, nullptr));
+    ASSERT_EQ(nullptr, cpu.code);
+    ArvissRelease(other.get());
+}
+
+TEST_F(TestRun, SharesCodeOnlyFromMatchingRegions)
+{
+    constexpr uint32_t lineSize = CACHE_LINE_LENGTH * 4;
+    constexpr uint32_t romStart = (rambase + lineSize - 1) / lineSize * lineSize;
+    uint8_t* mem = ram + (romStart - rambase);
+
+    // Code can only be shared from read-only regions that start and end on cache line boundaries.
+    const ArvissMemoryRegion rom{romStart, lineSize, mem, false};
+    const ArvissMemoryRegion writable{romStart, lineSize, mem, true};
+    const ArvissMemoryRegion misaligned{romStart + 4, lineSize, mem + 4, false};
+    const ArvissMemoryRegion partial{romStart, lineSize - 4, mem, false};
+    ASSERT_EQ(nullptr, ArvissCreateCode(&writable));
+    ASSERT_EQ(nullptr, ArvissCreateCode(&misaligned));
+    ASSERT_EQ(nullptr, ArvissCreateCode(&partial));
+    ArvissCode* code = ArvissCreateCode(&rom);
+    ASSERT_NE(nullptr, code);
+
+    // It can only be attached to a CPU that has the same read-only region.
+    ASSERT_FALSE(ArvissAttachCode(&cpu, code));
+    UseMemoryMap(&writable, 1);
+    ASSERT_FALSE(ArvissAttachCode(&cpu, code));
+    UseMemoryMap(&partial, 1);
+    ASSERT_FALSE(ArvissAttachCode(&cpu, code));
+    UseMemoryMap(&rom, 1);
+    ASSERT_TRUE(ArvissAttachCode(&cpu, code));
+    ASSERT_EQ(code, cpu.code);
+
+    // Replacing the memory map detaches it.
+    const ArvissMemoryMap map{&rom, 1, bus};
+    ASSERT_TRUE(ArvissSetMemoryMap(&cpu, &map));
+    ASSERT_EQ(nullptr, cpu.code);
+    ArvissReleaseCode(code);
+}
+
+TEST_F(TestRun, RunsBatchesInLockStep)
+{
+    constexpr uint32_t lineSize = CACHE_LINE_LENGTH * 4;
+    constexpr uint32_t romStart = (rambase + lineSize - 1) / lineSize * lineSize;
+    constexpr uint32_t romSize = lineSize * 4;
+    constexpr uint32_t ramStart = romStart + romSize;
+
+    // An if-else in a loop whose trip count is loaded from RAM, so that the guests go their separate ways and meet again.
+    here = romStart;
+    Emit(Lw(10, 2, -8));
+    const uint32_t top = here;
+    Emit(OpImm(0b111, 5, 10, 1));  // andi t0, a0, 1
+    Emit(Branch(0b000, 5, 0, 12)); // beq t0, zero, even
+    Emit(Addi(11, 11, 3));         // addi a1, a1, 3
+    Emit(Jal(0, 12));              // j join
+    Emit(OpImm(0b001, 11, 11, 1)); // even: slli a1, a1, 1
+    Emit(OpImm(0b100, 11, 11, 5)); // xori a1, a1, 5
+    Emit(Addi(10, 10, -1));        // join: addi a0, a0, -1
+    Emit(Bne(10, 0, top - here));
+    Emit(Addi(6, 0, 3));
+    Emit(Op(0b0000001, 0b100, 11, 11, 6)); // div a1, a1, t1, which each guest runs on its own
+    Emit(Sw(11, 2, -4));
+    Emit(Ecall());
+    const ArvissMemoryRegion rom{romStart, romSize, ram + (romStart - rambase), false};
+    ArvissCode* code = ArvissCreateCode(&rom);
+    ASSERT_NE(nullptr, code);
+
+    // More guests than fit in one batch, each with its own RAM, run in lock-step and on their own. One of them doesn't share the
+    // code, so it splits the batch.
+    struct Guest
+    {
+        std::vector<uint8_t> mem;
+        std::unique_ptr<ArvissCpu> cpu;
+    };
+    constexpr int numGuests = BATCH_LANES + 5;
+    std::vector<Guest> batched(numGuests);
+    std::vector<Guest> alone(numGuests);
+    std::vector<ArvissCpu*> cpus;
+    for (std::vector<Guest>* guests : {&batched, &alone})
+    {
+        for (int i = 0; i < numGuests; i++)
+        {
+            Guest& guest = (*guests)[i];
+            guest.mem.assign(ram, ram + ramsize);
+            const uint32_t trips = 1 + i % 7;
+            std::memcpy(&guest.mem[ramsize - 8], &trips, sizeof(trips));
+            const ArvissMemoryRegion regions[] = {{ramStart, rambase + ramsize - ramStart, &guest.mem[ramStart - rambase], true},
+                                                  {romStart, romSize, &guest.mem[romStart - rambase], false}};
+            const ArvissMemoryMap map{regions, 2, {}};
+            guest.cpu = std::make_unique<ArvissCpu>();
+            ASSERT_TRUE(ArvissInitWithMemoryMap(guest.cpu.get(), &map));
+            guest.cpu->xreg[2] = rambase + ramsize;
+            guest.cpu->pc = romStart;
+            if (i != 3)
+            {
+                ASSERT_TRUE(ArvissAttachCode(guest.cpu.get(), code));
+            }
+        }
+    }
+    ArvissReleaseCode(code);
+    for (Guest& guest : batched)
+    {
+        cpus.push_back(guest.cpu.get());
+    }
+
+    // Run the batch a few instructions at a time, so that the guests also stop when they've run for long enough.
+    std::vector<int> retired(numGuests);
+    for (int round = 0; round < 100; round++)
+    {
+        ArvissRunBatch(cpus.data(), numGuests, 5);
+        for (int i = 0; i < numGuests; i++)
+        {
+            retired[i] += cpus[i]->retired;
+        }
+    }
+
+    // Every guest ends up where it would have if it had been run on its own.
+    for (int i = 0; i < numGuests; i++)
+    {
+        ArvissCpu* expected = alone[i].cpu.get();
+        ArvissCpu* actual = batched[i].cpu.get();
+        ArvissResult result = ArvissRun(expected, 1000);
+        ASSERT_TRUE(ArvissResultIsTrap(result));
+        ASSERT_TRUE(ArvissResultIsTrap(actual->result));
+        ASSERT_EQ(trENVIRONMENT_CALL_FROM_M_MODE, ArvissResultAsTrap(actual->result).mcause);
+        ASSERT_EQ(expected->retired, retired[i]) << "guest " << i;
+        ASSERT_EQ(expected->pc, actual->pc);
+        ASSERT_EQ(expected->mepc, actual->mepc);
+        for (int r = 0; r < 32; r++)
+        {
+            ASSERT_EQ(expected->xreg[r], actual->xreg[r]) << "guest " << i << " x" << r;
+        }
+        ASSERT_TRUE(std::equal(alone[i].mem.begin(), alone[i].mem.end(), batched[i].mem.begin()));
+        ArvissRelease(expected);
+        ArvissRelease(actual);
+    }
+}
+
+TEST_F(TestRun, CountsTlbUse)
+{
+    const ArvissMemoryRegion regions[] = {{rambase, ramsize, ram, true}};
+    UseMemoryMap(regions, 1);
+
+    // A loop that loads from a page other than the one that holds the code.
+    Emit(Lui(10, rambase + 0x2000));
+    Emit(Addi(6, 0, 100));
+    const uint32_t top = here;
+    Emit(Lw(11, 10, 0));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+
+    ArvissRun(&cpu, 1000);
+    ASSERT_EQ(0, cpu.xreg[6]);
+
+    // Fetching the code and loading the data each miss once. Cache lines are filled straight from the region, without the TLB.
+    ArvissTlbStats stats = ArvissGetTlbStats(&cpu);
+#if defined(ARVISS_TLB) && defined(ARVISS_CACHE_STATS)
+#if defined(ARVISS_BLOCK_CACHE)
+    ASSERT_EQ(2, stats.misses);
+    ASSERT_LE(100, stats.hits);
+#else
+    ASSERT_EQ(1, stats.misses);
+    ASSERT_EQ(99, stats.hits);
+#endif
+#else
+    ASSERT_EQ(0, stats.misses);
+    ASSERT_EQ(0, stats.hits);
+#endif
+}
+
+TEST_F(TestRun, TrapsAccessesToGuardPages)
+{
+    // The first page is read-only and holds the code.
+    // There's no bus, as guard pages would bypass it.
+    const ArvissMemoryRegion regions[] = {{rambase, 0x1000, ram, false}, {rambase + 0x1000, ramsize - 0x1000, ram + 0x1000, true}};
+    UseMemoryMap(regions, 2, false);
+
+    // A loop that copies words upwards until it runs off the end of RAM.
+    Emit(Lui(10, rambase + 0x1000));
+    const uint32_t top = here;
+    Emit(Lw(11, 10, 0));
+    Emit(Addi(11, 11, 1));
+    Emit(Sw(11, 10, 4));
+    Emit(Addi(10, 10, 4));
+    Emit(Jal(0, top - here));
+
+    // A store to the read-only page.
+    const uint32_t storeToRom = here;
+    Emit(Lui(12, rambase));
+    Emit(Sw(11, 12, 0));
+
+    const bool isGuarded = ArvissEnableGuardPages(&cpu, true);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    ASSERT_TRUE(isGuarded);
+#else
+    ASSERT_FALSE(isGuarded);
+#endif
+
+    // Guard pages or not, the CPU should behave the same.
+    ArvissResult result = ArvissRun(&cpu, 100000);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trSTORE_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(rambase + ramsize, ArvissResultAsTrap(result).mtval);
+    ASSERT_EQ(1 + 5 * (ramsize - 0x1000) / 4 - 3, cpu.retired);
+    ASSERT_EQ(bcOK, cpu.busCode);
+
+    BusCode busCode = bcOK;
+    ASSERT_EQ(cpu.xreg[11] - 1, ArvissRead32(&cpu, rambase + ramsize - 4, &busCode));
+    ArvissRead32(&cpu, rambase + ramsize, &busCode);
+    ASSERT_EQ(bcLOAD_ACCESS_FAULT, busCode);
+
+    cpu.pc = storeToRom;
+    result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trSTORE_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(rambase, ArvissResultAsTrap(result).mtval);
+    busCode = bcOK;
+    ArvissWrite32(&cpu, rambase + 4, 0, &busCode);
+    ASSERT_EQ(bcSTORE_ACCESS_FAULT, busCode);
+    busCode = bcOK;
+    ASSERT_EQ(Lui(10, rambase + 0x1000), ArvissRead32(&cpu, rambase, &busCode));
+    ASSERT_EQ(Lw(11, 10, 0), ArvissRead32(&cpu, rambase + 4, &busCode));
+    ASSERT_EQ(bcOK, busCode);
+
+    // Run off the end of RAM, so that the instruction after the last one is fetched before it's run.
+    ArvissWrite32(&cpu, rambase + ramsize - 4, Addi(13, 0, 7), &busCode);
+    cpu.pc = rambase + ramsize - 4;
+    result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trINSTRUCTION_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(rambase + ramsize, ArvissResultAsTrap(result).mtval);
+    ASSERT_EQ(7, cpu.xreg[13]);
+
+    cpu.pc = 0x100000; // Nowhere near any memory.
+    result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trINSTRUCTION_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+
+    // Disabling guard pages copies guest memory back.
+    ArvissEnableGuardPages(&cpu, false);
+    uint32_t last = 0;
+    std::memcpy(&last, &ram[ramsize - 8], sizeof(last));
+    ASSERT_EQ(cpu.xreg[11] - 2, last);
+}
+
+TEST_F(TestRun, TrapsDiscardedLoadsFromGuardPages)
+{
+    // There's no bus, so nothing is mapped outside the region, and a load to x0 from outside it has to fault even though its value
+    // isn't used.
+    const ArvissMemoryRegion regions[] = {{rambase, 0x1000, ram, true}};
+    UseMemoryMap(regions, 1, false);
+    Emit(Lui(10, rambase + 0x2000));
+    Emit(Lw(0, 10, 0));
+    Emit(Addi(5, 0, 1));
+
+    const bool isGuarded = ArvissEnableGuardPages(&cpu, true);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    ASSERT_TRUE(isGuarded);
+#else
+    ASSERT_FALSE(isGuarded);
+#endif
+
+    ArvissResult result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trLOAD_ACCESS_FAULT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(rambase + 0x2000, ArvissResultAsTrap(result).mtval);
+    ASSERT_EQ(rambase + 4, cpu.pc);
+    ASSERT_EQ(0, cpu.xreg[5]);
+    ASSERT_EQ(bcOK, cpu.busCode);
+}
+
+TEST_F(TestRun, NeedsNoBusForGuardPages)
+{
+    // Guard pages would bypass the bus, so they can't be enabled while it has callbacks, and giving it some disables them.
+    const ArvissMemoryRegion regions[] = {{rambase, ramsize, ram, true}};
+    UseMemoryMap(regions, 1);
+    ASSERT_FALSE(ArvissEnableGuardPages(&cpu, true));
+
+    UseMemoryMap(regions, 1, false);
+    const bool isGuarded = ArvissEnableGuardPages(&cpu, true);
+#if defined(ARVISS_USE_GUARD_PAGES)
+    ASSERT_TRUE(isGuarded);
+#else
+    ASSERT_FALSE(isGuarded);
+#endif
+    BusCode busCode = bcOK;
+    ArvissWrite32(&cpu, rambase + 0x100, 0x12345678, &busCode);
+    ASSERT_EQ(bcOK, busCode);
+
+    ArvissSetBus(&cpu, &bus);
+    ASSERT_FALSE(ArvissEnableGuardPages(&cpu, true));
+    uint32_t word = 0;
+    std::memcpy(&word, &ram[0x100], sizeof(word));
+    ASSERT_EQ(0x12345678, word);
+}
+
+#if defined(ARVISS_USE_GUARD_PAGES)
+TEST_F(TestRun, PutsBackTheSegvHandlerWhenGuardPagesAreDisabled)
+{
+    // The handler is shared by the CPUs that have guard pages enabled, and put back once none of them do. While it's installed, a
+    // fault outside their windows still ends the process as it would have without it.
+    struct sigaction before{};
+    ASSERT_EQ(0, sigaction(SIGSEGV, nullptr, &before));
+    const ArvissMemoryRegion regions[] = {{rambase, ramsize, ram, true}};
+    UseMemoryMap(regions, 1, false);
+    ArvissCpu other{};
+    const ArvissMemoryMap map{regions, 1, {}};
+    ASSERT_TRUE(ArvissInitWithMemoryMap(&other, &map));
+    ASSERT_TRUE(ArvissEnableGuardPages(&cpu, true));
+    ASSERT_TRUE(ArvissEnableGuardPages(&other, true));
+    ASSERT_DEATH(
+            {
+                volatile uintptr_t unmapped = 16;
+                *reinterpret_cast<volatile int*>(unmapped) = 1;
+            },
+            "");
+
+    struct sigaction during{};
+    ArvissEnableGuardPages(&other, false);
+    ArvissRelease(&other);
+    ASSERT_EQ(0, sigaction(SIGSEGV, nullptr, &during));
+    ASSERT_NE(before.sa_sigaction, during.sa_sigaction);
+
+    struct sigaction after{};
+    ArvissEnableGuardPages(&cpu, false);
+    ASSERT_EQ(0, sigaction(SIGSEGV, nullptr, &after));
+    ASSERT_EQ(before.sa_sigaction, after.sa_sigaction);
+    ASSERT_EQ(before.sa_flags & SA_SIGINFO, after.sa_flags & SA_SIGINFO);
+}
+#endif
+
+TEST_F(TestRun, NeedsPageAlignedRegionsForGuardPages)
+{
+    const ArvissMemoryRegion regions[] = {{rambase, 0x100, ram, false}, {rambase + 0x100, ramsize - 0x100, ram + 0x100, true}};
+    UseMemoryMap(regions, 2);
+    ASSERT_FALSE(ArvissEnableGuardPages(&cpu, true));
+}
+
+TEST_F(TestRun, PredictsReturns)
+{
+    // A loop that calls the same function from two places.
+    Emit(Addi(6, 0, 10));
+    const uint32_t top = here;
+    Emit(Jal(1, 28)); // Call the function.
+    Emit(Addi(7, 7, 1));
+    Emit(Jal(1, 20)); // Call it again from somewhere else.
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+    Emit(Addi(0, 0, 0));
+    Emit(Addi(5, 5, 1)); // The function.
+    Emit(Jalr(0, 1, 0));
+
+    RunAndCompare(1000);
+    ASSERT_EQ(20, cpu.xreg[5]);
+
+    // The first return to each block that makes a call has to be looked up, but after that the return address stack knows where it
+    // goes. The first call is made by the block that sets up the loop, so three blocks make calls.
+    ArvissJumpStats stats = ArvissGetJumpStats(&cpu);
+#if defined(ARVISS_BLOCK_CACHE) && defined(ARVISS_CACHE_STATS)
+    ASSERT_EQ(17, stats.returnHits);
+    ASSERT_EQ(3, stats.returnMisses);
+#else
+    ASSERT_EQ(0, stats.returnHits);
+    ASSERT_EQ(0, stats.returnMisses);
+#endif
+}
+
+TEST_F(TestRun, PredictsIndirectJumps)
+{
+    // A loop that jumps to an address held in a register, which jumps straight back.
+    const uint32_t target = rambase + 0x1000;
+    Emit(Addi(6, 0, 10));
+    const uint32_t top = here;
+    Emit(Lui(10, target));
+    Emit(Jalr(0, 10, 0));
+    const uint32_t back = here;
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+    here = target;
+    Emit(Addi(5, 5, 1));
+    Emit(Jal(0, back - here));
+
+    RunAndCompare(1000);
+    ASSERT_EQ(10, cpu.xreg[5]);
+
+    ArvissJumpStats stats = ArvissGetJumpStats(&cpu);
+#if defined(ARVISS_BLOCK_CACHE) && defined(ARVISS_CACHE_STATS)
+    ASSERT_EQ(9, stats.targetHits);
+    ASSERT_EQ(1, stats.targetMisses);
+#else
+    ASSERT_EQ(0, stats.targetHits);
+    ASSERT_EQ(0, stats.targetMisses);
+#endif
+}
+
+TEST_F(TestRun, KeepsConflictingLinesInDifferentWays)
+{
+    // A loop that calls a function whose address maps to the same set of cache lines as the loop does.
+    const uint32_t function = rambase + CACHE_SETS * CACHE_LINE_LENGTH * 4;
+    Emit(Addi(6, 0, 10));
+    const uint32_t top = here;
+    Emit(Jal(1, function - here));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+    here = function;
+    Emit(Addi(5, 5, 1));
+    Emit(Jalr(0, 1, 0));
+
+    RunAndCompare(1000);
+    ASSERT_EQ(10, cpu.xreg[5]);
+
+#if !defined(ARVISS_BLOCK_CACHE)
+    // The loop and the function each keep a line of their own if there are enough ways, otherwise they evict each other.
+    int valid = 0;
+    for (const auto& line : cpu.cache->line)
+    {
+        valid += line.generation == cpu.cache->generation ? 1 : 0;
+    }
+    ASSERT_EQ(CACHE_WAYS > 1 ? 2 : 1, valid);
+#endif
+}
+
+TEST_F(TestRun, CountsCacheUse)
+{
+    // Straight-line code that is decoded once, as one block or as however many cache lines it spans.
+    const int length = 11;
+    for (int i = 0; i < length - 1; i++)
+    {
+        Emit(Addi(5, 5, 1));
+    }
+    Emit(Ebreak());
+
+    RunAndCompare(1000);
+
+    ArvissCacheStats stats = ArvissGetCacheStats(&cpu);
+#if defined(ARVISS_CACHE_STATS)
+#if defined(ARVISS_BLOCK_CACHE)
+    const uint64_t misses = 1;
+    const uint64_t lookups = misses;
+#else
+    const uint64_t misses = (length + CACHE_LINE_LENGTH - 1) / CACHE_LINE_LENGTH;
+#if defined(ARVISS_USE_THREADED_DISPATCH)
+    const uint64_t lookups = misses;
+#else
+    const uint64_t lookups = length; // Switched dispatch looks up the line of every instruction that it runs.
+#endif
+#endif
+    ASSERT_EQ(lookups, stats.lookups);
+    ASSERT_EQ(misses, stats.misses);
+    ASSERT_EQ(0, stats.evictions);
+#if defined(ARVISS_BLOCK_CACHE)
+    ASSERT_EQ(length, stats.decodes);
+#else
+    ASSERT_EQ(LineDecodes(length), stats.decodes);
+#endif
+#else
+    ASSERT_EQ(0, stats.lookups);
+    ASSERT_EQ(0, stats.misses);
+    ASSERT_EQ(0, stats.evictions);
+    ASSERT_EQ(0, stats.decodes);
+#endif
+}
+
+TEST_F(TestRun, AdaptsToConflicts)
+{
+    // A long loop that calls a function whose address maps to the same cache line as the loop does if the cache is direct-mapped.
+    const uint32_t function = rambase + CACHE_LINES * CACHE_LINE_LENGTH * 4;
+    Emit(Lui(6, 0x2000));
+    const uint32_t top = here;
+    Emit(Jal(1, function - here));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+    here = function;
+    Emit(Addi(5, 5, 1));
+    Emit(Jalr(0, 1, 0));
+
+    RunAndCompare(100000);
+    ASSERT_EQ(0x2000, cpu.xreg[5]);
+
+#if defined(ARVISS_USE_ADAPTIVE_CACHE)
+    // Every lookup evicts a line until the first check, after which the loop and the function each have a way of their own.
+    ArvissCacheStats stats = ArvissGetCacheStats(&cpu);
+    ASSERT_EQ(1, stats.adaptations);
+    ASSERT_EQ(2, cpu.cache->ways);
+    ASSERT_LE(stats.evictions, ADAPTIVE_CACHE_INTERVAL);
+#endif
+}
+
+TEST_F(TestRun, RunsSelfModifyingCode)
+{
+    // A loop that overwrites one of its instructions on its first pass, then runs FENCE.I so that the next pass sees the change.
+    const uint32_t replacement = Addi(5, 5, 100);
+    Emit(Addi(6, 0, 2));
+    Emit(Lui(7, replacement));
+    Emit(Addi(7, 7, replacement & 0xfff));
+    Emit(Auipc(8, 0));
+    Emit(Addi(8, 8, 12)); // The address of the instruction to replace.
+    Emit(Jal(0, 4));      // Start a new block, so that each pass runs the same one.
+    const uint32_t top = here;
+    Emit(Addi(5, 5, 1));
+    Emit(Sw(7, 8, 0));
+    Emit(FenceI());
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+
+    RunAndCompare(1000);
+    ASSERT_EQ(101, cpu.xreg[5]);
+}
+
+TEST_F(TestRun, InvalidatesCodeOverwrittenByStores)
+{
+    // The same again, but relying on the store to invalidate the decoded instruction rather than on FENCE.I.
+    const uint32_t replacement = Addi(5, 5, 100);
+    Emit(Addi(6, 0, 2));
+    Emit(Lui(7, replacement));
+    Emit(Addi(7, 7, replacement & 0xfff));
+    Emit(Auipc(8, 0));
+    Emit(Addi(8, 8, 12)); // The address of the instruction to replace.
+    Emit(Jal(0, 4));      // Start a new block, so that each pass runs the same one.
+    const uint32_t top = here;
+    Emit(Addi(5, 5, 1));
+    Emit(Sw(7, 8, 0));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+
+    RunAndCompare(1000);
+    ASSERT_EQ(101, cpu.xreg[5]);
+}
+
+TEST_F(TestRun, ReturnsCorrectlyAfterStoreToCode)
+{
+    // A loop that calls a function straight after a store. The first pass stores to data, and the second overwrites code that has
+    // already run, which discards everything that was decoded, including the block that makes the call. On the second pass the
+    // function takes a longer path, so decoding it takes the place of whatever was decoded after it on the first pass.
+    const int padding = 32;
+    Emit(Auipc(9, 0)); // The address of the code to overwrite.
+    Emit(Lui(8, rambase + 0x2000));
+    Emit(Addi(6, 0, 2));
+    Emit(Jal(0, 4)); // Start a new block, so that each pass runs the same one.
+    const uint32_t top = here;
+    Emit(Sw(0, 8, 0));
+    const uint32_t call = here;
+    Emit(Jal(1, 0)); // Filled in below.
+    Emit(Addi(5, 5, 1));
+    Emit(Addi(8, 9, 0));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+    const uint32_t function = here;
+    Emit(Addi(7, 7, 1));
+    Emit(Branch(0b000, 8, 9, 8)); // beq x8, x9, longer
+    Emit(Jalr(0, 1, 0));
+    for (int i = 0; i < padding; i++)
+    {
+        Emit(Addi(0, 0, 0));
+    }
+    Emit(Addi(7, 7, 4));
+    Emit(Jalr(0, 1, 0));
+    here = call;
+    Emit(Jal(1, (int32_t)(function - call)));
+
+    RunAndCompare(1000);
+    ASSERT_EQ(trBREAKPOINT, cpu.mcause);
+    ASSERT_EQ(2, cpu.xreg[5]);
+    ASSERT_EQ(6, cpu.xreg[7]);
+}
+
+TEST_F(TestRun, InvalidatesCodeLaterInTheSameBlock)
+{
+    // A loop that stores to data until it has run often enough to be translated by the JIT, then runs once more, storing over the
+    // instruction that follows the store. That pass must run the replacement rather than the rest of the block that's running.
+    const uint32_t replacement = Addi(5, 5, 100);
+    Emit(Auipc(9, 0));
+    Emit(Addi(9, 9, 28)); // The address of the instruction to replace.
+    Emit(Lui(8, rambase + 0x2000));
+    Emit(Lui(7, replacement));
+    Emit(Addi(7, 7, replacement & 0xfff));
+    Emit(Addi(6, 0, 100));
+    const uint32_t top = here;
+    Emit(Sw(7, 8, 0));
+    Emit(Addi(5, 5, 1));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Bne(10, 0, 20)); // Stop after the last pass.
+    Emit(Addi(10, 0, 1));
+    Emit(Addi(8, 9, 0));
+    Emit(Addi(6, 0, 1));
+    Emit(Jal(0, top - here));
+    Emit(Ebreak());
+
+    RunAndCompare(1000);
+    ASSERT_EQ(trBREAKPOINT, cpu.mcause);
+    ASSERT_EQ(200, cpu.xreg[5]);
+}
+
+TEST_F(TestRun, KeepsCodeWhenStoringToDataInItsPage)
+{
+    // A loop that stores to a word after it, in the same page. The store doesn't overlap the code, so nothing is decoded twice.
+    Emit(Auipc(8, 0));
+    Emit(Addi(8, 8, 64)); // The address of the data.
+    Emit(Addi(6, 0, 100));
+    const uint32_t top = here;
+    Emit(Sw(6, 8, 0));
+    Emit(Addi(6, 6, -1));
+    Emit(Bne(6, 0, top - here));
+    Emit(Ebreak());
+
+    RunAndCompare(1000);
+    ASSERT_EQ(trBREAKPOINT, cpu.mcause);
+    ASSERT_EQ(1, ram[64]);
+
+#if defined(ARVISS_CACHE_STATS)
+    // The block cache decodes the loop again as a block of its own, and each ends at the branch.
+    ArvissCacheStats stats = ArvissGetCacheStats(&cpu);
+#if defined(ARVISS_BLOCK_CACHE)
+    ASSERT_EQ(10, stats.decodes);
+#else
+    ASSERT_EQ(LineDecodes(7), stats.decodes);
+#endif
+#endif
+}
+
+TEST_F(TestRun, InvalidatesRange)
+{
+    Emit(Addi(5, 5, 1));
+    Emit(Ebreak());
+    ArvissResult result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(1, cpu.xreg[5]);
+
+    // Change the code behind the CPU's back, then tell it so.
+    here = rambase;
+    Emit(Addi(5, 5, 100));
+    ArvissInvalidateRange(&cpu, rambase, 4);
+
+    cpu.pc = rambase;
+    result = ArvissRun(&cpu, 100);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+    ASSERT_EQ(101, cpu.xreg[5]);
+}
+
+TEST_F(TestRun, AgreesWithReferenceOnPairs)
+{
+    // A loop made of pairs of instructions that can be fused into superinstructions.
+    Emit(Addi(6, 0, 5)); // Loop counter.
+    const uint32_t top = here;
+    Emit(Lui(10, 0x12345000)); // li x10, 0x12345678
+    Emit(Addi(10, 10, 0x678));
+    Emit(Auipc(11, 0x1000)); // la x11, data
+    Emit(Addi(11, 11, 8));
+    Emit(Sw(10, 11, 0));
+    Emit(Lw(12, 11, 0));           // Load and accumulate.
+    Emit(Add(13, 13, 12));
+    Emit(Lw(14, 11, 0)); // Load and adjust.
+    Emit(Addi(14, 14, 1));
+    const uint32_t call = here;
+    Emit(Auipc(1, 0)); // call function
+    Emit(Jalr(1, 1, 24));
+    Emit(Addi(6, 6, -1));
+    Emit(Op(0b0000000, 0b010, 15, 0, 6)); // slt x15, x0, x6
+    Emit(Bne(15, 0, top - here));
+    Emit(Ebreak());
+    ASSERT_EQ(call + 24, here);
+    Emit(Addi(16, 16, 1)); // The function.
+    Emit(Jalr(0, 1, 0));
+
+    // Stop after every possible number of instructions, so that the count runs out between the halves of each pair.
+    const int total = 1 + 5 * 16;
+    for (int count = 1; count <= total + 1; count++)
+    {
+        ArvissRelease(&cpu);
+        SetUp();
+        RunAndCompare(count);
+        ASSERT_EQ(std::min(count, total), cpu.retired);
+    }
+    ASSERT_EQ(5, cpu.xreg[16]);
+}
+
+TEST_F(TestRun, AgreesWithReferenceOnLoadFaultInPair)
+{
+    // A load that faults, followed by an instruction that it could be fused with, which must not be run.
+    Emit(Lui(10, 0x80000000));
+    Emit(Lw(11, 10, 0));
+    Emit(Add(12, 12, 11));
+    Emit(Addi(13, 13, 1));
+
+    RunAndCompare(100);
+    ASSERT_EQ(trLOAD_ACCESS_FAULT, cpu.mcause);
+    ASSERT_EQ(rambase + 4, cpu.pc);
+    ASSERT_EQ(0, cpu.xreg[12]);
+}
@@ -0,0 +1,97 @@
+#include "../arviss.h"
+#include "../sparsemem.h"
+
+#include "gtest/gtest.h"
+#include <cstring>
+
+class TestSparseMem : public ::testing::Test
+{
+protected:
+    void TearDown() override;
+
+    static constexpr uint32_t base = 0x1000;
+    static constexpr uint32_t size = 0x40000000; // Far more than the test ever touches.
+
+    SparseMem sm{};
+};
+
+void TestSparseMem::TearDown()
+{
+    SparseMemFree(&sm);
+}
+
+TEST_F(TestSparseMem, StartsZeroed)
+{
+    ASSERT_TRUE(SparseMemInit(&sm, base, size, SM_NONE));
+    ASSERT_EQ(base, sm.start);
+    ASSERT_EQ(size, sm.size);
+    ASSERT_EQ(0, sm.mem[0]);
+    ASSERT_EQ(0, sm.mem[size / 2]);
+    ASSERT_EQ(0, sm.mem[size - 1]);
+}
+
+TEST_F(TestSparseMem, WritesAndZeroes)
+{
+    ASSERT_TRUE(SparseMemInit(&sm, base, size, SM_NONE));
+    std::memset(sm.mem, 0xaa, 0x10000);
+
+    // Zero a range that starts and ends part way through a page.
+    ASSERT_TRUE(SparseMemZero(&sm, base + 0x100, 0x8000));
+    ASSERT_EQ(0xaa, sm.mem[0xff]);
+    for (uint32_t i = 0x100; i < 0x8100; i++)
+    {
+        ASSERT_EQ(0, sm.mem[i]) << i;
+    }
+    ASSERT_EQ(0xaa, sm.mem[0x8100]);
+
+    // And within a page.
+    ASSERT_TRUE(SparseMemZero(&sm, base + 0x9001, 2));
+    ASSERT_EQ(0xaa, sm.mem[0x9000]);
+    ASSERT_EQ(0, sm.mem[0x9001]);
+    ASSERT_EQ(0, sm.mem[0x9002]);
+    ASSERT_EQ(0xaa, sm.mem[0x9003]);
+
+    const uint8_t bytes[] = {1, 2, 3};
+    ASSERT_TRUE(SparseMemWrite(&sm, base + 0x100, bytes, sizeof(bytes)));
+    ASSERT_EQ(0, std::memcmp(bytes, &sm.mem[0x100], sizeof(bytes)));
+}
+
+TEST_F(TestSparseMem, RejectsRangesOutsideIt)
+{
+    ASSERT_TRUE(SparseMemInit(&sm, base, 0x1000, SM_NONE));
+    const uint8_t bytes[] = {1, 2, 3, 4};
+    ASSERT_FALSE(SparseMemWrite(&sm, base - 1, bytes, 2));
+    ASSERT_FALSE(SparseMemWrite(&sm, base + 0x1000 - 2, bytes, 4));
+    ASSERT_FALSE(SparseMemZero(&sm, base, 0x1001));
+    ASSERT_TRUE(SparseMemZero(&sm, base, 0x1000));
+}
+
+TEST_F(TestSparseMem, RunsCode)
+{
+    ASSERT_TRUE(SparseMemInit(&sm, base, size, SM_HUGE_PAGES));
+
+    // Clear a huge .bss, as LoadElf() would, then write a program that stores to the far end of it.
+    ElfToken token{&sm};
+    SparseMemElfZero(token, base, size);
+    const uint32_t program[] = {
+            0x40000537, // lui a0, 0x40000
+            0x02a00593, // li a1, 42
+            0xfeb52e23, // sw a1, -4(a0)
+            0x00100073, // ebreak
+    };
+    SparseMemElfWrite(token, base, (void*)program, sizeof(program));
+
+    ArvissCpu cpu;
+    const ArvissMemoryRegion regions[] = {{base, size, sm.mem, true}};
+    const ArvissMemoryMap map{regions, 1, {}};
+    ASSERT_TRUE(ArvissInitWithMemoryMap(&cpu, &map));
+    cpu.pc = base;
+    ArvissResult result = ArvissRun(&cpu, 100);
+    ArvissRelease(&cpu);
+    ASSERT_TRUE(ArvissResultIsTrap(result));
+    ASSERT_EQ(trBREAKPOINT, ArvissResultAsTrap(result).mcause);
+
+    uint32_t word;
+    std::memcpy(&word, &sm.mem[0x40000000 - 4 - base], sizeof(word));
+    ASSERT_EQ(42, word);
+}